@@ -1,5 +1,41 @@
 #include "BenchmarkPCH.h"
 
+//
+// Usage:
+//
+// Server:
+//		Benchmark server port=<port>
+//
+// Client:
+//		Benchmark ip=<ip> port=<port> [options]
+//
+// Client options:
+//		mode=closed|open|submit : closed : Each worker thread keeps "inflight" calls in flight, and sends a new call as soon
+//						   as one completes.
+//						   open : Calls are sent at a fixed rate ("rate"), regardless of how fast the server replies.
+//						   Latency is measured from the time the call should have been sent, so a stalled server
+//						   doesn't hide latency (coordinated omission).
+//						   submit : Measures how fast several threads can submit calls through one single
+//						   connection. For each thread count in "submitThreads", each thread submits "calls" calls
+//						   without waiting for the replies, and only the time to submit them is measured. Replies
+//						   are waited for before moving on to the next thread count.
+//						   Default is closed
+//		submitThreads=<n,n,...> : Thread counts for the submit mode. Default is 1,2,4,8,16,32,64
+//		calls=<n> : Calls per thread, for the submit mode. Default is 10000
+//		payloads=<size,size,...> : Payload sizes (in bytes) to run, one run per size. Default is 0,64,1024,65536
+//		inflight=<n> : Calls in flight per worker thread, for the closed mode. Default is 1
+//		rate=<n> : Total calls per second, for the open mode. Default is 10000
+//		threads=<n> : Number of worker threads sending calls. The same number of threads runs the io. Default is 1
+//		connections=<n> : Number of connections. Worker threads share the connections. Default is 1
+//		duration=<seconds> : Duration of each run, excluding the warmup. Default is 5
+//		warmup=<seconds> : Time to run before measuring, for each run. Default is 1
+//		json=<file> : Writes the results to the specified file. If not specified, writes to stdout
+//		latency=<us> : Emulated network latency added to each call, in microseconds. Default is 0
+//		jitter=<us> : Maximum random delay added on top of the latency, in microseconds. Default is 0
+//		bandwidth=<bytes/s> : Emulated bandwidth limit for the calls, per connection. Default is 0 (no limit)
+//		nofinish : Don't tell the server to finish once done
+//
+
 #define FATAL_ERROR(fmt, ...) \
 	{ \
 		printf(fmt##"\n", ##__VA_ARGS__); \
@@ -38,74 +74,348 @@ private:
 
 Parameters gParams;
 
-template<typename LOCAL, typename REMOTE>
-struct SimpleClient
+using Clock = std::chrono::high_resolution_clock;
+using ConType = Connection<void, BenchmarkServer>;
+
+struct BenchmarkParams
+{
+	std::string ip;
+	int port = 0;
+	bool openLoop = false;
+	bool submit = false;
+	std::vector<size_t> payloads;
+	std::vector<size_t> submitThreads;
+	int calls = 10000;
+	int inflight = 1;
+	double rate = 10000;
+	int threads = 1;
+	int connections = 1;
+	double duration = 5;
+	double warmup = 1;
+	std::string json;
+	NetEmulatorSettings net;
+};
+
+struct RunResult
+{
+	size_t payload = 0;
+	uint64_t ops = 0;
+	uint64_t errors = 0;
+	double seconds = 0;
+	Histogram latency; // In nanoseconds
+};
+
+//
+// Several connections to the server, sharing a pool of io threads
+//
+class BenchmarkClient
 {
 public:
-	using Local = LOCAL;
-	using Remote = REMOTE;
+	~BenchmarkClient()
+	{
+		m_io.stop();
+		for (auto&& th : m_iothreads)
+			th.join();
+	}
+
+	bool start(const BenchmarkParams& params)
+	{
+		for (int i = 0; i < params.threads; i++)
+		{
+			m_iothreads.emplace_back([this]
+			{
+				ASIO::io_service::work w(m_io);
+				m_io.run();
+			});
+		}
+
+		printf("Connecting %d connection(s) to %s:%d\n", params.connections, params.ip.c_str(), params.port);
+		for (int i = 0; i < params.connections; i++)
+		{
+			TransportDecoratorFunc decorator;
+			if (params.net.latency.count() || params.net.jitter.count() || params.net.bandwidth)
+			{
+				decorator = [this, net = params.net](std::shared_ptr<Transport> trp)
+				{
+					return std::make_shared<NetEmulatorTransport>(m_io, std::move(trp), net);
+				};
+			}
+			auto con =
+				AsioTransport<void, BenchmarkServer>::create(m_io, params.ip.c_str(), params.port, decorator).get();
+			if (!con)
+			{
+				printf("Could not connect to server at %s:%d\n", params.ip.c_str(), params.port);
+				return false;
+			}
+
+			bool authRes = false;
+			CZRPC_CALLGENERIC(*con, "__auth", std::vector<Any>{ Any("Benchmark") }).ft().get().get().getAs(authRes);
+			if (!authRes)
+			{
+				printf("Authentication failed\n");
+				return false;
+			}
+			m_cons.push_back(std::move(con));
+		}
 
-	SimpleClient()
+		return true;
+	}
+
+	// Connections used by the specified worker thread
+	std::vector<ConType*> getConnections(int worker, int numWorkers)
 	{
+		std::vector<ConType*> res;
+		for (size_t i = worker; i < m_cons.size(); i += numWorkers)
+			res.push_back(m_cons[i].get());
+		// If there are more workers than connections, workers share connections
+		if (res.size() == 0)
+			res.push_back(m_cons[worker % m_cons.size()].get());
+		return res;
 	}
 
-	template<typename U=Local>
-	explicit SimpleClient(typename std::enable_if<!std::is_void<U>::value, U>::type& localObj)
-		:m_localObj(&localObj)
+	ConType& con()
 	{
+		return *m_cons[0];
 	}
 
-	~SimpleClient()
+private:
+	ASIO::io_service m_io;
+	std::vector<std::thread> m_iothreads;
+	std::vector<std::shared_ptr<ConType>> m_cons;
+};
+
+//
+// Results for one worker thread. Replies are processed in the io threads, so access is protected by a mutex.
+//
+struct WorkerResults
+{
+	std::mutex mtx;
+	std::condition_variable cv;
+	int inflight = 0;
+	uint64_t ops = 0;
+	uint64_t errors = 0;
+	Histogram latency;
+
+	// start : When the call was sent (or should have been sent, for the open mode)
+	// measure : false if the call was sent during the warmup
+	void onReply(const Result<void>& res, Clock::time_point start, bool measure)
 	{
-		if (m_iothread.joinable())
+		auto end = Clock::now();
+		std::unique_lock<std::mutex> lk(mtx);
+		if (!res.isValid())
+			errors++;
+		else if (measure)
 		{
-			m_io.stop();
-			m_iothread.join();
+			ops++;
+			latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
 		}
+		inflight--;
+		cv.notify_one();
+	}
+
+	void waitInflight(int maxInflight)
+	{
+		std::unique_lock<std::mutex> lk(mtx);
+		cv.wait(lk, [&] { return inflight < maxInflight; });
+		inflight++;
 	}
+};
 
-	bool start(const std::string& ip, int port, std::string token="")
+void runWorker(const BenchmarkParams& params, std::vector<ConType*> cons, const std::vector<uint8_t>& payload,
+			   Clock::time_point measureStart, Clock::time_point end, WorkerResults& res)
+{
+	size_t conIndex = 0;
+	auto sendCall = [&](Clock::time_point start)
 	{
-		m_iothread = std::thread([this]
+		bool measure = start >= measureStart;
+		ConType& con = *cons[conIndex];
+		conIndex = (conIndex + 1) % cons.size();
+		CZRPC_CALL(con, send, payload).async([&res, start, measure](Result<void> r)
 		{
-			ASIO::io_service::work w(m_io);
-			m_io.run();
+			res.onReply(r, start, measure);
 		});
+	};
 
-		printf("Connecting to %s:%d with token '%s'\n", ip.c_str(), port, token.c_str());
-		m_con = AsioTransport<Local,Remote>::create(m_io, ip.c_str(), port).get();
-		if (!m_con)
+	if (params.openLoop)
+	{
+		auto interval = std::chrono::duration_cast<Clock::duration>(
+			std::chrono::duration<double>(params.threads / params.rate));
+		auto next = Clock::now();
+		while (next < end)
 		{
-			printf("Could not connect to server at %s:%d\n", ip.c_str(), port);
-			return false;
-		}
-		auto trp = static_cast<BaseAsioTransport*>(m_con->transport.get());
-		auto point = trp->getLocalEndpoint();
-		printf("Connected. LocalEndpoint=%s:%d\n", point.address().to_string().c_str(), point.port());
+			// Sleeping has a coarse granularity, so only sleep if we have time to spare, and spin otherwise
+			auto now = Clock::now();
+			if (next - now > std::chrono::milliseconds(2))
+				std::this_thread::sleep_for(next - now - std::chrono::milliseconds(2));
+			while (Clock::now() < next)
+				std::this_thread::yield();
 
-		bool authRes = false;
-		CZRPC_CALLGENERIC(*m_con, "__auth", std::vector<Any>{ Any(token) }).ft().get().get().getAs(authRes);
-		if (!authRes)
+			{
+				std::unique_lock<std::mutex> lk(res.mtx);
+				res.inflight++;
+			}
+			sendCall(next);
+			next += interval;
+		}
+	}
+	else
+	{
+		while (Clock::now() < end)
 		{
-			printf("Authentication failed\n");
-			return false;
+			res.waitInflight(params.inflight);
+			sendCall(Clock::now());
 		}
+	}
 
-		return true;
+	// Wait for all the replies
+	std::unique_lock<std::mutex> lk(res.mtx);
+	res.cv.wait(lk, [&] { return res.inflight == 0; });
+}
+
+RunResult runPayload(const BenchmarkParams& params, BenchmarkClient& client, size_t payloadSize)
+{
+	std::vector<uint8_t> payload(payloadSize);
+	for (size_t i = 0; i < payload.size(); i++)
+		payload[i] = static_cast<uint8_t>(i);
+
+	auto start = Clock::now();
+	auto measureStart = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(params.warmup));
+	auto end = measureStart + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(params.duration));
+
+	std::vector<std::unique_ptr<WorkerResults>> workerResults;
+	std::vector<std::thread> workers;
+	for (int i = 0; i < params.threads; i++)
+	{
+		workerResults.push_back(std::make_unique<WorkerResults>());
+		workers.emplace_back(runWorker, std::cref(params), client.getConnections(i, params.threads),
+							 std::cref(payload), measureStart, end, std::ref(*workerResults.back()));
 	}
 
-	Connection<Local,Remote>& con()
+	RunResult res;
+	for (int i = 0; i < params.threads; i++)
 	{
-		return *m_con;
+		workers[i].join();
+		res.ops += workerResults[i]->ops;
+		res.errors += workerResults[i]->errors;
+		res.latency.merge(workerResults[i]->latency);
 	}
+	res.payload = payloadSize;
+	res.seconds = params.duration;
+	return res;
+}
 
-private:
-	std::shared_ptr<Connection<Local, Remote>> m_con;
-	Local* m_localObj = nullptr;
-	ASIO::io_service m_io;
-	std::thread m_iothread;
+struct SubmitResult
+{
+	size_t payload = 0;
+	int threads = 0;
+	uint64_t calls = 0;
+	double seconds = 0;
 };
 
+//
+// Several threads submitting calls through the same connection as fast as they can
+//
+SubmitResult runSubmit(const BenchmarkParams& params, BenchmarkClient& client, size_t payloadSize, int numThreads)
+{
+	std::vector<uint8_t> payload(payloadSize);
+	ConType& con = client.con();
+	std::atomic<int> ready(0);
+	std::atomic<bool> go(false);
+	std::atomic<uint64_t> replies(0);
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < numThreads; i++)
+	{
+		threads.emplace_back([&]
+		{
+			ready++;
+			while (!go)
+				std::this_thread::yield();
+			for (int c = 0; c < params.calls; c++)
+			{
+				CZRPC_CALL(con, send, payload).async([&replies](Result<void>)
+				{
+					replies++;
+				});
+			}
+		});
+	}
+
+	while (ready != numThreads)
+		std::this_thread::yield();
+	auto start = Clock::now();
+	go = true;
+	for (auto&& th : threads)
+		th.join();
+
+	SubmitResult res;
+	res.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	res.payload = payloadSize;
+	res.threads = numThreads;
+	res.calls = static_cast<uint64_t>(numThreads) * params.calls;
+
+	while (replies != res.calls)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	return res;
+}
+
+void writeSubmitJson(FILE* f, const BenchmarkParams& params, const std::vector<SubmitResult>& results)
+{
+	fprintf(f, "{\n");
+	fprintf(f, "  \"mode\": \"submit\",\n");
+	fprintf(f, "  \"calls\": %d,\n", params.calls);
+	fprintf(f, "  \"results\": [\n");
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const SubmitResult& r = results[i];
+		fprintf(f, "    { \"payload\": %u, \"threads\": %d, \"callsPerSec\": %.1f, \"callsPerSecPerThread\": %.1f }%s\n",
+				static_cast<unsigned>(r.payload), r.threads, r.calls / r.seconds, r.calls / r.seconds / r.threads,
+				i + 1 < results.size() ? "," : "");
+	}
+	fprintf(f, "  ]\n");
+	fprintf(f, "}\n");
+}
+
+void writeJson(FILE* f, const BenchmarkParams& params, const std::vector<RunResult>& results)
+{
+	fprintf(f, "{\n");
+	fprintf(f, "  \"mode\": \"%s\",\n", params.openLoop ? "open" : "closed");
+	fprintf(f, "  \"threads\": %d,\n", params.threads);
+	fprintf(f, "  \"connections\": %d,\n", params.connections);
+	fprintf(f, "  \"inflight\": %d,\n", params.inflight);
+	fprintf(f, "  \"rate\": %.0f,\n", params.rate);
+	fprintf(f, "  \"duration\": %.3f,\n", params.duration);
+	fprintf(f, "  \"warmup\": %.3f,\n", params.warmup);
+	fprintf(f, "  \"latencyUs\": %lld,\n", static_cast<long long>(params.net.latency.count()));
+	fprintf(f, "  \"jitterUs\": %lld,\n", static_cast<long long>(params.net.jitter.count()));
+	fprintf(f, "  \"bandwidth\": %llu,\n", static_cast<unsigned long long>(params.net.bandwidth));
+	fprintf(f, "  \"results\": [\n");
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const RunResult& r = results[i];
+		const Histogram& h = r.latency;
+		auto us = [](uint64_t ns) { return ns / 1000.0; };
+		fprintf(f, "    {\n");
+		fprintf(f, "      \"payload\": %u,\n", static_cast<unsigned>(r.payload));
+		fprintf(f, "      \"ops\": %llu,\n", static_cast<unsigned long long>(r.ops));
+		fprintf(f, "      \"errors\": %llu,\n", static_cast<unsigned long long>(r.errors));
+		fprintf(f, "      \"opsPerSec\": %.1f,\n", r.ops / r.seconds);
+		fprintf(f, "      \"MBPerSec\": %.3f,\n", (r.ops * r.payload) / r.seconds / (1024 * 1024));
+		fprintf(f, "      \"latencyUs\": {\n");
+		fprintf(f, "        \"min\": %.3f,\n", us(h.getMin()));
+		fprintf(f, "        \"mean\": %.3f,\n", h.getMean() / 1000.0);
+		fprintf(f, "        \"p50\": %.3f,\n", us(h.getPercentile(50)));
+		fprintf(f, "        \"p90\": %.3f,\n", us(h.getPercentile(90)));
+		fprintf(f, "        \"p99\": %.3f,\n", us(h.getPercentile(99)));
+		fprintf(f, "        \"p999\": %.3f,\n", us(h.getPercentile(99.9)));
+		fprintf(f, "        \"max\": %.3f\n", us(h.getMax()));
+		fprintf(f, "      }\n");
+		fprintf(f, "    }%s\n", i + 1 < results.size() ? "," : "");
+	}
+	fprintf(f, "  ]\n");
+	fprintf(f, "}\n");
+}
+
 int runClient()
 {
 	if (!gParams.has("ip"))
@@ -113,14 +423,118 @@ int runClient()
 	if (!gParams.has("port"))
 		FATAL_ERROR("port parameter not specified");
 
-	std::string ip = gParams.get("ip");
-	int port = std::stoi(gParams.get("port"));
+	BenchmarkParams params;
+	params.ip = gParams.get("ip");
+	params.port = std::stoi(gParams.get("port"));
+	if (gParams.has("mode"))
+	{
+		if (gParams.get("mode") == "open")
+			params.openLoop = true;
+		else if (gParams.get("mode") == "submit")
+			params.submit = true;
+		else if (gParams.get("mode") != "closed")
+			FATAL_ERROR("Invalid mode '%s'", gParams.get("mode").c_str());
+	}
+
+	auto parseList = [](const std::string& str)
+	{
+		std::vector<size_t> res;
+		size_t pos = 0;
+		while (pos < str.size())
+		{
+			size_t next = str.find(',', pos);
+			if (next == std::string::npos)
+				next = str.size();
+			res.push_back(std::stoul(str.substr(pos, next - pos)));
+			pos = next + 1;
+		}
+		return res;
+	};
+	params.payloads = parseList(gParams.has("payloads") ? gParams.get("payloads") : "0,64,1024,65536");
+	params.submitThreads = parseList(gParams.has("submitThreads") ? gParams.get("submitThreads") : "1,2,4,8,16,32,64");
+	if (gParams.has("calls"))
+		params.calls = std::stoi(gParams.get("calls"));
+
+	if (gParams.has("inflight"))
+		params.inflight = std::stoi(gParams.get("inflight"));
+	if (gParams.has("rate"))
+		params.rate = std::stod(gParams.get("rate"));
+	if (gParams.has("threads"))
+		params.threads = std::stoi(gParams.get("threads"));
+	if (gParams.has("connections"))
+		params.connections = std::stoi(gParams.get("connections"));
+	if (gParams.has("duration"))
+		params.duration = std::stod(gParams.get("duration"));
+	if (gParams.has("warmup"))
+		params.warmup = std::stod(gParams.get("warmup"));
+	params.json = gParams.get("json");
+	if (gParams.has("latency"))
+		params.net.latency = std::chrono::microseconds(std::stoll(gParams.get("latency")));
+	if (gParams.has("jitter"))
+		params.net.jitter = std::chrono::microseconds(std::stoll(gParams.get("jitter")));
+	if (gParams.has("bandwidth"))
+		params.net.bandwidth = std::stoull(gParams.get("bandwidth"));
 
-	SimpleClient<void, BenchmarkServer> client;
-	if (!client.start(ip, port, "Benchmark"))
+	if (params.inflight < 1 || params.threads < 1 || params.connections < 1 || params.rate <= 0 ||
+		params.duration <= 0 || params.warmup < 0 || params.net.latency.count() < 0 || params.net.jitter.count() < 0 ||
+		params.calls < 1)
+		FATAL_ERROR("Invalid parameters");
+
+	BenchmarkClient client;
+	if (!client.start(params))
 		FATAL_ERROR("");
 
-	CZRPC_CALL(client.con(), finish);
+	if (params.submit)
+	{
+		std::vector<SubmitResult> results;
+		for (auto&& size : params.payloads)
+		{
+			for (auto&& threads : params.submitThreads)
+			{
+				results.push_back(runSubmit(params, client, size, static_cast<int>(threads)));
+				const SubmitResult& r = results.back();
+				printf("Payload %u, %d thread(s): %.1f calls/s (%.1f per thread)\n", static_cast<unsigned>(size),
+					   r.threads, r.calls / r.seconds, r.calls / r.seconds / r.threads);
+			}
+		}
+
+		FILE* f = params.json.size() ? fopen(params.json.c_str(), "wt") : stdout;
+		if (!f)
+			FATAL_ERROR("Could not open file '%s'", params.json.c_str());
+		writeSubmitJson(f, params, results);
+		if (f != stdout)
+			fclose(f);
+		if (!gParams.has("nofinish"))
+			CZRPC_CALL(client.con(), finish).ft().get();
+		return EXIT_SUCCESS;
+	}
+
+	std::vector<RunResult> results;
+	for (auto&& size : params.payloads)
+	{
+		printf("Running with payload size %u...\n", static_cast<unsigned>(size));
+		results.push_back(runPayload(params, client, size));
+		const RunResult& r = results.back();
+		printf("    %.1f ops/s, p50=%.1fus, p99=%.1fus, p999=%.1fus\n", r.ops / r.seconds,
+			   r.latency.getPercentile(50) / 1000.0, r.latency.getPercentile(99) / 1000.0,
+			   r.latency.getPercentile(99.9) / 1000.0);
+	}
+
+	if (params.json.size())
+	{
+		FILE* f = fopen(params.json.c_str(), "wt");
+		if (!f)
+			FATAL_ERROR("Could not open file '%s'", params.json.c_str());
+		writeJson(f, params, results);
+		fclose(f);
+	}
+	else
+	{
+		writeJson(stdout, params, results);
+	}
+
+	if (!gParams.has("nofinish"))
+		CZRPC_CALL(client.con(), finish).ft().get();
 
 	return EXIT_SUCCESS;
 }
@@ -9,10 +9,14 @@
 
 #include <stdio.h>
 #include <tchar.h>
+#include <chrono>
+#include <condition_variable>
 
 #include "crazygaze/rpc/RPC.h"
 #include "crazygaze/rpc/RPCAsioTransport.h"
+#include "crazygaze/rpc/RPCNetEmulator.h"
 
 #include "../SamplesCommon/SimpleServer.h"
 #include "../SamplesCommon/StringUtil.h"
-#include "../SamplesCommon/Parameters.h"
\ No newline at end of file
+#include "../SamplesCommon/Parameters.h"
+#include "../SamplesCommon/Histogram.h"
\ No newline at end of file
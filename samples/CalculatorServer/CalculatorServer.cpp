@@ -34,11 +34,67 @@ public:
 
 CZRPC_ALLOW_CONST_LVALUE_REFS;
 
+//
+// Usage:
+//		CalculatorServer port=<port> [capture=<file>]
+//			Runs the server. If "capture" is specified, all the traffic is captured to that file.
+//
+//		CalculatorServer replay=<file> [speed=<n>|max]
+//			Replays a capture file into a local Calculator, and reports the throughput and latency.
+//			speed : 1 is the original speed, 2 twice as fast, etc. Default is 1
+//
+
 Parameters gParams;
+
+int replay(const std::string& filename)
+{
+	CaptureReader reader;
+	if (!reader.open(filename.c_str()))
+	{
+		printf("Could not open capture file '%s'\n", filename.c_str());
+		return EXIT_FAILURE;
+	}
+
+	double speed = 1;
+	if (gParams.has("speed"))
+		speed = gParams.get("speed") == "max" ? 0 : std::stod(gParams.get("speed"));
+
+	Calculator calc;
+	Replayer<CalculatorInterface> replayer(calc, speed);
+	std::mutex mtx;
+	Histogram latency;
+	uint64_t errors = 0;
+	replayer.setOnReply([&](bool success, std::chrono::steady_clock::duration duration)
+	{
+		std::unique_lock<std::mutex> lk(mtx);
+		latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+		if (!success)
+			errors++;
+	});
+
+	printf("Replaying '%s' at %s speed\n", filename.c_str(),
+		   speed ? (std::to_string(speed) + "x").c_str() : "max");
+	auto start = std::chrono::steady_clock::now();
+	uint64_t calls = replayer.run(reader);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	printf("Calls: %llu, Replies: %llu, Errors: %llu, Missing replies: %llu\n", (unsigned long long)calls,
+		   (unsigned long long)latency.getCount(), (unsigned long long)errors,
+		   (unsigned long long)replayer.getPending());
+	printf("Throughput: %.0f calls/s\n", seconds > 0 ? calls / seconds : 0);
+	printf("Latency (us): mean=%.2f, p50=%.2f, p99=%.2f, p99.9=%.2f, max=%.2f\n", latency.getMean() / 1000,
+		   latency.getPercentile(50) / 1000.0, latency.getPercentile(99) / 1000.0,
+		   latency.getPercentile(99.9) / 1000.0, latency.getMax() / 1000.0);
+	return EXIT_SUCCESS;
+}
+
 int main(int argc, char* argv[])
 {
 	gParams.set(argc, argv);
 
+	if (gParams.has("replay"))
+		return replay(gParams.get("replay"));
+
 	try
 	{
 		int port;
@@ -55,14 +111,31 @@ int main(int argc, char* argv[])
 		printf("Running CalculatorServer on port %d.\n", port);
 		printf("Type any key to quit.\n");
 
+		TransportDecoratorFunc decorator;
+		auto capture = std::make_shared<CaptureWriter>();
+		if (gParams.has("capture"))
+		{
+			if (!capture->open(gParams.get("capture").c_str()))
+			{
+				printf("Could not create capture file '%s'\n", gParams.get("capture").c_str());
+				return EXIT_FAILURE;
+			}
+			printf("Capturing traffic to '%s'\n", gParams.get("capture").c_str());
+			decorator = [capture](std::shared_ptr<Transport> trp)
+			{
+				return std::make_shared<CaptureTransport>(std::move(trp), capture);
+			};
+		}
+
 		Calculator calc;
-		SimpleServer<CalculatorInterface, void> server(calc, port);
+		SimpleServer<CalculatorInterface, void> server(calc, port, "", decorator);
 		server.objData().setProperty("name", "calc");
 		while (true)
 		{
 			if (getch())
 				break;
 		}
+		capture->close();
 	}
 	catch (const std::exception& e)
 	{
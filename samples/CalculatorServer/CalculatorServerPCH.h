@@ -16,3 +16,4 @@
 
 #include "../SamplesCommon/Parameters.h"
 #include "../SamplesCommon/SimpleServer.h"
+#include "../SamplesCommon/Histogram.h"
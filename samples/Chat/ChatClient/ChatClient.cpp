@@ -63,12 +63,22 @@ public:
 			}
 			else if (strncmp(msg.c_str(), "/userlist", strlen("/userlist")) == 0)
 			{
-				Result<std::vector<std::string>> res = CZRPC_CALL(*m_con, getUserList).ft().get();
-				if (res.isValid())
+				// Printed as the names arrive
+				auto reader = CZRPC_CALL(*m_con, getUserList).reader();
+				std::string name;
+				int count = 0;
+				try
 				{
-					printf("%d users.\n", (int)res.get().size());
-					for (auto&& u : res.get())
-						printf("    %s\n", u.c_str());
+					while (reader.next(name))
+					{
+						printf("    %s\n", name.c_str());
+						count++;
+					}
+					printf("%d users.\n", count);
+				}
+				catch (const Exception& e)
+				{
+					printf("Failed to get the user list: %s\n", e.what());
 				}
 			}
 			else if (msg.size())
@@ -16,7 +16,8 @@ public:
 
 	virtual void sendMsg(const std::string& msg) = 0;
 	virtual void kick(const std::string& name) = 0;
-	virtual std::vector<std::string> getUserList() = 0;
+	// Streamed, so the server never needs the whole list in memory, no matter how many users there are
+	virtual cz::rpc::ServerStream<std::string> getUserList() = 0;
 };
 
 #define RPCTABLE_CLASS ChatServerInterface
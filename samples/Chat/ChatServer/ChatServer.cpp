@@ -12,16 +12,8 @@ Parameters gParams;
 
 #define LOG(fmt, ...) printf("LOG: " fmt "\n", __VA_ARGS__)
 
-#define BROADCAST_RPC(excludedClient, func, ...)             \
-	{                                                        \
-		auto excluded = excludedClient;                      \
-		for (auto&& c : m_clients)                           \
-		{                                                    \
-			if (c.second.get() == excluded)                  \
-				continue;                                    \
-			CZRPC_CALL(*(c.second->con), func, __VA_ARGS__); \
-		}                                                    \
-	}
+// All clients are subscribed to this topic, to receive the chat messages
+#define CHAT_TOPIC "chat"
 
 struct ClientInfo
 {
@@ -59,6 +51,7 @@ public:
 				onDisconnect(info);
 			});
 			m_clients.insert(std::make_pair(con.get(), info));
+			m_pubsub.subscribe(con, CHAT_TOPIC);
 		});
 
 	}
@@ -78,10 +71,11 @@ private:
 			if (it->second == info)
 			{
 				m_clients.erase(it);
+				m_pubsub.unsubscribeAll(info->con.get());
 				LOG("User %s disconnected", info->name.c_str());
 
 				if (info->name.size())
-					BROADCAST_RPC(nullptr, onMsg, "", formatString("user %s disconnected", info->name.c_str()));
+					CZRPC_PUBLISH(m_pubsub, CHAT_TOPIC, onMsg, "", formatString("user %s disconnected", info->name.c_str()));
 				return;
 			}
 		}
@@ -136,7 +130,7 @@ private:
 		if (name == "Admin")
 			user->admin = true;
 
-		BROADCAST_RPC(nullptr, onMsg, "", formatString("%s joined the chat", name.c_str()));
+		CZRPC_PUBLISH(m_pubsub, CHAT_TOPIC, onMsg, "", formatString("%s joined the chat", name.c_str()));
 		user->authenticated = true;
 		return "OK";
 	}
@@ -147,7 +141,7 @@ private:
 		auto user = getCurrentUser();
 		if (!user || !user->authenticated)
 			return;
-		BROADCAST_RPC(nullptr, onMsg, user->name, msg);
+		CZRPC_PUBLISH(m_pubsub, CHAT_TOPIC, onMsg, user->name, msg);
 	}
 
 	virtual void kick(const std::string& name) override
@@ -177,23 +171,34 @@ private:
 
 	}
 
-	virtual std::vector<std::string> getUserList() override
+	virtual ServerStream<std::string> getUserList() override
 	{
 		LOG("RPC:getUserList");
 		auto user = getCurrentUser();
 		if (!user || !user->authenticated)
-			return std::vector<std::string>();
+			return ServerStream<std::string>::fromContainer(std::vector<std::string>());
 
-		std::vector<std::string> users;
+		// Only the pointers are copied. The names are serialized as the stream gets room for them.
+		std::vector<std::shared_ptr<ClientInfo>> users;
+		users.reserve(m_clients.size());
 		for (auto&& u : m_clients)
-			users.push_back(u.second->name);
-		return users;
+			users.push_back(u.second);
+		return ServerStream<std::string>([users = std::move(users), i = size_t(0)](StreamWriter<std::string>& w) mutable
+		{
+			while (i < users.size())
+			{
+				if (!w.write(users[i++]->name))
+					break;
+			}
+			return i < users.size();
+		});
 	}
 
 	ASIO::io_service m_io;
 	std::thread m_th;
 	std::shared_ptr<AsioTransportAcceptor<ChatServerInterface, ChatClientInterface>> m_acceptor;
 	std::unordered_map<ConType*, std::shared_ptr<ClientInfo>> m_clients;
+	PubSub<ConType> m_pubsub;
 	ObjectData m_objData;
 };
 
@@ -0,0 +1,490 @@
+#include "MicroBenchmarkPCH.h"
+
+//
+// Measures the cost of serialization and dispatch, without any network involved.
+//
+// Usage:
+//		MicroBenchmark [time=<ms>] [filter=<text>] [json=<file>]
+//
+//		time : Time to run each benchmark for, in milliseconds. Default is 200
+//		filter : Only run the benchmarks whose name contains the specified text
+//		json : Also writes the results to the specified file, in json format
+//
+// For each benchmark, it reports the time per operation, and the number and size of the heap allocations
+// per operation.
+//
+
+#define FATAL_ERROR(fmt, ...) \
+	{ \
+		printf(fmt##"\n", ##__VA_ARGS__); \
+		exit(EXIT_FAILURE); \
+	}
+
+using namespace cz;
+using namespace cz::rpc;
+
+//
+// Allocation tracking
+// The benchmarks run in the main thread only, so there is no need for atomics
+//
+namespace
+{
+	bool gTrackAllocs = false;
+	uint64_t gAllocs = 0;
+	uint64_t gAllocBytes = 0;
+}
+
+void* operator new(size_t size)
+{
+	if (gTrackAllocs)
+	{
+		gAllocs++;
+		gAllocBytes += size;
+	}
+	void* p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete[](void* p) noexcept
+{
+	operator delete(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	operator delete(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+	operator delete(p);
+}
+
+class BenchService
+{
+public:
+	void noParams()
+	{
+	}
+
+	int add(int a, int b)
+	{
+		return a + b;
+	}
+
+	std::string echoString(std::string v)
+	{
+		return v;
+	}
+
+	std::vector<int> echoVector(std::vector<int> v)
+	{
+		return v;
+	}
+
+	std::tuple<int, std::string, double> echoTuple(std::tuple<int, std::string, double> v)
+	{
+		return v;
+	}
+
+	Any echoAny(Any v)
+	{
+		return v;
+	}
+};
+
+#define RPCTABLE_CLASS BenchService
+#define RPCTABLE_CONTENTS \
+	REGISTERRPC(noParams) \
+	REGISTERRPC(add) \
+	REGISTERRPC(echoString) \
+	REGISTERRPC(echoVector) \
+	REGISTERRPC(echoTuple) \
+	REGISTERRPC(echoAny)
+#include "crazygaze/rpc/RPCGenerate.h"
+
+//
+// Transport that drops everything sent through it
+//
+class NullTransport : public Transport
+{
+public:
+	virtual bool send(std::vector<char> data, Priority) override
+	{
+		return true;
+	}
+	virtual bool receive(std::vector<char>& dst) override
+	{
+		dst.clear();
+		return true;
+	}
+	virtual void close() override
+	{
+	}
+};
+
+//
+// In memory transport, to connect two connections in the same thread.
+// Whatever is sent by one side, is received by the other side.
+//
+class LoopbackTransport : public Transport
+{
+public:
+	static std::pair<std::shared_ptr<LoopbackTransport>, std::shared_ptr<LoopbackTransport>> createPair()
+	{
+		auto a = std::make_shared<LoopbackTransport>();
+		auto b = std::make_shared<LoopbackTransport>();
+		a->m_peer = b.get();
+		b->m_peer = a.get();
+		return std::make_pair(a, b);
+	}
+
+	virtual bool send(std::vector<char> data, Priority) override
+	{
+		m_peer->m_q.push(std::move(data));
+		return true;
+	}
+	virtual bool receive(std::vector<char>& dst) override
+	{
+		if (m_q.size() == 0)
+		{
+			dst.clear();
+			return true;
+		}
+		dst = std::move(m_q.front());
+		m_q.pop();
+		return true;
+	}
+	virtual void close() override
+	{
+	}
+
+private:
+	LoopbackTransport* m_peer = nullptr;
+	std::queue<std::vector<char>> m_q;
+};
+
+Parameters gParams;
+
+struct BenchResult
+{
+	std::string name;
+	double nsPerOp;
+	double allocsPerOp;
+	double bytesPerOp;
+};
+
+std::vector<BenchResult> gResults;
+
+template<typename F>
+void runBench(const std::string& name, F&& f)
+{
+	if (gParams.has("filter") && name.find(gParams.get("filter")) == std::string::npos)
+		return;
+
+	using Clock = std::chrono::high_resolution_clock;
+	auto targetTime = std::chrono::milliseconds(gParams.has("time") ? std::stoi(gParams.get("time")) : 200);
+
+	auto run = [&f](uint64_t iterations)
+	{
+		auto start = Clock::now();
+		for (uint64_t i = 0; i < iterations; i++)
+			f();
+		return Clock::now() - start;
+	};
+
+	// Warmup, and find out how many iterations we need to run for the specified time
+	uint64_t iterations = 1;
+	while (true)
+	{
+		auto elapsed = run(iterations);
+		if (elapsed >= targetTime / 10)
+		{
+			iterations = static_cast<uint64_t>(
+				iterations * (std::chrono::duration<double>(targetTime) / std::chrono::duration<double>(elapsed)));
+			break;
+		}
+		iterations *= 2;
+	}
+	iterations = std::max(iterations, uint64_t(1));
+
+	gAllocs = 0;
+	gAllocBytes = 0;
+	gTrackAllocs = true;
+	auto elapsed = run(iterations);
+	gTrackAllocs = false;
+
+	BenchResult res;
+	res.name = name;
+	res.nsPerOp = std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+	res.allocsPerOp = static_cast<double>(gAllocs) / iterations;
+	res.bytesPerOp = static_cast<double>(gAllocBytes) / iterations;
+	printf("%-40s %12.1f %12.2f %12.1f\n", res.name.c_str(), res.nsPerOp, res.allocsPerOp, res.bytesPerOp);
+	gResults.push_back(std::move(res));
+}
+
+//
+// Stream encoding and decoding of a value.
+// The streams and buffers are reused, so the numbers reflect the cost of ParamTraits, and not of growing the
+// buffers.
+//
+template<typename T>
+void benchType(const std::string& name, const T& v)
+{
+	Stream out;
+	runBench(name + " encode", [&]
+	{
+		out.clear();
+		out << v;
+	});
+
+	out.clear();
+	out << v;
+	std::vector<char> buf = out.extract();
+	T dst;
+	runBench(name + " decode", [&]
+	{
+		Stream in(std::move(buf));
+		in >> dst;
+		buf = in.extract();
+	});
+}
+
+//
+// Property reads, as done by __getProperty
+//
+void benchGetProperty()
+{
+	int obj;
+	ObjectData objData(&obj);
+	objData.setProperty("name", Any("MicroBenchmark"));
+	objData.setProperty("version", Any(1));
+	runBench("ObjectData getProperty", [&]
+	{
+		Any v = objData.getProperty("name");
+	});
+	PropertyKey key("name");
+	runBench("ObjectData getProperty(PropertyKey)", [&]
+	{
+		Any v = objData.getProperty(key);
+	});
+}
+
+//
+// Serialization of all the parameters of a call
+//
+template<typename F, typename... Args>
+void benchSerializeMethod(const std::string& name, Args&&... args)
+{
+	Stream out;
+	runBench("serializeMethod " + name, [&]
+	{
+		out.clear();
+		serializeMethod<F>(out, args...);
+	});
+}
+
+//
+// Dispatching a call on the server side: Finding the RPC in the table, deserializing the parameters, calling the
+// method, and serializing the reply. The reply is sent to a transport that drops it.
+//
+template<typename F, typename... Args>
+void benchProcessCall(const std::string& name, uint32_t rpcid, Args&&... args)
+{
+	static BenchService obj;
+	static InProcessor<BenchService> prc(&obj);
+	NullTransport trp;
+
+	Stream out;
+	Header hdr;
+	hdr.bits.rpcid = rpcid;
+	out << hdr;
+	serializeMethod<F>(out, args...);
+	*reinterpret_cast<Header*>(out.ptr(0)) = hdr;
+	std::vector<char> buf = out.extract();
+
+	runBench("processCall " + name, [&]
+	{
+		Stream in(std::move(buf));
+		Header h;
+		in >> h;
+		prc.processCall(trp, in, h);
+		buf = in.extract();
+	});
+}
+
+//
+// Same as benchProcessCall, but as a generic RPC call
+//
+void benchProcessGenericCall(const std::string& name, const std::vector<Any>& args)
+{
+	static BenchService obj;
+	static InProcessor<BenchService> prc(&obj);
+	NullTransport trp;
+
+	Stream out;
+	Header hdr;
+	hdr.bits.rpcid = static_cast<uint32_t>(Table<BenchService>::RPCId::genericRPC);
+	out << hdr;
+	serializeMethod<details::GenericRPCFunc>(out, name, args);
+	*reinterpret_cast<Header*>(out.ptr(0)) = hdr;
+	std::vector<char> buf = out.extract();
+
+	runBench("processCall generic " + name, [&]
+	{
+		Stream in(std::move(buf));
+		Header h;
+		in >> h;
+		prc.processCall(trp, in, h);
+		buf = in.extract();
+	});
+}
+
+#define BENCH_SERIALIZEMETHOD(func, ...) \
+	benchSerializeMethod<decltype(&BenchService::func)>(#func, ##__VA_ARGS__)
+
+#define BENCH_PROCESSCALL(func, ...)                                 \
+	benchProcessCall<decltype(&BenchService::func)>(                 \
+		#func, (uint32_t)Table<BenchService>::RPCId::func, ##__VA_ARGS__)
+
+//
+// Full round trip of a call between two connections in the same thread: Serializing the call, committing it
+// (setting up the reply handler), dispatching it on the server side, and processing the reply.
+//
+void benchRoundTrip()
+{
+	BenchService obj;
+	auto trps = LoopbackTransport::createPair();
+	Connection<void, BenchService> client(nullptr, trps.first);
+	Connection<BenchService, void> server(&obj, trps.second);
+
+	int res = 0;
+	runBench("roundtrip add", [&]
+	{
+		CZRPC_CALL(client, add, 1, 2).async([&res](Result<int>&& r)
+		{
+			res = r.get();
+		});
+		server.process();
+		client.process();
+	});
+
+	runBench("roundtrip add ft", [&]
+	{
+		auto ft = CZRPC_CALL(client, add, 1, 2).ft();
+		server.process();
+		client.process();
+		res = ft.get().get();
+	});
+
+	std::string str(64, 'a');
+	runBench("roundtrip echoString(64)", [&]
+	{
+		CZRPC_CALL(client, echoString, str).async([&res](Result<std::string>&& r)
+		{
+			res = static_cast<int>(r.get().size());
+		});
+		server.process();
+		client.process();
+	});
+
+	ObjectData(&obj).setProperty("name", Any("MicroBenchmark"));
+	runBench("roundtrip __getProperty", [&]
+	{
+		CZRPC_CALLGENERIC(client, "__getProperty", std::vector<Any>{Any("name")}).async([&res](Result<Any>&& r)
+		{
+			res = static_cast<int>(r.get().getType());
+		});
+		server.process();
+		client.process();
+	});
+
+	// First request watches the property. Any further requests are served from the cache
+	client.getPropertyAsync("name", [](Result<Any>&&) {});
+	server.process();
+	client.process();
+	runBench("cached getProperty", [&]
+	{
+		res = static_cast<int>(client.getProperty("name").get().getType());
+	});
+}
+
+void writeJson(const char* filename)
+{
+	FILE* f = fopen(filename, "wt");
+	if (!f)
+		FATAL_ERROR("Could not open file '%s'", filename);
+	fprintf(f, "{\n  \"results\": [\n");
+	for (size_t i = 0; i < gResults.size(); i++)
+	{
+		const BenchResult& r = gResults[i];
+		fprintf(f, "    { \"name\": \"%s\", \"nsPerOp\": %.2f, \"allocsPerOp\": %.3f, \"bytesPerOp\": %.1f }%s\n",
+				r.name.c_str(), r.nsPerOp, r.allocsPerOp, r.bytesPerOp, i + 1 < gResults.size() ? "," : "");
+	}
+	fprintf(f, "  ]\n}\n");
+	fclose(f);
+}
+
+int main(int argc, char* argv[])
+{
+	gParams.set(argc, argv);
+
+	printf("%-40s %12s %12s %12s\n", "Benchmark", "ns/op", "allocs/op", "bytes/op");
+
+	std::string shortStr(8, 'a');
+	std::string longStr(256, 'a');
+	std::vector<int> vec(100, 1);
+	auto tuple = std::make_tuple(1, std::string("Hello World"), 1.5);
+
+	benchType("int", 1);
+	benchType("double", 1.5);
+	benchType("string(8)", shortStr);
+	benchType("string(256)", longStr);
+	benchType("vector<int>(100)", vec);
+	benchType("tuple<int,string,double>", tuple);
+	benchType("Any(int)", Any(1));
+	benchType("Any(string(8))", Any(shortStr.c_str()));
+	benchType("Any(string(24))", Any(std::string(24, 'a')));
+	benchType("Any(string(256))", Any(longStr));
+	benchType("Any(float)", Any(1.5f));
+	benchType("Any(int64)", Any(int64_t(1) << 40));
+	benchType("Any(double)", Any(1.5));
+	benchType("Any(array(8 x int))", Any(Any::Array(8, Any(1000))));
+	benchType("Any(map(4 x int))", Any(Any::Map{{"a", Any(1)}, {"b", Any(2)}, {"c", Any(3)}, {"d", Any(4)}}));
+
+	BENCH_SERIALIZEMETHOD(noParams);
+	BENCH_SERIALIZEMETHOD(add, 1, 2);
+	BENCH_SERIALIZEMETHOD(echoString, longStr);
+	BENCH_SERIALIZEMETHOD(echoVector, vec);
+	BENCH_SERIALIZEMETHOD(echoTuple, tuple);
+	BENCH_SERIALIZEMETHOD(echoAny, Any(1));
+
+	BENCH_PROCESSCALL(noParams);
+	BENCH_PROCESSCALL(add, 1, 2);
+	BENCH_PROCESSCALL(echoString, longStr);
+	BENCH_PROCESSCALL(echoVector, vec);
+	BENCH_PROCESSCALL(echoTuple, tuple);
+	BENCH_PROCESSCALL(echoAny, Any(1));
+	benchProcessGenericCall("add", std::vector<Any>{Any(1), Any(2)});
+	benchProcessGenericCall("echoString", std::vector<Any>{Any(longStr)});
+
+	benchGetProperty();
+	benchRoundTrip();
+
+	if (gParams.has("json"))
+		writeJson(gParams.get("json").c_str());
+
+	return EXIT_SUCCESS;
+}
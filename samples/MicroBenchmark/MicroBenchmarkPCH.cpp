@@ -0,0 +1 @@
+#include "MicroBenchmarkPCH.h"
@@ -0,0 +1,18 @@
+// stdafx.h : include file for standard system include files,
+// or project specific include files that are used frequently, but
+// are changed infrequently
+//
+
+#pragma once
+
+#include "targetver.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <tchar.h>
+#include <chrono>
+#include <new>
+
+#include "crazygaze/rpc/RPC.h"
+
+#include "../SamplesCommon/Parameters.h"
@@ -0,0 +1,114 @@
+#include "SamplesCommonPCH.h"
+#include "Histogram.h"
+#include <assert.h>
+#include <algorithm>
+
+namespace cz
+{
+
+namespace
+{
+	int getMSB(uint64_t v)
+	{
+		int msb = 0;
+		while (v >>= 1)
+			msb++;
+		return msb;
+	}
+}
+
+//
+// Values below m_subBucketCount are kept in their own bucket.
+// Above that, each power of 2 is split into m_subBucketHalfCount buckets of equal size, therefore keeping
+// the relative error constant.
+//
+Histogram::Histogram(uint64_t maxValue, int significantDigits)
+	: m_maxValue(maxValue)
+{
+	assert(significantDigits >= 1 && significantDigits <= 5);
+	uint64_t largestSingleUnit = 2;
+	for (int i = 0; i < significantDigits; i++)
+		largestSingleUnit *= 10;
+
+	m_subBucketBits = getMSB(largestSingleUnit - 1) + 1;
+	m_subBucketCount = uint64_t(1) << m_subBucketBits;
+	m_subBucketHalfCount = m_subBucketCount / 2;
+	m_counts.resize(getIndex(maxValue) + 1);
+}
+
+size_t Histogram::getIndex(uint64_t value) const
+{
+	if (value < m_subBucketCount)
+		return static_cast<size_t>(value);
+	// How much we need to shift the value to fit in [m_subBucketHalfCount, m_subBucketCount)
+	int shift = getMSB(value) - (m_subBucketBits - 1);
+	return static_cast<size_t>(
+		m_subBucketCount + (shift - 1) * m_subBucketHalfCount + ((value >> shift) - m_subBucketHalfCount));
+}
+
+uint64_t Histogram::getHighestEquivalentValue(size_t index) const
+{
+	if (index < m_subBucketCount)
+		return index;
+	uint64_t shift = (index - m_subBucketCount) / m_subBucketHalfCount + 1;
+	uint64_t sub = (index - m_subBucketCount) % m_subBucketHalfCount + m_subBucketHalfCount;
+	return ((sub + 1) << shift) - 1;
+}
+
+void Histogram::record(uint64_t value)
+{
+	value = std::min(value, m_maxValue);
+	m_counts[getIndex(value)]++;
+	m_count++;
+	m_min = std::min(m_min, value);
+	m_max = std::max(m_max, value);
+	m_total += static_cast<double>(value);
+}
+
+void Histogram::merge(const Histogram& other)
+{
+	assert(m_counts.size() == other.m_counts.size());
+	for (size_t i = 0; i < m_counts.size(); i++)
+		m_counts[i] += other.m_counts[i];
+	m_count += other.m_count;
+	m_min = std::min(m_min, other.m_min);
+	m_max = std::max(m_max, other.m_max);
+	m_total += other.m_total;
+}
+
+void Histogram::reset()
+{
+	std::fill(m_counts.begin(), m_counts.end(), 0);
+	m_count = 0;
+	m_min = UINT64_MAX;
+	m_max = 0;
+	m_total = 0;
+}
+
+double Histogram::getMean() const
+{
+	return m_count ? m_total / m_count : 0;
+}
+
+uint64_t Histogram::getPercentile(double percentile) const
+{
+	if (m_count == 0)
+		return 0;
+
+	percentile = std::min(std::max(percentile, 0.0), 100.0);
+	uint64_t target = static_cast<uint64_t>(percentile / 100.0 * m_count + 0.5);
+	target = std::max(target, uint64_t(1));
+
+	uint64_t acc = 0;
+	for (size_t i = 0; i < m_counts.size(); i++)
+	{
+		acc += m_counts[i];
+		if (acc >= target)
+			return std::min(getHighestEquivalentValue(i), m_max);
+	}
+
+	return m_max;
+}
+
+} // namespace cz
+
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <vector>
+#include <stdint.h>
+
+namespace cz
+{
+
+//
+// HDR style histogram (log-linear buckets), for recording latencies.
+// Values are kept with a fixed number of significant digits across the whole range, so percentiles
+// are accurate for both small and large values, with a fixed memory footprint.
+//
+class Histogram
+{
+public:
+	// maxValue : Values above this are recorded as maxValue
+	// significantDigits : Precision to keep (1 to 5)
+	explicit Histogram(uint64_t maxValue = 3600ull * 1000 * 1000 * 1000, int significantDigits = 3);
+
+	void record(uint64_t value);
+
+	// Adds the values of another histogram. Both histograms need to have the same configuration
+	void merge(const Histogram& other);
+	void reset();
+
+	uint64_t getCount() const { return m_count; }
+	uint64_t getMin() const { return m_count ? m_min : 0; }
+	uint64_t getMax() const { return m_max; }
+	double getMean() const;
+
+	// percentile : 0 to 100 (e.g: 99.9)
+	// return: The highest value that is equivalent (within the precision) to the value at that percentile
+	uint64_t getPercentile(double percentile) const;
+
+private:
+	size_t getIndex(uint64_t value) const;
+	uint64_t getHighestEquivalentValue(size_t index) const;
+
+	uint64_t m_maxValue;
+	int m_subBucketBits;
+	uint64_t m_subBucketCount;
+	uint64_t m_subBucketHalfCount;
+	std::vector<uint64_t> m_counts;
+	uint64_t m_count = 0;
+	uint64_t m_min = UINT64_MAX;
+	uint64_t m_max = 0;
+	double m_total = 0;
+};
+
+} // namespace cz
+
@@ -12,7 +12,9 @@ public:
 	using Local = LOCAL;
 	using Remote = REMOTE;
 
-	explicit SimpleServer(Local& obj, int port, std::string authToken="")
+	// decorator : If specified, it is used to wrap the transport of each connection (e.g: to capture the traffic)
+	explicit SimpleServer(Local& obj, int port, std::string authToken="",
+		TransportDecoratorFunc decorator = nullptr)
 		: m_obj(obj)
 		, m_objData(&m_obj)
 	{
@@ -26,9 +28,10 @@ public:
 		m_objData.setAuthToken(std::move(authToken));
 
 		m_acceptor = AsioTransportAcceptor<Local, Remote>::create(m_io, m_obj);
+		m_acceptor->setTransportDecorator(std::move(decorator));
 		m_acceptor->start(port, [&](std::shared_ptr<Connection<Local, Remote>> con)
 		{
-			auto trp = static_cast<BaseAsioTransport*>(con->transport.get());
+			auto trp = findTransport<BaseAsioTransport>(con->transport.get());
 			auto point = trp->getRemoteEndpoint();
 			printf("Client %s:%d connected.\n", point.address().to_string().c_str(), point.port());
 			trp->setOnClosed([point]
@@ -6,6 +6,7 @@ separated parameters:
 command param1,param2,param2
 parameters can be numbers, strings, or file contents (contents of the file will be loaded):
 command 100,100.5,"Hello", !"filename.txt"
+Integers that don't fit in an int are passed as 64 bits integers, and numbers with a '.' as doubles.
 
 returns the command and the parameters
 */
@@ -39,18 +40,23 @@ GenericCommand parseCommandParameters(const std::string& str)
 	{
 		token = cz::trim(token);
 		std::stringstream sstoken(token);
-		int i;
+		long long i;
 		std::string s;
 		// first try to read integer (doesn't have a '.')
-		// This is needed to differentiate between integer and float.
+		// This is needed to differentiate between integer and double.
 		int ch = sstoken.peek();
-		if (ch>='0' && ch<='9')
+		if ((ch>='0' && ch<='9') || ch=='-')
 		{
-			float f;
+			double d;
 			if (token.find('.')==std::string::npos && (sstoken >> i))
-				cmd.params.emplace_back(i);
-			else if (sstoken >> f)
-				cmd.params.emplace_back(f);
+			{
+				if (i >= std::numeric_limits<int>::min() && i <= std::numeric_limits<int>::max())
+					cmd.params.emplace_back(static_cast<int>(i));
+				else
+					cmd.params.emplace_back(static_cast<int64_t>(i));
+			}
+			else if (sstoken >> d)
+				cmd.params.emplace_back(d);
 			else
 				return std::move(empty);
 		}
@@ -147,11 +153,13 @@ bool cmd_Connect(const std::vector<cz::rpc::Any>& params)
 		return true;
 	}
 
-	// Try to get the name from the server (if any)
-	auto res = CZRPC_CALLGENERIC(*con, "__getProperty", std::vector<Any>{Any("name")}).ft().get();
+	// Try to get the name from the server (if any).
+	// The property is cached, and the server pushes any changes, so the name can be read any time without a
+	// round trip.
+	auto res = con->getProperty("name");
 	if (!res.isValid())
 	{
-		std::cout << "Call to __getProperty failed\n";
+		std::cout << "Call to __watchProperty failed\n";
 		return true;
 	}
 
@@ -223,6 +231,45 @@ bool cmd_Quit(const std::vector<cz::rpc::Any>&)
 	return false;
 }
 
+bool cmd_Stats(const std::vector<cz::rpc::Any>& params)
+{
+	std::tuple<std::string> p;
+	if (!toTuple(params, p))
+	{
+		std::cout << "Invalid number/type of parameters\n";
+		return true;
+	}
+
+	auto it = gCons.find(std::get<0>(p));
+	if (it == gCons.end())
+	{
+		std::cout << "No connection with name " << std::get<0>(p) << " found.\n";
+		return true;
+	}
+
+	auto res = CZRPC_CALLGENERIC(*it->second->con, "__stats").ft().get();
+	std::vector<RPCStatsEntry> entries;
+	if (!res.isValid() || !statsFromAny(res.get(), entries))
+	{
+		std::cout << "Call to __stats failed\n";
+		return true;
+	}
+
+	// Latencies are shown in microseconds
+	printf("%-24s %10s %8s %12s %12s %10s %10s %10s %10s\n", "RPC", "Calls", "Errors", "CallBytes", "ReplyBytes",
+		   "Mean(us)", "p50(us)", "p99(us)", "p999(us)");
+	for (auto&& e : entries)
+	{
+		const RPCStatsSnapshot& s = e.stats;
+		printf("%-24s %10llu %8llu %12llu %12llu %10.1f %10.1f %10.1f %10.1f\n", e.name.c_str(),
+			   (unsigned long long)s.calls, (unsigned long long)s.errors, (unsigned long long)s.callBytes,
+			   (unsigned long long)s.replyBytes, s.getMeanLatency() / 1000, s.getPercentile(50) / 1000.0,
+			   s.getPercentile(99) / 1000.0, s.getPercentile(99.9) / 1000.0);
+	}
+
+	return true;
+}
+
 bool cmd_List(const std::vector<cz::rpc::Any>&)
 {
 	std::cout << "Connections list:" << std::endl;
@@ -269,6 +316,12 @@ InternalCommand gCmds[] =
 		"l", "list", &cmd_List,
 		"List all active connections"
 	} ,
+	{
+		"s", "stats", &cmd_Stats,
+		"\n" \
+		"    Displays the server side stats of all the RPCs called so far.\n" \
+		"    Format: stats conname"
+	},
 	{
 		"q", "quit", &cmd_Quit,
 		"Quit the application"
@@ -11,6 +11,28 @@ transports you want to use
 	#define CZRPC_CATCH_EXCEPTIONS 1
 #endif
 
+// If set to 1, it keeps per RPC counters and latency histograms, on both the
+// server side (time to process calls) and client side (round trip time)
+#if !defined(CZRPC_STATS)
+	#define CZRPC_STATS 1
+#endif
+
+// If set to 1, tracing of the RPC lifecycle is compiled in (see RPCTrace.h).
+// It still needs to be enabled at runtime with cz::rpc::Trace::setEnabled
+#if !defined(CZRPC_TRACE)
+	#define CZRPC_TRACE 0
+#endif
+
+// If set to 1, calls can be awaited with co_await, and RPCs can be coroutines returning cz::rpc::Task<T>
+// (see RPCCoroutine.h). Requires C++20, and is enabled by default if the compiler supports coroutines
+#if !defined(CZRPC_COROUTINES)
+	#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+		#define CZRPC_COROUTINES 1
+	#else
+		#define CZRPC_COROUTINES 0
+	#endif
+#endif
+
 // If defined AND set to 1, it will use Boost Asio, instead of standalone Asio
 #if !defined(CZRPC_HAS_BOOST)
 	#define CZRPC_HAS_BOOST 0
@@ -26,19 +48,42 @@ transports you want to use
 #include <mutex>
 #include <type_traits>
 #include <queue>
+#include <deque>
+#include <condition_variable>
+#include <algorithm>
+#include <atomic>
+#include <array>
 #include <stdexcept>
 #include <unordered_map>
 #include <future>
+#include <chrono>
+#include <thread>
+#include <limits>
+#include <cmath>
 #include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#if CZRPC_COROUTINES
+	#include <coroutine>
+	#include <optional>
+#endif
 #include "crazygaze/rpc/RPCCallstack.h"
 #include "crazygaze/rpc/RPCParamTraits.h"
 #include "crazygaze/rpc/RPCAny.h"
-#include "crazygaze/rpc/RPCObjectData.h"
 #include "crazygaze/rpc/RPCResult.h"
 #include "crazygaze/rpc/RPCStream.h"
 #include "crazygaze/rpc/RPCUtils.h"
+#include "crazygaze/rpc/RPCObjectData.h"
+#include "crazygaze/rpc/RPCFuture.h"
+#include "crazygaze/rpc/RPCStats.h"
+#include "crazygaze/rpc/RPCTrace.h"
 #include "crazygaze/rpc/RPCTransport.h"
+#include "crazygaze/rpc/RPCCoroutine.h"
 #include "crazygaze/rpc/RPCTable.h"
+#include "crazygaze/rpc/RPCStreaming.h"
+#include "crazygaze/rpc/RPCChannel.h"
 #include "crazygaze/rpc/RPCProcessor.h"
 #include "crazygaze/rpc/RPCConnection.h"
+#include "crazygaze/rpc/RPCCapture.h"
+#include "crazygaze/rpc/RPCPubSub.h"
 #include "crazygaze/rpc/RPCGenericServer.h"
@@ -13,16 +13,80 @@ namespace cz
 namespace rpc
 {
 
+namespace details
+{
+	// Maximum size of a varint encoded 64 bits value
+	static constexpr int kMaxVarintSize = 10;
+
+	// Encodes v as a varint (7 bits per byte, least significant bits first)
+	// return: Number of bytes written to dst
+	inline int encodeVarint(uint64_t v, unsigned char* dst)
+	{
+		int n = 0;
+		while (v >= 0x80)
+		{
+			dst[n++] = static_cast<unsigned char>(v | 0x80);
+			v >>= 7;
+		}
+		dst[n++] = static_cast<unsigned char>(v);
+		return n;
+	}
+
+	template<typename S>
+	uint64_t readVarint(S& s)
+	{
+		uint64_t res = 0;
+		for (int shift = 0; shift < 64; shift += 7)
+		{
+			unsigned char b;
+			s.read(&b, 1);
+			res |= static_cast<uint64_t>(b & 0x7F) << shift;
+			if ((b & 0x80) == 0)
+				break;
+		}
+		return res;
+	}
+
+	// Zigzag encoding, so that small negative numbers also have a small varint
+	inline uint64_t zigzagEncode(int64_t v)
+	{
+		return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+	}
+
+	inline int64_t zigzagDecode(uint64_t v)
+	{
+		return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+	}
+}
+
+//
+// Variant type used by generic RPCs and properties.
+//
+// Numbers, and strings/blobs up to kInlineCapacity bytes are stored inline, so they don't allocate memory.
+// Encoding is a one byte tag with the type, followed by:
+//	- Bool : One byte
+//	- Integer, Int64 : Zigzag varint
+//	- UnsignedInteger, UInt64 : Varint
+//	- Float, Double : 4/8 bytes
+//	- String, Blob : Varint size, followed by the data
+//	- Array : Varint count, followed by the elements
+//	- Map : Varint count, followed by the entries (key as varint size plus data, and then the value)
+//
 class Any
 {
 public:
-	enum class Type { None, Bool, Integer, UnsignedInteger, Float, String, Blob, MAX};
-private:
-	using LargestFundamental = float;
-	static constexpr Type LargestFundamentalType = Type::Float;
-public:
+	enum class Type : unsigned char
+	{
+		None, Bool, Integer, UnsignedInteger, Float, String, Blob, Int64, UInt64, Double, Array, Map, MAX
+	};
+	using Array = std::vector<Any>;
+	// Kept in insertion order. Lookups (see Any::find) are linear, since maps are expected to be small
+	using Map = std::vector<std::pair<std::string, Any>>;
 
-	Any() : m_type(Type::None)
+	// Strings and blobs up to this size are stored inline
+	static constexpr size_t kInlineCapacity = sizeof(std::string) - 2;
+
+	Any() : m_f(0), m_type(Type::None)
 	{
 	}
 
@@ -33,7 +97,7 @@ public:
 
 	// Constructing from an unsupported type leaves it set to None
 	template<typename T>
-	explicit Any(const T&) : m_type(Type::None)
+	explicit Any(const T&) : m_f(0), m_type(Type::None)
 	{
 	}
 
@@ -43,43 +107,93 @@ public:
 	}
 
 	explicit Any(bool v)
-		: m_type(Type::Bool)
+		: m_f(0)
+		, m_type(Type::Bool)
 	{
 		asF<bool>() = v;
 	}
 
 	explicit Any(int v)
-		: m_type(Type::Integer)
+		: m_f(0)
+		, m_type(Type::Integer)
 	{
 		asF<int>() = v;
 	}
 
 	explicit Any(unsigned v)
-		: m_type(Type::UnsignedInteger)
+		: m_f(0)
+		, m_type(Type::UnsignedInteger)
 	{
 		asF<unsigned>() = v;
 	}
 
+	explicit Any(int64_t v)
+		: m_f(0)
+		, m_type(Type::Int64)
+	{
+		asF<int64_t>() = v;
+	}
+
+	explicit Any(uint64_t v)
+		: m_f(0)
+		, m_type(Type::UInt64)
+	{
+		asF<uint64_t>() = v;
+	}
+
 	explicit Any(float v)
-		: m_type(Type::Float)
+		: m_f(0)
+		, m_type(Type::Float)
 	{
 		asF<float>() = v;
 	}
 
+	explicit Any(double v)
+		: m_f(0)
+		, m_type(Type::Double)
+	{
+		asF<double>() = v;
+	}
+
 	explicit Any(std::string v)
 		: m_type(Type::String)
-		, m_str(std::move(v))
-	{ }
+	{
+		if (v.size() <= kInlineCapacity)
+			setInline(v.data(), v.size());
+		else
+			new(&m_str) std::string(std::move(v));
+	}
 
 	explicit Any(const char* v)
 		: m_type(Type::String)
-		, m_str(v)
-	{ }
+	{
+		size_t size = strlen(v);
+		if (size <= kInlineCapacity)
+			setInline(v, size);
+		else
+			new(&m_str) std::string(v, size);
+	}
 
 	explicit Any(std::vector<unsigned char> v)
 		: m_type(Type::Blob)
-		, m_blob(std::move(v))
-	{ }
+	{
+		if (v.size() <= kInlineCapacity)
+			setInline(reinterpret_cast<const char*>(v.data()), v.size());
+		else
+			new(&m_blob) std::vector<unsigned char>(std::move(v));
+	}
+
+	explicit Any(Array v)
+		: m_type(Type::Array)
+	{
+		new(&m_array) Array(std::move(v));
+	}
+
+	explicit Any(Map v)
+		: m_type(Type::Map)
+	{
+		new(&m_map) Map(std::move(v));
+	}
 
 	Any(const Any& other)
 	{
@@ -111,6 +225,38 @@ public:
 		return *this;
 	}
 
+	bool operator==(const Any& other) const
+	{
+		if (m_type != other.m_type)
+			return false;
+		switch (m_type)
+		{
+		case Type::None:
+			return true;
+		case Type::Bool:
+			return asF<bool>() == other.asF<bool>();
+		case Type::Float:
+			return asF<float>() == other.asF<float>();
+		case Type::Double:
+			return asF<double>() == other.asF<double>();
+		case Type::String:
+		case Type::Blob:
+			return getBytesSize() == other.getBytesSize() &&
+				   memcmp(getBytes(), other.getBytes(), getBytesSize()) == 0;
+		case Type::Array:
+			return m_array == other.m_array;
+		case Type::Map:
+			return m_map == other.m_map;
+		default:
+			return m_f == other.m_f;
+		}
+	}
+
+	bool operator!=(const Any& other) const
+	{
+		return !(*this == other);
+	}
+
 	template<typename T>
 	bool getAs(T& dst) const
 	{
@@ -119,9 +265,14 @@ public:
 
 	bool getAs(bool& dst) const
 	{
-		if (m_type == Type::Bool || m_type == Type::Integer || m_type == Type::UnsignedInteger)
+		if (m_type == Type::Bool)
 		{
-			dst = asF<unsigned int>() == 0 ? false : true;
+			dst = asF<bool>();
+			return true;
+		}
+		else if (isInteger())
+		{
+			dst = asUInt64() != 0;
 			return true;
 		}
 		else
@@ -132,14 +283,29 @@ public:
 
 	bool getAs(int& dst) const
 	{
-		if (m_type == Type::Integer)
-		{
-			dst = asF<int>();
-			return true;
-		}
-		else if (m_type == Type::Float)
+		return getIntegerAs(dst);
+	}
+
+	bool getAs(unsigned& dst) const
+	{
+		return getIntegerAs(dst);
+	}
+
+	bool getAs(int64_t& dst) const
+	{
+		return getIntegerAs(dst);
+	}
+
+	bool getAs(uint64_t& dst) const
+	{
+		return getIntegerAs(dst);
+	}
+
+	bool getAs(float& dst) const
+	{
+		if (isNumber())
 		{
-			dst = static_cast<int>(asF<float>());
+			dst = static_cast<float>(asDouble());
 			return true;
 		}
 		else
@@ -148,21 +314,11 @@ public:
 		}
 	}
 
-	bool getAs(unsigned& dst) const
+	bool getAs(double& dst) const
 	{
-		if (m_type == Type::UnsignedInteger)
-		{
-			dst = asF<unsigned>();
-			return true;
-		}
-		else if (m_type == Type::Integer)
+		if (isNumber())
 		{
-			dst = asF<int>();
-			return true;
-		}
-		else if (m_type == Type::Float)
-		{
-			dst = static_cast<int>(asF<float>());
+			dst = asDouble();
 			return true;
 		}
 		else
@@ -171,21 +327,25 @@ public:
 		}
 	}
 
-	bool getAs(float& dst) const
+	bool getAs(std::string& dst) const
 	{
-		if (m_type == Type::Float)
+		if (m_type == Type::String)
 		{
-			dst = asF<float>();
+			dst.assign(getBytes(), getBytesSize());
 			return true;
 		}
-		else if (m_type == Type::Integer)
+		else
 		{
-			dst = static_cast<float>(asF<int>());
-			return true;
+			return false;
 		}
-		else if (m_type == Type::UnsignedInteger)
+	}
+
+	bool getAs(std::vector<unsigned char>& dst) const
+	{
+		if (m_type == Type::Blob)
 		{
-			dst = static_cast<float>(asF<unsigned>());
+			auto p = reinterpret_cast<const unsigned char*>(getBytes());
+			dst.assign(p, p + getBytesSize());
 			return true;
 		}
 		else
@@ -194,11 +354,11 @@ public:
 		}
 	}
 
-	bool getAs(std::string& dst) const
+	bool getAs(Array& dst) const
 	{
-		if (m_type == Type::String)
+		if (m_type == Type::Array)
 		{
-			dst = m_str;
+			dst = m_array;
 			return true;
 		}
 		else
@@ -207,11 +367,11 @@ public:
 		}
 	}
 
-	bool getAs(std::vector<unsigned char>& dst) const
+	bool getAs(Map& dst) const
 	{
-		if (m_type == Type::Blob)
+		if (m_type == Type::Map)
 		{
-			dst = m_blob;
+			dst = m_map;
 			return true;
 		}
 		else
@@ -226,9 +386,47 @@ public:
 		return true;
 	}
 
+	// Access to the elements of an array without copying.
+	// return: nullptr if this is not an array
+	const Array* getArray() const
+	{
+		return m_type == Type::Array ? &m_array : nullptr;
+	}
+
+	Array* getArray()
+	{
+		return m_type == Type::Array ? &m_array : nullptr;
+	}
+
+	// Access to the entries of a map without copying.
+	// return: nullptr if this is not a map
+	const Map* getMap() const
+	{
+		return m_type == Type::Map ? &m_map : nullptr;
+	}
+
+	Map* getMap()
+	{
+		return m_type == Type::Map ? &m_map : nullptr;
+	}
+
+	// Finds the value of a key in a map
+	// return: nullptr if this is not a map, or the key doesn't exist
+	const Any* find(const std::string& key) const
+	{
+		if (m_type != Type::Map)
+			return nullptr;
+		for (auto&& e : m_map)
+		{
+			if (e.first == key)
+				return &e.second;
+		}
+		return nullptr;
+	}
+
 	const char* toString() const
 	{
-		thread_local static char tmp[22];
+		thread_local static char tmp[24];
 		switch (m_type)
 		{
 		case Type::None:
@@ -239,19 +437,30 @@ public:
 			return itoa(asF<int>(), tmp, 10);
 		case Type::UnsignedInteger:
 			return itoa(asF<unsigned>(), tmp, 10);
+		case Type::Int64:
+			snprintf(tmp, sizeof(tmp), "%lld", static_cast<long long>(asF<int64_t>()));
+			return tmp;
+		case Type::UInt64:
+			snprintf(tmp, sizeof(tmp), "%llu", static_cast<unsigned long long>(asF<uint64_t>()));
+			return tmp;
 		case Type::Float:
+		case Type::Double:
 		{
-			auto res = snprintf(tmp, sizeof(tmp), "%.4f", asF<float>());
+			auto res = snprintf(tmp, sizeof(tmp), "%.4f", asDouble());
 			if (res >= 0 && res < sizeof(tmp))
 				return tmp;
 			else
 				return "conversion error";
 		}
 		case Type::String:
-			return m_str.c_str();
+			return getBytes();
 		case Type::Blob:
+		case Type::Array:
+		case Type::Map:
 		{
-			int res = snprintf(tmp, sizeof(tmp), "BLOB{%d}", static_cast<int>(m_blob.size()));
+			const char* fmt = m_type == Type::Blob ? "BLOB{%d}" : (m_type == Type::Array ? "ARRAY{%d}" : "MAP{%d}");
+			size_t size = m_type == Type::Blob ? getBytesSize() : (m_type == Type::Array ? m_array.size() : m_map.size());
+			int res = snprintf(tmp, sizeof(tmp), fmt, static_cast<int>(size));
 			if (res >= 0 && res < sizeof(tmp))
 				return tmp;
 			else
@@ -266,88 +475,408 @@ public:
 	template<typename S>
 	void write(S& s) const
 	{
-		s << (unsigned char)m_type;
-		if (m_type == Type::Bool)
-			s << asF<bool>();
-		else if (m_type == Type::String)
-			s << m_str;
-		else if (m_type == Type::Blob)
-			s << m_blob;
-		else
-			s << asF<LargestFundamental>();
+		unsigned char buf[1 + details::kMaxVarintSize];
+		int n = 1;
+		buf[0] = static_cast<unsigned char>(m_type);
+		switch (m_type)
+		{
+		case Type::Bool:
+			buf[n++] = asF<bool>() ? 1 : 0;
+			break;
+		case Type::Integer:
+			n += details::encodeVarint(details::zigzagEncode(asF<int>()), buf + n);
+			break;
+		case Type::Int64:
+			n += details::encodeVarint(details::zigzagEncode(asF<int64_t>()), buf + n);
+			break;
+		case Type::UnsignedInteger:
+			n += details::encodeVarint(asF<unsigned>(), buf + n);
+			break;
+		case Type::UInt64:
+			n += details::encodeVarint(asF<uint64_t>(), buf + n);
+			break;
+		case Type::Float:
+			memcpy(buf + n, &asF<float>(), sizeof(float));
+			n += sizeof(float);
+			break;
+		case Type::Double:
+			memcpy(buf + n, &asF<double>(), sizeof(double));
+			n += sizeof(double);
+			break;
+		case Type::String:
+		case Type::Blob:
+			n += details::encodeVarint(getBytesSize(), buf + n);
+			s.write(buf, n);
+			if (getBytesSize())
+				s.write(getBytes(), static_cast<int>(getBytesSize()));
+			return;
+		case Type::Array:
+			n += details::encodeVarint(m_array.size(), buf + n);
+			s.write(buf, n);
+			for (auto&& e : m_array)
+				e.write(s);
+			return;
+		case Type::Map:
+			n += details::encodeVarint(m_map.size(), buf + n);
+			s.write(buf, n);
+			for (auto&& e : m_map)
+			{
+				n = details::encodeVarint(e.first.size(), buf);
+				s.write(buf, n);
+				if (e.first.size())
+					s.write(e.first.data(), static_cast<int>(e.first.size()));
+				e.second.write(s);
+			}
+			return;
+		default:
+			break;
+		}
+		s.write(buf, n);
 	}
-	
+
 	template<typename S>
 	void read(S& s)
 	{
-		destroy();
-		// Read type
+		readData(s, readType(s));
+	}
+
+	// Reads an Any from the stream straight into dst, converting it the same way getAs does.
+	// Strings and blobs are read directly into the destination, instead of being read into an Any and then
+	// copied.
+	template<typename S, typename T>
+	static bool readAs(S& s, T& dst)
+	{
+		Any tmp;
+		tmp.read(s);
+		return tmp.getAs(dst);
+	}
+
+	template<typename S>
+	static bool readAs(S& s, std::string& dst)
+	{
+		Type t = readType(s);
+		if (t == Type::String)
+		{
+			readBytes(s, dst);
+			return true;
+		}
+		Any tmp;
+		tmp.readData(s, t);
+		return tmp.getAs(dst);
+	}
+
+	template<typename S>
+	static bool readAs(S& s, std::vector<unsigned char>& dst)
+	{
+		Type t = readType(s);
+		if (t == Type::Blob)
+		{
+			readBytes(s, dst);
+			return true;
+		}
+		Any tmp;
+		tmp.readData(s, t);
+		return tmp.getAs(dst);
+	}
+
+	template<typename S>
+	static bool readAs(S& s, Any& dst)
+	{
+		dst.read(s);
+		return true;
+	}
+
+private:
+
+	template<typename S>
+	static Type readType(S& s)
+	{
 		unsigned char t;
 		s >> t;
 		assert(t < (unsigned char)Type::MAX);
-		m_type = static_cast<Type>(t);
+		return static_cast<Type>(t);
+	}
 
-		// Read data
-		if (m_type == Type::Bool)
-			s >> asF<bool>();
-		else if (m_type == Type::String)
+	// Reads a varint size followed by that many bytes
+	template<typename S, typename C>
+	static void readBytes(S& s, C& dst)
+	{
+		dst.resize(static_cast<size_t>(details::readVarint(s)));
+		if (dst.size())
+			s.read(&dst[0], static_cast<int>(dst.size()));
+	}
+
+	template<typename S>
+	void readData(S& s, Type type)
+	{
+		destroy();
+
+		switch (type)
 		{
-			std::string v;
-			s >> v;
-			new(&m_str) std::string(std::move(v));
+		case Type::Bool:
+		{
+			unsigned char v;
+			s.read(&v, 1);
+			asF<bool>() = v != 0;
+			break;
 		}
-		else if (m_type == Type::Blob)
+		case Type::Integer:
+			asF<int>() = static_cast<int>(details::zigzagDecode(details::readVarint(s)));
+			break;
+		case Type::Int64:
+			asF<int64_t>() = details::zigzagDecode(details::readVarint(s));
+			break;
+		case Type::UnsignedInteger:
+			asF<unsigned>() = static_cast<unsigned>(details::readVarint(s));
+			break;
+		case Type::UInt64:
+			asF<uint64_t>() = details::readVarint(s);
+			break;
+		case Type::Float:
+			s.read(&asF<float>(), sizeof(float));
+			break;
+		case Type::Double:
+			s.read(&asF<double>(), sizeof(double));
+			break;
+		case Type::String:
+		case Type::Blob:
 		{
-			std::vector<unsigned char> v;
-			s >> v;
-			new(&m_blob) std::vector<unsigned char>(std::move(v));
+			size_t size = static_cast<size_t>(details::readVarint(s));
+			if (size <= kInlineCapacity)
+			{
+				m_isInline = true;
+				m_inline.size = static_cast<unsigned char>(size);
+				if (size)
+					s.read(m_inline.data, static_cast<int>(size));
+				m_inline.data[size] = 0;
+			}
+			else if (type == Type::String)
+			{
+				std::string v(size, 0);
+				s.read(&v[0], static_cast<int>(size));
+				new(&m_str) std::string(std::move(v));
+			}
+			else
+			{
+				std::vector<unsigned char> v(size);
+				s.read(&v[0], static_cast<int>(size));
+				new(&m_blob) std::vector<unsigned char>(std::move(v));
+			}
+			break;
+		}
+		case Type::Array:
+		{
+			Array v(static_cast<size_t>(details::readVarint(s)));
+			for (auto&& e : v)
+				e.read(s);
+			new(&m_array) Array(std::move(v));
+			break;
 		}
+		case Type::Map:
+		{
+			Map v(static_cast<size_t>(details::readVarint(s)));
+			for (auto&& e : v)
+			{
+				readBytes(s, e.first);
+				e.second.read(s);
+			}
+			new(&m_map) Map(std::move(v));
+			break;
+		}
+		default:
+			break;
+		}
+
+		m_type = type;
+	}
+
+	void setInline(const char* data, size_t size)
+	{
+		m_isInline = true;
+		m_inline.size = static_cast<unsigned char>(size);
+		memcpy(m_inline.data, data, size);
+		m_inline.data[size] = 0;
+	}
+
+	// Data of a String or Blob. For strings, it's null terminated
+	const char* getBytes() const
+	{
+		if (m_isInline)
+			return m_inline.data;
+		else if (m_type == Type::String)
+			return m_str.c_str();
 		else
-			s >> asF<LargestFundamental>();
+			return reinterpret_cast<const char*>(m_blob.data());
 	}
 
+	size_t getBytesSize() const
+	{
+		if (m_isInline)
+			return m_inline.size;
+		else if (m_type == Type::String)
+			return m_str.size();
+		else
+			return m_blob.size();
+	}
 
-private:
+	bool isInteger() const
+	{
+		return m_type == Type::Integer || m_type == Type::UnsignedInteger || m_type == Type::Int64 ||
+			   m_type == Type::UInt64;
+	}
+
+	bool isNumber() const
+	{
+		return isInteger() || m_type == Type::Float || m_type == Type::Double;
+	}
+
+	// These assume the type is an integer (see isInteger)
+	int64_t asInt64() const
+	{
+		switch (m_type)
+		{
+		case Type::Integer:
+			return asF<int>();
+		case Type::UnsignedInteger:
+			return asF<unsigned>();
+		case Type::UInt64:
+			return static_cast<int64_t>(asF<uint64_t>());
+		default:
+			return asF<int64_t>();
+		}
+	}
+
+	uint64_t asUInt64() const
+	{
+		return m_type == Type::UInt64 ? asF<uint64_t>() : static_cast<uint64_t>(asInt64());
+	}
+
+	// This assumes the type is a number (see isNumber)
+	double asDouble() const
+	{
+		switch (m_type)
+		{
+		case Type::Float:
+			return asF<float>();
+		case Type::Double:
+			return asF<double>();
+		case Type::UInt64:
+			return static_cast<double>(asF<uint64_t>());
+		default:
+			return static_cast<double>(asInt64());
+		}
+	}
+
+	// Converts an integer to another integer type, failing if the value doesn't fit
+	template<typename From, typename To>
+	static bool narrow(From v, To& dst)
+	{
+		To res = static_cast<To>(v);
+		if (static_cast<From>(res) != v || (res < To(0)) != (v < From(0)))
+			return false;
+		dst = res;
+		return true;
+	}
+
+	// Converts a floating point value to an integer type, discarding the fractional part, and failing if the
+	// value doesn't fit (or is NaN).
+	// The bounds are powers of two, so they are exact as doubles.
+	template<typename To>
+	static bool narrow(double v, To& dst)
+	{
+		double t = std::trunc(v);
+		if (!(t >= static_cast<double>(std::numeric_limits<To>::min()) &&
+			  t < static_cast<double>(std::numeric_limits<To>::max() / 2 + 1) * 2))
+			return false;
+		dst = static_cast<To>(t);
+		return true;
+	}
+
+	template<typename To>
+	bool getIntegerAs(To& dst) const
+	{
+		switch (m_type)
+		{
+		case Type::Integer:
+			return narrow(asF<int>(), dst);
+		case Type::UnsignedInteger:
+			return narrow(asF<unsigned>(), dst);
+		case Type::Int64:
+			return narrow(asF<int64_t>(), dst);
+		case Type::UInt64:
+			return narrow(asF<uint64_t>(), dst);
+		case Type::Float:
+		case Type::Double:
+			return narrow(asDouble(), dst);
+		default:
+			return false;
+		}
+	}
 
 	void copyFrom(const Any& other)
 	{
 		m_type = other.m_type;
-		if (m_type == Type::String)
+		m_isInline = other.m_isInline;
+		if (m_isInline)
+			m_inline = other.m_inline;
+		else if (m_type == Type::String)
 			new(&m_str) std::string(other.m_str);
 		else if (m_type == Type::Blob)
 			new(&m_blob) std::vector<unsigned char>(other.m_blob);
+		else if (m_type == Type::Array)
+			new(&m_array) Array(other.m_array);
+		else if (m_type == Type::Map)
+			new(&m_map) Map(other.m_map);
 		else
-			asF<LargestFundamental>() = other.asF<LargestFundamental>();
+			m_f = other.m_f;
 	}
 
 	void moveFrom(Any&& other)
 	{
 		m_type = other.m_type;
-		if (m_type == Type::String)
+		m_isInline = other.m_isInline;
+		if (m_isInline)
+			m_inline = other.m_inline;
+		else if (m_type == Type::String)
 			new(&m_str) std::string(std::move(other.m_str));
 		else if (m_type == Type::Blob)
 			new(&m_blob) std::vector<unsigned char>(std::move(other.m_blob));
+		else if (m_type == Type::Array)
+			new(&m_array) Array(std::move(other.m_array));
+		else if (m_type == Type::Map)
+			new(&m_map) Map(std::move(other.m_map));
 		else
-			asF<LargestFundamental>() = other.asF<LargestFundamental>();
+			m_f = other.m_f;
 	}
 
 	void destroy()
 	{
 		using String = std::string;
 		using Vector = std::vector<unsigned char>;
-		switch(m_type)
+		if (!m_isInline)
 		{
-		case Type::String:
-			m_str.~String();
-			break;
-		case Type::Blob:
-			m_blob.~Vector();
-			break;
-		default:
-			asF<LargestFundamental>() = 0;
-		};
+			switch (m_type)
+			{
+			case Type::String:
+				m_str.~String();
+				break;
+			case Type::Blob:
+				m_blob.~Vector();
+				break;
+			case Type::Array:
+				m_array.~Array();
+				break;
+			case Type::Map:
+				m_map.~Map();
+				break;
+			default:
+				break;
+			};
+		}
 
+		m_f = 0;
 		m_type = Type::None;
+		m_isInline = false;
 	}
 
 	template<typename T>
@@ -366,13 +895,26 @@ private:
 		return *reinterpret_cast<const T*>(&m_f);
 	}
 
+	// Strings and blobs small enough to not need an allocation
+	struct Inline
+	{
+		// +1 for the null terminator of strings
+		char data[kInlineCapacity + 1];
+		unsigned char size;
+	};
+
 	union
 	{
-		int m_f; // any supported fundamental type
+		uint64_t m_f; // any supported fundamental type
+		Inline m_inline;
 		std::string m_str;
 		std::vector<unsigned char> m_blob;
+		Array m_array;
+		Map m_map;
 	};
 	Type m_type;
+	// For Strings and Blobs, tells if the data is in m_inline, or in m_str/m_blob
+	bool m_isInline = false;
 
 };
 
@@ -432,6 +974,43 @@ static bool toTuple(const std::vector<Any>& v, Tuple& t)
 	return details::convert_any<Tuple, std::tuple_size<Tuple>::value == 0, 0>::convert(v, t);
 }
 
+namespace details
+{
+	template<typename Tuple, bool Done, int N>
+	struct read_any
+	{
+		template<typename S>
+		static bool read(S& s, Tuple& dst)
+		{
+			if (!Any::readAs(s, std::get<N>(dst)))
+				return false;
+			return read_any<Tuple, std::tuple_size<Tuple>::value == N + 1, N + 1>::read(s, dst);
+		}
+	};
+
+	template<typename Tuple, int N>
+	struct read_any<Tuple, true, N>
+	{
+		template<typename S>
+		static bool read(S& /*s*/, Tuple& /*dst*/)
+		{
+			return true;
+		}
+	};
+}
+
+// Same as reading a std::vector<Any> and then calling toTuple, but reads the values straight into the tuple,
+// without creating the std::vector<Any>.
+template<typename S, typename Tuple>
+static bool readTupleFromAny(S& s, Tuple& t)
+{
+	int len;
+	s.read(&len, sizeof(len));
+	if (len != std::tuple_size<Tuple>::value)
+		return false;
+	return details::read_any<Tuple, std::tuple_size<Tuple>::value == 0, 0>::read(s, t);
+}
+
 } // namespace rpc
 } // namespace cz
 
@@ -25,6 +25,76 @@ namespace rpc
 	namespace ASIO = ::asio;
 #endif
 
+// What to do when sending through a transport whose outgoing queue reached the high watermarks
+enum class OverflowPolicy
+{
+	// Block the caller until the queue drains to the low watermarks.
+	// If sending from a thread running the transport's io_service (e.g: from any of its handlers), blocking is not
+	// possible, and the data is queued anyway.
+	Block,
+	// Drop the oldest queued property pushes (see __watchProperty) to make room, since nothing waits for them.
+	// New calls are refused like with Fail, and anything else the peer waits for (e.g: replies, or stream frames)
+	// is queued anyway.
+	DropOldest,
+	// Refuse the new frame. Any call being sent is aborted.
+	Fail,
+	// Close the transport
+	Close
+};
+
+// Limits for the outgoing queue of a transport.
+// A limit of 0 for the high watermark means no limit for that dimension.
+struct SendQueueLimits
+{
+	size_t highWatermarkBytes = 0;
+	size_t lowWatermarkBytes = 0;
+	size_t highWatermarkFrames = 0;
+	size_t lowWatermarkFrames = 0;
+	OverflowPolicy policy = OverflowPolicy::Block;
+};
+
+// Limits for the incoming queue of a transport (RPCs received but not yet dispatched).
+// Once the high watermark is reached, the transport stops reading from the socket until the queue drains
+// to the low watermarks, therefore letting TCP flow control push back on the sender.
+// A limit of 0 for the high watermark means no limit for that dimension.
+struct ReceiveQueueLimits
+{
+	size_t highWatermarkBytes = 0;
+	size_t lowWatermarkBytes = 0;
+	size_t highWatermarkFrames = 0;
+	size_t lowWatermarkFrames = 0;
+};
+
+class BaseAsioTransport;
+
+namespace details
+{
+	// Metrics of a group of transports (e.g: all the transports created by an acceptor).
+	// Transports fold their metrics into the group when they close, so the group doesn't need to keep them alive.
+	struct AsioTransportGroup
+	{
+		// Metrics of the transports that already closed
+		TransportMetrics closed;
+		std::vector<BaseAsioTransport*> live;
+	};
+
+	// Frames bigger than the transport's maximum chunk size are sent as several chunks, interleaved with the
+	// other outgoing frames, so one big frame doesn't hold back everything queued behind it.
+	// Each chunk starts with this header. Whole frames start with their own size (see Header), which can't have
+	// kChunkBit set, since whole frames are never bigger than the maximum chunk size.
+	struct ChunkHeader
+	{
+		static constexpr uint32_t kChunkBit = 0x80000000;
+		// Size of the chunk (including this header), with kChunkBit set
+		uint32_t size;
+		// Frame the chunk belongs to. Unique amongst the frames being sent by the transport
+		uint32_t id;
+		// Size of the whole frame
+		uint64_t total;
+	};
+	static_assert(sizeof(ChunkHeader) == 16, "Unexpected ChunkHeader size");
+}
+
 class BaseAsioTransport : public Transport, public std::enable_shared_from_this<BaseAsioTransport>
 {
 private:
@@ -33,8 +103,14 @@ private:
 	struct ConstructorCookie { };
 public:
 
+	static constexpr size_t kDefaultMaxChunkSize = 64 * 1024;
+	// Default number of incoming frames dispatched in one go (see setProcessBudget)
+	static constexpr unsigned kDefaultProcessBudgetFrames = 64;
+	static constexpr size_t kMaxChunkSize = details::ChunkHeader::kChunkBit - sizeof(details::ChunkHeader) - 1;
+
 	virtual ~BaseAsioTransport()
 	{
+		leaveGroup();
 	}
 
 	BaseAsioTransport(ConstructorCookie, ASIO::io_service& io) : m_io(io)
@@ -51,29 +127,16 @@ public:
 		return m_s->remote_endpoint();
 	}
 
-	virtual void send(std::vector<char> data) override
+	virtual bool send(std::vector<char> data, Priority priority) override
 	{
-		if (m_closed)
-			return;
-
-		auto trigger = m_out([&](Out& out)
-		{
-			if (out.ongoingWrite)
-			{
-				out.q.push(std::move(data));
-				return false;
-			}
-			else
-			{
-				assert(out.q.size() == 0);
-				out.ongoingWrite = true;
-				m_outgoing = std::move(data);
-				return true;
-			}
-		});
+		CZRPC_TRACE_SCOPE("send", peekHeader(data).bits.rpcid, peekHeader(data).bits.counter);
+		return queue(OutFrame(std::move(data)), priority);
+	}
 
-		if (trigger)
-			triggerSend();
+	virtual bool sendShared(std::vector<char> prefix, SharedBuffer payload, Priority priority) override
+	{
+		CZRPC_TRACE_SCOPE("send", peekHeader(prefix).bits.rpcid, peekHeader(prefix).bits.counter);
+		return queue(OutFrame(std::move(prefix), std::move(payload)), priority);
 	}
 
 	virtual bool receive(std::vector<char>& dst) override
@@ -81,26 +144,41 @@ public:
 		if (m_closed)
 			return false;
 
-		return m_in([&dst](In& in) -> bool
+		bool resume = m_in([&dst](In& in)
 		{
 			if (in.q.size() == 0)
 			{
 				dst.clear();
-				return true;
+				return false;
 			}
-			else
+
+			dst = std::move(in.q.front());
+			in.q.pop();
+			in.bytes -= dst.size();
+			if (in.readPaused && in.isUnderLow())
 			{
-				dst = std::move(in.q.front());
-				in.q.pop();
+				in.readPaused = false;
 				return true;
 			}
+			return false;
 		});
+
+		if (resume)
+		{
+			m_io.post([this_ = shared_from_this()]
+			{
+				this_->startReadSize();
+			});
+		}
+
+		return true;
 	}
 
 	// This only causes the asio sockets to close, which in turn will cause our asio handlers
 	// to fail, therefore signaling our close cleanup code (to abort RPC replies)
 	virtual void close() override
 	{
+		setCloseReason(CloseReason::Local);
 		if (m_closeStarted)
 			return;
 		m_closeStarted = true;
@@ -124,29 +202,163 @@ public:
 		{
 			callback(ec ? false : true);
 			if (!ec)
+			{
+				this_->setNoDelay();
 				this_->startReadSize();
+			}
 		});
 
 	}
 
+	// The handler is called once the transport closes, after aborting any pending replies, from whatever thread
+	// dispatches the connection (see setExecutor)
 	void setOnClosed(std::function<void()> h)
 	{
 		m_onClosed = std::move(h);
 	}
 
+	void setReceiveQueueLimits(const ReceiveQueueLimits& limits)
+	{
+		assert(limits.lowWatermarkBytes <= limits.highWatermarkBytes);
+		assert(limits.lowWatermarkFrames <= limits.highWatermarkFrames);
+		m_in([&](In& in)
+		{
+			in.limits = limits;
+		});
+	}
+
+	// By default, incoming RPCs are dispatched (with Connection::process) from the io thread, as soon as
+	// they arrive. Setting an executor allows dispatching them somewhere else (e.g: a thread pool).
+	// Only one dispatch is scheduled at a time per transport, so RPCs are still processed in order.
+	// Should be set before any data arrives.
+	void setExecutor(std::function<void(std::function<void()>)> executor)
+	{
+		m_executor = std::move(executor);
+	}
+
+	// How much one dispatch processes before giving other connections a turn. If frames are still queued
+	// once the budget is used up, another dispatch is scheduled behind whatever else is waiting for the io
+	// thread (or the executor), so one connection flooding us with RPCs doesn't delay everyone else.
+	// Should be set before any data arrives.
+	void setProcessBudget(const ProcessBudget& budget)
+	{
+		m_processBudget = budget;
+	}
+
+	void setSendQueueLimits(const SendQueueLimits& limits)
+	{
+		assert(limits.lowWatermarkBytes <= limits.highWatermarkBytes);
+		assert(limits.lowWatermarkFrames <= limits.highWatermarkFrames);
+		m_out([&](Out& out)
+		{
+			out.limits = limits;
+			m_outHighBytes = limits.highWatermarkBytes;
+			m_outHighFrames = limits.highWatermarkFrames;
+			m_outPolicy = limits.policy;
+		});
+	}
+
+	// Outgoing frames bigger than this are split into chunks of this size, which are interleaved with other
+	// frames. A bigger size means less overhead for big frames, but a longer wait for whatever is queued behind.
+	// The peer reassembles the chunks as they arrive, so it doesn't need to be told about it.
+	void setMaxChunkSize(size_t size)
+	{
+		assert(size >= sizeof(Header) && size <= kMaxChunkSize);
+		m_maxChunkSize = size;
+	}
+
+	// Urgent frames are always sent first. The other priorities share the socket in proportion to their weights
+	// (4, 2 and 1 by default, for High, Normal and Low), so lower priorities are slowed down, but never starved.
+	void setPriorityWeight(Priority priority, unsigned weight)
+	{
+		assert(priority != Priority::Urgent && weight > 0);
+		m_weights[static_cast<int>(priority)] = weight;
+	}
+
+	virtual bool isWritable() const override
+	{
+		return !m_outFull.load(std::memory_order_acquire);
+	}
+
+	virtual void waitWritable(std::function<void()> h) override
+	{
+		// The writer only clears m_outFull with the lock held, so we can't miss it
+		bool ready = m_out([&](Out& out)
+		{
+			if (!m_outFull || m_closed)
+				return true;
+			out.writableHandlers.push_back(std::move(h));
+			return false;
+		});
+
+		if (ready)
+			h();
+	}
+
+	virtual bool getMetrics(TransportMetrics& dst) const override
+	{
+		dst = TransportMetrics();
+		dst.transports = 1;
+		m_out([&](Out& out)
+		{
+			dst.bytesSent = out.bytesSent;
+			dst.framesSent = out.framesSent;
+			dst.writes = out.writes;
+			dst.framesDropped = out.framesDropped;
+			dst.chunksSent = out.chunksSent;
+			dst.queuedTimeSum = out.queuedTimeSum;
+			dst.queuedTimeMax = out.queuedTimeMax;
+			dst.lanes = out.lanes;
+		});
+		dst.outQueueFrames = m_outFrames.load(std::memory_order_relaxed);
+		dst.outQueueBytes = m_outBytes.load(std::memory_order_relaxed);
+		dst.outQueuePeakFrames = m_outPeakFrames.load(std::memory_order_relaxed);
+		dst.outQueuePeakBytes = m_outPeakBytes.load(std::memory_order_relaxed);
+		m_in([&](In& in)
+		{
+			dst.bytesReceived = in.bytesReceived;
+			dst.framesReceived = in.framesReceived;
+			dst.reads = in.reads;
+			dst.chunksReceived = in.chunksReceived;
+			dst.inQueueFrames = in.q.size();
+			dst.inQueueBytes = in.bytes;
+			dst.inQueuePeakFrames = in.peakFrames;
+			dst.inQueuePeakBytes = in.peakBytes;
+		});
+		CloseReason reason = m_closeReason;
+		if (reason != CloseReason::None)
+			dst.closes[static_cast<int>(reason)] = 1;
+		return true;
+	}
+
+	CloseReason getCloseReason() const
+	{
+		return m_closeReason;
+	}
+
+	// Runs at most one ready handler of the io_service.
+	// Note that this can run handlers of anything else using the same io_service (e.g: other connections).
+	virtual bool poll() override
+	{
+		return m_io.poll_one() != 0;
+	}
+
 protected:
 
 	template<typename LOCAL, typename REMOTE>
 	static std::future<std::shared_ptr<Connection<LOCAL, REMOTE>>>
-		createImpl(ASIO::io_service& io, LOCAL* localObj, const char* ip, int port)
+		createImpl(ASIO::io_service& io, LOCAL* localObj, const char* ip, int port, TransportDecoratorFunc decorator)
 	{
 		auto trp = std::make_shared<BaseAsioTransport>(ConstructorCookie(), io);
 		auto pr = std::make_shared<std::promise<std::shared_ptr<Connection<LOCAL, REMOTE>>>>();
-		trp->connect(ip, port, [pr, trp, localObj](bool result)
+		trp->connect(ip, port, [pr, trp, localObj, decorator = std::move(decorator)](bool result)
 		{
 			if (result)
 			{
-				auto con = std::make_shared<Connection<LOCAL, REMOTE>>(localObj, trp);
+				std::shared_ptr<Transport> conTrp = trp;
+				if (decorator)
+					conTrp = decorator(std::move(conTrp));
+				auto con = std::make_shared<Connection<LOCAL, REMOTE>>(localObj, std::move(conTrp));
 				trp->m_con = con.get();
 				pr->set_value(std::move(con));
 			}
@@ -164,36 +376,520 @@ protected:
 	ASIO::io_service& m_io;
 
 	bool m_closeStarted = false;
-	bool m_closed = false;
+	std::atomic<bool> m_closed{false};
+	// Set once the close handler was called (see finishClose)
+	std::atomic<bool> m_closeFinished{false};
+	std::atomic<CloseReason> m_closeReason{CloseReason::None};
+	std::shared_ptr<Monitor<details::AsioTransportGroup>> m_group;
 	BaseConnection* m_con;
 	std::function<void()> m_onClosed;
 
+	// One outgoing RPC. The shared payload (if any) is sent after the data
+	struct OutFrame
+	{
+		OutFrame() {}
+		explicit OutFrame(std::vector<char> data) : data(std::move(data)) {}
+		OutFrame(std::vector<char> data, SharedBuffer shared) : data(std::move(data)), shared(std::move(shared)) {}
+		size_t size() const
+		{
+			return data.size() + (shared ? shared->size() : 0);
+		}
+		void clear()
+		{
+			data.clear();
+			shared = nullptr;
+		}
+		std::vector<char> data;
+		SharedBuffer shared;
+#if CZRPC_STATS
+		std::chrono::steady_clock::time_point queuedTime;
+#endif
+	};
+
+	// Outgoing state not needed by the senders. Only the writer and the metrics need the lock, so senders
+	// never wait on it, unless they are waiting for the queue to drain.
 	struct Out
 	{
-		bool ongoingWrite = false;
-		std::queue<std::vector<char>> q;
+		SendQueueLimits limits;
+		std::vector<std::function<void()>> writableHandlers;
+
+		// Metrics
+		uint64_t bytesSent = 0;
+		uint64_t framesSent = 0;
+		uint64_t writes = 0;
+		uint64_t framesDropped = 0;
+		uint64_t chunksSent = 0;
+		uint64_t queuedTimeSum = 0;
+		uint64_t queuedTimeMax = 0;
+		std::array<TransportMetrics::Lane, kNumPriorities> lanes;
 	};
 	Monitor<Out> m_out;
 
+	// Outgoing frame being sent in chunks
+	struct ChunkedFrame
+	{
+		OutFrame frame;
+		uint32_t id;
+		// See callKey
+		uint32_t key;
+		// How much of the frame was sent already
+		size_t offset = 0;
+		// How long the frame was queued before its first chunk, in nanoseconds
+		uint64_t queued = 0;
+		// Frames of the same call queued after this one. They wait for it to finish, since the peer only
+		// dispatches it once reassembled (e.g: a stream's end can't overtake its elements).
+		std::deque<OutFrame> held;
+	};
+
+	// Outgoing frames of one priority
+	struct Lane
+	{
+		// Any thread can queue, but only the owner of the write chain (see m_writing) pops, and uses the rest
+		MPSCQueue<OutFrame> q;
+		// Frames bigger than m_maxChunkSize, being sent in chunks, in round robin
+		std::deque<ChunkedFrame> chunked;
+		// Frames that were held behind a chunked frame that finished. They go before anything still in q.
+		std::deque<OutFrame> released;
+		// Bytes of whole frames that can still be written before the next chunk is due. Chunks and whole frames
+		// get the same share of the lane, so neither can starve the other.
+		size_t wholeCredit = 0;
+		// Bytes sent, divided by the lane's weight (see pickLane)
+		uint64_t vtime = 0;
+
+		bool hasWork() const
+		{
+			return !q.empty() || chunked.size() || released.size();
+		}
+	};
+	// Indexed by Priority
+	std::array<Lane, kNumPriorities> m_lanes;
+	std::array<std::atomic<unsigned>, kNumPriorities> m_weights{{{0}, {4}, {2}, {1}}};
+	// Virtual time of the last lane picked (see pickLane)
+	uint64_t m_vclock = 0;
+	// Set while a thread owns the write chain (popping frames and writing them to the socket). Whoever queues
+	// a frame while the chain is idle takes ownership, and the write completion handlers keep it until the
+	// queue is empty.
+	std::atomic<bool> m_writing{false};
+	// Bytes and frames queued, including the ongoing write
+	std::atomic<size_t> m_outBytes{0};
+	std::atomic<size_t> m_outFrames{0};
+	std::atomic<uint64_t> m_outPeakBytes{0};
+	std::atomic<uint64_t> m_outPeakFrames{0};
+	// Set when the queue reaches the high watermarks, and cleared by the writer once it drains to the low
+	// watermarks
+	std::atomic<bool> m_outFull{false};
+	// Copy of the limits senders need, so they don't need the lock
+	std::atomic<size_t> m_outHighBytes{0};
+	std::atomic<size_t> m_outHighFrames{0};
+	std::atomic<OverflowPolicy> m_outPolicy{OverflowPolicy::Block};
+	// Used by senders with the OverflowPolicy::Block policy, to wait for the queue to drain
+	std::mutex m_writableMtx;
+	std::condition_variable m_writableCv;
+
 	struct In
 	{
 		std::queue<std::vector<char>> q;
+		ReceiveQueueLimits limits;
+		size_t bytes = 0;
+		// Set when we stopped reading from the socket because the queue reached the high watermarks
+		bool readPaused = false;
+
+		// Metrics
+		uint64_t bytesReceived = 0;
+		uint64_t framesReceived = 0;
+		uint64_t reads = 0;
+		uint64_t chunksReceived = 0;
+		uint64_t peakFrames = 0;
+		uint64_t peakBytes = 0;
+
+		bool isOverHigh() const
+		{
+			return (limits.highWatermarkBytes && bytes >= limits.highWatermarkBytes) ||
+				   (limits.highWatermarkFrames && q.size() >= limits.highWatermarkFrames);
+		}
+
+		bool isUnderLow() const
+		{
+			return (!limits.highWatermarkBytes || bytes <= limits.lowWatermarkBytes) &&
+				   (!limits.highWatermarkFrames || q.size() <= limits.lowWatermarkFrames);
+		}
 	};
 	Monitor<In> m_in;
+	std::function<void(std::function<void()>)> m_executor;
+	std::atomic<bool> m_dispatchScheduled{false};
+	ProcessBudget m_processBudget{kDefaultProcessBudgetFrames};
 	// Holds the next incoming RPC data
 	std::vector<char> m_incoming;
+	// Frames being reassembled from chunks, by chunk id
+	std::unordered_map<uint32_t, std::vector<char>> m_partial;
 	// Hold the currently outgoing RPC data
-	std::vector<char> m_outgoing;
+	OutFrame m_outgoing;
+	// How long m_outgoing was queued, in nanoseconds
+	uint64_t m_outgoingQueued = 0;
+
+	std::atomic<size_t> m_maxChunkSize{kDefaultMaxChunkSize};
+	uint32_t m_nextChunkId = 0;
+	// Lane of the ongoing write
+	int m_writingLane = 0;
+	// Set if the ongoing write is a chunk of the lane's chunked.front()
+	bool m_writingChunk = false;
+	size_t m_chunkSize = 0;
+	details::ChunkHeader m_chunkHdr;
+	std::array<ASIO::const_buffer, 3> m_chunkBufs;
+
+	// Header of an outgoing or incoming frame, for tracing
+	static Header peekHeader(const std::vector<char>& data)
+	{
+		return data.size() >= sizeof(Header) ? *reinterpret_cast<const Header*>(&data[0]) : Header();
+	}
+
+	// Identifies the frames one side sends for a call (the call and its client stream frames, or the replies
+	// and server stream frames), which need to arrive in the order they were queued
+	static uint32_t callKey(const OutFrame& frame)
+	{
+		Header hdr = peekHeader(frame.data);
+		return hdr.key() | (static_cast<uint32_t>(hdr.bits.isReply) << 31);
+	}
+
+	bool queue(OutFrame frame, Priority priority)
+	{
+		// Blocking a thread running the io_service would deadlock (e.g: any handler, or Call::get polling it),
+		// since the io_service is what drains the queue
+		bool canBlock = !m_io.get_executor().running_in_this_thread();
+#if CZRPC_STATS
+		frame.queuedTime = std::chrono::steady_clock::now();
+#endif
+
+		while (true)
+		{
+			if (m_closed)
+				return false;
+
+			if (m_outFull.load(std::memory_order_acquire))
+			{
+				switch (m_outPolicy.load(std::memory_order_relaxed))
+				{
+				case OverflowPolicy::DropOldest:
+				{
+					// Pushes are queued anyway, and the writer drops the oldest ones (see popFrame). Calls are
+					// refused, so the caller aborts them right away.
+					Header hdr = peekHeader(frame.data);
+					if (!hdr.bits.isReply && !hdr.isStreamFrame())
+						return false;
+					break;
+				}
+				case OverflowPolicy::Block:
+					if (canBlock)
+					{
+						waitWritableBlocking(details::TransportDriver::isCurrent());
+						continue; // try again
+					}
+					break;
+				case OverflowPolicy::Close:
+					setCloseReason(CloseReason::Overflow);
+					close();
+					return false;
+				case OverflowPolicy::Fail:
+					return false;
+				default:
+					break;
+				}
+			}
+
+			push(std::move(frame), priority);
+			return true;
+		}
+	}
+
+	static void updatePeak(std::atomic<uint64_t>& peak, uint64_t v)
+	{
+		uint64_t current = peak.load(std::memory_order_relaxed);
+		while (current < v && !peak.compare_exchange_weak(current, v, std::memory_order_relaxed))
+		{
+		}
+	}
 
-	void onClosed()
+	bool isOverHigh(size_t bytes, size_t frames) const
+	{
+		size_t highBytes = m_outHighBytes.load(std::memory_order_relaxed);
+		size_t highFrames = m_outHighFrames.load(std::memory_order_relaxed);
+		return (highBytes && bytes >= highBytes) || (highFrames && frames >= highFrames);
+	}
+
+	// Lock free, unless the frame needs to wait for the chain to be idle to start writing
+	void push(OutFrame frame, Priority priority)
+	{
+		size_t size = frame.size();
+		size_t bytes = m_outBytes.fetch_add(size, std::memory_order_acq_rel) + size;
+		size_t frames = m_outFrames.fetch_add(1, std::memory_order_acq_rel) + 1;
+		updatePeak(m_outPeakBytes, bytes);
+		updatePeak(m_outPeakFrames, frames);
+		if (isOverHigh(bytes, frames))
+			m_outFull.store(true, std::memory_order_release);
+
+		m_lanes[static_cast<int>(priority)].q.push(std::move(frame));
+		if (!m_writing.exchange(true, std::memory_order_acq_rel))
+			writeNext();
+	}
+
+	// Must be called by the owner of the write chain.
+	// Starts writing the next frame or chunk, or gives up the ownership if there is nothing left to write.
+	void writeNext()
+	{
+		while (true)
+		{
+			if (prepareWrite())
+			{
+				triggerSend();
+				return;
+			}
+
+			m_writing.store(false, std::memory_order_seq_cst);
+			// A sender might have queued a frame after we found the queue empty, but before we gave up the
+			// ownership, in which case it didn't start writing it. If so, take the ownership back.
+			// m_outFrames includes frames still being pushed, so this might loop for a bit, until the push
+			// completes.
+			if (m_outFrames.load(std::memory_order_seq_cst) == 0 || m_writing.exchange(true, std::memory_order_acq_rel))
+				return;
+		}
+	}
+
+	// Must be called by the owner of the write chain.
+	// Picks what to write next: either a whole frame (into m_outgoing), or the next chunk of a big frame.
+	bool prepareWrite()
+	{
+		while (Lane* lane = pickLane())
+		{
+			if (!prepareLaneWrite(*lane))
+				continue;
+			if (m_writingLane != static_cast<int>(Priority::Urgent))
+			{
+				size_t size = m_writingChunk ? m_chunkSize : m_outgoing.size();
+				lane->vtime += size * 1024 / m_weights[m_writingLane].load(std::memory_order_relaxed);
+			}
+			return true;
+		}
+		return false;
+	}
+
+	// Urgent frames go first. The other lanes share the socket with start-time fair queuing: each lane's virtual
+	// time grows by the bytes it sends divided by its weight, and the lane with the lowest goes next.
+	Lane* pickLane()
+	{
+		m_writingLane = static_cast<int>(Priority::Urgent);
+		if (m_lanes[m_writingLane].hasWork())
+			return &m_lanes[m_writingLane];
+
+		Lane* res = nullptr;
+		for (int i = static_cast<int>(Priority::Urgent) + 1; i < kNumPriorities; i++)
+		{
+			Lane& lane = m_lanes[i];
+			if (!lane.hasWork())
+				continue;
+			// A lane that had nothing to send doesn't get to catch up for that time
+			lane.vtime = std::max(lane.vtime, m_vclock);
+			if (!res || lane.vtime < res->vtime)
+			{
+				res = &lane;
+				m_writingLane = i;
+			}
+		}
+
+		if (res)
+			m_vclock = res->vtime;
+		return res;
+	}
+
+	// Picks what to write next from the specified lane
+	bool prepareLaneWrite(Lane& lane)
+	{
+		while (true)
+		{
+			if (lane.chunked.size() && (lane.wholeCredit == 0 || (lane.q.empty() && lane.released.empty())))
+			{
+				prepareChunk(lane);
+				return true;
+			}
+
+			if (!popFrame(lane))
+			{
+				if (lane.chunked.empty())
+					return false;
+				lane.wholeCredit = 0;
+				continue;
+			}
+
+			uint32_t key = callKey(m_outgoing);
+			auto it = std::find_if(lane.chunked.begin(), lane.chunked.end(), [key](const ChunkedFrame& c)
+			{
+				return c.key == key;
+			});
+			if (it != lane.chunked.end())
+			{
+				it->held.push_back(std::move(m_outgoing));
+				m_outgoing.clear();
+				continue;
+			}
+
+			size_t size = m_outgoing.size();
+			if (size > m_maxChunkSize.load(std::memory_order_relaxed))
+			{
+				ChunkedFrame c;
+				c.frame = std::move(m_outgoing);
+				c.id = m_nextChunkId++;
+				c.key = key;
+				c.queued = m_outgoingQueued;
+				lane.chunked.push_back(std::move(c));
+				m_outgoing.clear();
+				continue;
+			}
+
+			lane.wholeCredit -= std::min(lane.wholeCredit, size);
+			m_writingChunk = false;
+			return true;
+		}
+	}
+
+	// Sets up the next chunk of the lane's first chunked frame
+	void prepareChunk(Lane& lane)
+	{
+		ChunkedFrame& c = lane.chunked.front();
+		size_t total = c.frame.size();
+		m_chunkSize = std::min(m_maxChunkSize.load(std::memory_order_relaxed), total - c.offset);
+		m_chunkHdr.size = static_cast<uint32_t>(m_chunkSize + sizeof(m_chunkHdr)) | details::ChunkHeader::kChunkBit;
+		m_chunkHdr.id = c.id;
+		m_chunkHdr.total = total;
+
+		// The chunk can span the frame's data and its shared payload
+		size_t begin = c.offset;
+		size_t end = c.offset + m_chunkSize;
+		size_t dataSize = c.frame.data.size();
+		m_chunkBufs[0] = ASIO::buffer(&m_chunkHdr, sizeof(m_chunkHdr));
+		m_chunkBufs[1] = begin < dataSize ? ASIO::buffer(&c.frame.data[begin], std::min(end, dataSize) - begin)
+										  : ASIO::const_buffer();
+		m_chunkBufs[2] = end > dataSize
+							 ? ASIO::buffer(&(*c.frame.shared)[std::max(begin, dataSize) - dataSize],
+											end - std::max(begin, dataSize))
+							 : ASIO::const_buffer();
+		lane.wholeCredit = m_chunkSize;
+		m_writingChunk = true;
+	}
+
+	// Must be called by the owner of the write chain.
+	// Pops the lane's next frame to write into m_outgoing.
+	bool popFrame(Lane& lane)
+	{
+		if (lane.released.size())
+		{
+			m_outgoing = std::move(lane.released.front());
+			lane.released.pop_front();
+			setOutgoingQueued();
+			return true;
+		}
+
+		while (lane.q.pop(m_outgoing))
+		{
+			// Only the writer can remove frames from the queue, so OverflowPolicy::DropOldest drops pushes here,
+			// but never the newest frame of the lane.
+			if (peekHeader(m_outgoing.data).isPush() && m_outFull.load(std::memory_order_acquire) &&
+				m_outPolicy.load(std::memory_order_relaxed) == OverflowPolicy::DropOldest && !lane.q.empty() &&
+				isOverHigh(m_outBytes.load(std::memory_order_relaxed), m_outFrames.load(std::memory_order_relaxed)))
+			{
+				m_outBytes.fetch_sub(m_outgoing.size(), std::memory_order_acq_rel);
+				m_outFrames.fetch_sub(1, std::memory_order_acq_rel);
+				m_out([](Out& out)
+				{
+					out.framesDropped++;
+				});
+				continue;
+			}
+
+			setOutgoingQueued();
+			return true;
+		}
+
+		m_outgoing.clear();
+		return false;
+	}
+
+	void setOutgoingQueued()
+	{
+#if CZRPC_STATS
+		m_outgoingQueued = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - m_outgoing.queuedTime).count());
+#endif
+	}
+
+	// drive : Run the io_service's handlers while waiting, since the caller might be the only thread running it
+	void waitWritableBlocking(bool drive)
+	{
+		auto ready = [this]
+		{
+			return m_closed || isWritable();
+		};
+
+		if (!drive)
+		{
+			std::unique_lock<std::mutex> lk(m_writableMtx);
+			m_writableCv.wait(lk, ready);
+			return;
+		}
+
+		while (!ready())
+		{
+			if (m_io.poll_one())
+				continue;
+			std::unique_lock<std::mutex> lk(m_writableMtx);
+			m_writableCv.wait_for(lk, details::TransportDriver::pollInterval(), ready);
+		}
+	}
+
+	void notifyWritable()
+	{
+		auto handlers = m_out([](Out& out)
+		{
+			return std::move(out.writableHandlers);
+		});
+
+		{
+			std::unique_lock<std::mutex> lk(m_writableMtx);
+			m_writableCv.notify_all();
+		}
+
+		for (auto&& h : handlers)
+			h();
+	}
+
+	void setCloseReason(CloseReason reason)
+	{
+		CloseReason expected = CloseReason::None;
+		m_closeReason.compare_exchange_strong(expected, reason);
+	}
+
+	void onClosed(const CZRPC_ASIO_ERROR_CODE& ec)
 	{
 		if (m_closed)
 			return;
 
+		if (ec == ASIO::error::eof || ec == ASIO::error::connection_reset)
+			setCloseReason(CloseReason::Peer);
+		else
+			setCloseReason(CloseReason::Error);
 		m_closed = true;
-		// One last call to abort pending replies, since the transport is closed now
-		m_con->process();
+		// Wake up anyone waiting for the outgoing queue to drain
+		notifyWritable();
+		// One last dispatch to abort pending replies, since the transport is closed now. It goes through dispatch
+		// like any other, so it never runs at the same time as a dispatch already scheduled with the executor.
+		// Whoever runs it calls the close handler (see finishClose).
+		dispatch();
+		leaveGroup();
+	}
 
+	// Called once processing the connection finds the transport closed, and therefore aborted pending replies
+	void finishClose()
+	{
+		if (m_closeFinished.exchange(true))
+			return;
 		if (m_onClosed)
 		{
 			m_onClosed();
@@ -202,6 +898,45 @@ protected:
 		}
 	}
 
+	void joinGroup(std::shared_ptr<Monitor<details::AsioTransportGroup>> group)
+	{
+		assert(!m_group);
+		m_group = std::move(group);
+		(*m_group)([this](details::AsioTransportGroup& g)
+		{
+			g.live.push_back(this);
+		});
+	}
+
+	// Folds our metrics into the group's metrics for closed transports
+	void leaveGroup()
+	{
+		if (!m_group)
+			return;
+		(*m_group)([this](details::AsioTransportGroup& g)
+		{
+			auto it = std::find(g.live.begin(), g.live.end(), this);
+			assert(it != g.live.end());
+			g.live.erase(it);
+
+			TransportMetrics metrics;
+			getMetrics(metrics);
+			// Whatever is still queued will never be sent or dispatched
+			metrics.outQueueFrames = metrics.outQueueBytes = 0;
+			metrics.inQueueFrames = metrics.inQueueBytes = 0;
+			g.closed.merge(metrics);
+		});
+		m_group = nullptr;
+	}
+
+	// Outgoing frames are already batched into as few writes as possible, so Nagle's algorithm only adds latency.
+	// E.g: The credit frames of a stream would otherwise wait for delayed ACKs, stalling the stream.
+	void setNoDelay()
+	{
+		CZRPC_ASIO_ERROR_CODE ec;
+		m_s->set_option(ASIO::ip::tcp::no_delay(true), ec);
+	}
+
 	void startReadSize()
 	{
 		assert(m_incoming.size() == 0);
@@ -212,7 +947,7 @@ protected:
 		{
 			if (ec)
 			{
-				onClosed();
+				onClosed(ec);
 				return;
 			}
 
@@ -222,32 +957,233 @@ protected:
 
 	void startReadData()
 	{
-		// reserve space for the rest of the rpc data
 		auto rpcSize = *reinterpret_cast<uint32_t*>(&m_incoming[0]);
-		m_incoming.insert(m_incoming.end(), rpcSize - 4, 0);
+		if (rpcSize & details::ChunkHeader::kChunkBit)
+		{
+			startReadChunk(rpcSize & ~details::ChunkHeader::kChunkBit);
+			return;
+		}
+		if (rpcSize < sizeof(Header))
+		{
+			protocolError();
+			return;
+		}
+
+		continueReadData(rpcSize, 1);
+	}
+
+	// Reads the rest of a whole frame. As with chunks, the buffer grows as the data arrives (doubling at each
+	// step), so a size the peer claims but doesn't send is never allocated.
+	// reads : Socket reads done for this frame so far
+	void continueReadData(size_t total, uint64_t reads)
+	{
+		size_t offset = m_incoming.size();
+		size_t step = std::min(total - offset, std::max(offset, static_cast<size_t>(kDefaultMaxChunkSize)));
+		m_incoming.resize(offset + step);
 		ASIO::async_read(
-			*m_s, ASIO::buffer(&m_incoming[4], rpcSize - 4),
-			[this, this_=shared_from_this()](const CZRPC_ASIO_ERROR_CODE& ec, std::size_t bytesTransfered)
+			*m_s, ASIO::buffer(&m_incoming[offset], step),
+			[this, this_=shared_from_this(), total, reads](const CZRPC_ASIO_ERROR_CODE& ec, std::size_t)
+		{
+			if (ec)
+			{
+				onClosed(ec);
+				return;
+			}
+
+			if (m_incoming.size() < total)
+				continueReadData(total, reads + 1);
+			else
+				onRead(reads + 1, total, false, std::move(m_incoming));
+		});
+	}
+
+	// Reads the rest of a chunk's header, and then its data straight into the frame being reassembled.
+	// The frame's buffer grows as the chunks arrive, so only what the peer actually sends is allocated.
+	void startReadChunk(uint32_t chunkSize)
+	{
+		if (chunkSize <= sizeof(details::ChunkHeader))
+		{
+			protocolError();
+			return;
+		}
+
+		m_incoming.insert(m_incoming.end(), sizeof(details::ChunkHeader) - 4, 0);
+		ASIO::async_read(
+			*m_s, ASIO::buffer(&m_incoming[4], sizeof(details::ChunkHeader) - 4),
+			[this, this_=shared_from_this(), chunkSize](const CZRPC_ASIO_ERROR_CODE& ec, std::size_t)
 		{
 			if (ec)
 			{
-				onClosed();
+				onClosed(ec);
+				return;
+			}
+
+			details::ChunkHeader hdr;
+			memcpy(&hdr, &m_incoming[0], sizeof(hdr));
+			m_incoming.clear();
+			size_t dataSize = chunkSize - sizeof(hdr);
+			std::vector<char>& frame = m_partial[hdr.id];
+			size_t offset = frame.size();
+			if (hdr.total > SIZE_MAX || offset + dataSize > hdr.total)
+			{
+				protocolError();
 				return;
 			}
-			assert(bytesTransfered == m_incoming.size() - 4);
-			m_in([this](In& in)
+
+			frame.resize(offset + dataSize);
+			ASIO::async_read(
+				*m_s, ASIO::buffer(&frame[offset], dataSize),
+				[this, this_=shared_from_this(), hdr, &frame](const CZRPC_ASIO_ERROR_CODE& ec, std::size_t)
 			{
-				in.q.push(std::move(m_incoming));
+				if (ec)
+				{
+					onClosed(ec);
+					return;
+				}
+
+				// Each chunk takes three reads (the size, the rest of the header, and the data)
+				size_t size = hdr.size & ~details::ChunkHeader::kChunkBit;
+				if (frame.size() == hdr.total)
+				{
+					std::vector<char> data = std::move(frame);
+					m_partial.erase(hdr.id);
+					onRead(3, size, true, std::move(data));
+				}
+				else
+				{
+					onRead(3, size, true, std::vector<char>());
+				}
 			});
-			startReadSize();
-			m_con->process();
 		});
 	}
 
+	// Accounts for data read from the socket, and queues the frame, if complete.
+	// reads : Socket reads it took
+	// size : Bytes read, including any headers
+	// frame : The frame to queue, or empty if the data read was a chunk of a frame still incomplete
+	void onRead(uint64_t reads, size_t size, bool chunk, std::vector<char> frame)
+	{
+		bool complete = frame.size() != 0;
+		if (complete)
+			CZRPC_TRACE_INSTANT("read", peekHeader(frame).bits.rpcid, peekHeader(frame).bits.counter);
+		bool paused = m_in([&](In& in)
+		{
+			in.reads += reads;
+			in.bytesReceived += size;
+			if (chunk)
+				in.chunksReceived++;
+			if (!complete)
+				return false;
+
+			in.framesReceived++;
+			in.bytes += frame.size();
+			in.q.push(std::move(frame));
+			in.peakFrames = std::max(in.peakFrames, static_cast<uint64_t>(in.q.size()));
+			in.peakBytes = std::max(in.peakBytes, static_cast<uint64_t>(in.bytes));
+			if (in.isOverHigh())
+				in.readPaused = true;
+			return in.readPaused;
+		});
+
+		// If paused, reading is resumed by whoever drains the queue (see ::receive)
+		if (!paused)
+			startReadSize();
+		if (complete)
+			dispatch();
+	}
+
+	// The peer sent something that doesn't make sense, so there is no way to know where the next frame starts
+	void protocolError()
+	{
+		setCloseReason(CloseReason::Error);
+		close();
+	}
+
+	void dispatch()
+	{
+		// Nested in a dispatch of this transport (e.g: an RPC using Call::get, which polls the io_service), so
+		// process everything right away, since the outer dispatch can't continue until this returns
+		if (!m_executor && Callstack<BaseAsioTransport>::contains(this))
+		{
+			if (!m_con->process())
+				finishClose();
+			return;
+		}
+
+		if (m_dispatchScheduled.exchange(true))
+			return;
+
+		if (m_executor)
+			m_executor([this_ = shared_from_this()] { this_->dispatchPass(); });
+		else
+			dispatchPass();
+	}
+
+	// Processes as much as the budget allows. The flag stays set while the rest waits for its turn, so more
+	// frames arriving meanwhile don't get this connection ahead of the others.
+	void dispatchPass()
+	{
+		Callstack<BaseAsioTransport>::Context ctx(this);
+		bool alive;
+		try
+		{
+			alive = m_con->process(m_processBudget);
+		}
+		catch (...)
+		{
+			// Let it through to whoever runs the io_service (or the executor), but without leaving the flag set,
+			// since then nothing would be dispatched ever again
+			m_dispatchScheduled = false;
+			throw;
+		}
+
+		if (!alive)
+		{
+			m_dispatchScheduled = false;
+			finishClose();
+			return;
+		}
+
+		if (hasIncoming())
+		{
+			auto pass = [this_ = shared_from_this()] { this_->dispatchPass(); };
+			if (m_executor)
+				m_executor(std::move(pass));
+			else
+				m_io.post(std::move(pass));
+			return;
+		}
+
+		m_dispatchScheduled = false;
+		// Dispatch again if anything arrived (or the transport closed) after processing but before we cleared the
+		// flag
+		if (hasIncoming() || m_closed)
+			dispatch();
+	}
+
+	bool hasIncoming()
+	{
+		return m_in([](In& in) { return in.q.size() != 0; });
+	}
+
 	void triggerSend()
 	{
+		if (m_writingChunk)
+		{
+			ASIO::async_write(
+				*m_s, m_chunkBufs,
+				[this, this_=shared_from_this()](const CZRPC_ASIO_ERROR_CODE& ec, std::size_t bytesTransfered)
+			{
+				handleAsyncWrite(ec, bytesTransfered);
+			});
+			return;
+		}
+
+		std::array<ASIO::const_buffer, 2> bufs = {
+			ASIO::buffer(m_outgoing.data),
+			m_outgoing.shared ? ASIO::buffer(*m_outgoing.shared) : ASIO::const_buffer()};
 		ASIO::async_write(
-			*m_s, ASIO::buffer(m_outgoing),
+			*m_s, bufs,
 			[this, this_=shared_from_this()](const CZRPC_ASIO_ERROR_CODE& ec, std::size_t bytesTransfered)
 		{
 			handleAsyncWrite(ec, bytesTransfered);
@@ -258,28 +1194,81 @@ protected:
 	{
 		if (ec)
 		{
-			onClosed();
+			onClosed(ec);
 			return;
 		}
-		assert(bytesTransfered == m_outgoing.size());
+		// Frame bytes written, not counting chunk headers
+		size_t size;
+		bool frameDone = true;
+		uint64_t queued;
+		if (m_writingChunk)
+		{
+			size = m_chunkSize;
+			assert(bytesTransfered == size + sizeof(details::ChunkHeader));
+			std::deque<ChunkedFrame>& chunked = m_lanes[m_writingLane].chunked;
+			ChunkedFrame& c = chunked.front();
+			c.offset += size;
+			queued = c.queued;
+			frameDone = c.offset == c.frame.size();
+			if (frameDone)
+			{
+				CZRPC_TRACE_INSTANT("written", peekHeader(c.frame.data).bits.rpcid, peekHeader(c.frame.data).bits.counter);
+				std::deque<OutFrame>& released = m_lanes[m_writingLane].released;
+				for (OutFrame& f : c.held)
+					released.push_back(std::move(f));
+				chunked.pop_front();
+			}
+			else if (chunked.size() > 1)
+			{
+				chunked.push_back(std::move(c));
+				chunked.pop_front();
+			}
+		}
+		else
+		{
+			size = m_outgoing.size();
+			assert(bytesTransfered == size);
+			queued = m_outgoingQueued;
+			CZRPC_TRACE_INSTANT("written", peekHeader(m_outgoing.data).bits.rpcid, peekHeader(m_outgoing.data).bits.counter);
+		}
+		size_t bytes = m_outBytes.fetch_sub(size, std::memory_order_acq_rel) - size;
+		size_t frames = frameDone ? m_outFrames.fetch_sub(1, std::memory_order_acq_rel) - 1
+								  : m_outFrames.load(std::memory_order_acquire);
 
-		m_out([&](Out& out)
+		bool writable = m_out([&](Out& out)
 		{
-			assert(out.ongoingWrite);
-			if (out.q.size())
+			TransportMetrics::Lane& lane = out.lanes[m_writingLane];
+			out.bytesSent += bytesTransfered;
+			lane.bytesSent += bytesTransfered;
+			out.writes++;
+			if (m_writingChunk)
+				out.chunksSent++;
+			if (frameDone)
 			{
-				m_outgoing  = std::move(out.q.front());
-				out.q.pop();
+				out.framesSent++;
+				lane.framesSent++;
+#if CZRPC_STATS
+				out.queuedTimeSum += queued;
+				out.queuedTimeMax = std::max(out.queuedTimeMax, queued);
+				lane.queuedTimeSum += queued;
+				lane.queuedTimeMax = std::max(lane.queuedTimeMax, queued);
+#endif
 			}
-			else
+
+			const SendQueueLimits& l = out.limits;
+			if (m_outFull.load(std::memory_order_acquire) &&
+				(!l.highWatermarkBytes || bytes <= l.lowWatermarkBytes) &&
+				(!l.highWatermarkFrames || frames <= l.lowWatermarkFrames))
 			{
-				out.ongoingWrite = false;
-				m_outgoing.clear();
+				m_outFull.store(false, std::memory_order_release);
+				return true;
 			}
+			return false;
 		});
 
-		if (m_outgoing.size())
-			triggerSend();
+		if (writable)
+			notifyWritable();
+		writeNext();
 	}
 };
 
@@ -287,10 +1276,12 @@ template<typename LOCAL, typename REMOTE>
 class AsioTransport : public BaseAsioTransport
 {
 public:
+	// decorator : If specified, it is used to wrap the transport (e.g: with a NetEmulatorTransport)
 	static std::future<std::shared_ptr<Connection<LOCAL, REMOTE>>>
-		create(ASIO::io_service& io, LOCAL& localObj, const char* ip, int port)
+		create(ASIO::io_service& io, LOCAL& localObj, const char* ip, int port,
+			   TransportDecoratorFunc decorator = nullptr)
 	{
-		return createImpl<LOCAL, REMOTE>(io, &localObj, ip, port);
+		return createImpl<LOCAL, REMOTE>(io, &localObj, ip, port, std::move(decorator));
 	}
 };
 
@@ -299,22 +1290,86 @@ class AsioTransport<void, REMOTE> : public BaseAsioTransport
 {
 public:
 	static std::future<std::shared_ptr<Connection<void, REMOTE>>>
-		create(ASIO::io_service& io, const char* ip, int port)
+		create(ASIO::io_service& io, const char* ip, int port, TransportDecoratorFunc decorator = nullptr)
 	{
-		return createImpl<void, REMOTE>(io, nullptr, ip, port);
+		return createImpl<void, REMOTE>(io, nullptr, ip, port, std::move(decorator));
 	}
 };
 
 class BaseAsioTransportAcceptor
 {
 public:
-	BaseAsioTransportAcceptor(ASIO::io_service& io) : m_io(io)
+	BaseAsioTransportAcceptor(ASIO::io_service& io)
+		: m_io(io)
+		, m_group(std::make_shared<Monitor<details::AsioTransportGroup>>())
 	{
 	}
 	virtual ~BaseAsioTransportAcceptor() {}
+
+	// Sets the outgoing queue limits for any connections accepted from now on
+	void setSendQueueLimits(const SendQueueLimits& limits)
+	{
+		m_sendLimits = limits;
+	}
+
+	// Sets the incoming queue limits for any connections accepted from now on
+	void setReceiveQueueLimits(const ReceiveQueueLimits& limits)
+	{
+		m_receiveLimits = limits;
+	}
+
+	// Sets the maximum chunk size (see BaseAsioTransport::setMaxChunkSize) for any connections accepted from now on
+	void setMaxChunkSize(size_t size)
+	{
+		m_maxChunkSize = size;
+	}
+
+	// Sets the weight of a priority (see BaseAsioTransport::setPriorityWeight) for any connections accepted from now on
+	void setPriorityWeight(Priority priority, unsigned weight)
+	{
+		m_weights[static_cast<int>(priority)] = weight;
+	}
+
+	// Sets the process budget (see BaseAsioTransport::setProcessBudget) for any connections accepted from now on
+	void setProcessBudget(const ProcessBudget& budget)
+	{
+		m_processBudget = budget;
+	}
+
+	// Sets a function to wrap the transports of the connections accepted from now on (e.g: with a
+	// CaptureTransport). Use findTransport<BaseAsioTransport> to get to the asio transport of a connection.
+	void setTransportDecorator(TransportDecoratorFunc decorator)
+	{
+		m_decorator = std::move(decorator);
+	}
+
+	// Aggregated metrics of all the connections accepted so far, including the ones already closed
+	TransportMetrics getMetrics() const
+	{
+		return (*m_group)([](details::AsioTransportGroup& g)
+		{
+			TransportMetrics res = g.closed;
+			for (auto&& trp : g.live)
+			{
+				TransportMetrics metrics;
+				trp->getMetrics(metrics);
+				res.merge(metrics);
+			}
+			return res;
+		});
+	}
+
 protected:
 	ASIO::io_service& m_io;
 	std::shared_ptr<ASIO::ip::tcp::acceptor> m_acceptor;
+	std::shared_ptr<Monitor<details::AsioTransportGroup>> m_group;
+	SendQueueLimits m_sendLimits;
+	ReceiveQueueLimits m_receiveLimits;
+	size_t m_maxChunkSize = BaseAsioTransport::kDefaultMaxChunkSize;
+	ProcessBudget m_processBudget{BaseAsioTransport::kDefaultProcessBudgetFrames};
+	// Only set for the priorities with a weight other than the default
+	std::array<unsigned, kNumPriorities> m_weights = {};
+	TransportDecoratorFunc m_decorator;
 };
 
 
@@ -378,11 +1433,25 @@ private:
 			return;
 
 		auto trp = std::make_shared<BaseAsioTransport>(BaseAsioTransport::ConstructorCookie(), m_io);
+		trp->setSendQueueLimits(m_sendLimits);
+		trp->setReceiveQueueLimits(m_receiveLimits);
+		trp->setMaxChunkSize(m_maxChunkSize);
+		trp->setProcessBudget(m_processBudget);
+		for (int i = 0; i < kNumPriorities; i++)
+		{
+			if (m_weights[i])
+				trp->setPriorityWeight(static_cast<Priority>(i), m_weights[i]);
+		}
+		trp->joinGroup(m_group);
 		trp->m_s = std::move(socket);
+		trp->setNoDelay();
 		trp->startReadSize();
 		//printf("Server side transport = trp=%p, trp->m_s=%p\n", trp.get(), trp->m_s.get());
 
-		auto con = std::make_shared<ConnectionType>(&m_localObj, trp);
+		std::shared_ptr<Transport> conTrp = trp;
+		if (m_decorator)
+			conTrp = m_decorator(std::move(conTrp));
+		auto con = std::make_shared<ConnectionType>(&m_localObj, std::move(conTrp));
 		trp->m_con = con.get();
 
 		if (m_newConnectionCallback)
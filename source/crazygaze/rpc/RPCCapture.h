@@ -0,0 +1,389 @@
+/************************************************************************
+Capture of the traffic of connections to a file, and replay of captured
+files into a server object, to reproduce real load without any clients.
+
+File format (native byte order):
+	Header : "CZRPCCAP" (8 bytes), followed by the version (uint32_t)
+	Frames :
+		uint64_t time : Nanoseconds since the capture started
+		uint32_t connection : Id of the connection the frame belongs to
+		uint8_t direction : See CaptureDirection
+		uint32_t size : Size of the frame data
+		data
+************************************************************************/
+
+#pragma once
+
+namespace cz
+{
+namespace rpc
+{
+
+enum class CaptureDirection : uint8_t
+{
+	// Frame received by the capturing side
+	In,
+	// Frame sent by the capturing side
+	Out
+};
+
+struct CaptureFrame
+{
+	uint64_t time = 0;
+	uint32_t connection = 0;
+	CaptureDirection direction = CaptureDirection::In;
+	std::vector<char> data;
+};
+
+namespace details
+{
+	static const char kCaptureMagic[8] = {'C', 'Z', 'R', 'P', 'C', 'C', 'A', 'P'};
+	// Version 2 added Header::bits.stream
+	static const uint32_t kCaptureVersion = 2;
+}
+
+//
+// Writes frames to a capture file.
+// One writer can be shared by several connections (e.g: all the connections of a server).
+// Writes are buffered, so they are cheap, but the file is only complete once the writer is closed.
+//
+class CaptureWriter
+{
+public:
+	CaptureWriter() {}
+	~CaptureWriter()
+	{
+		close();
+	}
+
+	CaptureWriter(const CaptureWriter&) = delete;
+	CaptureWriter& operator=(const CaptureWriter&) = delete;
+
+	bool open(const char* filename)
+	{
+		std::unique_lock<std::mutex> lk(m_mtx);
+		assert(m_f == nullptr);
+		m_f = fopen(filename, "wb");
+		if (!m_f)
+			return false;
+		setvbuf(m_f, nullptr, _IOFBF, 256 * 1024);
+		fwrite(details::kCaptureMagic, sizeof(details::kCaptureMagic), 1, m_f);
+		fwrite(&details::kCaptureVersion, sizeof(details::kCaptureVersion), 1, m_f);
+		m_start = std::chrono::steady_clock::now();
+		return true;
+	}
+
+	// Flushes and closes the file. Anything written after this is ignored.
+	void close()
+	{
+		std::unique_lock<std::mutex> lk(m_mtx);
+		if (m_f)
+		{
+			fclose(m_f);
+			m_f = nullptr;
+		}
+	}
+
+	// Id to use for a new connection
+	uint32_t newConnection()
+	{
+		return m_nextConnection++;
+	}
+
+	// The frame data can be split in two parts (e.g: prefix and shared payload)
+	void write(uint32_t connection, CaptureDirection direction, const char* data, size_t size,
+			   const char* data2 = nullptr, size_t size2 = 0)
+	{
+		uint64_t time = static_cast<uint64_t>(
+			std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count());
+		uint8_t dir = static_cast<uint8_t>(direction);
+		uint32_t total = static_cast<uint32_t>(size + size2);
+
+		std::unique_lock<std::mutex> lk(m_mtx);
+		if (!m_f)
+			return;
+		fwrite(&time, sizeof(time), 1, m_f);
+		fwrite(&connection, sizeof(connection), 1, m_f);
+		fwrite(&dir, sizeof(dir), 1, m_f);
+		fwrite(&total, sizeof(total), 1, m_f);
+		if (size)
+			fwrite(data, size, 1, m_f);
+		if (size2)
+			fwrite(data2, size2, 1, m_f);
+	}
+
+private:
+	std::mutex m_mtx;
+	FILE* m_f = nullptr;
+	std::chrono::steady_clock::time_point m_start;
+	std::atomic<uint32_t> m_nextConnection{0};
+};
+
+//
+// Reads frames from a capture file, in the order they were captured
+//
+class CaptureReader
+{
+public:
+	CaptureReader() {}
+	~CaptureReader()
+	{
+		if (m_f)
+			fclose(m_f);
+	}
+
+	CaptureReader(const CaptureReader&) = delete;
+	CaptureReader& operator=(const CaptureReader&) = delete;
+
+	// return: false if the file couldn't be opened, or it is not a capture file
+	bool open(const char* filename)
+	{
+		assert(m_f == nullptr);
+		m_f = fopen(filename, "rb");
+		if (!m_f)
+			return false;
+		char magic[sizeof(details::kCaptureMagic)];
+		uint32_t version;
+		return fread(magic, sizeof(magic), 1, m_f) == 1 &&
+			   memcmp(magic, details::kCaptureMagic, sizeof(magic)) == 0 &&
+			   fread(&version, sizeof(version), 1, m_f) == 1 && version == details::kCaptureVersion;
+	}
+
+	// Reads the next frame
+	// return: false if there are no more frames (or the file is truncated)
+	bool next(CaptureFrame& dst)
+	{
+		uint8_t dir;
+		uint32_t size;
+		if (!m_f || fread(&dst.time, sizeof(dst.time), 1, m_f) != 1 ||
+			fread(&dst.connection, sizeof(dst.connection), 1, m_f) != 1 || fread(&dir, sizeof(dir), 1, m_f) != 1 ||
+			fread(&size, sizeof(size), 1, m_f) != 1)
+			return false;
+		dst.direction = static_cast<CaptureDirection>(dir);
+		dst.data.resize(size);
+		return size == 0 || fread(&dst.data[0], size, 1, m_f) == 1;
+	}
+
+private:
+	FILE* m_f = nullptr;
+};
+
+//
+// Transport decorator that writes all the frames sent and received to a capture file
+//
+class CaptureTransport : public TransportDecorator
+{
+public:
+	CaptureTransport(std::shared_ptr<Transport> inner, std::shared_ptr<CaptureWriter> writer)
+		: TransportDecorator(std::move(inner))
+		, m_writer(std::move(writer))
+		, m_id(m_writer->newConnection())
+	{
+	}
+
+	virtual bool send(std::vector<char> data, Priority priority) override
+	{
+		m_writer->write(m_id, CaptureDirection::Out, data.data(), data.size());
+		return m_inner->send(std::move(data), priority);
+	}
+
+	virtual bool sendShared(std::vector<char> prefix, SharedBuffer payload, Priority priority) override
+	{
+		m_writer->write(m_id, CaptureDirection::Out, prefix.data(), prefix.size(), payload->data(), payload->size());
+		return m_inner->sendShared(std::move(prefix), std::move(payload), priority);
+	}
+
+	virtual bool receive(std::vector<char>& dst) override
+	{
+		bool res = m_inner->receive(dst);
+		if (dst.size())
+			m_writer->write(m_id, CaptureDirection::In, dst.data(), dst.size());
+		return res;
+	}
+
+private:
+	std::shared_ptr<CaptureWriter> m_writer;
+	uint32_t m_id;
+};
+
+//
+// Feeds the calls in a capture file (the frames captured as incoming) into an object, as if they were coming from
+// the original connections, and measures how long the object takes to reply.
+// Replies are discarded.
+//
+template<typename LOCAL>
+class Replayer
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	// speed : 1 replays at the original speed, 2 at twice the speed, etc. 0 replays as fast as possible
+	Replayer(LOCAL& obj, double speed)
+		: m_obj(obj)
+		, m_speed(speed)
+	{
+	}
+
+	// Called for each reply, with the time since the call was fed to the object.
+	// For asynchronous RPCs, this is called from whatever thread the reply is sent from.
+	void setOnReply(std::function<void(bool success, Clock::duration latency)> h)
+	{
+		m_onReply = std::move(h);
+	}
+
+	// Replays the whole file, and waits up to "timeout" for any outstanding replies
+	// return: Number of calls fed
+	uint64_t run(CaptureReader& reader, Clock::duration timeout = std::chrono::seconds(5))
+	{
+		uint64_t calls = 0;
+		bool first = true;
+		uint64_t firstTime = 0;
+		Clock::time_point start = Clock::now();
+		CaptureFrame frame;
+		while (reader.next(frame))
+		{
+			if (frame.direction != CaptureDirection::In || frame.data.size() < sizeof(Header))
+				continue;
+			Header hdr = *reinterpret_cast<const Header*>(&frame.data[0]);
+			// Replies to calls the object made can't be fed, since those calls were not made
+			if (hdr.bits.isReply)
+				continue;
+
+			if (first)
+			{
+				first = false;
+				firstTime = frame.time;
+			}
+			if (m_speed > 0)
+				std::this_thread::sleep_until(
+					start + std::chrono::nanoseconds(static_cast<uint64_t>((frame.time - firstTime) / m_speed)));
+
+			auto& con = getConnection(frame.connection);
+			con.trp->feed(std::move(frame.data));
+			con.con->process();
+			calls++;
+		}
+
+		auto deadline = Clock::now() + timeout;
+		while (getPending() && Clock::now() < deadline)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+		return calls;
+	}
+
+	// Calls fed whose reply didn't arrive yet
+	size_t getPending() const
+	{
+		size_t res = 0;
+		for (auto&& c : m_cons)
+			res += c.second.trp->getPending();
+		return res;
+	}
+
+private:
+	// In memory transport, that gets its incoming frames from the replayer
+	class ReplayTransport : public Transport
+	{
+	public:
+		explicit ReplayTransport(Replayer& outer)
+			: m_outer(outer)
+		{
+		}
+
+		void feed(std::vector<char> data)
+		{
+			Header hdr = *reinterpret_cast<const Header*>(&data[0]);
+			// Stream frames (e.g: credit) belong to a call fed earlier
+			if (!hdr.isStreamFrame())
+			{
+				m_pending([&](std::unordered_map<uint32_t, Clock::time_point>& pending)
+				{
+					pending[hdr.key()] = Clock::now();
+				});
+			}
+			m_in.push(std::move(data));
+		}
+
+		size_t getPending() const
+		{
+			return m_pending([](std::unordered_map<uint32_t, Clock::time_point>& pending)
+			{
+				return pending.size();
+			});
+		}
+
+		virtual bool send(std::vector<char> data, Priority) override
+		{
+			Header hdr = *reinterpret_cast<const Header*>(&data[0]);
+			// Stream frames (e.g: credit for a client stream) are not replies
+			if (!hdr.bits.isReply || hdr.isStreamFrame())
+				return true;
+
+			Clock::time_point start;
+			bool found = m_pending([&](std::unordered_map<uint32_t, Clock::time_point>& pending)
+			{
+				auto it = pending.find(hdr.key());
+				if (it == pending.end())
+					return false;
+				start = it->second;
+				pending.erase(it);
+				return true;
+			});
+
+			if (found && m_outer.m_onReply)
+				m_outer.m_onReply(hdr.bits.success != 0, Clock::now() - start);
+			return true;
+		}
+
+		virtual bool receive(std::vector<char>& dst) override
+		{
+			if (m_in.size())
+			{
+				dst = std::move(m_in.front());
+				m_in.pop();
+			}
+			else
+			{
+				dst.clear();
+			}
+			return true;
+		}
+
+		virtual void close() override
+		{
+		}
+
+	private:
+		Replayer& m_outer;
+		// Only used from the replaying thread
+		std::queue<std::vector<char>> m_in;
+		// Calls waiting for a reply, and when they were fed
+		Monitor<std::unordered_map<uint32_t, Clock::time_point>> m_pending;
+	};
+
+	struct ReplayConnection
+	{
+		std::shared_ptr<ReplayTransport> trp;
+		std::unique_ptr<Connection<LOCAL, void>> con;
+	};
+
+	ReplayConnection& getConnection(uint32_t id)
+	{
+		auto& res = m_cons[id];
+		if (!res.con)
+		{
+			res.trp = std::make_shared<ReplayTransport>(*this);
+			res.con = std::make_unique<Connection<LOCAL, void>>(&m_obj, res.trp);
+		}
+		return res;
+	}
+
+	LOCAL& m_obj;
+	double m_speed;
+	std::function<void(bool, Clock::duration)> m_onReply;
+	std::unordered_map<uint32_t, ReplayConnection> m_cons;
+};
+
+} // namespace rpc
+} // namespace cz
+
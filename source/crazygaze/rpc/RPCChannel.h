@@ -0,0 +1,294 @@
+/************************************************************************
+Bidirectional channels.
+
+An RPC taking a Channel<In, Out> as its last parameter opens a channel
+with the caller (see Call::channel). Both sides can then send elements to
+each other, for as long as they keep it open. The call's reply doesn't
+close the channel, so the RPC can keep it around (e.g: the subscribers of
+a feed) and return right away.
+
+Each direction is a separate stream under the call's key, with its own
+credit window (see RPCStreaming.h). A channel can only have kStreamWindow
+frames in flight per direction, regardless of how fast its writer is, so
+a busy channel can't fill the transport's queue, and normal calls and
+other channels through the same connection only ever wait behind that.
+
+Channel::close finishes this side's direction only. Destroying the
+Channel cancels both directions.
+************************************************************************/
+
+#pragma once
+
+namespace cz
+{
+namespace rpc
+{
+
+template<typename In, typename Out> class Channel;
+
+namespace details
+{
+	template<typename T>
+	struct IsChannel
+	{
+		static constexpr bool value = false;
+	};
+
+	template<typename In, typename Out>
+	struct IsChannel<Channel<In, Out>>
+	{
+		static constexpr bool value = true;
+	};
+
+	template<typename In, typename Out>
+	struct IsClientStream<Channel<In, Out>>
+	{
+		static constexpr bool value = true;
+	};
+
+	//
+	// Either side of a channel.
+	// Registered with the processor that gets its stream frames until both directions finish.
+	//
+	template<typename In, typename Out>
+	class ChannelState : public BaseStreamState
+	{
+	public:
+		explicit ChannelState(int chunkSize)
+			: m_reader(std::make_shared<StreamReaderState<In>>())
+			, m_sender(chunkSize)
+		{
+		}
+
+		// priority : Of the frames this side sends
+		// isCallee : true if this is the callee's side
+		// unregister : Removes it from the processor it's registered with
+		void setCall(Transport& trp, Header hdr, Priority priority, bool isCallee, std::function<void()> unregister)
+		{
+			m_reader->setCall(trp, hdr, priority, isCallee);
+			m_sender.setCall(trp, hdr, priority, isCallee);
+			m_unregister = std::move(unregister);
+		}
+
+		const std::shared_ptr<StreamReaderState<In>>& reader() const
+		{
+			return m_reader;
+		}
+
+		StreamSender<Out>& sender()
+		{
+			return m_sender;
+		}
+
+		void close()
+		{
+			m_sender.end();
+			checkDone();
+		}
+
+		// The Channel was destroyed. Cancels whatever direction is still open
+		void abandon()
+		{
+			bool writing = m_sender.close(false);
+			bool reading = !m_readDone.exchange(true);
+			// A Cancel frame stops both directions at the other side, so only one is needed
+			if (reading)
+				m_reader->cancel();
+			else if (writing)
+				m_sender.sendControl(StreamFrame::Cancel);
+			checkDone();
+		}
+
+		virtual void onFrame(Stream& in) override
+		{
+			uint8_t kind;
+			in >> kind;
+			if (kind == static_cast<uint8_t>(StreamFrame::Credit))
+			{
+				uint32_t credit;
+				in >> credit;
+				m_sender.addCredit(credit);
+				return;
+			}
+
+			if (kind == static_cast<uint8_t>(StreamFrame::Cancel))
+				m_sender.close(false);
+			if (m_reader->onFrame(kind, in))
+				m_readDone = true;
+			checkDone();
+		}
+
+		// The transport is going away
+		virtual void cancel() override
+		{
+			{
+				std::unique_lock<std::mutex> lk(m_mtx);
+				m_unregister = nullptr;
+			}
+			m_sender.detach();
+			m_reader->detach();
+			m_reader->fail(Result<void>());
+			m_readDone = true;
+		}
+
+		// The call failed, so there is no channel at the other side
+		void onError(Result<void>&& res)
+		{
+			m_sender.close(false);
+			m_reader->fail(std::move(res));
+			m_readDone = true;
+			checkDone();
+		}
+
+	private:
+		void checkDone()
+		{
+			if (!m_readDone || !m_sender.isClosed())
+				return;
+			// Done while holding the lock, since "cancel" clears it once the processor is going away
+			std::unique_lock<std::mutex> lk(m_mtx);
+			if (m_unregister)
+			{
+				m_unregister();
+				m_unregister = nullptr;
+			}
+		}
+
+		std::shared_ptr<StreamReaderState<In>> m_reader;
+		StreamSender<Out> m_sender;
+		std::atomic<bool> m_readDone{false};
+		std::mutex m_mtx;
+		std::function<void()> m_unregister;
+	};
+
+	template<typename In, typename Out>
+	struct ClientStreamFactory<Channel<In, Out>>
+	{
+		static void create(Channel<In, Out>& dst, InProcessorData& out, Transport& trp, Header hdr,
+						   Priority priority)
+		{
+			auto st = std::make_shared<ChannelState<In, Out>>(kDefaultStreamChunkSize);
+			st->setCall(trp, hdr, priority, true, [&out, key = hdr.key()]
+			{
+				out.streams([&](InProcessorData::StreamMap& streams)
+				{
+					streams.erase(key);
+				});
+			});
+			out.streams([&](InProcessorData::StreamMap& streams)
+			{
+				streams[hdr.key()] = st;
+			});
+			dst = Channel<In, Out>(std::move(st));
+		}
+	};
+}
+
+//
+// One side of a bidirectional channel, getting elements of type In, and sending elements of type Out.
+// The callee gets it as the last parameter of the RPC, and the caller from Call::channel, with the types reversed.
+// Reading and writing can be done from different threads, but only one thread at a time should write.
+// It can outlive the connection, in which case reading fails, and writing returns false.
+//
+template<typename In, typename Out>
+class Channel
+{
+public:
+	using in_type = In;
+	using out_type = Out;
+
+	Channel() {}
+	Channel(Channel&& other) = default;
+	Channel& operator=(Channel&& other)
+	{
+		if (this == &other)
+			return *this;
+		if (m_st)
+			m_st->abandon();
+		m_st = std::move(other.m_st);
+		return *this;
+	}
+
+	Channel(const Channel&) = delete;
+	Channel& operator=(const Channel&) = delete;
+
+	~Channel()
+	{
+		if (m_st)
+			m_st->abandon();
+	}
+
+	// Elements are sent in frames of about the channel's chunk size, so call "flush" to send what was written so
+	// far right away. Blocks while the peer's window is full, so it should not be called from the thread that
+	// processes the connection.
+	// return: false if the channel can't be written to anymore (e.g: it was closed, or the connection was lost)
+	bool write(const Out& v)
+	{
+		return m_st->sender().write(v);
+	}
+
+	bool flush()
+	{
+		return m_st->sender().flush();
+	}
+
+	// return: true if a frame can be sent right away, without waiting for credit
+	bool isWritable()
+	{
+		return m_st->sender().isWritable();
+	}
+
+	// Sends what was written so far, and finishes this side's direction.
+	// The peer's reads finish once it gets everything. Reading from this side can continue.
+	void close()
+	{
+		m_st->close();
+	}
+
+	// Blocks until the next element arrives. Same as StreamReader::next
+	bool next(In& dst)
+	{
+		return m_st->reader()->next(dst);
+	}
+
+#if CZRPC_COROUTINES
+	// Same as StreamReader::nextAsync
+	details::StreamReadAwaiter<In> nextAsync()
+	{
+		return details::StreamReadAwaiter<In>(m_st->reader());
+	}
+#endif
+
+private:
+	template<typename F> friend class Call;
+	template<typename P> friend struct details::ClientStreamFactory;
+	explicit Channel(std::shared_ptr<details::ChannelState<In, Out>> st)
+		: m_st(std::move(st))
+	{
+	}
+	std::shared_ptr<details::ChannelState<In, Out>> m_st;
+};
+
+// Only valid as the last parameter of an RPC. Nothing is serialized with the call.
+template<typename In, typename Out>
+struct ParamTraits<Channel<In, Out>>
+{
+	using store_type = Channel<In, Out>;
+	static constexpr bool valid = ParamTraits<In>::valid && ParamTraits<Out>::valid;
+
+	template<typename S>
+	static void write(S&, const Channel<In, Out>&)
+	{
+	}
+
+	template<typename S>
+	static void read(S&, Channel<In, Out>&)
+	{
+	}
+
+	static Channel<In, Out>&& get(Channel<In, Out>&& v) { return std::move(v); }
+};
+
+} // namespace rpc
+} // namespace cz
+
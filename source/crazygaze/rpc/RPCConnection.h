@@ -5,13 +5,36 @@ namespace cz
 namespace rpc
 {
 
+// Limits how much one call to Connection::process does, so a connection with lots of incoming frames doesn't
+// hold the thread processing it (e.g: the io thread shared by all the connections of a server) for too long.
+// Whatever is left is processed by the next call.
+// A limit of 0 means no limit for that dimension.
+struct ProcessBudget
+{
+	unsigned maxFrames = 0;
+	std::chrono::microseconds maxTime{0};
+
+	// return: true if processing "frames" frames since "start" used up the budget
+	bool isSpent(unsigned frames, std::chrono::steady_clock::time_point start) const
+	{
+		return (maxFrames && frames >= maxFrames) ||
+			   (maxTime.count() && std::chrono::steady_clock::now() - start >= maxTime);
+	}
+};
+
 struct BaseConnection
 {
 	virtual ~BaseConnection() { }
 
-	//! Process any incoming RPCs or replies
+	//! Process any incoming RPCs or replies, within the specified budget
 	// Return true if the connection is still alive, false otherwise
-	virtual bool process() = 0;
+	virtual bool process(const ProcessBudget& budget) = 0;
+
+	//! Process all incoming RPCs or replies
+	bool process()
+	{
+		return process(ProcessBudget());
+	}
 };
 
 template<typename LOCAL, typename REMOTE>
@@ -21,8 +44,8 @@ struct Connection : public BaseConnection
 	using Remote = REMOTE;
 	using ThisType = Connection<Local, Remote>;
 	Connection(Local* localObj, std::shared_ptr<Transport> transport)
-		: localPrc(localObj)
-		, transport(std::move(transport))
+		: transport(std::move(transport))
+		, localPrc(localObj)
 	{
 	}
 
@@ -37,20 +60,37 @@ struct Connection : public BaseConnection
 		return remotePrc.callGeneric(transport, name, args);
 	}
 
+	// Gets a property of the remote object, through a local cache (see OutProcessor::getProperty)
+	Result<Any> getProperty(const std::string& name)
+	{
+		return remotePrc.getProperty(*transport, name);
+	}
+
+	template<typename H>
+	void getPropertyAsync(const std::string& name, H&& handler)
+	{
+		remotePrc.getPropertyAsync(*transport, name, std::forward<H>(handler));
+	}
+
 	static ThisType* getCurrent()
 	{
 		auto it = Callstack<ThisType>::begin();
 		return (*it)==nullptr ? nullptr : (*it)->getKey();
 	}
 
-	virtual bool process() override
+	using BaseConnection::process;
+	virtual bool process(const ProcessBudget& budget) override
 	{
 		// Place a callstack marker, so other code can detect we are serving an
 		// RPC
 		typename Callstack<ThisType>::Context ctx(this);
 		std::vector<char> data;
-		while(true)
+		auto start = budget.maxTime.count() ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+		for (unsigned frames = 0; ; frames++)
 		{
+			if (budget.isSpent(frames, start))
+				return true; // Leave the rest for the next call
+
 			if (!transport->receive(data))
 			{
 				// Transport is closed
@@ -65,7 +105,18 @@ struct Connection : public BaseConnection
 			Stream in(std::move(data));
 			in >> hdr;
 
-			if (hdr.bits.isReply)
+			if (hdr.isStreamFrame())
+			{
+				if (hdr.bits.isReply)
+					remotePrc.processStreamFrame(*transport, in, hdr);
+				else
+					localPrc.processStreamFrame(*transport, in, hdr);
+			}
+			else if (hdr.isPush())
+			{
+				remotePrc.processPush(in);
+			}
+			else if (hdr.bits.isReply)
 			{
 				remotePrc.processReply(in, hdr);
 			}
@@ -76,10 +127,32 @@ struct Connection : public BaseConnection
 		}
 	}
 
+	// Declared first, so it is destroyed last. Asynchronous RPCs still pending when the processors are destroyed
+	// might still use it.
+	std::shared_ptr<Transport> transport;
 	InProcessor<Local> localPrc;
 	OutProcessor<Remote> remotePrc;
-	std::shared_ptr<Transport> transport;
 };
 
+namespace details
+{
+	// Allows getting the LOCAL and REMOTE types from pointers to connections
+	template<typename T>
+	struct ConnectionTraits {};
+
+	template<typename LOCAL, typename REMOTE>
+	struct ConnectionTraits<Connection<LOCAL, REMOTE>>
+	{
+		using Local = LOCAL;
+		using Remote = REMOTE;
+	};
+
+	template<typename LOCAL, typename REMOTE>
+	struct ConnectionTraits<Connection<LOCAL, REMOTE>*> : ConnectionTraits<Connection<LOCAL, REMOTE>> {};
+
+	template<typename LOCAL, typename REMOTE>
+	struct ConnectionTraits<std::shared_ptr<Connection<LOCAL, REMOTE>>> : ConnectionTraits<Connection<LOCAL, REMOTE>> {};
+}
+
 } // namespace rpc
 } // namespace cz
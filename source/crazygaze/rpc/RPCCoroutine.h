@@ -0,0 +1,252 @@
+/************************************************************************
+C++20 coroutine support:
+	- Calls can be awaited: auto res = co_await CZRPC_CALL(con, add, 1, 2);
+	- RPCs can be coroutines returning cz::rpc::Task<T>. They are
+	dispatched like RPCs returning std::future<T>, but don't need a thread
+	per pending call.
+************************************************************************/
+
+#pragma once
+
+#if CZRPC_COROUTINES
+
+namespace cz
+{
+namespace rpc
+{
+
+template<typename T> class Task;
+template<typename F> class Call;
+
+namespace details
+{
+	template<typename T>
+	struct TaskPromise;
+
+	// Common code for the promise types of Task<T> and Task<void>
+	template<typename T>
+	struct TaskPromiseBase
+	{
+		// Coroutine awaiting this task, if any
+		std::coroutine_handle<> continuation;
+		// Set if the task was detached. Called once the task finishes, just before the task destroys itself
+		std::function<void()> onDone;
+		std::exception_ptr exception;
+
+		Task<T> get_return_object()
+		{
+			return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(static_cast<TaskPromise<T>&>(*this)));
+		}
+
+		// Tasks are lazy. They only start once awaited or detached
+		std::suspend_always initial_suspend() noexcept
+		{
+			return {};
+		}
+
+		struct FinalAwaiter
+		{
+			bool await_ready() noexcept
+			{
+				return false;
+			}
+
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<TaskPromise<T>> h) noexcept
+			{
+				auto& p = h.promise();
+				if (p.onDone)
+				{
+					auto onDone = std::move(p.onDone);
+					onDone();
+					h.destroy();
+					return std::noop_coroutine();
+				}
+				return p.continuation ? p.continuation : std::noop_coroutine();
+			}
+
+			void await_resume() noexcept
+			{
+			}
+		};
+
+		FinalAwaiter final_suspend() noexcept
+		{
+			return {};
+		}
+
+		void unhandled_exception()
+		{
+			exception = std::current_exception();
+		}
+	};
+
+	template<typename T>
+	struct TaskPromise : public TaskPromiseBase<T>
+	{
+		std::optional<T> value;
+
+		template<typename V>
+		void return_value(V&& v)
+		{
+			value.emplace(std::forward<V>(v));
+		}
+
+		// Gets the result, or throws the exception the coroutine finished with
+		T get()
+		{
+			if (this->exception)
+				std::rethrow_exception(this->exception);
+			return std::move(*value);
+		}
+	};
+
+	template<>
+	struct TaskPromise<void> : public TaskPromiseBase<void>
+	{
+		void return_void()
+		{
+		}
+
+		void get()
+		{
+			if (exception)
+				std::rethrow_exception(exception);
+		}
+	};
+}
+
+//
+// Lazy coroutine task.
+// It can be awaited by another coroutine, or detached with a completion handler.
+//
+template<typename T>
+class Task
+{
+public:
+	using promise_type = details::TaskPromise<T>;
+	using value_type = T;
+
+	Task(Task&& other) noexcept
+		: m_h(other.m_h)
+	{
+		other.m_h = nullptr;
+	}
+
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+	Task& operator=(Task&&) = delete;
+
+	~Task()
+	{
+		if (m_h)
+			m_h.destroy();
+	}
+
+	bool await_ready() const noexcept
+	{
+		return false;
+	}
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept
+	{
+		m_h.promise().continuation = continuation;
+		return m_h;
+	}
+
+	T await_resume()
+	{
+		return m_h.promise().get();
+	}
+
+	// Starts the task, without anyone awaiting it.
+	// The handler is called with the task's promise once the task finishes (call "get" on it to get the result),
+	// and the task then destroys itself.
+	template<typename H>
+	void detach(H&& handler)
+	{
+		auto h = m_h;
+		m_h = nullptr;
+		auto& p = h.promise();
+		p.onDone = [&p, handler = std::forward<H>(handler)]() mutable
+		{
+			handler(p);
+		};
+		h.resume();
+	}
+
+private:
+	friend struct details::TaskPromiseBase<T>;
+	explicit Task(std::coroutine_handle<promise_type> h)
+		: m_h(h)
+	{
+	}
+
+	std::coroutine_handle<promise_type> m_h;
+};
+
+namespace details
+{
+	// Tasks are dispatched as asynchronous RPCs
+	template<typename T>
+	struct CheckFuture<Task<T>>
+	{
+		static constexpr bool value = true;
+		using type = T;
+	};
+
+	// Awaiter for a call. The coroutine is resumed with the call's Result once the reply arrives (or the call is
+	// aborted), either right away in whatever thread processes the reply, or through an executor.
+	template<typename F>
+	class CallAwaiter
+	{
+	public:
+		using R = typename ParamTraits<typename FunctionTraits<F>::return_type>::store_type;
+		using Executor = std::function<void(std::function<void()>)>;
+
+		CallAwaiter(Call<F>& call, Executor executor)
+			: m_call(call)
+			, m_executor(std::move(executor))
+		{
+		}
+
+		bool await_ready() const noexcept
+		{
+			return false;
+		}
+
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			// The coroutine might be resumed before "async" returns, so nothing can be touched after it
+			m_call.async([this, h](Result<R>&& res)
+			{
+				m_res = std::move(res);
+				if (m_executor)
+				{
+					// The executor can resume the coroutine (destroying this) before returning, so we call a copy
+					auto executor = m_executor;
+					executor([h] { h.resume(); });
+				}
+				else
+				{
+					h.resume();
+				}
+			});
+		}
+
+		Result<R> await_resume()
+		{
+			return std::move(m_res);
+		}
+
+	private:
+		Call<F>& m_call;
+		Executor m_executor;
+		Result<R> m_res;
+	};
+}
+
+} // namespace rpc
+} // namespace cz
+
+#endif
+
@@ -0,0 +1,246 @@
+/************************************************************************
+Lightweight future, as returned by Call::ft().
+
+Compared to std::future/std::promise, the state shared by the future and
+the promise is one single allocation, and waiting spins for a little while
+before parking the thread, since replies often arrive shortly after.
+************************************************************************/
+
+#pragma once
+
+namespace cz
+{
+namespace rpc
+{
+
+template<typename T> class Future;
+
+namespace details
+{
+	// State shared by a Future and its Promise.
+	// T needs to be default constructible (e.g: Result<T>)
+	template<typename T>
+	class FutureState
+	{
+	public:
+		// Number of times to check for the value before parking the thread
+		static constexpr int kSpinCount = 1024;
+
+		FutureState() {}
+		FutureState(const FutureState&) = delete;
+		FutureState& operator=(const FutureState&) = delete;
+
+		void addRef()
+		{
+			m_refs.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		void release()
+		{
+			if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				delete this;
+		}
+
+		template<typename V>
+		void set(V&& v)
+		{
+			assert(!isReady() && "Value already set");
+			m_value = std::forward<V>(v);
+			// Both this and the parked flag need to be sequentially consistent, so that either the waiter sees
+			// the value, or we see the waiter parked.
+			m_ready.store(true, std::memory_order_seq_cst);
+			if (m_parked.load(std::memory_order_seq_cst))
+			{
+				std::unique_lock<std::mutex> lk(m_mtx);
+				m_cv.notify_all();
+			}
+		}
+
+		bool isReady() const
+		{
+			return m_ready.load(std::memory_order_acquire);
+		}
+
+		void wait()
+		{
+			if (spin())
+				return;
+			std::unique_lock<std::mutex> lk(m_mtx);
+			m_parked.store(true, std::memory_order_seq_cst);
+			m_cv.wait(lk, [this] { return m_ready.load(std::memory_order_seq_cst); });
+		}
+
+		template<typename Clock, typename Duration>
+		bool waitUntil(const std::chrono::time_point<Clock, Duration>& point)
+		{
+			if (spin())
+				return true;
+			std::unique_lock<std::mutex> lk(m_mtx);
+			m_parked.store(true, std::memory_order_seq_cst);
+			return m_cv.wait_until(lk, point, [this] { return m_ready.load(std::memory_order_seq_cst); });
+		}
+
+		T take()
+		{
+			return std::move(m_value);
+		}
+
+	private:
+		bool spin() const
+		{
+			for (int i = 0; i < kSpinCount; i++)
+			{
+				if (isReady())
+					return true;
+			}
+			return false;
+		}
+
+		// Starts at 2, since it's created for a future and a promise
+		std::atomic<int> m_refs{2};
+		std::atomic<bool> m_ready{false};
+		std::atomic<bool> m_parked{false};
+		std::mutex m_mtx;
+		std::condition_variable m_cv;
+		T m_value;
+	};
+
+	// Sets the value of a Future.
+	// It can be copied (so it can be captured by a std::function), but the value can only be set once.
+	template<typename T>
+	class Promise
+	{
+	public:
+		Promise(const Promise& other)
+			: m_st(other.m_st)
+		{
+			m_st->addRef();
+		}
+
+		Promise(Promise&& other)
+			: m_st(other.m_st)
+		{
+			other.m_st = nullptr;
+		}
+
+		Promise& operator=(const Promise&) = delete;
+		Promise& operator=(Promise&&) = delete;
+
+		~Promise()
+		{
+			if (m_st)
+				m_st->release();
+		}
+
+		template<typename V>
+		void setValue(V&& v) const
+		{
+			m_st->set(std::forward<V>(v));
+		}
+
+	private:
+		template<typename U> friend class ::cz::rpc::Future;
+		explicit Promise(FutureState<T>* st)
+			: m_st(st)
+		{
+		}
+		FutureState<T>* m_st;
+	};
+}
+
+//
+// Similar to std::future, but it can only be created together with a promise, with Future::create
+//
+template<typename T>
+class Future
+{
+public:
+	Future() {}
+
+	Future(Future&& other)
+		: m_st(other.m_st)
+	{
+		other.m_st = nullptr;
+	}
+
+	Future& operator=(Future&& other)
+	{
+		if (this == &other)
+			return *this;
+		if (m_st)
+			m_st->release();
+		m_st = other.m_st;
+		other.m_st = nullptr;
+		return *this;
+	}
+
+	Future(const Future&) = delete;
+	Future& operator=(const Future&) = delete;
+
+	~Future()
+	{
+		if (m_st)
+			m_st->release();
+	}
+
+	// Creates a future, and the promise to set its value
+	static std::pair<Future, details::Promise<T>> create()
+	{
+		auto st = new details::FutureState<T>();
+		return std::make_pair(Future(st), details::Promise<T>(st));
+	}
+
+	// false if the future was default constructed, moved from, or "get" was already called
+	bool isValid() const
+	{
+		return m_st != nullptr;
+	}
+
+	bool isReady() const
+	{
+		assert(m_st);
+		return m_st->isReady();
+	}
+
+	void wait() const
+	{
+		assert(m_st);
+		m_st->wait();
+	}
+
+	// return: true if the value is ready, or false if it timed out
+	template<typename Clock, typename Duration>
+	bool waitUntil(const std::chrono::time_point<Clock, Duration>& point) const
+	{
+		assert(m_st);
+		return m_st->waitUntil(point);
+	}
+
+	template<typename Rep, typename Period>
+	bool waitFor(const std::chrono::duration<Rep, Period>& duration) const
+	{
+		return waitUntil(std::chrono::steady_clock::now() + duration);
+	}
+
+	// Waits for the value and returns it. As with std::future, this can only be called once.
+	T get()
+	{
+		assert(m_st);
+		m_st->wait();
+		T res = m_st->take();
+		m_st->release();
+		m_st = nullptr;
+		return res;
+	}
+
+private:
+	explicit Future(details::FutureState<T>* st)
+		: m_st(st)
+	{
+	}
+	details::FutureState<T>* m_st = nullptr;
+};
+
+} // namespace rpc
+} // namespace cz
+
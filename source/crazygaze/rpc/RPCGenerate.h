@@ -33,10 +33,38 @@ public:
 
 	static const Info* get(uint32_t rpcid)
 	{
-		static Table<RPCTABLE_CLASS> tbl;
+		auto& tbl = getTable();
 		assert(tbl.isValid(rpcid));
 		return static_cast<Info*>(tbl.m_rpcs[rpcid].get());
 	}
+
+	static const BaseTable& getBaseTable()
+	{
+		return getTable();
+	}
+
+	// Sets the priority of an RPC (see Priority). Calls use it unless overridden with Call::priority, and the
+	// replies (and any stream frames) are sent with the callee's, so both sides should normally set the same.
+	static void setPriority(RPCId rpcid, Priority priority)
+	{
+		get(static_cast<uint32_t>(rpcid))->priority.store(priority, std::memory_order_relaxed);
+	}
+
+	// Same as setPriority, for control RPCs (e.g: "__watchProperty", whose priority is also used for the property
+	// changes pushed to the watchers)
+	static void setControlPriority(const char* name, Priority priority)
+	{
+		auto info = getTable().getControlBaseInfo(name);
+		assert(info);
+		info->priority.store(priority, std::memory_order_relaxed);
+	}
+
+private:
+	static const Table<RPCTABLE_CLASS>& getTable()
+	{
+		static Table<RPCTABLE_CLASS> tbl;
+		return tbl;
+	}
 };
 
 #undef REGISTERRPC
@@ -0,0 +1,261 @@
+/************************************************************************
+Transport decorator that emulates network conditions (latency, jitter and
+limited bandwidth), to experiment with WAN like conditions on a single
+machine.
+************************************************************************/
+
+#pragma once
+
+#include "crazygaze/rpc/RPCAsioTransport.h"
+#include <random>
+
+namespace cz
+{
+namespace rpc
+{
+
+struct NetEmulatorSettings
+{
+	// Delay added to every frame
+	std::chrono::microseconds latency{0};
+	// Maximum random delay added on top of the latency.
+	// Frames are never reordered, so a frame might be delayed further until the previous one is delivered.
+	std::chrono::microseconds jitter{0};
+	// Bandwidth limit, in bytes per second. 0 means no limit
+	uint64_t bandwidth = 0;
+	// The transport reports itself as not writable (see Transport::isWritable) while more than this is waiting
+	// to be delivered, so senders that respect that (e.g: PubSub, channels) don't pile up frames without limit
+	size_t maxQueuedBytes = 1024 * 1024;
+};
+
+//
+// Delays the frames sent through the wrapped transport, according to the specified settings.
+// Only the frames sent by this side are delayed, so to emulate a round trip, either wrap both sides, or account
+// for the full round trip in the latency.
+// Timers run on the specified io_service.
+// Frames are only delivered while the wrapped transport is writable, so delivering never blocks. If the wrapped
+// transport still refuses a frame, the transport is closed, since the frame (and any reply to it) is lost.
+//
+class NetEmulatorTransport : public TransportDecorator, public std::enable_shared_from_this<NetEmulatorTransport>
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	NetEmulatorTransport(ASIO::io_service& io, std::shared_ptr<Transport> inner,
+						 const NetEmulatorSettings& settings = NetEmulatorSettings())
+		: TransportDecorator(std::move(inner))
+		, m_io(io)
+		, m_timer(io)
+	{
+		setSettings(settings);
+	}
+
+	// Changes the settings for the frames sent from now on
+	void setSettings(const NetEmulatorSettings& settings)
+	{
+		m_state([&](State& s)
+		{
+			s.settings = settings;
+		});
+	}
+
+	virtual bool send(std::vector<char> data, Priority priority) override
+	{
+		return delay(std::move(data), nullptr, priority);
+	}
+
+	virtual bool sendShared(std::vector<char> prefix, SharedBuffer payload, Priority priority) override
+	{
+		return delay(std::move(prefix), std::move(payload), priority);
+	}
+
+	// Frames not delivered yet are lost, as they would be in a real network
+	virtual void close() override
+	{
+		m_closed = true;
+		auto handlers = m_state([&](State& s)
+		{
+			s.q = std::queue<Frame>();
+			s.bytes = 0;
+			return std::move(s.writableHandlers);
+		});
+		m_inner->close();
+		for (auto&& h : handlers)
+			h();
+	}
+
+	virtual bool isWritable() const override
+	{
+		bool full = m_state([](State& s)
+		{
+			return s.bytes > s.settings.maxQueuedBytes;
+		});
+		return !full && m_inner->isWritable();
+	}
+
+	virtual void waitWritable(std::function<void()> h) override
+	{
+		// Waits for our own queue first, then for the wrapped transport's (see onTimer)
+		bool full = m_state([&](State& s)
+		{
+			if (m_closed || s.bytes <= s.settings.maxQueuedBytes)
+				return false;
+			s.writableHandlers.push_back(std::move(h));
+			return true;
+		});
+		if (!full)
+			m_inner->waitWritable(std::move(h));
+	}
+
+private:
+
+	struct Frame
+	{
+		std::vector<char> data;
+		SharedBuffer shared;
+		Priority priority;
+		Clock::time_point due;
+		size_t size;
+	};
+
+	struct State
+	{
+		NetEmulatorSettings settings;
+		std::queue<Frame> q;
+		// Bytes in "q"
+		size_t bytes = 0;
+		std::vector<std::function<void()>> writableHandlers;
+		// When the emulated link finishes sending the last frame (for the bandwidth limit)
+		Clock::time_point linkFree;
+		Clock::time_point lastDue;
+		bool timerActive = false;
+		std::mt19937 rng;
+	};
+
+	bool delay(std::vector<char> data, SharedBuffer shared, Priority priority)
+	{
+		if (m_closed)
+			return false;
+
+		size_t size = data.size() + (shared ? shared->size() : 0);
+		auto now = Clock::now();
+		bool startTimer = m_state([&](State& s)
+		{
+			Clock::time_point sent = now;
+			if (s.settings.bandwidth)
+			{
+				sent = std::max(now, s.linkFree) +
+					   std::chrono::nanoseconds(static_cast<uint64_t>(size) * 1000000000ull / s.settings.bandwidth);
+				s.linkFree = sent;
+			}
+
+			Clock::time_point due = sent + s.settings.latency;
+			if (s.settings.jitter.count())
+				due += std::chrono::microseconds(
+					std::uniform_int_distribution<int64_t>(0, s.settings.jitter.count())(s.rng));
+			due = std::max(due, s.lastDue);
+			s.lastDue = due;
+			s.q.push(Frame{std::move(data), std::move(shared), priority, due, size});
+			s.bytes += size;
+
+			if (s.timerActive)
+				return false;
+			s.timerActive = true;
+			return true;
+		});
+
+		if (startTimer)
+		{
+			m_io.post([this_ = shared_from_this()]
+			{
+				this_->onTimer();
+			});
+		}
+		return true;
+	}
+
+	enum class Next
+	{
+		Deliver,
+		Wait,
+		Idle
+	};
+
+	// Delivers the frames that are due, and sets the timer for the next one.
+	// There is only one chain of onTimer calls active at any time, so the timer is never used concurrently.
+	void onTimer()
+	{
+		while (true)
+		{
+			// Sending into a full transport could block the thread running the timers, so wait for it to drain
+			if (!m_inner->isWritable())
+			{
+				m_inner->waitWritable([this_ = shared_from_this()]
+				{
+					this_->m_io.post([this_]
+					{
+						this_->onTimer();
+					});
+				});
+				return;
+			}
+
+			Frame frame;
+			Clock::time_point due;
+			std::vector<std::function<void()>> writable;
+			Next next = m_state([&](State& s)
+			{
+				if (s.q.size() == 0)
+				{
+					s.timerActive = false;
+					return Next::Idle;
+				}
+
+				due = s.q.front().due;
+				if (due > Clock::now())
+					return Next::Wait;
+
+				frame = std::move(s.q.front());
+				s.q.pop();
+				s.bytes -= frame.size;
+				if (s.bytes <= s.settings.maxQueuedBytes)
+					writable = std::move(s.writableHandlers);
+				return Next::Deliver;
+			});
+
+			for (auto&& h : writable)
+				m_inner->waitWritable(std::move(h));
+
+			if (next == Next::Idle)
+				return;
+
+			if (next == Next::Wait)
+			{
+				m_timer.expires_at(due);
+				m_timer.async_wait([this_ = shared_from_this()](const CZRPC_ASIO_ERROR_CODE&)
+				{
+					this_->onTimer();
+				});
+				return;
+			}
+
+			bool sent = frame.shared
+				? m_inner->sendShared(std::move(frame.data), std::move(frame.shared), frame.priority)
+				: m_inner->send(std::move(frame.data), frame.priority);
+			if (!sent)
+			{
+				// The frame is lost, and so is any reply to it. Closing is the only way to let the calls know.
+				close();
+			}
+		}
+	}
+
+	ASIO::io_service& m_io;
+	ASIO::steady_timer m_timer;
+	std::atomic<bool> m_closed{false};
+	Monitor<State> m_state;
+};
+
+} // namespace rpc
+} // namespace cz
+
@@ -5,9 +5,111 @@ namespace cz
 namespace rpc
 {
 
+//
+// Interned property name.
+// Names are interned once and never released, so keys are cheap to compare, and objects don't need to keep
+// copies of the names. Creating a key for a name looks it up (and interns it if needed), so code that uses
+// the same property often can create the key once and keep it.
+//
+class PropertyKey
+{
+public:
+	PropertyKey() {}
+
+	// Interns the name if it wasn't interned yet
+	explicit PropertyKey(const std::string& name)
+		: m_name(intern(name, true))
+	{
+	}
+
+	// Gets the key of a name, without interning it.
+	// Properties are only set with interned names, so if the name was not interned yet, no object has that
+	// property, and the key returned is not valid.
+	static PropertyKey find(const std::string& name)
+	{
+		PropertyKey res;
+		res.m_name = intern(name, false);
+		return res;
+	}
+
+	bool isValid() const
+	{
+		return m_name != nullptr;
+	}
+
+	const std::string& getName() const
+	{
+		assert(m_name);
+		return *m_name;
+	}
+
+	bool operator==(const PropertyKey& other) const
+	{
+		return m_name == other.m_name;
+	}
+
+	bool operator!=(const PropertyKey& other) const
+	{
+		return m_name != other.m_name;
+	}
+
+	// Arbitrary order, but stable for the duration of the process
+	bool operator<(const PropertyKey& other) const
+	{
+		return std::less<const std::string*>()(m_name, other.m_name);
+	}
+
+private:
+	// The strings are never deleted, so keys can point to them, even after the map is updated
+	using Names = std::unordered_map<std::string, const std::string*>;
+
+	static RCU<Names>& getNames()
+	{
+		static RCU<Names> names;
+		return names;
+	}
+
+	static const std::string* intern(const std::string& name, bool add)
+	{
+		auto& names = getNames();
+		const std::string* res = names.read([&](const Names& n) -> const std::string*
+		{
+			auto it = n.find(name);
+			return it == n.end() ? nullptr : it->second;
+		});
+		if (res || !add)
+			return res;
+
+		names.update([&](Names& n)
+		{
+			// Someone else might have interned it meanwhile
+			auto it = n.find(name);
+			if (it != n.end())
+			{
+				res = it->second;
+				return false;
+			}
+			res = new std::string(name);
+			n.emplace(name, res);
+			return true;
+		});
+		return res;
+	}
+
+	const std::string* m_name = nullptr;
+};
+
+//
+// Properties and authentication token of an object.
+// All ObjectData instances created for the same object share the same data.
+// Reads don't take any locks (see RCU), so any number of connections can poll the properties concurrently.
+// Changes copy the data, so they are a lot more expensive than reads.
+//
 class ObjectData
 {
 public:
+	// Called when a watched property changes. See ObjectData::watchProperty
+	using WatchHandler = std::function<void(const PropertyKey& key, const Any& val)>;
 
 	explicit ObjectData(void* owner) : m_owner(owner)
 	{
@@ -22,30 +124,96 @@ public:
 		shared(m_owner);
 	}
 
+	// Looking up by name doesn't need to intern the name, so unknown names are cheap
 	Any getProperty(const std::string& name) const
 	{
-		auto lk = m_data->lock();
-		auto it = m_data->props.find(name);
-		return it == m_data->props.end() ? Any() : it->second;
+		return m_data->state.read([&](const State& st)
+		{
+			const Any* v = st.find(name);
+			return v ? *v : Any();
+		});
+	}
+
+	Any getProperty(PropertyKey key) const
+	{
+		if (!key.isValid())
+			return Any();
+		return m_data->state.read([&](const State& st)
+		{
+			const Any* v = st.find(key);
+			return v ? *v : Any();
+		});
 	}
 
 	// Returns true if added, false if failed (already existed, and `replace` was set to false)
 	bool setProperty(const std::string& name, Any val, bool replace = false)
 	{
-		auto lk = m_data->lock();
-		auto it = m_data->props.find(name);
-		if (it==m_data->props.end())
+		return setProperty(PropertyKey(name), std::move(val), replace);
+	}
+
+	bool setProperty(PropertyKey key, Any val, bool replace = false)
+	{
+		assert(key.isValid());
+		// Held while changing the value and queuing the notification, so the watchers see the changes in the same
+		// order they happen
+		std::unique_lock<std::mutex> lk(m_data->watchMtx);
+		auto handlers = m_data->getWatchers(key);
+		Any copy;
+		if (handlers.size())
+			copy = val;
+
+		bool res = false;
+		bool changed = m_data->state.update([&](State& st)
 		{
-			m_data->props.insert(std::pair<std::string, Any>(name, std::move(val)));
-			return true;
-		}
-		else
+			auto it = std::lower_bound(st.props.begin(), st.props.end(), key, PropLess());
+			if (it == st.props.end() || it->first != key)
+			{
+				st.props.emplace(it, key, std::move(val));
+				res = true;
+				return true;
+			}
+			else
+			{
+				if (!replace)
+					return false;
+				res = true;
+				// Setting the same value doesn't need a new version, or to notify the watchers
+				if (it->second == val)
+					return false;
+				it->second = std::move(val);
+				return true;
+			}
+		});
+
+		if (changed && handlers.size())
+			m_data->notifications.push_back(Notification{key, std::move(copy), std::move(handlers)});
+
+		// The watchers are notified one change at a time, without holding the lock, so a slow watcher (e.g: one
+		// pushing to a slow connection) doesn't hold back other threads changing the properties. Whoever is
+		// already notifying delivers the changes queued meanwhile.
+		if (m_data->notifying)
+			return res;
+		m_data->notifying = true;
+		while (m_data->notifications.size())
 		{
-			if (!replace)
-				return false;
-			it->second = std::move(val);
-			return true;
+			Notification n = std::move(m_data->notifications.front());
+			m_data->notifications.pop_front();
+			lk.unlock();
+			try
+			{
+				for (auto&& h : n.handlers)
+					(*h)(n.key, n.val);
+			}
+			catch (...)
+			{
+				lk.lock();
+				m_data->notifying = false;
+				throw;
+			}
+			lk.lock();
 		}
+		m_data->notifying = false;
+		return res;
 	}
 
 	template<typename T>
@@ -56,50 +224,145 @@ public:
 
 	std::string getAuthToken()
 	{
-		auto lk = m_data->lock();
-		return m_data->authToken;
+		return m_data->state.read([](const State& st)
+		{
+			return st.authToken;
+		});
 	}
 
 	void setAuthToken(std::string tk)
 	{
-		auto lk = m_data->lock();
-		m_data->authToken = std::move(tk);
+		m_data->state.update([&](State& st)
+		{
+			st.authToken = std::move(tk);
+			return true;
+		});
 	}
 
 	bool checkAuthToken(const std::string& tk) const
 	{
-		auto lk = m_data->lock();
-		return tk == m_data->authToken;
+		return m_data->state.read([&](const State& st)
+		{
+			return tk == st.authToken;
+		});
+	}
+
+	// Calls the handler whenever the property changes, from whatever thread changes it (or from a thread changing
+	// another property of this object at the same time).
+	// Only a weak reference to the handler is kept, so it's enough to destroy the handler to stop watching.
+	// The handlers of an object are called one at a time, in the order the changes happen.
+	void watchProperty(PropertyKey key, const std::shared_ptr<WatchHandler>& handler)
+	{
+		assert(key.isValid());
+		std::lock_guard<std::mutex> lk(m_data->watchMtx);
+		auto& watchers = m_data->watchers;
+		for (auto&& w : watchers)
+		{
+			if (w.first == key && w.second.lock() == handler)
+				return;
+		}
+		watchers.emplace_back(key, handler);
 	}
 
 private:
 
 	void* m_owner;
-	struct SharedData
+
+	using Prop = std::pair<PropertyKey, Any>;
+	struct PropLess
 	{
-		std::unique_lock<std::mutex> lock()
+		bool operator()(const Prop& a, PropertyKey b) const
 		{
-			return std::unique_lock<std::mutex>(mtx);
+			return a.first < b;
 		}
-		mutable std::mutex mtx;
-		std::unordered_map<std::string, Any> props;
+	};
+
+	struct State
+	{
+		// Sorted by key, since objects only have a few properties
+		std::vector<Prop> props;
 		std::string authToken;
+
+		const Any* find(PropertyKey key) const
+		{
+			auto it = std::lower_bound(props.begin(), props.end(), key, PropLess());
+			return (it == props.end() || it->first != key) ? nullptr : &it->second;
+		}
+
+		const Any* find(const std::string& name) const
+		{
+			for (auto&& p : props)
+			{
+				if (p.first.getName() == name)
+					return &p.second;
+			}
+			return nullptr;
+		}
+	};
+
+	// A change still to be delivered to its watchers
+	struct Notification
+	{
+		PropertyKey key;
+		Any val;
+		std::vector<std::shared_ptr<WatchHandler>> handlers;
+	};
+
+	struct SharedData
+	{
+		RCU<State> state;
+
+		std::mutex watchMtx;
+		std::vector<std::pair<PropertyKey, std::weak_ptr<WatchHandler>>> watchers;
+		std::deque<Notification> notifications;
+		// Set while a thread is delivering the notifications
+		bool notifying = false;
+
+		// Live handlers watching the specified property. Also removes the ones that expired.
+		// Needs to be called with watchMtx held
+		std::vector<std::shared_ptr<WatchHandler>> getWatchers(PropertyKey key)
+		{
+			std::vector<std::shared_ptr<WatchHandler>> res;
+			for (auto it = watchers.begin(); it != watchers.end();)
+			{
+				auto h = it->second.lock();
+				if (!h)
+				{
+					it = watchers.erase(it);
+					continue;
+				}
+				if (it->first == key)
+					res.push_back(std::move(h));
+				++it;
+			}
+			return res;
+		}
 	};
 	std::shared_ptr<SharedData> m_data;
 
+	// The objects are spread over several shards, so creating/destroying ObjectData instances for different
+	// objects doesn't contend on one single lock
+	struct alignas(64) RegistryShard
+	{
+		std::mutex mtx;
+		std::unordered_map<void*, std::weak_ptr<SharedData>> objs;
+	};
+	static constexpr size_t kRegistryShards = 16;
+
 	// Given a pointer, it creates the shared data for that object pointer
 	// or removes the shared data from the map if the weak_ptr expired
 	static std::shared_ptr<SharedData> shared(void* owner)
 	{
-		static std::mutex mtx;
-		static std::unordered_map<void*, std::weak_ptr<SharedData>> objs;
+		static RegistryShard shards[kRegistryShards];
+		// Ignore the lower bits, since objects are aligned
+		auto& shard = shards[(reinterpret_cast<uintptr_t>(owner) >> 4) % kRegistryShards];
 
-		std::lock_guard<std::mutex> lk(mtx);
-		auto it = objs.find(owner);
-		if (it==objs.end())
+		std::lock_guard<std::mutex> lk(shard.mtx);
+		auto it = shard.objs.find(owner);
+		if (it==shard.objs.end())
 		{
 			auto p = std::make_shared<SharedData>();
-			objs.insert(std::make_pair(owner, p));
+			shard.objs.insert(std::make_pair(owner, p));
 			return p;
 		}
 		else
@@ -107,7 +370,7 @@ private:
 			auto p = it->second.lock();
 			if (p)
 				return p;
-			objs.erase(it);
+			shard.objs.erase(it);
 			return nullptr;
 		}
 	}
@@ -115,4 +378,3 @@ private:
 
 }
 }
-
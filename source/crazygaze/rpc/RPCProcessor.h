@@ -19,6 +19,7 @@ public:
 		: m_outer(other.m_outer)
 		, m_transport(other.m_transport)
 		, m_rpcid(other.m_rpcid)
+		, m_priority(other.m_priority)
 		, m_data(std::move(other.m_data))
 	{
 	}
@@ -33,31 +34,158 @@ public:
 			async([](Result<RTraits::store_type>&) {});
 	}
 
+	// Overrides the RPC's priority (see Table<T>::setPriority) for this call, and any stream frames it sends.
+	// The reply still uses the callee's priority for the RPC. E.g:
+	//		CZRPC_CALL(con, heartbeat).priority(Priority::Urgent).async(...);
+	Call& priority(Priority priority) &
+	{
+		m_priority = priority;
+		return *this;
+	}
+
+	Call&& priority(Priority priority) &&
+	{
+		m_priority = priority;
+		return std::move(*this);
+	}
+
 	template<typename H>
 	void async(H&& handler)
 	{
-		m_outer.commit<F>(m_transport, m_rpcid, m_data, std::forward<H>(handler));
+		// Set before committing, since the handler can cause this object to be destroyed (e.g: when awaited by a
+		// coroutine)
 		m_commited = true;
+		m_outer.commit<F>(m_transport, m_rpcid, m_priority, m_data, std::forward<H>(handler));
 	}
 
-	std::future<class Result<typename RTraits::store_type>> ft()
+	Future<Result<typename RTraits::store_type>> ft()
 	{
-		auto pr = std::make_shared<std::promise<Result<RTraits::store_type>>>();
-		auto ft = pr->get_future();
-		async([pr=std::move(pr)](Result<RTraits::store_type>&& res) 
+		auto ft = Future<Result<RTraits::store_type>>::create();
+		async([pr = std::move(ft.second)](Result<RTraits::store_type>&& res)
 		{
-			pr->set_value(std::move(res));
+			pr.setValue(std::move(res));
 		});
 
-		return ft;
+		return std::move(ft.first);
+	}
+
+	// Sends the call and blocks until the reply arrives, driving the transport from the calling thread (see
+	// Transport::poll), instead of waiting for another thread to process the reply. That includes waiting for
+	// room in a full outgoing queue.
+	// If the transport's io_service is not run by any other thread, the whole round trip happens in the calling
+	// thread, without any thread handoffs. Once there is nothing left to do, it parks until the reply arrives,
+	// waking up now and then to poll again, in case no other thread is doing it.
+	Result<typename RTraits::store_type> get()
+	{
+		return getUntil(std::chrono::steady_clock::time_point::max());
+	}
+
+	// Same as "get", but gives up once the timeout expires, returning an aborted Result.
+	// A reply arriving after that is ignored.
+	template<typename Rep, typename Period>
+	Result<typename RTraits::store_type> get(const std::chrono::duration<Rep, Period>& timeout)
+	{
+		return getUntil(std::chrono::steady_clock::now() + timeout);
+	}
+
+	// For server streaming RPCs (see ServerStream). Calls onItem(T&&) for each element as it arrives, and
+	// onDone(Result<void>&&) once the stream finishes, fails, or is aborted.
+	// Both are called from the thread processing the connection. Credit is given back to the server once onItem
+	// returns, so a slow handler slows down the server, instead of piling up elements.
+	template<typename I, typename D>
+	void stream(I&& onItem, D&& onDone)
+	{
+		using Traits = details::ServerStreamTraits<RType>;
+		static_assert(Traits::value, "Not a server streaming RPC");
+		using T = typename Traits::value_type;
+		m_commited = true;
+		m_outer.template commitStream<F, T>(
+			m_transport, m_rpcid, m_priority, m_data,
+			std::make_shared<details::CallbackStreamConsumer<T, typename std::decay<I>::type, typename std::decay<D>::type>>(
+				std::forward<I>(onItem), std::forward<D>(onDone)));
+	}
+
+	// For server streaming RPCs. Returns a reader to pull the elements from, at the caller's own pace.
+	auto reader()
+	{
+		using Traits = details::ServerStreamTraits<RType>;
+		static_assert(Traits::value, "Not a server streaming RPC");
+		using T = typename Traits::value_type;
+		m_commited = true;
+		auto st = std::make_shared<details::StreamReaderState<T>>();
+		m_outer.template commitStream<F, T>(m_transport, m_rpcid, m_priority, m_data, st);
+		return StreamReader<T>(std::move(st));
+	}
+
+	// For client streaming RPCs (RPCs taking a StreamReader<T> as the last parameter, which is not specified when
+	// doing the call). Sends the call, and returns the upload to write the elements to. E.g:
+	//		auto up = CZRPC_CALL(con, store, "file.bin").upload();
+	//		while (...)
+	//			up.write(block);
+	//		Result<bool> res = up.finish().get();
+	// Doing the call without "upload" is the same as an empty upload.
+	auto upload(int chunkSize = details::kDefaultStreamChunkSize)
+	{
+		using Traits = FunctionTraits<F>;
+		static_assert(Traits::hasClientStream, "Not a client streaming RPC");
+		static_assert(!details::ServerStreamTraits<RType>::value, "RPCs can't both take and return a stream");
+		using Reader = typename std::decay<typename Traits::template argument<Traits::arity - 1>::type>::type;
+		static_assert(!details::IsChannel<Reader>::value, "Channel RPCs are called with Call::channel");
+		using T = typename Reader::value_type;
+		using R = typename RTraits::store_type;
+		m_commited = true;
+		auto st = std::make_shared<details::UploadState<T, R>>(chunkSize);
+		m_outer.template commitUpload<F>(m_transport, m_rpcid, m_priority, m_data, st);
+		return StreamUpload<T, R>(std::move(st));
+	}
+
+	// For RPCs taking a Channel<In, Out> as the last parameter, which is not specified when doing the call.
+	// Sends the call, and returns the caller's side of the channel, which gets Out and sends In. E.g:
+	//		auto ch = CZRPC_CALL(con, subscribe, "prices").channel();
+	//		Price p;
+	//		while (ch.next(p))
+	//			...
+	// The RPC's reply doesn't close the channel, but a failed call does.
+	// Doing the call without "channel" is the same as closing the caller's side right away, and any elements the
+	// callee sends are dropped.
+	auto channel(int chunkSize = details::kDefaultStreamChunkSize)
+	{
+		using Traits = FunctionTraits<F>;
+		static_assert(Traits::hasClientStream, "Not a channel RPC");
+		using Ch = typename std::decay<typename Traits::template argument<Traits::arity - 1>::type>::type;
+		static_assert(details::IsChannel<Ch>::value, "Not a channel RPC");
+		static_assert(std::is_void<typename RTraits::store_type>::value, "Channel RPCs can't return values");
+		using In = typename Ch::out_type;
+		using Out = typename Ch::in_type;
+		m_commited = true;
+		auto st = std::make_shared<details::ChannelState<In, Out>>(chunkSize);
+		m_outer.template commitChannel<F>(m_transport, m_rpcid, m_priority, m_data, st);
+		return Channel<In, Out>(std::move(st));
+	}
+
+#if CZRPC_COROUTINES
+	// Allows awaiting the call from a coroutine. E.g:
+	//		Result<int> res = co_await CZRPC_CALL(con, add, 1, 2);
+	// The coroutine is resumed in whatever thread processes the reply
+	details::CallAwaiter<F> operator co_await() &&
+	{
+		return details::CallAwaiter<F>(*this, nullptr);
+	}
+
+	// Same as awaiting the call, but the coroutine is resumed through the specified executor. E.g:
+	//		co_await CZRPC_CALL(con, add, 1, 2).resumeOn(executor);
+	details::CallAwaiter<F> resumeOn(std::function<void(std::function<void()>)> executor) &&
+	{
+		return details::CallAwaiter<F>(*this, std::move(executor));
 	}
+#endif
 
 protected:
 
 	template<typename T> friend class OutProcessor;
 
-	explicit Call(BaseOutProcessor& outer, Transport& transport, uint32_t rpcid)
-		: m_outer(outer), m_transport(transport), m_rpcid(rpcid)
+	explicit Call(BaseOutProcessor& outer, Transport& transport, uint32_t rpcid, Priority priority)
+		: m_outer(outer), m_transport(transport), m_rpcid(rpcid), m_priority(priority)
 	{
 		m_data << Header(); // Reserve space for the header
 	}
@@ -65,12 +193,32 @@ protected:
 	template<typename... Args>
 	void serializeParams(Args&&... args)
 	{
+		CZRPC_TRACE_SCOPE("serialize", m_rpcid, 0);
 		serializeMethod<F>(m_data, std::forward<Args>(args)...);
 	}
 
+	Result<typename RTraits::store_type> getUntil(std::chrono::steady_clock::time_point deadline)
+	{
+		// Sends blocked by a full queue keep driving the transport too (see details::TransportDriver)
+		details::TransportDriver driver;
+		Callstack<details::TransportDriver>::Context ctx(&driver);
+		auto reply = ft();
+		while (!reply.isReady())
+		{
+			if (m_transport.poll())
+				continue;
+			auto now = std::chrono::steady_clock::now();
+			if (now >= deadline)
+				return Result<typename RTraits::store_type>();
+			reply.waitUntil(std::min(deadline, now + details::TransportDriver::pollInterval()));
+		}
+		return reply.get();
+	}
+
 	BaseOutProcessor& m_outer;
 	Transport& m_transport;
 	uint32_t m_rpcid;
+	Priority m_priority;
 	Stream m_data;
 	// Used in the destructor to do a commit with an empty handler if the rpc was not committed.
 	bool m_commited = false;
@@ -79,80 +227,523 @@ protected:
 class BaseOutProcessor
 {
 public:
-	virtual ~BaseOutProcessor() {}
+	BaseOutProcessor()
+	{
+#if CZRPC_STATS
+		for (auto&& s : m_stats)
+			s.store(nullptr, std::memory_order_relaxed);
+#endif
+	}
+
+	virtual ~BaseOutProcessor()
+	{
+		// Channels can outlive the connection
+		abortStreams();
+#if CZRPC_STATS
+		for (auto&& s : m_stats)
+			delete s.load();
+#endif
+	}
+
+	// Round trip stats of the calls to the specified RPC done through this processor
+	RPCStatsSnapshot getStats(uint32_t rpcid) const
+	{
+#if CZRPC_STATS
+		assert(rpcid < m_stats.size());
+		RPCStats* stats = m_stats[rpcid].load(std::memory_order_acquire);
+		if (stats)
+			return stats->getSnapshot();
+#endif
+		return RPCStatsSnapshot();
+	}
+
 protected:
 
 	template<typename R> friend class Call;
+	template<typename R> friend class SharedCall;
 	template<typename L, typename R> friend struct Connection;
 
 	template<typename F, typename H>
-	void commit(Transport& transport, uint32_t rpcid, Stream& data, H&& handler)
+	void commit(Transport& transport, uint32_t rpcid, Priority priority, Stream& data, H&& handler)
+	{
+		Header hdr = prepareCall<F>(transport, rpcid, priority, data.writeSize(), std::forward<H>(handler));
+		*reinterpret_cast<Header*>(data.ptr(0)) = hdr;
+		if (!transport.send(data.extract(), priority))
+		{
+			abortCall(hdr);
+			return;
+		}
+		// A client streaming call done without Call::upload is an empty upload (see Call::channel for channels)
+		if (FunctionTraits<F>::hasClientStream)
+			details::sendStreamControl(transport, hdr, priority, details::StreamFrame::End, 0, false);
+	}
+
+	// Same as commit, but for server streaming calls consumed as the elements arrive
+	template<typename F, typename T>
+	void commitStream(Transport& transport, uint32_t rpcid, Priority priority, Stream& data,
+					  std::shared_ptr<details::StreamConsumer<T>> consumer)
+	{
+		Header hdr = newCall(rpcid, data.writeSize());
+		addReply(hdr, makeStreamReply(transport, hdr, priority, std::move(consumer),
+									  newCallStats(rpcid, data.writeSize())));
+		*reinterpret_cast<Header*>(data.ptr(0)) = hdr;
+		if (!transport.send(data.extract(), priority))
+			abortCall(hdr);
+	}
+
+	// Same as commit, but for client streaming calls. The elements follow the call as stream frames.
+	template<typename F, typename T, typename R>
+	void commitUpload(Transport& transport, uint32_t rpcid, Priority priority, Stream& data,
+					  const std::shared_ptr<details::UploadState<T, R>>& st)
+	{
+		using RType = typename FunctionTraits<F>::return_type;
+		Header hdr = newCall(rpcid, data.writeSize());
+		st->sender().setCall(transport, hdr, priority, false);
+		m_streams([&](StreamMap& streams)
+		{
+			streams[hdr.key()] = st;
+		});
+		addReply(hdr, makeReply(transport, hdr, priority,
+								[this, st, key = hdr.key()](Result<R>&& res)
+								{
+									unregisterStream(key);
+									st->onResult(std::move(res));
+								},
+								newCallStats(rpcid, data.writeSize()), static_cast<RType*>(nullptr)));
+		*reinterpret_cast<Header*>(data.ptr(0)) = hdr;
+		if (!transport.send(data.extract(), priority))
+			abortCall(hdr);
+	}
+
+	// Same as commit, but for calls opening a channel. The channel stays registered after the reply, until both
+	// directions finish
+	template<typename F, typename In, typename Out>
+	void commitChannel(Transport& transport, uint32_t rpcid, Priority priority, Stream& data,
+					   const std::shared_ptr<details::ChannelState<In, Out>>& st)
+	{
+		using RType = typename FunctionTraits<F>::return_type;
+		Header hdr = newCall(rpcid, data.writeSize());
+		st->setCall(transport, hdr, priority, false, [this, key = hdr.key()]
+		{
+			unregisterStream(key);
+		});
+		m_streams([&](StreamMap& streams)
+		{
+			streams[hdr.key()] = st;
+		});
+		addReply(hdr, makeReply(transport, hdr, priority,
+								[st](Result<void>&& res)
+								{
+									if (!res.isValid())
+										st->onError(std::move(res));
+								},
+								newCallStats(rpcid, data.writeSize()), static_cast<RType*>(nullptr)));
+		*reinterpret_cast<Header*>(data.ptr(0)) = hdr;
+		if (!transport.send(data.extract(), priority))
+			abortCall(hdr);
+	}
+
+	void unregisterStream(uint32_t key)
+	{
+		m_streams([&](StreamMap& streams)
+		{
+			streams.erase(key);
+		});
+	}
+
+	// Same as commit, but for parameters already serialized (without header) into a buffer shared by
+	// several calls
+	template<typename F, typename H>
+	void commitShared(Transport& transport, uint32_t rpcid, Priority priority, const SharedBuffer& payload,
+					  H&& handler)
+	{
+		Header hdr =
+			prepareCall<F>(transport, rpcid, priority, sizeof(Header) + payload->size(), std::forward<H>(handler));
+		std::vector<char> prefix(sizeof(Header));
+		*reinterpret_cast<Header*>(&prefix[0]) = hdr;
+		if (!transport.sendShared(std::move(prefix), payload, priority))
+			abortCall(hdr);
+	}
+
+	// Handles the reply frames of a call, or the call being aborted if the stream is nullptr.
+	// return: true if the call is finished. Only streaming calls get more than one frame.
+	using ReplyHandler = std::function<bool(Stream*, Header)>;
+	struct PendingReply
+	{
+		ReplyHandler h;
+		// Streaming calls stay registered until the last frame
+		bool stream = false;
+	};
+
+	// Creates the header for a new call, and sets up the reply handler
+	template<typename F, typename H>
+	Header prepareCall(Transport& transport, uint32_t rpcid, Priority priority, size_t size, H&& handler)
+	{
+		using RType = typename FunctionTraits<F>::return_type;
+		Header hdr = newCall(rpcid, size);
+		addReply(hdr, makeReply(transport, hdr, priority, std::forward<H>(handler), newCallStats(rpcid, size),
+								static_cast<RType*>(nullptr)));
+		return hdr;
+	}
+
+	Header newCall(uint32_t rpcid, size_t size)
 	{
-		std::unique_lock<std::mutex> lk(m_mtx);
 		Header hdr;
-		hdr.bits.size = data.writeSize();
-		hdr.bits.counter = ++m_replyIdCounter;
+		hdr.bits.size = static_cast<unsigned>(size);
+		// Counter 0 is never used, since that's how pushes are identified (see Header::isPush)
+		hdr.bits.counter =
+			m_replyIdCounter.fetch_add(1, std::memory_order_relaxed) % ((1u << Header::kCounterBits) - 1) + 1;
 		hdr.bits.rpcid = rpcid;
-		*reinterpret_cast<Header*>(data.ptr(0)) = hdr;
-		m_replies[hdr.key()] = [handler = std::move(handler)](Stream* in, Header hdr)
+		return hdr;
+	}
+
+	details::CallStats newCallStats(uint32_t rpcid, size_t size)
+	{
+#if CZRPC_STATS
+		return details::CallStats(getOrCreateStats(rpcid), static_cast<uint32_t>(size));
+#else
+		return details::CallStats();
+#endif
+	}
+
+	void addReply(Header hdr, PendingReply reply)
+	{
+		ReplyShard& shard = getReplyShard(hdr);
+		std::unique_lock<std::mutex> lk(shard.mtx);
+		shard.replies[hdr.key()] = std::move(reply);
+	}
+
+	template<typename H, typename R>
+	static PendingReply makeReply(Transport&, Header, Priority, H&& handler, const details::CallStats& stats, R*)
+	{
+		PendingReply reply;
+		reply.h = [handler = std::forward<H>(handler), stats](Stream* in, Header hdr) mutable
 		{
-			using R = typename ParamTraits<typename FunctionTraits<F>::return_type>::store_type;
+			using Store = typename ParamTraits<R>::store_type;
 			if (in)
 			{
+				stats.record(hdr.bits.success != 0, hdr.bits.size);
 				if (hdr.bits.success)
 				{
-					handler(Result<R>::fromStream((*in)));
+					handler(Result<Store>::fromStream((*in)));
 				}
 				else
 				{
 					std::string str;
 					(*in) >> str;
-					handler(Result<R>::fromException(std::move(str)));
+					handler(Result<Store>::fromException(std::move(str)));
 				}
 			}
 			else
 			{
 				// if the stream is nullptr, it means the result is being aborted
-				handler(Result<R>());
+				handler(Result<Store>());
 			}
+			return true;
+		};
+		return reply;
+	}
+
+	// Server streaming calls waited for as a whole get all the elements in a vector
+	template<typename H, typename T>
+	static PendingReply makeReply(Transport& transport, Header hdr, Priority priority, H&& handler,
+								  const details::CallStats& stats, ServerStream<T>*)
+	{
+		return makeStreamReply<T>(
+			transport, hdr, priority,
+			std::make_shared<details::CollectStreamConsumer<T, typename std::decay<H>::type>>(std::forward<H>(handler)),
+			stats);
+	}
+
+	template<typename T>
+	static PendingReply makeStreamReply(Transport& transport, Header hdr, Priority priority,
+										std::shared_ptr<details::StreamConsumer<T>> consumer,
+										const details::CallStats& stats)
+	{
+		consumer->setCall(transport, hdr, priority);
+		PendingReply reply;
+		reply.stream = true;
+		reply.h = [consumer = std::move(consumer), stats](Stream* in, Header hdr)
+		{
+			if (!consumer->onReply(in, hdr))
+				return false;
+			if (in)
+				stats.record(hdr.bits.success != 0, hdr.bits.size);
+			return true;
 		};
-		lk.unlock();
+		return reply;
+	}
 
-		transport.send(data.extract());
+	// Used when the transport refused the data, so there will be no reply. Aborts the call, unless it
+	// was already aborted meanwhile (e.g: the transport closed)
+	void abortCall(Header hdr)
+	{
+		ReplyHandler h;
+		{
+			ReplyShard& shard = getReplyShard(hdr);
+			std::unique_lock<std::mutex> lk(shard.mtx);
+			auto it = shard.replies.find(hdr.key());
+			if (it == shard.replies.end())
+				return;
+			h = std::move(it->second.h);
+			shard.replies.erase(it);
+		}
+
+		h(nullptr, Header());
 	}
 
 	void processReply(Stream& in, Header hdr)
 	{
-		std::function<void(Stream*, Header)> h;
+		CZRPC_TRACE_SCOPE("processReply", hdr.bits.rpcid, hdr.bits.counter);
+		ReplyHandler h;
+		bool stream;
+		ReplyShard& shard = getReplyShard(hdr);
 		{
-			std::unique_lock<std::mutex> lk(m_mtx);
-			auto it = m_replies.find(hdr.key());
-			assert(it != m_replies.end());
-			h = std::move(it->second);
-			m_replies.erase(it);
+			std::unique_lock<std::mutex> lk(shard.mtx);
+			auto it = shard.replies.find(hdr.key());
+			assert(it != shard.replies.end());
+			stream = it->second.stream;
+			if (stream)
+			{
+				h = it->second.h;
+			}
+			else
+			{
+				h = std::move(it->second.h);
+				shard.replies.erase(it);
+			}
 		}
 
-		h(&in, hdr);
+		if (h(&in, hdr) && stream)
+		{
+			std::unique_lock<std::mutex> lk(shard.mtx);
+			shard.replies.erase(hdr.key());
+		}
+	}
+
+	// Frame sent by the callee of a client streaming call or channel (see Header::isStreamFrame)
+	void processStreamFrame(Transport& transport, Stream& in, Header hdr)
+	{
+		auto st = m_streams([&](StreamMap& streams)
+		{
+			auto it = streams.find(hdr.key());
+			return it == streams.end() ? nullptr : it->second;
+		});
+		// The stream might have finished meanwhile
+		if (st)
+			st->onFrame(in);
+		else
+			details::rejectStreamFrame(transport, in, hdr);
+	}
+
+
+	// Property change pushed by the remote object (see __watchProperty)
+	void processPush(Stream& in)
+	{
+		std::string name;
+		Any val;
+		in >> name;
+		in >> val;
+
+		std::vector<PropertyHandler> waiting;
+		m_props([&](PropertyCache& props)
+		{
+			auto it = props.find(name);
+			// Only properties we are watching are pushed
+			if (it == props.end())
+				return;
+			it->second.value = std::move(val);
+			it->second.ready = true;
+			waiting = std::move(it->second.waiting);
+		});
+
+		for (auto&& h : waiting)
+			h(cachedPropertyResult(name));
+	}
+
+	// Reply to a __watchProperty call
+	void processWatchReply(const std::string& name, Result<Any>&& res)
+	{
+		std::vector<PropertyHandler> waiting;
+		bool ready = false;
+		m_props([&](PropertyCache& props)
+		{
+			auto it = props.find(name);
+			assert(it != props.end());
+			waiting = std::move(it->second.waiting);
+			// If a push arrived first, it's at least as recent as this reply
+			if (res.isValid() && !it->second.ready)
+			{
+				it->second.value = std::move(res.get());
+				it->second.ready = true;
+			}
+			ready = it->second.ready;
+			// Next request tries again
+			if (!ready)
+				props.erase(it);
+		});
+
+		for (auto&& h : waiting)
+			h(ready ? cachedPropertyResult(name) : Result<Any>(res));
+	}
+
+	Result<Any> cachedPropertyResult(const std::string& name)
+	{
+		Any v;
+		getCachedProperty(name, v);
+		return Result<Any>(std::move(v));
+	}
+
+public:
+	// Gets a property of the remote object from the local cache, without any calls.
+	// return: false if the property is not cached yet (see OutProcessor::getProperty)
+	bool getCachedProperty(const std::string& name, Any& dst) const
+	{
+		return m_props([&](PropertyCache& props)
+		{
+			auto it = props.find(name);
+			if (it == props.end() || !it->second.ready)
+				return false;
+			dst = it->second.value;
+			return true;
+		});
 	}
 
+protected:
 
 	void abortReplies()
 	{
-		decltype(m_replies) replies;
+		for (auto&& shard : m_replies)
 		{
-			std::unique_lock<std::mutex> lk(m_mtx);
-			replies = std::move(m_replies);
+			ReplyMap replies;
+			{
+				std::unique_lock<std::mutex> lk(shard.mtx);
+				replies = std::move(shard.replies);
+			}
+
+			for (auto&& r : replies)
+			{
+				r.second.h(nullptr, Header());
+			}
 		}
 
-		for (auto&& r : replies)
+		abortStreams();
+	};
+
+	void abortStreams()
+	{
+		// Cancelled outside the lock, since they remove themselves once they finish
+		StreamMap streams;
+		m_streams([&](StreamMap& s)
 		{
-			r.second(nullptr, Header());
-		}
+			streams = std::move(s);
+		});
+		for (auto&& s : streams)
+			s.second->cancel();
+	}
+
+#if CZRPC_STATS
+	RPCStats* getOrCreateStats(uint32_t rpcid)
+	{
+		RPCStats* stats = m_stats[rpcid].load(std::memory_order_acquire);
+		if (stats)
+			return stats;
+		// Several threads might race to create it, so only one wins
+		auto newStats = std::make_unique<RPCStats>();
+		if (m_stats[rpcid].compare_exchange_strong(stats, newStats.get(), std::memory_order_acq_rel))
+			return newStats.release();
+		return stats;
+	}
+
+	// Created on demand, since most RPCs are never called through a given connection
+	std::array<std::atomic<RPCStats*>, 1 << Header::kRPCIdBits> m_stats;
+#endif
+
+	using ReplyMap = std::unordered_map<uint32_t, PendingReply>;
+
+	// Pending replies are sharded by call counter, so threads doing calls through the same connection rarely
+	// fight over the same lock
+	static constexpr int kNumReplyShards = 16;
+	struct alignas(64) ReplyShard
+	{
+		std::mutex mtx;
+		ReplyMap replies;
 	};
 
-	std::mutex m_mtx;
-	uint32_t m_replyIdCounter = 0;
-	std::unordered_map<uint32_t, std::function<void(Stream*, Header)>> m_replies;
+	ReplyShard& getReplyShard(Header hdr)
+	{
+		return m_replies[hdr.bits.counter % kNumReplyShards];
+	}
+
+	std::atomic<uint32_t> m_replyIdCounter{0};
+	ReplyShard m_replies[kNumReplyShards];
+
+	// Client streaming calls and channels, for the callee's stream frames
+	using StreamMap = std::unordered_map<uint32_t, std::shared_ptr<details::BaseStreamState>>;
+	Monitor<StreamMap> m_streams;
+
+	// Properties of the remote object this side is watching
+	using PropertyHandler = std::function<void(Result<Any>&&)>;
+	struct CachedProperty
+	{
+		// Set once the value arrives, either as the reply to __watchProperty or as a push
+		bool ready = false;
+		Any value;
+		// Requests waiting for the value to arrive
+		std::vector<PropertyHandler> waiting;
+	};
+	using PropertyCache = std::unordered_map<std::string, CachedProperty>;
+	Monitor<PropertyCache> m_props;
+};
+
+//
+// A call serialized only once, that can be sent to any number of connections with the same REMOTE type.
+// Only the header is created per connection, and all connections share the same serialized parameters,
+// which makes broadcasts cost O(payload + N) instead of O(N*payload).
+// Replies are ignored, unless a handler is specified when sending to a connection.
+template<typename F>
+class SharedCall
+{
+private:
+	using Traits = FunctionTraits<F>;
+	using RType = typename Traits::return_type;
+	using RTraits = ParamTraits<RType>;
+public:
+
+	template<typename... Args>
+	explicit SharedCall(uint32_t rpcid, Args&&... args)
+		: m_rpcid(rpcid)
+	{
+		Stream s;
+		serializeMethod<F>(s, std::forward<Args>(args)...);
+		m_payload = std::make_shared<const std::vector<char>>(s.extract());
+	}
+
+	template<typename CON>
+	void send(CON& con) const
+	{
+		send(con, [](Result<typename RTraits::store_type>&&) {});
+	}
+
+	template<typename CON, typename H>
+	void send(CON& con, H&& handler) const
+	{
+		static_assert(std::is_base_of<typename Traits::class_type, typename CON::Remote>::value,
+			"Not a member function of the connection's remote class");
+		static_assert(!Traits::hasClientStream, "Client streaming RPCs can't be shared calls");
+		Priority priority = Table<typename CON::Remote>::get(m_rpcid)->priority.load(std::memory_order_relaxed);
+		con.remotePrc.template commitShared<F>(*con.transport, m_rpcid, priority, m_payload,
+											   std::forward<H>(handler));
+	}
+
+	const SharedBuffer& getPayload() const
+	{
+		return m_payload;
+	}
+
+private:
+	uint32_t m_rpcid;
+	SharedBuffer m_payload;
 };
 
 namespace details
@@ -167,6 +758,7 @@ class OutProcessor : public BaseOutProcessor
 {
 public:
 	using Type = T;
+	using BaseOutProcessor::getStats;
 
 	template<typename F, typename... Args>
 	auto call(Transport& transport, uint32_t rpcid, Args&&... args)
@@ -176,18 +768,101 @@ public:
 			std::is_member_function_pointer<F>::value &&
 			std::is_base_of<typename Traits::class_type, Type>::value,
 			"Not a member function of the wrapped class");
-		Call<F> c(*this, transport, rpcid);
+		Call<F> c(*this, transport, rpcid, Table<T>::get(rpcid)->priority.load(std::memory_order_relaxed));
 		c.serializeParams(std::forward<Args>(args)...);
 		return std::move(c);
 	}
 
 	auto callGeneric(Transport& transport, const std::string& name, const std::vector<Any>& args)
 	{
-		Call<details::GenericRPCFunc> c(*this, transport, (int)Table<T>::RPCId::genericRPC);
+		uint32_t rpcid = static_cast<uint32_t>(Table<T>::RPCId::genericRPC);
+		Call<details::GenericRPCFunc> c(*this, transport, rpcid,
+										Table<T>::get(rpcid)->priority.load(std::memory_order_relaxed));
 		c.serializeParams(name, args);
 		return std::move(c);
 	}
 
+	// Gets a property of the remote object, through a local cache.
+	// The first request for a property calls __watchProperty, which replies with the current value, and makes
+	// the remote push any changes from then on. Any further requests are served from the cache, without
+	// any calls.
+	// The handler is called right away if the property is cached, or once the value arrives otherwise.
+	template<typename H>
+	void getPropertyAsync(Transport& transport, const std::string& name, H&& handler)
+	{
+		bool cached = false;
+		bool call = false;
+		Result<Any> res;
+		m_props([&](PropertyCache& props)
+		{
+			auto it = props.find(name);
+			if (it == props.end())
+			{
+				it = props.emplace(name, CachedProperty()).first;
+				call = true;
+			}
+
+			if (it->second.ready)
+			{
+				res = Result<Any>(Any(it->second.value));
+				cached = true;
+			}
+			else
+			{
+				it->second.waiting.push_back(std::forward<H>(handler));
+			}
+		});
+
+		if (cached)
+		{
+			handler(std::move(res));
+			return;
+		}
+
+		if (call)
+		{
+			callGeneric(transport, "__watchProperty", std::vector<Any>{Any(name)})
+				.async([this, name](Result<Any>&& r)
+			{
+				processWatchReply(name, std::move(r));
+			});
+		}
+	}
+
+	// Same as getPropertyAsync, but blocks until the value arrives if it is not cached.
+	// Should not be called from the thread that processes the connection.
+	Result<Any> getProperty(Transport& transport, const std::string& name)
+	{
+		Any v;
+		if (getCachedProperty(name, v))
+			return Result<Any>(std::move(v));
+
+		auto ft = Future<Result<Any>>::create();
+		getPropertyAsync(transport, name, [pr = std::move(ft.second)](Result<Any>&& res)
+		{
+			pr.setValue(std::move(res));
+		});
+		return ft.first.get();
+	}
+
+	// Round trip stats of all the RPCs called through this processor.
+	// All generic RPC calls are merged under "genericRPC".
+	std::vector<RPCStatsEntry> getStats() const
+	{
+		std::vector<RPCStatsEntry> res;
+		const BaseTable& tbl = Table<T>::getBaseTable();
+		for (uint32_t rpcid = 0; rpcid < tbl.getNumRPCs(); rpcid++)
+		{
+			RPCStatsEntry e;
+			e.stats = BaseOutProcessor::getStats(rpcid);
+			if (e.stats.calls == 0)
+				continue;
+			e.name = tbl.getBaseInfo(rpcid)->name;
+			res.push_back(std::move(e));
+		}
+		return res;
+	}
+
 protected:
 
 };
@@ -200,6 +875,8 @@ class OutProcessor<void>
   public:
 	OutProcessor() {}
 	void processReply(Stream&, Header) { assert(0 && "Incoming replies not allowed for OutProcessor<void>"); }
+	void processPush(Stream&) { assert(0 && "Incoming pushes not allowed for OutProcessor<void>"); }
+	void processStreamFrame(Transport&, Stream&, Header) { assert(0 && "Incoming stream frames not allowed for OutProcessor<void>"); }
 	void abortReplies() {}
 };
 
@@ -234,14 +911,31 @@ public:
 		: BaseInProcessor(obj)
 		, m_obj(*obj)
 	{
+		m_data.table = &Table<Type>::getBaseTable();
 	}
 
 	void processCall(Transport& transport, Stream& in, Header hdr)
 	{
+		CZRPC_TRACE_SCOPE("dispatch", hdr.bits.rpcid, hdr.bits.counter);
 		auto&& info = Table<Type>::get(hdr.bits.rpcid);
 		info->dispatcher(m_obj, in, m_data, transport, hdr);
 	}
 
+	// Frame sent by the caller of a streaming call (see Header::isStreamFrame)
+	void processStreamFrame(Transport& transport, Stream& in, Header hdr)
+	{
+		auto s = m_data.streams([&](InProcessorData::StreamMap& streams)
+		{
+			auto it = streams.find(hdr.key());
+			return it == streams.end() ? nullptr : it->second;
+		});
+		// The stream might have finished meanwhile
+		if (s)
+			s->onFrame(in);
+		else
+			details::rejectStreamFrame(transport, in, hdr);
+	}
+
 protected:
 	Type& m_obj;
 };
@@ -254,7 +948,12 @@ public:
 	void processCall(Transport& trp, Stream& in, Header hdr)
 	{
 		//assert(0 && "Incoming RPC not allowed for void local type");
-		details::Send::error(trp, hdr, "Peer doesn't have an object to process RPC calls");
+		details::Send::error(trp, hdr, Priority::Normal, "Peer doesn't have an object to process RPC calls");
+	}
+	void processStreamFrame(Transport& transport, Stream& in, Header hdr)
+	{
+		// No calls, therefore no streams
+		details::rejectStreamFrame(transport, in, hdr);
 	}
 };
 
@@ -268,6 +967,27 @@ public:
 #define CZRPC_CALLGENERIC(con, name, ...) \
 	(con).callGeneric(*(con).transport, name, ##__VA_ARGS__)
 
+// Serializes a call to an RPC of class REMOTE, so it can be sent to several connections.
+// Example:
+//		auto call = CZRPC_SHAREDCALL(ChatClientInterface, onMsg, "", "Hello");
+//		for (auto&& con : connections)
+//			call.send(*con);
+#define CZRPC_SHAREDCALL(REMOTE, func, ...)                              \
+    cz::rpc::SharedCall<decltype(&REMOTE::func)>(                        \
+        (uint32_t)cz::rpc::Table<REMOTE>::RPCId::func, ##__VA_ARGS__)
+
+// Sends the same call to all the connections in a range (of pointers or std::shared_ptr),
+// serializing the parameters only once.
+#define CZRPC_BROADCAST(cons, func, ...)                                         \
+    do                                                                           \
+    {                                                                            \
+        using CZRPC_Remote = typename cz::rpc::details::ConnectionTraits<        \
+            typename std::decay<decltype(*std::begin(cons))>::type>::Remote;    \
+        auto CZRPC_sharedCall = CZRPC_SHAREDCALL(CZRPC_Remote, func, ##__VA_ARGS__); \
+        for (auto&& CZRPC_con : cons)                                            \
+            CZRPC_sharedCall.send(*CZRPC_con);                                   \
+    } while (0)
+
 } // namespace rpc
 } // namespace cz
 
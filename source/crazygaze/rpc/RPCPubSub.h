@@ -0,0 +1,317 @@
+#pragma once
+
+//
+// Topic based publish/subscribe on top of connections.
+//
+// Connections subscribe to topics (e.g: the server subscribes a client when it calls some "subscribe" RPC), and
+// publishing a one-way RPC to a topic sends it to all subscribers:
+//		PubSub<ConType> pubsub;
+//		pubsub.subscribe(con, "chat");
+//		CZRPC_PUBLISH(pubsub, "chat", onMsg, "", "Hello");
+//
+// - Parameters are serialized only once per publish, and all subscribers share the same buffer (see SharedCall).
+// - Publishing doesn't lock the subscription sets. Subscribing/unsubscribing creates a new snapshot, which
+// publishers pick up with std::atomic_load.
+// - Messages are sent right away to subscribers whose transport is writable. Messages to slow subscribers
+// are kept in a per-subscriber bounded queue, where a message replaces any pending message for the same
+// topic and RPC (last value wins). If the queue is full, the oldest message is dropped.
+//
+
+namespace cz
+{
+namespace rpc
+{
+
+template<typename CON>
+class PubSub
+{
+public:
+	using Con = CON;
+	using Remote = typename CON::Remote;
+
+	// maxPending : Maximum number of messages queued per subscriber (after coalescing). 0 means no limit.
+	explicit PubSub(size_t maxPending = 256)
+		: m_maxPending(maxPending)
+		, m_topics(std::make_shared<const TopicMap>())
+	{
+	}
+
+	PubSub(const PubSub&) = delete;
+	PubSub& operator=(const PubSub&) = delete;
+
+	struct Stats
+	{
+		// Messages replaced by a more recent message for the same topic/rpc, before being sent
+		uint64_t coalesced = 0;
+		// Messages dropped because a subscriber queue was full
+		uint64_t dropped = 0;
+	};
+
+	// return: false if the connection was already subscribed to the topic
+	bool subscribe(const std::shared_ptr<CON>& con, const std::string& topic)
+	{
+		std::unique_lock<std::mutex> lk(m_mtx);
+		auto& sub = m_subscribers[con.get()];
+		if (!sub)
+			sub = std::make_shared<Subscriber>(con, m_maxPending);
+		if (std::find(sub->topics.begin(), sub->topics.end(), topic) != sub->topics.end())
+			return false;
+		sub->topics.push_back(topic);
+
+		auto topics = std::make_shared<TopicMap>(*std::atomic_load(&m_topics));
+		auto& subs = (*topics)[topic];
+		auto newSubs = subs ? std::make_shared<SubscriberList>(*subs) : std::make_shared<SubscriberList>();
+		newSubs->push_back(sub);
+		subs = std::move(newSubs);
+		std::atomic_store(&m_topics, std::shared_ptr<const TopicMap>(std::move(topics)));
+		return true;
+	}
+
+	// return: false if the connection was not subscribed to the topic
+	bool unsubscribe(const CON* con, const std::string& topic)
+	{
+		std::unique_lock<std::mutex> lk(m_mtx);
+		auto it = m_subscribers.find(con);
+		if (it == m_subscribers.end())
+			return false;
+		auto& topics = it->second->topics;
+		auto topicIt = std::find(topics.begin(), topics.end(), topic);
+		if (topicIt == topics.end())
+			return false;
+		topics.erase(topicIt);
+
+		auto sub = it->second;
+		if (topics.size() == 0)
+			removeSubscriber(it);
+		removeFromTopics(sub, std::vector<std::string>{topic});
+		return true;
+	}
+
+	// Unsubscribes the connection from all topics. Call this when the connection closes.
+	void unsubscribeAll(const CON* con)
+	{
+		std::unique_lock<std::mutex> lk(m_mtx);
+		auto it = m_subscribers.find(con);
+		if (it == m_subscribers.end())
+			return;
+		auto sub = it->second;
+		removeSubscriber(it);
+		removeFromTopics(sub, sub->topics);
+	}
+
+	size_t getSubscriberCount(const std::string& topic) const
+	{
+		auto topics = std::atomic_load(&m_topics);
+		auto it = topics->find(topic);
+		return it == topics->end() ? 0 : it->second->size();
+	}
+
+	Stats getStats() const
+	{
+		Stats stats;
+		std::unique_lock<std::mutex> lk(m_mtx);
+		stats.coalesced = m_removedStats.coalesced;
+		stats.dropped = m_removedStats.dropped;
+		for (auto&& s : m_subscribers)
+		{
+			stats.coalesced += s.second->coalesced.load();
+			stats.dropped += s.second->dropped.load();
+		}
+		return stats;
+	}
+
+	// Publishes a one-way RPC to all subscribers of the topic. Use CZRPC_PUBLISH instead of calling this directly.
+	// return: Number of subscribers the message was delivered or queued to
+	template<typename F, typename... Args>
+	size_t publish(const std::string& topic, uint32_t rpcid, Args&&... args)
+	{
+		static_assert(std::is_void<typename FunctionTraits<F>::return_type>::value,
+			"Only RPCs without a return value can be published");
+
+		auto topics = std::atomic_load(&m_topics);
+		auto it = topics->find(topic);
+		if (it == topics->end() || it->second->size() == 0)
+			return 0;
+
+		auto msg = std::make_shared<Message>();
+		msg->topic = topic;
+		msg->rpcid = rpcid;
+		msg->send = [call = SharedCall<F>(rpcid, std::forward<Args>(args)...)](CON& con)
+		{
+			call.send(con);
+		};
+
+		size_t count = 0;
+		for (auto&& sub : *it->second)
+		{
+			if (sub->deliver(msg))
+				count++;
+		}
+		return count;
+	}
+
+private:
+
+	struct Message
+	{
+		std::string topic;
+		uint32_t rpcid;
+		std::function<void(CON&)> send;
+	};
+
+	struct Subscriber : public std::enable_shared_from_this<Subscriber>
+	{
+		Subscriber(const std::shared_ptr<CON>& con, size_t maxPending)
+			: con(con)
+			, maxPending(maxPending)
+		{
+		}
+
+		bool deliver(const std::shared_ptr<const Message>& msg)
+		{
+			auto c = con.lock();
+			if (!c)
+				return false;
+
+			{
+				std::unique_lock<std::mutex> lk(mtx);
+				// If there are messages already queued, the new one needs to go through the queue too, to keep
+				// the ordering
+				if (pending.size() == 0 && c->transport->isWritable())
+				{
+					msg->send(*c);
+					return true;
+				}
+
+				for (auto&& p : pending)
+				{
+					if (p->rpcid == msg->rpcid && p->topic == msg->topic)
+					{
+						p = msg;
+						coalesced++;
+						return true;
+					}
+				}
+
+				if (maxPending && pending.size() >= maxPending)
+				{
+					pending.pop_front();
+					dropped++;
+				}
+				pending.push_back(msg);
+
+				if (waiting)
+					return true;
+				waiting = true;
+			}
+
+			waitWritable(*c);
+			return true;
+		}
+
+		// Sends as much of the pending messages as the transport allows.
+		// Called when the transport notifies it is writable. If it is not writable by now (e.g: closed, or
+		// someone else filled it meanwhile), all pending messages are sent anyway, so we don't keep waiting
+		// forever. The transport's overflow policy then decides what to do with them.
+		void flush()
+		{
+			auto c = con.lock();
+			{
+				std::unique_lock<std::mutex> lk(mtx);
+				waiting = false;
+				if (!c)
+				{
+					pending.clear();
+					return;
+				}
+
+				bool force = !c->transport->isWritable();
+				while (pending.size() && (force || c->transport->isWritable()))
+				{
+					auto msg = std::move(pending.front());
+					pending.pop_front();
+					msg->send(*c);
+				}
+
+				if (pending.size() == 0)
+					return;
+				waiting = true;
+			}
+
+			waitWritable(*c);
+		}
+
+		void waitWritable(CON& c)
+		{
+			// Not keeping the Subscriber alive, so it's not kept around by a transport that never drains
+			std::weak_ptr<Subscriber> weak = this->shared_from_this();
+			c.transport->waitWritable([weak]
+			{
+				if (auto sub = weak.lock())
+					sub->flush();
+			});
+		}
+
+		std::weak_ptr<CON> con;
+		size_t maxPending;
+		std::mutex mtx;
+		std::deque<std::shared_ptr<const Message>> pending;
+		bool waiting = false;
+		std::atomic<uint64_t> coalesced{ 0 };
+		std::atomic<uint64_t> dropped{ 0 };
+		// Topics this subscriber is subscribed to. Protected by PubSub::m_mtx
+		std::vector<std::string> topics;
+	};
+
+	using SubscriberList = std::vector<std::shared_ptr<Subscriber>>;
+	using TopicMap = std::unordered_map<std::string, std::shared_ptr<const SubscriberList>>;
+
+	// Must be called with m_mtx locked
+	void removeFromTopics(const std::shared_ptr<Subscriber>& sub, const std::vector<std::string>& names)
+	{
+		auto topics = std::make_shared<TopicMap>(*std::atomic_load(&m_topics));
+		for (auto&& name : names)
+		{
+			auto it = topics->find(name);
+			if (it == topics->end())
+				continue;
+			auto newSubs = std::make_shared<SubscriberList>(*it->second);
+			newSubs->erase(std::remove(newSubs->begin(), newSubs->end(), sub), newSubs->end());
+			if (newSubs->size())
+				it->second = std::move(newSubs);
+			else
+				topics->erase(it);
+		}
+		std::atomic_store(&m_topics, std::shared_ptr<const TopicMap>(std::move(topics)));
+	}
+
+	// Must be called with m_mtx locked
+	void removeSubscriber(typename std::unordered_map<const CON*, std::shared_ptr<Subscriber>>::iterator it)
+	{
+		m_removedStats.coalesced += it->second->coalesced.load();
+		m_removedStats.dropped += it->second->dropped.load();
+		m_subscribers.erase(it);
+	}
+
+	size_t m_maxPending;
+	// Protects changes to the subscriptions. Publishing doesn't need it.
+	mutable std::mutex m_mtx;
+	std::unordered_map<const CON*, std::shared_ptr<Subscriber>> m_subscribers;
+	// Stats from subscribers already removed
+	Stats m_removedStats;
+	// Current snapshot of the subscriptions. Only accessed with std::atomic_load/std::atomic_store
+	std::shared_ptr<const TopicMap> m_topics;
+};
+
+// Publishes a one-way RPC to all subscribers of a topic
+// Example:
+//		CZRPC_PUBLISH(pubsub, "chat", onMsg, "", "Hello");
+#define CZRPC_PUBLISH(pubsub, topic, func, ...)                                          \
+    (pubsub).publish<decltype(&std::decay<decltype(pubsub)>::type::Remote::func)>(       \
+        topic,                                                                           \
+        (uint32_t)cz::rpc::Table<std::decay<decltype(pubsub)>::type::Remote>::RPCId::func, \
+        ##__VA_ARGS__)
+
+} // namespace rpc
+} // namespace cz
+
@@ -0,0 +1,256 @@
+#pragma once
+
+namespace cz
+{
+namespace rpc
+{
+
+//
+// Snapshot of the stats of one RPC
+//
+struct RPCStatsSnapshot
+{
+	// Latencies are kept in log buckets. Bucket N holds latencies in the [2^N, 2^(N+1)) nanoseconds range, with
+	// the exception of bucket 0, which also holds 0.
+	static constexpr int kNumBuckets = 48;
+
+	uint64_t calls = 0;
+	uint64_t errors = 0;
+	// Size of the calls and replies, including headers
+	uint64_t callBytes = 0;
+	uint64_t replyBytes = 0;
+	// Sum of all latencies, in nanoseconds
+	uint64_t latencySum = 0;
+	std::array<uint64_t, kNumBuckets> latency = {};
+
+	void merge(const RPCStatsSnapshot& other)
+	{
+		calls += other.calls;
+		errors += other.errors;
+		callBytes += other.callBytes;
+		replyBytes += other.replyBytes;
+		latencySum += other.latencySum;
+		for (int i = 0; i < kNumBuckets; i++)
+			latency[i] += other.latency[i];
+	}
+
+	// Mean latency in nanoseconds
+	double getMeanLatency() const
+	{
+		uint64_t count = getLatencyCount();
+		return count ? static_cast<double>(latencySum) / count : 0;
+	}
+
+	// Latency in nanoseconds at the specified percentile (0 to 100).
+	// Since the buckets are logarithmic, this is the upper bound of the bucket where the percentile falls in.
+	uint64_t getPercentile(double percentile) const
+	{
+		uint64_t count = getLatencyCount();
+		if (count == 0)
+			return 0;
+		uint64_t target = static_cast<uint64_t>(percentile / 100.0 * count + 0.5);
+		target = target ? target : 1;
+		uint64_t acc = 0;
+		for (int i = 0; i < kNumBuckets; i++)
+		{
+			acc += latency[i];
+			if (acc >= target)
+				return (uint64_t(1) << (i + 1)) - 1;
+		}
+		return (uint64_t(1) << kNumBuckets) - 1;
+	}
+
+	uint64_t getLatencyCount() const
+	{
+		uint64_t count = 0;
+		for (auto&& c : latency)
+			count += c;
+		return count;
+	}
+
+	void write(Stream& s) const
+	{
+		s << calls << errors << callBytes << replyBytes << latencySum;
+		for (auto&& c : latency)
+			s << c;
+	}
+
+	bool read(Stream& s)
+	{
+		if (s.readSize() < static_cast<int>(sizeof(uint64_t) * (5 + kNumBuckets)))
+			return false;
+		s >> calls >> errors >> callBytes >> replyBytes >> latencySum;
+		for (auto&& c : latency)
+			s >> c;
+		return true;
+	}
+};
+
+//
+// Counters and latency histogram for one RPC.
+// Counters are sharded, and each thread updates its own shard (threads are assigned a shard the first time
+// they use one), so recording is lock free, and threads don't fight over the same cache lines.
+// Snapshots merge all the shards.
+//
+class RPCStats
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	RPCStats() {}
+	RPCStats(const RPCStats&) = delete;
+	RPCStats& operator=(const RPCStats&) = delete;
+
+	void record(bool success, uint64_t callBytes, uint64_t replyBytes, Clock::duration latency)
+	{
+		Shard& shard = m_shards[getShardIndex()];
+		shard.calls.fetch_add(1, std::memory_order_relaxed);
+		if (!success)
+			shard.errors.fetch_add(1, std::memory_order_relaxed);
+		shard.callBytes.fetch_add(callBytes, std::memory_order_relaxed);
+		shard.replyBytes.fetch_add(replyBytes, std::memory_order_relaxed);
+
+		auto ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count());
+		shard.latencySum.fetch_add(ns, std::memory_order_relaxed);
+		int bucket = 0;
+		while ((ns >>= 1) && bucket < RPCStatsSnapshot::kNumBuckets - 1)
+			bucket++;
+		shard.latency[bucket].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	RPCStatsSnapshot getSnapshot() const
+	{
+		RPCStatsSnapshot res;
+		for (auto&& shard : m_shards)
+		{
+			res.calls += shard.calls.load(std::memory_order_relaxed);
+			res.errors += shard.errors.load(std::memory_order_relaxed);
+			res.callBytes += shard.callBytes.load(std::memory_order_relaxed);
+			res.replyBytes += shard.replyBytes.load(std::memory_order_relaxed);
+			res.latencySum += shard.latencySum.load(std::memory_order_relaxed);
+			for (int i = 0; i < RPCStatsSnapshot::kNumBuckets; i++)
+				res.latency[i] += shard.latency[i].load(std::memory_order_relaxed);
+		}
+		return res;
+	}
+
+private:
+	static constexpr int kNumShards = 8;
+
+	struct alignas(64) Shard
+	{
+		Shard()
+		{
+			for (auto&& c : latency)
+				c.store(0, std::memory_order_relaxed);
+		}
+		std::atomic<uint64_t> calls{0};
+		std::atomic<uint64_t> errors{0};
+		std::atomic<uint64_t> callBytes{0};
+		std::atomic<uint64_t> replyBytes{0};
+		std::atomic<uint64_t> latencySum{0};
+		std::array<std::atomic<uint64_t>, RPCStatsSnapshot::kNumBuckets> latency;
+	};
+
+	static int getShardIndex()
+	{
+		static std::atomic<int> next(0);
+		static thread_local int index = next.fetch_add(1, std::memory_order_relaxed) % kNumShards;
+		return index;
+	}
+
+	Shard m_shards[kNumShards];
+};
+
+namespace details
+{
+	// Measures one call, from when the server starts processing it, or the client sends it, until the server
+	// sends the reply, or the client receives it.
+	// If CZRPC_STATS is 0, this is empty, and does nothing.
+	class CallStats
+	{
+	public:
+		CallStats() {}
+#if CZRPC_STATS
+		CallStats(RPCStats* stats, uint32_t callBytes)
+			: m_stats(stats)
+			, m_callBytes(callBytes)
+			, m_start(RPCStats::Clock::now())
+		{
+		}
+#else
+		CallStats(RPCStats*, uint32_t) {}
+#endif
+
+		void record(bool success, uint32_t replyBytes) const
+		{
+#if CZRPC_STATS
+			if (m_stats)
+				m_stats->record(success, m_callBytes, replyBytes, RPCStats::Clock::now() - m_start);
+#endif
+		}
+
+	private:
+#if CZRPC_STATS
+		RPCStats* m_stats = nullptr;
+		uint32_t m_callBytes = 0;
+		RPCStats::Clock::time_point m_start;
+#endif
+	};
+}
+
+struct RPCStatsEntry
+{
+	std::string name;
+	RPCStatsSnapshot stats;
+};
+
+//
+// Conversion to/from Any, as returned by the __stats control RPC
+//
+inline Any statsToAny(const std::vector<RPCStatsEntry>& entries)
+{
+	Stream s;
+	s << static_cast<int>(entries.size());
+	for (auto&& e : entries)
+	{
+		s << e.name;
+		e.stats.write(s);
+	}
+	std::vector<char> buf = s.extract();
+	return Any(std::vector<unsigned char>(buf.begin(), buf.end()));
+}
+
+inline bool statsFromAny(const Any& a, std::vector<RPCStatsEntry>& entries)
+{
+	std::vector<unsigned char> blob;
+	if (!a.getAs(blob))
+		return false;
+	Stream s(std::vector<char>(blob.begin(), blob.end()));
+	int count;
+	if (s.readSize() < static_cast<int>(sizeof(count)))
+		return false;
+	s >> count;
+	entries.clear();
+	for (int i = 0; i < count; i++)
+	{
+		RPCStatsEntry e;
+		int len;
+		if (s.readSize() < static_cast<int>(sizeof(len)))
+			return false;
+		s >> len;
+		if (len < 0 || s.readSize() < len)
+			return false;
+		e.name.resize(len);
+		if (len)
+			s.read(&e.name[0], len);
+		if (!e.stats.read(s))
+			return false;
+		entries.push_back(std::move(e));
+	}
+	return true;
+}
+
+} // namespace rpc
+} // namespace cz
+
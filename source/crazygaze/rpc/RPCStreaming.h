@@ -0,0 +1,1310 @@
+/************************************************************************
+Streaming RPCs.
+
+Server streams: An RPC returning ServerStream<T> sends its result as a
+sequence of frames under the same reply key, instead of one single reply,
+so neither side needs to hold the whole result in memory at once.
+Those reply frames start with a StreamFrame byte, followed by zero or more
+elements. Data frames are followed by more frames, and End finishes the
+stream. An error reply (success==false) also finishes it.
+
+Client streams: An RPC taking a StreamReader<T> as its last parameter
+gets the elements the caller writes after the call (see Call::upload), as
+stream frames with the same layout (see Header::isStreamFrame). The reply
+is a normal reply.
+
+Flow control is done with credit, counted in frames: The sender starts
+with kStreamWindow, spends one per Data frame, and the receiver gives it
+back as it consumes the elements, with stream frames. The sender of a
+server stream also pauses while its transport is not writable. Therefore
+memory use is bounded on both sides, regardless of the stream's size.
+************************************************************************/
+
+#pragma once
+
+namespace cz
+{
+namespace rpc
+{
+
+template<typename T> class StreamWriter;
+template<typename T> class StreamReader;
+
+namespace details
+{
+	enum class StreamFrame : uint8_t
+	{
+		// Elements, with more frames to follow
+		Data,
+		// Last elements (if any). The stream is finished
+		End,
+		// Sent by the receiver, to let the sender send more Data frames. Followed by the number of frames (uint32_t)
+		Credit,
+		// Sent by the receiver, to stop the stream early.
+		// The sender of a server stream finishes it with an empty End frame. Sent by the sender of a client stream,
+		// it finishes the stream with an error.
+		Cancel
+	};
+
+	// Data frames the sender can have in flight before it needs credit
+	static constexpr unsigned kStreamWindow = 8;
+	static constexpr int kDefaultStreamChunkSize = 32 * 1024;
+
+	// Sends a stream frame for the call with the specified header.
+	// "o" has the space for the header reserved, followed by the frame's contents.
+	// All the frames a side sends for a call need the same priority, since frames of different priorities can
+	// overtake each other. Within a priority, they arrive in the order they were sent, even if the transport splits
+	// some in chunks.
+	inline bool sendStreamFrame(Transport& trp, Header callHdr, Priority priority, Stream& o, bool fromCallee)
+	{
+		Header hdr;
+		hdr.bits.counter = callHdr.bits.counter;
+		hdr.bits.rpcid = callHdr.bits.rpcid;
+		hdr.bits.isReply = fromCallee;
+		hdr.bits.stream = true;
+		hdr.bits.size = o.writeSize();
+		*reinterpret_cast<Header*>(o.ptr(0)) = hdr;
+		return trp.send(o.extract(), priority);
+	}
+
+	inline bool sendStreamControl(Transport& trp, Header callHdr, Priority priority, StreamFrame kind,
+								  uint32_t credit, bool fromCallee)
+	{
+		Stream o;
+		o << Header(); // reserve space for the header
+		o << static_cast<uint8_t>(kind);
+		if (kind == StreamFrame::Credit)
+			o << credit;
+		return sendStreamFrame(trp, callHdr, priority, o, fromCallee);
+	}
+
+	// Answers a stream frame that has nowhere to go (e.g: the stream finished, or was never taken), so the sender
+	// doesn't wait for credit forever.
+	// Only Data frames are answered, so the two sides never keep answering each other.
+	inline void rejectStreamFrame(Transport& trp, Stream& in, Header hdr)
+	{
+		uint8_t kind;
+		in >> kind;
+		if (kind == static_cast<uint8_t>(StreamFrame::Data))
+			sendStreamControl(trp, hdr, Priority::Normal, StreamFrame::Cancel, 0, !hdr.bits.isReply);
+	}
+
+	// Where a StreamWriter puts the elements
+	template<typename T>
+	class StreamSink
+	{
+	public:
+		virtual ~StreamSink() {}
+		virtual bool write(const T& v) = 0;
+	};
+
+	template<typename R>
+	struct ServerStreamTraits
+	{
+		static constexpr bool value = false;
+	};
+
+	template<typename T> class ServerStreamState;
+	template<typename P> struct ClientStreamFactory;
+}
+
+//
+// Given to the producer of a ServerStream, to write the elements
+//
+template<typename T>
+class StreamWriter
+{
+public:
+	explicit StreamWriter(details::StreamSink<T>& sink)
+		: m_sink(sink)
+	{
+	}
+
+	// Writes one element.
+	// return: true if the producer can keep writing, or false if it should return, so it is called again once the
+	// caller consumes what was sent so far.
+	bool write(const T& v)
+	{
+		return m_sink.write(v);
+	}
+
+private:
+	details::StreamSink<T>& m_sink;
+};
+
+//
+// Return type of server streaming RPCs. E.g:
+//		ServerStream<std::string> getNames()
+//		{
+//			return ServerStream<std::string>::fromContainer(m_names);
+//		}
+//
+// The caller can consume the elements as they arrive (see Call::stream and Call::reader), or wait for all of them
+// like with any other call, in which case it gets a std::vector<T>.
+// Generic RPC calls get all the elements at once, as an Any::Array.
+//
+template<typename T>
+class ServerStream
+{
+public:
+	using value_type = T;
+	using Producer = std::function<bool(StreamWriter<T>&)>;
+
+	// The producer is called whenever the stream can take more elements. It should write elements until the writer
+	// tells it to stop, and return true if there are more to come, or false once it wrote the last one.
+	// It is called from whatever thread gives the stream room (the thread processing the connection, or the thread
+	// draining the transport), but never from two threads at the same time.
+	// Elements are sent in frames of about "chunkSize" bytes.
+	explicit ServerStream(Producer producer, int chunkSize = details::kDefaultStreamChunkSize)
+		: m_producer(std::move(producer))
+		, m_chunkSize(chunkSize)
+	{
+	}
+
+	// Streams the elements of a container, which the stream keeps until it finishes
+	template<typename C>
+	static ServerStream fromContainer(C c, int chunkSize = details::kDefaultStreamChunkSize)
+	{
+		auto data = std::make_shared<C>(std::move(c));
+		auto it = data->begin();
+		return ServerStream([data, it](StreamWriter<T>& w) mutable
+		{
+			while (it != data->end())
+			{
+				if (!w.write(*it++))
+					return it != data->end();
+			}
+			return false;
+		}, chunkSize);
+	}
+
+private:
+	template<typename U> friend class details::ServerStreamState;
+	template<bool ASYNC, typename R> friend struct details::Dispatcher;
+	Producer m_producer;
+	int m_chunkSize;
+};
+
+// Callers waiting for the whole stream get it as a vector
+template<typename T>
+struct ParamTraits<ServerStream<T>>
+{
+	using store_type = std::vector<T>;
+	static constexpr bool valid = ParamTraits<T>::valid;
+};
+
+namespace details
+{
+	template<typename T>
+	struct ServerStreamTraits<ServerStream<T>>
+	{
+		static constexpr bool value = true;
+		using value_type = T;
+	};
+
+	// Collects all the elements, for generic RPC calls
+	template<typename T>
+	class AnyStreamSink : public StreamSink<T>
+	{
+	public:
+		virtual bool write(const T& v) override
+		{
+			items.push_back(Any(v));
+			return true;
+		}
+		Any::Array items;
+	};
+
+	//
+	// Server side of a server stream.
+	// Runs the producer while there is credit and the transport is writable, and sends the elements.
+	//
+	template<typename T>
+	class ServerStreamState : public BaseStreamState,
+							  public StreamSink<T>,
+							  public std::enable_shared_from_this<ServerStreamState<T>>
+	{
+	public:
+		ServerStreamState(ServerStream<T>&& s, InProcessorData& owner, Transport& trp, Header hdr, Priority priority,
+						  const CallStats& stats)
+			: m_producer(std::move(s.m_producer))
+			, m_chunkSize(s.m_chunkSize)
+			, m_owner(&owner)
+			, m_trp(trp)
+			, m_hdr(hdr)
+			, m_priority(priority)
+			, m_stats(stats)
+		{
+			resetChunk();
+		}
+
+		void start()
+		{
+			m_owner->streams([&](InProcessorData::StreamMap& streams)
+			{
+				streams[m_hdr.key()] = this->shared_from_this();
+			});
+			pump();
+		}
+
+		virtual void onFrame(Stream& in) override
+		{
+			uint8_t kind;
+			in >> kind;
+			if (kind == static_cast<uint8_t>(StreamFrame::Credit))
+			{
+				uint32_t credit;
+				in >> credit;
+				m_credit.fetch_add(static_cast<int>(credit));
+			}
+			else if (kind == static_cast<uint8_t>(StreamFrame::Cancel))
+			{
+				m_stop = true;
+			}
+			pump();
+		}
+
+		virtual void cancel() override
+		{
+			std::unique_lock<std::mutex> lk(m_runMtx);
+			m_finished = true;
+			m_producer = nullptr;
+		}
+
+		virtual bool write(const T& v) override
+		{
+			m_chunk << v;
+			m_chunkItems++;
+			if (m_chunk.writeSize() >= m_chunkSize)
+				flush(StreamFrame::Data);
+			return canWrite();
+		}
+
+	private:
+
+		bool canWrite() const
+		{
+			return !m_stop && m_credit.load() > 0 && m_trp.isWritable();
+		}
+
+		// Only one thread runs the producer at a time. Anyone calling this meanwhile just makes that thread run
+		// it again, so no thread ever waits for another one here (e.g: the thread draining the transport).
+		void pump()
+		{
+			{
+				std::unique_lock<std::mutex> lk(m_pumpMtx);
+				if (m_pumping)
+				{
+					m_repump = true;
+					return;
+				}
+				m_pumping = true;
+			}
+
+			while (true)
+			{
+				run();
+				std::unique_lock<std::mutex> lk(m_pumpMtx);
+				if (!m_repump)
+				{
+					m_pumping = false;
+					return;
+				}
+				m_repump = false;
+			}
+		}
+
+		void run()
+		{
+			std::unique_lock<std::mutex> lk(m_runMtx);
+			if (m_finished)
+				return;
+
+			StreamWriter<T> writer(*this);
+			while (canWrite())
+			{
+				bool more;
+#if CZRPC_CATCH_EXCEPTIONS
+				try {
+#endif
+					CZRPC_TRACE_SCOPE("handler", m_hdr.bits.rpcid, m_hdr.bits.counter);
+					more = m_producer(writer);
+#if CZRPC_CATCH_EXCEPTIONS
+				}
+				catch (std::exception& e)
+				{
+					Send::error(m_trp, m_hdr, m_priority, e.what(), m_stats);
+					finish();
+					return;
+				}
+#endif
+				if (!more)
+				{
+					flush(StreamFrame::End);
+					m_stats.record(!m_sendFailed, static_cast<uint32_t>(m_bytes));
+					finish();
+					return;
+				}
+			}
+
+			if (m_stop)
+			{
+				// Cancelled by the caller, or the transport refused a frame
+				resetChunk();
+				flush(StreamFrame::End);
+				m_stats.record(!m_sendFailed, static_cast<uint32_t>(m_bytes));
+				finish();
+				return;
+			}
+
+			// Paused. What was written so far goes out if there is credit for it, instead of waiting for a full frame
+			if (m_chunkItems && m_credit.load() > 0)
+				flush(StreamFrame::Data);
+
+			// If there is no credit, the caller's next credit frame resumes it
+			if (!m_trp.isWritable() && !m_waitingWritable.exchange(true))
+			{
+				m_trp.waitWritable([this_ = this->shared_from_this()]
+				{
+					this_->m_waitingWritable = false;
+					this_->pump();
+				});
+			}
+		}
+
+		void flush(StreamFrame kind)
+		{
+			*reinterpret_cast<uint8_t*>(m_chunk.ptr(sizeof(Header))) = static_cast<uint8_t>(kind);
+			m_bytes += m_chunk.writeSize();
+			if (kind == StreamFrame::Data)
+				m_credit.fetch_sub(1);
+			if (!Send::result(m_trp, m_hdr, m_priority, m_chunk))
+			{
+				m_sendFailed = true;
+				m_stop = true;
+			}
+			resetChunk();
+		}
+
+		void resetChunk()
+		{
+			m_chunk.clear();
+			m_chunk << Header(); // reserve space for the header
+			m_chunk << static_cast<uint8_t>(StreamFrame::Data);
+			m_chunkItems = 0;
+		}
+
+		void finish()
+		{
+			m_finished = true;
+			m_producer = nullptr;
+			m_owner->streams([&](InProcessorData::StreamMap& streams)
+			{
+				streams.erase(m_hdr.key());
+			});
+		}
+
+		typename ServerStream<T>::Producer m_producer;
+		int m_chunkSize;
+		InProcessorData* m_owner;
+		Transport& m_trp;
+		Header m_hdr;
+		Priority m_priority;
+		CallStats m_stats;
+
+		std::atomic<int> m_credit{static_cast<int>(kStreamWindow)};
+		// Set when the caller cancels the stream, or if a frame can't be sent
+		std::atomic<bool> m_stop{false};
+		std::atomic<bool> m_waitingWritable{false};
+
+		std::mutex m_pumpMtx;
+		bool m_pumping = false;
+		bool m_repump = false;
+
+		// Held while running the producer, so cancel can wait for it
+		std::mutex m_runMtx;
+		bool m_finished = false;
+		bool m_sendFailed = false;
+		Stream m_chunk;
+		int m_chunkItems = 0;
+		uint64_t m_bytes = 0;
+	};
+
+	// For functions returning ServerStream<T>
+	template <typename T>
+	struct Dispatcher<false, ServerStream<T>>
+	{
+		template <typename OBJ, typename F, typename P>
+		static void impl(OBJ& obj, F f, P&& params, InProcessorData& out, Transport& trp, Header hdr,
+						 Priority priority, const CallStats& stats)
+		{
+#if CZRPC_CATCH_EXCEPTIONS
+			try {
+#endif
+				ServerStream<T> s = callMethod(obj, f, std::move(params));
+				if (hdr.isGenericRPC())
+				{
+					// Generic calls get everything at once
+					AnyStreamSink<T> sink;
+					StreamWriter<T> writer(sink);
+					{
+						CZRPC_TRACE_SCOPE("handler", hdr.bits.rpcid, hdr.bits.counter);
+						while (s.m_producer(writer))
+						{
+						}
+					}
+					Stream o;
+					o << hdr; // reserve space for the header
+					o << Any(std::move(sink.items));
+					Send::result(trp, hdr, priority, o, stats);
+				}
+				else
+				{
+					std::make_shared<ServerStreamState<T>>(std::move(s), out, trp, hdr, priority, stats)->start();
+				}
+#if CZRPC_CATCH_EXCEPTIONS
+			}
+			catch (std::exception& e)
+			{
+				Send::error(trp, hdr, priority, e.what(), stats);
+			}
+#endif
+		}
+	};
+
+	//
+	// Receiving side of a stream (the caller for server streams, or the callee for client streams).
+	// Gets the frames, and gives credit back to the sender as the elements are consumed.
+	//
+	template<typename T>
+	class StreamConsumer
+	{
+	public:
+		virtual ~StreamConsumer() {}
+
+		// priority : Of the frames this side sends for the call
+		// isCallee : true if this is the callee's side (a client stream)
+		void setCall(Transport& trp, Header hdr, Priority priority, bool isCallee = false)
+		{
+			m_trp = &trp;
+			m_hdr = hdr;
+			m_priority = priority;
+			m_isCallee = isCallee;
+		}
+
+		// Stops sending anything to the sender, since the transport is going away
+		void detach()
+		{
+			std::unique_lock<std::mutex> lk(m_trpMtx);
+			m_trp = nullptr;
+		}
+
+		// Handles one reply frame, or the call being aborted if "in" is nullptr
+		// return: true once the stream finished
+		bool onReply(Stream* in, Header hdr)
+		{
+			if (!in)
+			{
+				finish(Result<void>());
+				return true;
+			}
+
+			if (!hdr.bits.success)
+			{
+				std::string str;
+				(*in) >> str;
+				finish(Result<void>::fromException(std::move(str)));
+				return true;
+			}
+
+			return onFrame(*in);
+		}
+
+		// Handles one frame with elements
+		// return: true once the stream finished
+		bool onFrame(Stream& in)
+		{
+			uint8_t kind;
+			in >> kind;
+			return onFrame(kind, in);
+		}
+
+		// Same as above, for when the frame type was already read
+		bool onFrame(uint8_t kind, Stream& in)
+		{
+			if (kind == static_cast<uint8_t>(StreamFrame::Cancel))
+			{
+				finish(Result<void>::fromException("Stream cancelled by the sender"));
+				return true;
+			}
+
+			std::vector<T> items;
+			while (in.readSize())
+			{
+				T v;
+				in >> v;
+				items.push_back(std::move(v));
+			}
+
+			bool end = kind == static_cast<uint8_t>(StreamFrame::End);
+			onItems(std::move(items), !end);
+			if (end)
+				finish(Result<void>::fromStream(in));
+			return end;
+		}
+
+		// Finishes the stream without the sender's involvement (e.g: the transport is going away)
+		void fail(Result<void>&& res)
+		{
+			finish(std::move(res));
+		}
+
+	protected:
+		// If "credit" is true, the frame counts against the window, and "consumed" needs to be called once the
+		// elements are consumed
+		virtual void onItems(std::vector<T>&& items, bool credit) = 0;
+		virtual void onDone(Result<void>&& res) = 0;
+
+		// Gives credit back to the sender for one frame.
+		// Batched, so there is only one credit frame per half window.
+		void consumed()
+		{
+			if (m_consumed.fetch_add(1) + 1 < kStreamWindow / 2)
+				return;
+			uint32_t credit = m_consumed.exchange(0);
+			if (credit)
+				sendControl(StreamFrame::Credit, credit);
+		}
+
+		void cancelStream()
+		{
+			sendControl(StreamFrame::Cancel, 0);
+		}
+
+	private:
+		void finish(Result<void>&& res)
+		{
+			m_finished = true;
+			onDone(std::move(res));
+		}
+
+		void sendControl(StreamFrame kind, uint32_t credit)
+		{
+			// Once the stream is finished, the sender is not listening anymore
+			if (m_finished)
+				return;
+			std::unique_lock<std::mutex> lk(m_trpMtx);
+			if (m_trp)
+				sendStreamControl(*m_trp, m_hdr, m_priority, kind, credit, m_isCallee);
+		}
+
+		std::mutex m_trpMtx;
+		Transport* m_trp = nullptr;
+		Header m_hdr;
+		Priority m_priority = Priority::Normal;
+		bool m_isCallee = false;
+		std::atomic<bool> m_finished{false};
+		std::atomic<uint32_t> m_consumed{0};
+	};
+
+	// Calls a handler per element as they arrive
+	template<typename T, typename I, typename D>
+	class CallbackStreamConsumer : public StreamConsumer<T>
+	{
+	public:
+		CallbackStreamConsumer(I onItem, D onDone)
+			: m_onItem(std::move(onItem))
+			, m_onDone(std::move(onDone))
+		{
+		}
+
+	protected:
+		virtual void onItems(std::vector<T>&& items, bool credit) override
+		{
+			for (auto&& v : items)
+				m_onItem(std::move(v));
+			if (credit)
+				this->consumed();
+		}
+
+		virtual void onDone(Result<void>&& res) override
+		{
+			m_onDone(std::move(res));
+		}
+
+	private:
+		I m_onItem;
+		D m_onDone;
+	};
+
+	// Collects all the elements, for callers waiting for the whole stream (e.g: Call::async)
+	template<typename T, typename H>
+	class CollectStreamConsumer : public StreamConsumer<T>
+	{
+	public:
+		explicit CollectStreamConsumer(H handler)
+			: m_handler(std::move(handler))
+		{
+		}
+
+	protected:
+		virtual void onItems(std::vector<T>&& items, bool credit) override
+		{
+			if (m_items.empty())
+				m_items = std::move(items);
+			else
+				m_items.insert(m_items.end(), std::make_move_iterator(items.begin()),
+							   std::make_move_iterator(items.end()));
+			if (credit)
+				this->consumed();
+		}
+
+		virtual void onDone(Result<void>&& res) override
+		{
+			if (res.isValid())
+				m_handler(Result<std::vector<T>>(std::move(m_items)));
+			else if (res.isException())
+				m_handler(Result<std::vector<T>>::fromException(res.getException()));
+			else
+				m_handler(Result<std::vector<T>>());
+		}
+
+	private:
+		H m_handler;
+		std::vector<T> m_items;
+	};
+
+	// Keeps the elements until the reader pulls them (see StreamReader)
+	template<typename T>
+	class StreamReaderState : public StreamConsumer<T>
+	{
+	public:
+		bool next(T& dst)
+		{
+			std::unique_lock<std::mutex> lk(m_mtx);
+			m_cv.wait(lk, [this] { return m_chunks.size() || m_done; });
+			return take(lk, dst);
+		}
+
+		bool isReady()
+		{
+			std::unique_lock<std::mutex> lk(m_mtx);
+			return m_chunks.size() || m_done;
+		}
+
+		void cancel()
+		{
+			{
+				std::unique_lock<std::mutex> lk(m_mtx);
+				if (m_done || m_cancelled)
+					return;
+				m_cancelled = true;
+				m_chunks.clear();
+			}
+			this->cancelStream();
+		}
+
+#if CZRPC_COROUTINES
+		// return: false if the coroutine doesn't need to suspend, because something arrived meanwhile
+		bool suspend(std::coroutine_handle<> h)
+		{
+			std::unique_lock<std::mutex> lk(m_mtx);
+			if (m_chunks.size() || m_done)
+				return false;
+			m_waiter = h;
+			return true;
+		}
+
+		bool tryNext(T& dst)
+		{
+			std::unique_lock<std::mutex> lk(m_mtx);
+			return take(lk, dst);
+		}
+#endif
+
+	protected:
+		virtual void onItems(std::vector<T>&& items, bool credit) override
+		{
+			{
+				std::unique_lock<std::mutex> lk(m_mtx);
+				// Once cancelled, the server only sends what was already in flight
+				if (m_cancelled)
+					return;
+				if (items.size())
+				{
+					m_chunks.emplace_back();
+					m_chunks.back().items = std::move(items);
+					m_chunks.back().credit = credit;
+					credit = false;
+				}
+			}
+			// Nothing to consume
+			if (credit)
+				this->consumed();
+			wakeUp();
+		}
+
+		virtual void onDone(Result<void>&& res) override
+		{
+			{
+				std::unique_lock<std::mutex> lk(m_mtx);
+				if (m_done)
+					return;
+				m_res = std::move(res);
+				m_done = true;
+			}
+			wakeUp();
+		}
+
+	private:
+		struct Chunk
+		{
+			std::vector<T> items;
+			size_t pos = 0;
+			bool credit = false;
+		};
+
+		// Takes the next element, or throws if the stream failed.
+		// return: false if the stream finished
+		bool take(std::unique_lock<std::mutex>& lk, T& dst)
+		{
+			if (m_chunks.empty())
+			{
+				assert(m_done);
+				m_res.get();
+				return false;
+			}
+
+			Chunk& c = m_chunks.front();
+			dst = std::move(c.items[c.pos++]);
+			if (c.pos == c.items.size())
+			{
+				bool credit = c.credit;
+				m_chunks.pop_front();
+				if (credit)
+				{
+					// Sending credit can block, so it's done outside the lock
+					lk.unlock();
+					this->consumed();
+				}
+			}
+			return true;
+		}
+
+		void wakeUp()
+		{
+			m_cv.notify_all();
+#if CZRPC_COROUTINES
+			std::coroutine_handle<> h;
+			{
+				std::unique_lock<std::mutex> lk(m_mtx);
+				h = m_waiter;
+				m_waiter = nullptr;
+			}
+			if (h)
+				h.resume();
+#endif
+		}
+
+		std::mutex m_mtx;
+		std::condition_variable m_cv;
+		std::deque<Chunk> m_chunks;
+		Result<void> m_res;
+		bool m_done = false;
+		bool m_cancelled = false;
+#if CZRPC_COROUTINES
+		std::coroutine_handle<> m_waiter;
+#endif
+	};
+
+#if CZRPC_COROUTINES
+	template<typename T>
+	class StreamReadAwaiter
+	{
+	public:
+		explicit StreamReadAwaiter(std::shared_ptr<StreamReaderState<T>> st)
+			: m_st(std::move(st))
+		{
+		}
+
+		bool await_ready()
+		{
+			return m_st->isReady();
+		}
+
+		bool await_suspend(std::coroutine_handle<> h)
+		{
+			return m_st->suspend(h);
+		}
+
+		std::optional<T> await_resume()
+		{
+			T v;
+			if (m_st->tryNext(v))
+				return std::optional<T>(std::move(v));
+			return std::nullopt;
+		}
+
+	private:
+		std::shared_ptr<StreamReaderState<T>> m_st;
+	};
+#endif
+}
+
+//
+// Pulls the elements of a stream at its own pace. Either the caller's side of a server stream (see Call::reader), or
+// the last parameter of an RPC taking a client stream (see Call::upload).
+// The sender only sends more once the elements already received are consumed, so a slow reader slows down the
+// sender, instead of piling up elements.
+// Destroying the reader before the stream finishes cancels the stream.
+// It must not outlive the connection it was created from.
+//
+template<typename T>
+class StreamReader
+{
+public:
+	using value_type = T;
+
+	StreamReader() {}
+	StreamReader(StreamReader&& other) = default;
+	StreamReader& operator=(StreamReader&& other)
+	{
+		if (this == &other)
+			return *this;
+		if (m_st)
+			m_st->cancel();
+		m_st = std::move(other.m_st);
+		return *this;
+	}
+
+	StreamReader(const StreamReader&) = delete;
+	StreamReader& operator=(const StreamReader&) = delete;
+
+	~StreamReader()
+	{
+		if (m_st)
+			m_st->cancel();
+	}
+
+	// Blocks until the next element arrives.
+	// Should not be called from the thread that processes the connection. Therefore RPCs taking a client stream
+	// need to read it from another thread (e.g: returning a std::future), or from a coroutine with nextAsync.
+	// return: true with the element in "dst", or false once the stream finished.
+	// Throws cz::rpc::Exception if the stream failed or was aborted.
+	bool next(T& dst)
+	{
+		return m_st->next(dst);
+	}
+
+#if CZRPC_COROUTINES
+	// Same as "next", but awaitable. The coroutine is resumed with the next element, or an empty optional once the
+	// stream finished, in whatever thread processes the connection. E.g:
+	//		while (auto name = co_await reader.nextAsync())
+	//			printf("%s\n", name->c_str());
+	details::StreamReadAwaiter<T> nextAsync()
+	{
+		return details::StreamReadAwaiter<T>(m_st);
+	}
+#endif
+
+private:
+	template<typename F> friend class Call;
+	template<typename P> friend struct details::ClientStreamFactory;
+	explicit StreamReader(std::shared_ptr<details::StreamReaderState<T>> st)
+		: m_st(std::move(st))
+	{
+	}
+	std::shared_ptr<details::StreamReaderState<T>> m_st;
+};
+
+// Only valid as the last parameter of an RPC. Nothing is serialized with the call, since the elements follow it
+// as stream frames.
+template<typename T>
+struct ParamTraits<StreamReader<T>>
+{
+	using store_type = StreamReader<T>;
+	static constexpr bool valid = ParamTraits<T>::valid;
+
+	template<typename S>
+	static void write(S&, const StreamReader<T>&)
+	{
+	}
+
+	template<typename S>
+	static void read(S&, StreamReader<T>&)
+	{
+	}
+
+	static StreamReader<T>&& get(StreamReader<T>&& v) { return std::move(v); }
+};
+
+namespace details
+{
+	template<typename T>
+	struct IsClientStream<StreamReader<T>>
+	{
+		static constexpr bool value = true;
+	};
+
+	//
+	// Callee side of a client stream.
+	// Feeds the stream frames from the caller to the RPC's StreamReader parameter.
+	//
+	template<typename T>
+	class ClientStreamState : public BaseStreamState
+	{
+	public:
+		ClientStreamState(InProcessorData& owner, Transport& trp, Header hdr, Priority priority)
+			: m_owner(owner)
+			, m_hdr(hdr)
+			, m_reader(std::make_shared<StreamReaderState<T>>())
+		{
+			m_reader->setCall(trp, hdr, priority, true);
+		}
+
+		const std::shared_ptr<StreamReaderState<T>>& getReader() const
+		{
+			return m_reader;
+		}
+
+		virtual void onFrame(Stream& in) override
+		{
+			if (!m_reader->onFrame(in))
+				return;
+			m_owner.streams([&](InProcessorData::StreamMap& streams)
+			{
+				streams.erase(m_hdr.key());
+			});
+		}
+
+		virtual void cancel() override
+		{
+			m_reader->detach();
+			m_reader->fail(Result<void>());
+		}
+
+	private:
+		InProcessorData& m_owner;
+		Header m_hdr;
+		std::shared_ptr<StreamReaderState<T>> m_reader;
+	};
+
+	// Creates the callee's side of a client stream parameter. Specialized for each type IsClientStream accepts.
+	template<typename T>
+	struct ClientStreamFactory<StreamReader<T>>
+	{
+		static void create(StreamReader<T>& dst, InProcessorData& out, Transport& trp, Header hdr, Priority priority)
+		{
+			auto st = std::make_shared<ClientStreamState<T>>(out, trp, hdr, priority);
+			out.streams([&](InProcessorData::StreamMap& streams)
+			{
+				streams[hdr.key()] = st;
+			});
+			dst = StreamReader<T>(st->getReader());
+		}
+	};
+
+	template<>
+	struct ClientStreamSetup<true>
+	{
+		template<typename P>
+		static void setup(P& params, InProcessorData& out, Transport& trp, Header hdr, Priority priority)
+		{
+			auto& dst = std::get<std::tuple_size<P>::value - 1>(params);
+			ClientStreamFactory<typename std::decay<decltype(dst)>::type>::create(dst, out, trp, hdr, priority);
+		}
+	};
+
+	//
+	// Sending side of a stream, other than server streams (client streams, and both directions of a channel).
+	// Puts the elements in frames of about chunkSize bytes, and sends a frame whenever the receiver gave credit for
+	// it, so "write" blocks if the receiver is not keeping up.
+	// Only one thread at a time should write to it.
+	//
+	template<typename T>
+	class StreamSender
+	{
+	public:
+		explicit StreamSender(int chunkSize)
+			: m_chunkSize(chunkSize)
+		{
+			resetChunk();
+		}
+
+		// isCallee : true if this is the callee's side
+		void setCall(Transport& trp, Header hdr, Priority priority, bool isCallee)
+		{
+			m_trp = &trp;
+			m_hdr = hdr;
+			m_priority = priority;
+			m_isCallee = isCallee;
+		}
+
+		bool write(const T& v)
+		{
+			m_chunk << v;
+			m_chunkItems++;
+			if (m_chunk.writeSize() >= m_chunkSize)
+				return send(StreamFrame::Data);
+			return !isClosed();
+		}
+
+		bool flush()
+		{
+			if (m_chunkItems == 0)
+				return !isClosed();
+			return send(StreamFrame::Data);
+		}
+
+		bool isWritable()
+		{
+			std::unique_lock<std::mutex> lk(m_mtx);
+			return !m_closed && m_credit > 0;
+		}
+
+		bool isClosed()
+		{
+			std::unique_lock<std::mutex> lk(m_mtx);
+			return m_closed;
+		}
+
+		// Sends the last elements. The receiver gets no more frames from this sender.
+		bool end()
+		{
+			return send(StreamFrame::End);
+		}
+
+		void addCredit(uint32_t credit)
+		{
+			{
+				std::unique_lock<std::mutex> lk(m_mtx);
+				m_credit += static_cast<int>(credit);
+			}
+			m_cv.notify_all();
+		}
+
+		// Stops accepting elements, and wakes up any writer waiting for credit. If "notify" is true, the receiver is
+		// told to drop the stream, with a Cancel frame.
+		// return: false if it was already closed
+		bool close(bool notify)
+		{
+			{
+				std::unique_lock<std::mutex> lk(m_mtx);
+				if (m_closed)
+					return false;
+				m_closed = true;
+			}
+			m_cv.notify_all();
+			if (notify)
+				sendControl(StreamFrame::Cancel);
+			return true;
+		}
+
+		// Sends a control frame to the receiver, if the transport is still there
+		void sendControl(StreamFrame kind)
+		{
+			std::unique_lock<std::mutex> lk(m_trpMtx);
+			if (m_trp)
+				sendStreamControl(*m_trp, m_hdr, m_priority, kind, 0, m_isCallee);
+		}
+
+		// Closes it, and stops using the transport, since it's going away
+		void detach()
+		{
+			close(false);
+			std::unique_lock<std::mutex> lk(m_trpMtx);
+			m_trp = nullptr;
+		}
+
+	private:
+		// Sends the current chunk. Data frames wait for credit.
+		// End, or Cancel (see "close") are the last frame the receiver gets.
+		bool send(StreamFrame kind)
+		{
+			{
+				std::unique_lock<std::mutex> lk(m_mtx);
+				if (kind == StreamFrame::Data)
+					m_cv.wait(lk, [this] { return m_closed || m_credit > 0; });
+				if (m_closed)
+				{
+					resetChunk();
+					return false;
+				}
+				if (kind == StreamFrame::Data)
+					m_credit--;
+				else
+					m_closed = true;
+			}
+
+			*reinterpret_cast<uint8_t*>(m_chunk.ptr(sizeof(Header))) = static_cast<uint8_t>(kind);
+			bool ok = false;
+			{
+				std::unique_lock<std::mutex> lk(m_trpMtx);
+				if (m_trp)
+					ok = sendStreamFrame(*m_trp, m_hdr, m_priority, m_chunk, m_isCallee);
+			}
+			resetChunk();
+			return ok;
+		}
+
+		void resetChunk()
+		{
+			m_chunk.clear();
+			m_chunk << Header(); // reserve space for the header
+			m_chunk << static_cast<uint8_t>(StreamFrame::Data);
+			m_chunkItems = 0;
+		}
+
+		int m_chunkSize;
+		Header m_hdr;
+		Priority m_priority = Priority::Normal;
+		bool m_isCallee = false;
+
+		// Only used by the thread writing the elements
+		Stream m_chunk;
+		int m_chunkItems = 0;
+
+		std::mutex m_mtx;
+		std::condition_variable m_cv;
+		int m_credit = static_cast<int>(kStreamWindow);
+		// Set once the receiver can't get any more frames
+		bool m_closed = false;
+
+		std::mutex m_trpMtx;
+		Transport* m_trp = nullptr;
+	};
+
+	//
+	// Caller side of a client stream (see StreamUpload)
+	//
+	template<typename T, typename R>
+	class UploadState : public BaseStreamState
+	{
+	public:
+		explicit UploadState(int chunkSize)
+			: UploadState(chunkSize, Future<Result<R>>::create())
+		{
+		}
+
+		StreamSender<T>& sender()
+		{
+			return m_sender;
+		}
+
+		Future<Result<R>> finish()
+		{
+			m_sender.end();
+			return std::move(m_future);
+		}
+
+		virtual void onFrame(Stream& in) override
+		{
+			uint8_t kind;
+			in >> kind;
+			if (kind == static_cast<uint8_t>(StreamFrame::Credit))
+			{
+				uint32_t credit;
+				in >> credit;
+				m_sender.addCredit(credit);
+			}
+			else if (kind == static_cast<uint8_t>(StreamFrame::Cancel))
+			{
+				// The callee doesn't want more. Answering with a Cancel of our own lets it drop its side.
+				m_sender.close(true);
+			}
+		}
+
+		virtual void cancel() override
+		{
+			m_sender.detach();
+		}
+
+		void onResult(Result<R>&& res)
+		{
+			// The callee might reply before reading everything
+			m_sender.close(!res.isAborted());
+			m_promise.setValue(std::move(res));
+		}
+
+	private:
+		UploadState(int chunkSize, std::pair<Future<Result<R>>, Promise<Result<R>>>&& ft)
+			: m_sender(chunkSize)
+			, m_future(std::move(ft.first))
+			, m_promise(std::move(ft.second))
+		{
+		}
+
+		StreamSender<T> m_sender;
+		Future<Result<R>> m_future;
+		Promise<Result<R>> m_promise;
+	};
+}
+
+//
+// Writes the elements of a client stream (see Call::upload).
+// Elements are sent in frames, and a frame is only sent once the callee gave credit for it, so "write" blocks if
+// the callee is not keeping up. Therefore it should not be called from the thread that processes the connection.
+// Destroying the upload before calling "finish" cancels it.
+// It must not outlive the connection it was created from.
+//
+template<typename T, typename R>
+class StreamUpload
+{
+public:
+	StreamUpload(StreamUpload&& other) = default;
+	StreamUpload& operator=(StreamUpload&& other)
+	{
+		if (this == &other)
+			return *this;
+		if (m_st)
+			m_st->sender().close(true);
+		m_st = std::move(other.m_st);
+		return *this;
+	}
+
+	StreamUpload(const StreamUpload&) = delete;
+	StreamUpload& operator=(const StreamUpload&) = delete;
+
+	~StreamUpload()
+	{
+		if (m_st)
+			m_st->sender().close(true);
+	}
+
+	// return: false if the upload can't continue (e.g: the callee replied or cancelled, or the connection is
+	// lost). The reason is in the call's result (see "finish").
+	bool write(const T& v)
+	{
+		return m_st->sender().write(v);
+	}
+
+	// Sends what was written so far, without waiting for a full frame
+	bool flush()
+	{
+		return m_st->sender().flush();
+	}
+
+	// return: true if a frame can be sent right away, without waiting for credit
+	bool isWritable()
+	{
+		return m_st->sender().isWritable();
+	}
+
+	// Sends the last elements, and returns the call's result
+	Future<Result<R>> finish()
+	{
+		return m_st->finish();
+	}
+
+private:
+	template<typename F> friend class Call;
+	explicit StreamUpload(std::shared_ptr<details::UploadState<T, R>> st)
+		: m_st(std::move(st))
+	{
+	}
+	std::shared_ptr<details::UploadState<T, R>> m_st;
+};
+
+} // namespace rpc
+} // namespace cz
+
@@ -12,7 +12,7 @@ struct Header
 	{
 		kSizeBits = 32,
 		kRPCIdBits = 8,
-		kCounterBits = 22,
+		kCounterBits = 21,
 	};
 	explicit Header()
 	{
@@ -27,10 +27,17 @@ struct Header
 		unsigned rpcid : kRPCIdBits;
 		unsigned isReply : 1;  // Is it a reply to a RPC call ?
 		unsigned success : 1;  // Was the RPC call a success ?
+		unsigned stream : 1;   // Is it a stream frame ? (see isStreamFrame)
 	};
 
 	uint32_t key() const { return (bits.counter << kRPCIdBits) | bits.rpcid; }
 	bool isGenericRPC() const { return bits.rpcid == 0; }
+	// Property change pushed by the peer (see __watchProperty).
+	// Pushes are sent as replies with counter 0, since calls never use that counter.
+	bool isPush() const { return bits.isReply && bits.counter == 0; }
+	// Frame of a streaming call, other than the call itself and its replies (e.g: credit, or the elements of a
+	// client stream). Sent by the caller if isReply is false, or by the callee otherwise (see RPCStreaming.h)
+	bool isStreamFrame() const { return bits.stream != 0; }
 
 	union {
 		Bits bits;
@@ -50,6 +57,22 @@ inline Stream& operator>>(Stream& s, Header& v)
 	return s;
 }
 
+class BaseTable;
+
+namespace details
+{
+	// Server side state of a streaming call (see RPCStreaming.h)
+	class BaseStreamState
+	{
+	public:
+		virtual ~BaseStreamState() {}
+		// Stream frame sent by the caller (see Header::isStreamFrame)
+		virtual void onFrame(Stream& in) = 0;
+		// The connection is going away. Once this returns, nothing else is sent, and the RPC's object is not used
+		virtual void cancel() = 0;
+	};
+}
+
 struct InProcessorData
 {
 	InProcessorData(void* owner)
@@ -57,15 +80,47 @@ struct InProcessorData
 	{
 	}
 
-	struct PendingFutures
-	{
-		unsigned counter = 0;
-		std::unordered_map<unsigned, std::future<void>> futures;
-		std::vector<std::future<void>> done;
-	};
-	Monitor<PendingFutures> pending;
 	ObjectData objData;
 	bool authPassed = false;
+	// Table of the object being served, so control RPCs can have access to it
+	const BaseTable* table = nullptr;
+	// Transport the control RPC being processed came from
+	Transport* transport = nullptr;
+	// Cleared when this is destroyed, so RPCs returning std::future or coroutines that finish afterwards don't try
+	// to send the reply
+	std::shared_ptr<Monitor<bool>> alive = std::make_shared<Monitor<bool>>(true);
+	// Transport to push the changes of watched properties to (see __watchProperty).
+	// Cleared when this is destroyed, since properties can change from any thread.
+	std::shared_ptr<Monitor<Transport*>> watchTransport;
+	// Registered with objData for all the properties this connection watches
+	std::shared_ptr<ObjectData::WatchHandler> watchHandler;
+	// Streaming calls still running, by call key, so the caller's stream frames can reach them
+	using StreamMap = std::unordered_map<uint32_t, std::shared_ptr<details::BaseStreamState>>;
+	Monitor<StreamMap> streams;
+
+	~InProcessorData()
+	{
+		// Cancelled outside the lock, since streams remove themselves once they finish
+		StreamMap running;
+		streams([&](StreamMap& s)
+		{
+			running = std::move(s);
+		});
+		for (auto&& s : running)
+			s.second->cancel();
+
+		(*alive)([](bool& a)
+		{
+			a = false;
+		});
+		if (watchTransport)
+		{
+			(*watchTransport)([](Transport*& trp)
+			{
+				trp = nullptr;
+			});
+		}
+	}
 
 	//
 	// Control RPCS
@@ -84,6 +139,16 @@ struct InProcessorData
 		authPassed = objData.checkAuthToken(token);
 		return Any(authPassed);
 	}
+	// Same as getProperty, but any further changes to the property are pushed to the caller
+	Any watchProperty(std::string name);
+	Any stats();
+	Any transportMetrics()
+	{
+		TransportMetrics metrics;
+		if (!transport || !transport->getMetrics(metrics))
+			return Any();
+		return transportMetricsToAny(metrics);
+	}
 };
 
 //
@@ -93,8 +158,10 @@ namespace details
 
 struct Send
 {
-	static void error(Transport& trp, Header hdr, const char* what)
+	static bool error(Transport& trp, Header hdr, Priority priority, const char* what,
+					  const CallStats& stats = CallStats())
 	{
+		CZRPC_TRACE_SCOPE("reply", hdr.bits.rpcid, hdr.bits.counter);
 		Stream o;
 		o << hdr; // reserve space for the header
 		o << what;
@@ -102,16 +169,34 @@ struct Send
 		hdr.bits.success = false;
 		hdr.bits.size = o.writeSize();
 		*reinterpret_cast<Header*>(o.ptr(0)) = hdr;
-		trp.send(o.extract());
+		stats.record(false, o.writeSize());
+		return trp.send(o.extract(), priority);
 	}
 
-	static void result(Transport& trp, Header hdr, Stream& o)
+	static bool result(Transport& trp, Header hdr, Priority priority, Stream& o, const CallStats& stats = CallStats())
 	{
+		CZRPC_TRACE_SCOPE("reply", hdr.bits.rpcid, hdr.bits.counter);
 		hdr.bits.isReply = true;
 		hdr.bits.success = true;
 		hdr.bits.size = o.writeSize();
 		*reinterpret_cast<Header*>(o.ptr(0)) = hdr;
-		trp.send(o.extract());
+		stats.record(true, o.writeSize());
+		return trp.send(o.extract(), priority);
+	}
+
+	// One way notification of a property change (see Header::isPush)
+	static void push(Transport& trp, Priority priority, const std::string& name, const Any& val)
+	{
+		Header hdr;
+		Stream o;
+		o << hdr; // reserve space for the header
+		o << name;
+		o << val;
+		hdr.bits.isReply = true;
+		hdr.bits.success = true;
+		hdr.bits.size = o.writeSize();
+		*reinterpret_cast<Header*>(o.ptr(0)) = hdr;
+		trp.send(o.extract(), priority);
 	}
 };
 
@@ -131,7 +216,7 @@ struct Dispatcher<false, R>
 		{
 			auto r = callMethod(obj, f, std::move(params));
 			if (hdr.isGenericRPC())
-				out << Any(r);
+				out << Any(std::move(r));
 			else
 				out << r;
 		}
@@ -150,20 +235,24 @@ struct Dispatcher<false, R>
 	};
 
 	template <typename OBJ, typename F, typename P>
-	static void impl(OBJ& obj, F f, P&& params, InProcessorData& out, Transport& trp, Header hdr)
+	static void impl(OBJ& obj, F f, P&& params, InProcessorData& out, Transport& trp, Header hdr,
+					 Priority priority, const CallStats& stats)
 	{
 #if CZRPC_CATCH_EXCEPTIONS
 		try {
 #endif
 			Stream o;
 			o << hdr; // Reserve space for the header
-			Caller<R>::doCall(obj, std::move(f), std::move(params), o, hdr);
-			Send::result(trp, hdr, o);
+			{
+				CZRPC_TRACE_SCOPE("handler", hdr.bits.rpcid, hdr.bits.counter);
+				Caller<R>::doCall(obj, std::move(f), std::move(params), o, hdr);
+			}
+			Send::result(trp, hdr, priority, o, stats);
 #if CZRPC_CATCH_EXCEPTIONS
 		}
 		catch (std::exception& e)
 		{
-			Send::error(trp, hdr, e.what());
+			Send::error(trp, hdr, priority, e.what(), stats);
 		}
 #endif
 	}
@@ -174,52 +263,114 @@ template <typename R>
 struct Dispatcher<true, R>
 {
 	template <typename OBJ, typename F, typename P>
-	static void impl(OBJ& obj, F f, P&& params, InProcessorData& out, Transport& trp, Header hdr)
+	static void impl(OBJ& obj, F f, P&& params, InProcessorData& out, Transport& trp, Header hdr,
+					 Priority priority, const CallStats& stats)
 	{
-		using Traits = FunctionTraits<F>;
-		auto resFt = callMethod(obj, f, std::move(params));
-		out.pending([&](InProcessorData::PendingFutures& pending)
+		CZRPC_TRACE_SCOPE("handler", hdr.bits.rpcid, hdr.bits.counter);
+		waitResult(out, trp, hdr, priority, callMethod(obj, f, std::move(params)), stats);
+	}
+
+	// The result is waited for by a thread nobody needs to join, so destroying the connection doesn't wait for
+	// RPCs still running. The reply is only sent if the connection is still alive by then.
+	template<typename T>
+	static void waitResult(InProcessorData& out, Transport& trp, Header hdr, Priority priority,
+						   std::future<T> resFt, const CallStats& stats)
+	{
+		std::thread([alive = out.alive, &trp, hdr, priority, ft = std::move(resFt), stats]() mutable
 		{
-			unsigned counter = pending.counter++;
-			auto ft = then(std::move(resFt), [&out, &trp, hdr, counter](std::future<Traits::return_type> ft)
+			ft.wait();
+			(*alive)([&](bool& isAlive)
 			{
-				processReady(out, trp, counter, hdr, std::move(ft));
+				if (isAlive)
+					processReady(trp, hdr, priority, std::move(ft), stats);
 			});
+		}).detach();
+	}
 
-			pending.futures.insert(std::make_pair(counter, std::move(ft)));
+#if CZRPC_COROUTINES
+	// Coroutines don't need a thread to wait for the result, since the reply is sent from whatever thread
+	// finishes the coroutine
+	template<typename T>
+	static void waitResult(InProcessorData& out, Transport& trp, Header hdr, Priority priority, Task<T> task,
+						   const CallStats& stats)
+	{
+		task.detach([alive = out.alive, &trp, hdr, priority, stats](details::TaskPromise<T>& p)
+		{
+			(*alive)([&](bool& isAlive)
+			{
+				if (!isAlive)
+					return;
+				try
+				{
+					Stream o;
+					o << hdr;
+					if constexpr (std::is_void_v<T>)
+					{
+						p.get();
+						if (hdr.isGenericRPC())
+							o << Any();
+					}
+					else
+					{
+						auto r = p.get();
+						if (hdr.isGenericRPC())
+							o << Any(std::move(r));
+						else
+							o << r;
+					}
+					Send::result(trp, hdr, priority, o, stats);
+				}
+				catch (const std::exception& e)
+				{
+					Send::error(trp, hdr, priority, e.what(), stats);
+				}
+			});
 		});
 	}
+#endif
+
+	template<typename T>
+	static void writeReady(Stream& o, Header hdr, std::future<T>& ft)
+	{
+		auto r = ft.get();
+		if (hdr.isGenericRPC())
+			o << Any(std::move(r));
+		else
+			o << r;
+	}
+
+	static void writeReady(Stream& o, Header hdr, std::future<void>& ft)
+	{
+		ft.get();
+		if (hdr.isGenericRPC())
+			o << Any();
+	}
 
 	template<typename T>
-	static void processReady(InProcessorData& out, Transport& trp, unsigned counter, Header hdr, std::future<T> ft)
+	static void processReady(Transport& trp, Header hdr, Priority priority, std::future<T> ft,
+							 const CallStats& stats)
 	{
 		try
 		{
 			Stream o;
 			o << hdr;
-			auto r = ft.get();
-			if (hdr.isGenericRPC())
-				o << Any(r);
-			else
-				o << r;
-			Send::result(trp, hdr, o);
+			writeReady(o, hdr, ft);
+			Send::result(trp, hdr, priority, o, stats);
 		}
 		catch (const std::exception& e)
 		{
-			Send::error(trp, hdr, e.what());
+			Send::error(trp, hdr, priority, e.what(), stats);
 		}
+	}
+};
 
-		// Delete previously finished futures, and prepare to delete this one.
-		// We can't delete this one right here, because it will deadlock.
-		out.pending([&](InProcessorData::PendingFutures& pending)
-		{
-			pending.done.clear();
-			auto it = pending.futures.find(counter);
-			assert(it != pending.futures.end());
-			pending.done.push_back(std::move(it->second));
-			pending.futures.erase(it);
-		});
-
+// Connects the StreamReader parameter of RPCs taking a client stream (see RPCStreaming.h)
+template<bool HAS_CLIENT_STREAM>
+struct ClientStreamSetup
+{
+	template<typename P>
+	static void setup(P&, InProcessorData&, Transport&, Header, Priority)
+	{
 	}
 };
 
@@ -230,6 +381,11 @@ struct BaseInfo
 	BaseInfo() {}
 	virtual ~BaseInfo(){};
 	std::string name;
+	// Stats for all calls to this RPC, across all the objects of the table's type
+	mutable RPCStats stats;
+	// Priority of the calls to this RPC (unless overridden with Call::priority), and of its replies and stream
+	// frames (see Table<T>::setPriority)
+	mutable std::atomic<Priority> priority{Priority::Normal};
 };
 
 class BaseTable
@@ -238,11 +394,75 @@ class BaseTable
 	BaseTable() {}
 	virtual ~BaseTable() {}
 	bool isValid(uint32_t rpcid) const { return rpcid < m_rpcs.size(); }
+	uint32_t getNumRPCs() const { return static_cast<uint32_t>(m_rpcs.size()); }
+	const BaseInfo* getBaseInfo(uint32_t rpcid) const { return m_rpcs[rpcid].get(); }
+	const BaseInfo* getControlBaseInfo(const std::string& name) const
+	{
+		for (auto&& info : m_controlrpcs)
+		{
+			if (info->name == name)
+				return info.get();
+		}
+		return nullptr;
+	}
+
+	// Snapshot of the stats of all RPCs (including control RPCs) that were called at least once
+	std::vector<RPCStatsEntry> getStats() const
+	{
+		std::vector<RPCStatsEntry> res;
+		auto add = [&res](const std::vector<std::unique_ptr<BaseInfo>>& infos)
+		{
+			for (auto&& info : infos)
+			{
+				RPCStatsEntry e;
+				e.stats = info->stats.getSnapshot();
+				if (e.stats.calls == 0)
+					continue;
+				e.name = info->name;
+				res.push_back(std::move(e));
+			}
+		};
+		add(m_rpcs);
+		add(m_controlrpcs);
+		return res;
+	}
+
   protected:
 	std::vector<std::unique_ptr<BaseInfo>> m_rpcs;
 	std::vector<std::unique_ptr<BaseInfo>> m_controlrpcs;
 };
 
+inline Any InProcessorData::stats()
+{
+	return statsToAny(table ? table->getStats() : std::vector<RPCStatsEntry>());
+}
+
+// NOTE: The name is interned (see PropertyKey) even if the property doesn't exist yet, so it can be watched
+// before it is set
+inline Any InProcessorData::watchProperty(std::string name)
+{
+	if (!watchHandler)
+	{
+		// Changes are pushed with the priority of __watchProperty (see Table<T>::setControlPriority)
+		const BaseInfo* info = table ? table->getControlBaseInfo("__watchProperty") : nullptr;
+		watchTransport = std::make_shared<Monitor<Transport*>>(transport);
+		watchHandler = std::make_shared<ObjectData::WatchHandler>(
+			[watchTransport = watchTransport, info](const PropertyKey& key, const Any& val)
+		{
+			Priority priority = info ? info->priority.load(std::memory_order_relaxed) : Priority::Normal;
+			(*watchTransport)([&](Transport* trp)
+			{
+				if (trp)
+					details::Send::push(*trp, priority, key.getName(), val);
+			});
+		});
+	}
+
+	PropertyKey key(name);
+	objData.watchProperty(key, watchHandler);
+	return objData.getProperty(key);
+}
+
 template <typename T>
 class TableImpl : public BaseTable
 {
@@ -293,7 +513,8 @@ class TableImpl : public BaseTable
 
 			if (!info)
 			{
-				details::Send::error(trp, hdr, "Generic RPC not found");
+				details::Send::error(trp, hdr, m_rpcs[0]->priority.load(std::memory_order_relaxed),
+									 "Generic RPC not found");
 				return;
 			}
 
@@ -305,6 +526,9 @@ class TableImpl : public BaseTable
 		registerControlRPC("__auth", &InProcessorData::auth);
 		registerControlRPC("__getProperty", &InProcessorData::getProperty);
 		registerControlRPC("__setProperty", &InProcessorData::setProperty);
+		registerControlRPC("__watchProperty", &InProcessorData::watchProperty);
+		registerControlRPC("__stats", &InProcessorData::stats);
+		registerControlRPC("__transportMetrics", &InProcessorData::transportMetrics);
 	}
 
 	template <typename F>
@@ -322,7 +546,7 @@ class TableImpl : public BaseTable
 
 		auto info = std::make_unique<Info>();
 		info->name = name;
-		info->dispatcher = [f](Type& obj, Stream& in, InProcessorData& out, Transport& trp, Header hdr) {
+		info->dispatcher = [f, info=info.get()](Type& obj, Stream& in, InProcessorData& out, Transport& trp, Header hdr) {
 			using Traits = FunctionTraits<F>;
 			typename Traits::param_tuple params;
 
@@ -332,25 +556,26 @@ class TableImpl : public BaseTable
 				return;
 			}
 
+			details::CallStats stats(&info->stats, hdr.bits.size);
+			Priority priority = info->priority.load(std::memory_order_relaxed);
 			if (hdr.isGenericRPC())
 			{
-				std::vector<Any> a;
-				in >> a;
-				if (!toTuple(a, params))
+				if (Traits::hasClientStream || !readTupleFromAny(in, params))
 				{
 					// Invalid parameters supplied, or the RPC function signature itself can't be used for
 					// generic RPCs, since the parameter types it uses can't be converted to/from cz::rpc::Any
-					details::Send::error(trp, hdr, "Invalid parameters for generic RPC");
+					details::Send::error(trp, hdr, priority, "Invalid parameters for generic RPC", stats);
 					return;
 				}
 			}
 			else
 			{
 				in >> params;
+				details::ClientStreamSetup<Traits::hasClientStream>::setup(params, out, trp, hdr, priority);
 			}
 
 			using R = typename Traits::return_type;
-			details::Dispatcher<Traits::isasync, R>::impl(obj, f, std::move(params), out, trp, hdr);
+			details::Dispatcher<Traits::isasync, R>::impl(obj, f, std::move(params), out, trp, hdr, priority, stats);
 		};
 		m_rpcs.push_back(std::move(info));
 	}
@@ -375,11 +600,11 @@ class TableImpl : public BaseTable
 				return;
 			}
 
-			std::vector<Any> a;
-			in >> a;
-			if (!toTuple(a, params))
+			details::CallStats stats(&info->stats, hdr.bits.size);
+			Priority priority = info->priority.load(std::memory_order_relaxed);
+			if (!readTupleFromAny(in, params))
 			{
-				details::Send::error(trp, hdr, "Invalid parameters for generic RPC");
+				details::Send::error(trp, hdr, priority, "Invalid parameters for generic RPC", stats);
 				return;
 			}
 
@@ -389,8 +614,9 @@ class TableImpl : public BaseTable
 			static_assert(std::is_same<R, Any>::value, "control RPC function needs to return Any");
 			Stream o;
 			o << hdr; // reserve space for header
+			out.transport = &trp;
 			o << callMethod(out, f, std::move(params));
-			details::Send::result(trp, hdr, o);
+			details::Send::result(trp, hdr, priority, o, stats);
 		};
 		m_controlrpcs.push_back(std::move(info));
 	}
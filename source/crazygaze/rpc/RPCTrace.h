@@ -0,0 +1,336 @@
+/************************************************************************
+Tracing of the RPC lifecycle (serialization, sending, dispatching,
+replies, etc), for viewing in chrome://tracing or Perfetto.
+
+Tracing is only compiled in if CZRPC_TRACE is 1, and even then it needs to be
+enabled at runtime with Trace::setEnabled. While disabled, each trace point
+costs one branch.
+Each thread writes to its own ring buffer, so recording doesn't need locks.
+Once a buffer is full, the oldest events are overwritten.
+************************************************************************/
+
+#pragma once
+
+#if CZRPC_TRACE
+	#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+		#include <intrin.h>
+		#define CZRPC_TRACE_HAS_TSC 1
+	#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+		#include <x86intrin.h>
+		#define CZRPC_TRACE_HAS_TSC 1
+	#else
+		#define CZRPC_TRACE_HAS_TSC 0
+	#endif
+#endif
+
+namespace cz
+{
+namespace rpc
+{
+
+#if CZRPC_TRACE
+
+namespace details
+{
+	struct TraceEvent
+	{
+		uint64_t start;
+		// Same as start for instant events
+		uint64_t end;
+		const char* name;
+		uint32_t rpcid;
+		uint32_t counter;
+	};
+
+	// Ring buffer written by one single thread
+	class TraceBuffer
+	{
+	public:
+		TraceBuffer(uint32_t tid, size_t capacity)
+			: m_tid(tid)
+			, m_events(capacity)
+			, m_mask(capacity - 1)
+		{
+			assert(capacity && (capacity & m_mask) == 0 && "Capacity needs to be a power of 2");
+		}
+
+		void push(const TraceEvent& evt)
+		{
+			uint64_t head = m_head.load(std::memory_order_relaxed);
+			m_events[head & m_mask] = evt;
+			m_head.store(head + 1, std::memory_order_release);
+		}
+
+		// Copies the events, oldest first.
+		// If the owner thread is still recording, the oldest events copied might be overwritten meanwhile, so
+		// for exact results, this should only be used while tracing is disabled.
+		void copy(std::vector<TraceEvent>& dst) const
+		{
+			uint64_t head = m_head.load(std::memory_order_acquire);
+			uint64_t tail = std::min(m_tail.load(std::memory_order_relaxed), head);
+			uint64_t count = std::min(head - tail, static_cast<uint64_t>(m_events.size()));
+			for (uint64_t i = head - count; i < head; i++)
+				dst.push_back(m_events[i & m_mask]);
+		}
+
+		// Can be called from any thread. Only the owner thread writes m_head, so instead of resetting it (which
+		// a push in progress would undo), this moves the tail up to it. Events pushed meanwhile might be
+		// discarded too.
+		void clear()
+		{
+			m_tail.store(m_head.load(std::memory_order_acquire), std::memory_order_relaxed);
+		}
+
+		uint32_t getTid() const
+		{
+			return m_tid;
+		}
+
+	private:
+		uint32_t m_tid;
+		std::vector<TraceEvent> m_events;
+		size_t m_mask;
+		std::atomic<uint64_t> m_head{0};
+		// Events before this were discarded by clear
+		std::atomic<uint64_t> m_tail{0};
+	};
+}
+
+class Trace
+{
+public:
+	static bool isEnabled()
+	{
+		return getEnabledFlag().load(std::memory_order_relaxed);
+	}
+
+	static void setEnabled(bool enabled)
+	{
+		if (enabled)
+		{
+			// Pair of timestamps to convert ticks to microseconds when dumping
+			getGlobals()([](Globals& g)
+			{
+				if (!g.cal.calibrated)
+				{
+					g.cal.calibrated = true;
+					g.cal.baseTicks = getTicks();
+					g.cal.baseTime = std::chrono::steady_clock::now();
+				}
+			});
+		}
+		getEnabledFlag().store(enabled, std::memory_order_relaxed);
+	}
+
+	// Size (in events) of the ring buffer of each thread. Must be a power of 2.
+	// Only affects threads that didn't record any events yet.
+	static void setBufferSize(size_t events)
+	{
+		getGlobals()([events](Globals& g)
+		{
+			g.bufferSize = events;
+		});
+	}
+
+	// Discards all the events recorded so far
+	static void clear()
+	{
+		getGlobals()([](Globals& g)
+		{
+			for (auto&& b : g.buffers)
+				b->clear();
+		});
+	}
+
+	static uint64_t getTicks()
+	{
+#if CZRPC_TRACE_HAS_TSC
+		return __rdtsc();
+#else
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+										 std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+	}
+
+	static void record(const char* name, uint64_t start, uint64_t end, uint32_t rpcid, uint32_t counter)
+	{
+		static thread_local details::TraceBuffer* buf = createBuffer();
+		buf->push(details::TraceEvent{start, end, name, rpcid, counter});
+	}
+
+	// Returns all the recorded events in Chrome trace format (json)
+	static std::string getJson()
+	{
+		std::vector<std::pair<uint32_t, std::vector<details::TraceEvent>>> threads;
+		Calibration cal;
+		getGlobals()([&](Globals& g)
+		{
+			for (auto&& b : g.buffers)
+			{
+				threads.emplace_back(b->getTid(), std::vector<details::TraceEvent>());
+				b->copy(threads.back().second);
+			}
+			cal = g.cal;
+		});
+		// Outside the lock, since it can take a while
+		uint64_t baseTicks = cal.baseTicks;
+		double ticksPerUs = calibrate(cal);
+
+		std::string res = "{\"traceEvents\":[\n";
+		bool first = true;
+		char tmp[256];
+		for (auto&& t : threads)
+		{
+			for (auto&& e : t.second)
+			{
+				double ts = (e.start - baseTicks) / ticksPerUs;
+				if (e.end == e.start)
+					snprintf(tmp, sizeof(tmp),
+							 "%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":%u,"
+							 "\"args\":{\"rpcid\":%u,\"counter\":%u}}",
+							 first ? "" : ",\n", e.name, ts, t.first, e.rpcid, e.counter);
+				else
+					snprintf(tmp, sizeof(tmp),
+							 "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u,"
+							 "\"args\":{\"rpcid\":%u,\"counter\":%u}}",
+							 first ? "" : ",\n", e.name, ts, (e.end - e.start) / ticksPerUs, t.first, e.rpcid,
+							 e.counter);
+				res += tmp;
+				first = false;
+			}
+		}
+		res += "\n]}\n";
+		return res;
+	}
+
+	static bool dump(const char* filename)
+	{
+		FILE* f = fopen(filename, "wb");
+		if (!f)
+			return false;
+		std::string json = getJson();
+		bool ok = fwrite(json.data(), 1, json.size(), f) == json.size();
+		fclose(f);
+		return ok;
+	}
+
+private:
+	// Pair of timestamps taken when tracing was first enabled, to convert ticks to microseconds
+	struct Calibration
+	{
+		bool calibrated = false;
+		uint64_t baseTicks = 0;
+		std::chrono::steady_clock::time_point baseTime;
+	};
+
+	struct Globals
+	{
+		size_t bufferSize = 16 * 1024;
+		std::vector<std::unique_ptr<details::TraceBuffer>> buffers;
+		Calibration cal;
+	};
+
+	static std::atomic<bool>& getEnabledFlag()
+	{
+		static std::atomic<bool> enabled(false);
+		return enabled;
+	}
+
+	static Monitor<Globals>& getGlobals()
+	{
+		static Monitor<Globals> globals;
+		return globals;
+	}
+
+	// Buffers are kept until the process exits, so events from threads that finished are not lost
+	static details::TraceBuffer* createBuffer()
+	{
+		return getGlobals()([](Globals& g)
+		{
+			g.buffers.push_back(std::make_unique<details::TraceBuffer>(
+				static_cast<uint32_t>(g.buffers.size() + 1), g.bufferSize));
+			return g.buffers.back().get();
+		});
+	}
+
+	// Ticks per microsecond
+	static double calibrate(const Calibration& cal)
+	{
+#if CZRPC_TRACE_HAS_TSC
+		if (!cal.calibrated)
+			return 1;
+		// Make sure the interval is long enough for a decent precision
+		auto minTime = cal.baseTime + std::chrono::milliseconds(10);
+		while (std::chrono::steady_clock::now() < minTime)
+		{
+		}
+		uint64_t ticks = getTicks();
+		auto us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - cal.baseTime).count();
+		return (ticks - cal.baseTicks) / us;
+#else
+		return 1000;
+#endif
+	}
+};
+
+namespace details
+{
+	// Records the time between start and destruction as one event.
+	// Nothing is recorded if start is not called, so CZRPC_TRACE_SCOPE only evaluates its parameters if
+	// tracing is enabled.
+	class TraceScope
+	{
+	public:
+		TraceScope() {}
+
+		void start(const char* name, uint32_t rpcid, uint32_t counter)
+		{
+			m_name = name;
+			m_rpcid = rpcid;
+			m_counter = counter;
+			m_start = Trace::getTicks();
+		}
+
+		~TraceScope()
+		{
+			if (m_name)
+				Trace::record(m_name, m_start, std::max(Trace::getTicks(), m_start + 1), m_rpcid, m_counter);
+		}
+
+		TraceScope(const TraceScope&) = delete;
+		TraceScope& operator=(const TraceScope&) = delete;
+
+	private:
+		const char* m_name = nullptr;
+		uint32_t m_rpcid;
+		uint32_t m_counter;
+		uint64_t m_start;
+	};
+}
+
+	#define CZRPC_TRACE_CONCAT_IMPL(a, b) a##b
+	#define CZRPC_TRACE_CONCAT(a, b) CZRPC_TRACE_CONCAT_IMPL(a, b)
+	// Traces the rest of the current scope.
+	// name needs to be a string literal (or any string that is never freed)
+	#define CZRPC_TRACE_SCOPE(name, rpcid, counter)                                     \
+		::cz::rpc::details::TraceScope CZRPC_TRACE_CONCAT(czrpcTraceScope, __LINE__);   \
+		if (::cz::rpc::Trace::isEnabled())                                              \
+			CZRPC_TRACE_CONCAT(czrpcTraceScope, __LINE__).start(name, rpcid, counter)
+	// Traces something that happened at this point
+	#define CZRPC_TRACE_INSTANT(name, rpcid, counter)                                         \
+		do                                                                                    \
+		{                                                                                     \
+			if (::cz::rpc::Trace::isEnabled())                                                \
+			{                                                                                 \
+				uint64_t czrpcTraceTicks = ::cz::rpc::Trace::getTicks();                      \
+				::cz::rpc::Trace::record(name, czrpcTraceTicks, czrpcTraceTicks, rpcid, counter); \
+			}                                                                                 \
+		} while (0)
+#else
+	#define CZRPC_TRACE_SCOPE(name, rpcid, counter)
+	#define CZRPC_TRACE_INSTANT(name, rpcid, counter) do {} while (0)
+#endif
+
+} // namespace rpc
+} // namespace cz
+
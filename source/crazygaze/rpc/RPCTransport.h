@@ -5,13 +5,231 @@ namespace cz
 namespace rpc
 {
 
+// Immutable buffer that can be shared by several outgoing frames (e.g: when broadcasting)
+using SharedBuffer = std::shared_ptr<const std::vector<char>>;
+
+// Priority of an outgoing frame.
+// Transports with priority lanes (e.g: BaseAsioTransport) send Urgent frames before anything else, and share the
+// rest of the bandwidth between the other lanes by weight. Frames of the same priority are sent in order.
+enum class Priority : uint8_t
+{
+	// Small control traffic (e.g: heartbeats), that should never wait behind anything else
+	Urgent,
+	High,
+	Normal,
+	// Bulk transfers
+	Low
+};
+static constexpr int kNumPriorities = 4;
+
+// Why a transport closed
+enum class CloseReason
+{
+	// Still open
+	None,
+	// Closed by us (Transport::close)
+	Local,
+	// Closed by the peer
+	Peer,
+	// Socket error
+	Error,
+	// Closed because the outgoing queue overflowed (OverflowPolicy::Close)
+	Overflow
+};
+
+//
+// Counters of a transport, or of a group of transports (e.g: all the connections of an acceptor)
+//
+struct TransportMetrics
+{
+	static constexpr int kNumCloseReasons = 5;
+
+	// Frames sent through one priority lane
+	struct Lane
+	{
+		uint64_t bytesSent = 0;
+		uint64_t framesSent = 0;
+		// Time the frames spent queued, as with queuedTimeSum/queuedTimeMax
+		uint64_t queuedTimeSum = 0;
+		uint64_t queuedTimeMax = 0;
+
+		double getMeanQueuedTime() const
+		{
+			return framesSent ? static_cast<double>(queuedTimeSum) / framesSent : 0;
+		}
+	};
+
+	// How many transports these metrics cover
+	uint64_t transports = 0;
+
+	uint64_t bytesSent = 0;
+	uint64_t bytesReceived = 0;
+	uint64_t framesSent = 0;
+	uint64_t framesReceived = 0;
+	// Completed socket writes and reads
+	uint64_t writes = 0;
+	uint64_t reads = 0;
+	// Outgoing frames dropped because of OverflowPolicy::DropOldest
+	uint64_t framesDropped = 0;
+	// Chunks of the frames too big to send in one go (see BaseAsioTransport::setMaxChunkSize).
+	// Each chunk takes one write, and the frame is only counted as sent or received with its last chunk.
+	uint64_t chunksSent = 0;
+	uint64_t chunksReceived = 0;
+
+	// Current and peak size of the outgoing queue, including the ongoing write.
+	// For groups, current values are summed, and peaks are the highest of any transport.
+	uint64_t outQueueFrames = 0;
+	uint64_t outQueueBytes = 0;
+	uint64_t outQueuePeakFrames = 0;
+	uint64_t outQueuePeakBytes = 0;
+	// Current and peak size of the incoming queue (frames received but not dispatched yet)
+	uint64_t inQueueFrames = 0;
+	uint64_t inQueueBytes = 0;
+	uint64_t inQueuePeakFrames = 0;
+	uint64_t inQueuePeakBytes = 0;
+
+	// Time the sent frames spent in the outgoing queue before being written, in nanoseconds.
+	// Only measured if CZRPC_STATS is 1
+	uint64_t queuedTimeSum = 0;
+	uint64_t queuedTimeMax = 0;
+
+	// How many transports closed for each reason (indexed by CloseReason)
+	std::array<uint64_t, kNumCloseReasons> closes = {};
+
+	// Indexed by Priority
+	std::array<Lane, kNumPriorities> lanes = {};
+
+	double getFramesPerWrite() const
+	{
+		return writes ? static_cast<double>(framesSent) / writes : 0;
+	}
+
+	// Mean time a frame spent queued, in nanoseconds
+	double getMeanQueuedTime() const
+	{
+		return framesSent ? static_cast<double>(queuedTimeSum) / framesSent : 0;
+	}
+
+	void merge(const TransportMetrics& other)
+	{
+		transports += other.transports;
+		bytesSent += other.bytesSent;
+		bytesReceived += other.bytesReceived;
+		framesSent += other.framesSent;
+		framesReceived += other.framesReceived;
+		writes += other.writes;
+		reads += other.reads;
+		framesDropped += other.framesDropped;
+		chunksSent += other.chunksSent;
+		chunksReceived += other.chunksReceived;
+		outQueueFrames += other.outQueueFrames;
+		outQueueBytes += other.outQueueBytes;
+		outQueuePeakFrames = std::max(outQueuePeakFrames, other.outQueuePeakFrames);
+		outQueuePeakBytes = std::max(outQueuePeakBytes, other.outQueuePeakBytes);
+		inQueueFrames += other.inQueueFrames;
+		inQueueBytes += other.inQueueBytes;
+		inQueuePeakFrames = std::max(inQueuePeakFrames, other.inQueuePeakFrames);
+		inQueuePeakBytes = std::max(inQueuePeakBytes, other.inQueuePeakBytes);
+		queuedTimeSum += other.queuedTimeSum;
+		queuedTimeMax = std::max(queuedTimeMax, other.queuedTimeMax);
+		for (int i = 0; i < kNumCloseReasons; i++)
+			closes[i] += other.closes[i];
+		for (int i = 0; i < kNumPriorities; i++)
+		{
+			lanes[i].bytesSent += other.lanes[i].bytesSent;
+			lanes[i].framesSent += other.lanes[i].framesSent;
+			lanes[i].queuedTimeSum += other.lanes[i].queuedTimeSum;
+			lanes[i].queuedTimeMax = std::max(lanes[i].queuedTimeMax, other.lanes[i].queuedTimeMax);
+		}
+	}
+
+	void write(Stream& s) const
+	{
+		s << transports << bytesSent << bytesReceived << framesSent << framesReceived << writes << reads
+		  << framesDropped << outQueueFrames << outQueueBytes << outQueuePeakFrames << outQueuePeakBytes
+		  << inQueueFrames << inQueueBytes << inQueuePeakFrames << inQueuePeakBytes << queuedTimeSum
+		  << queuedTimeMax << chunksSent << chunksReceived;
+		for (auto&& c : closes)
+			s << c;
+		for (auto&& l : lanes)
+			s << l.bytesSent << l.framesSent << l.queuedTimeSum << l.queuedTimeMax;
+	}
+
+	bool read(Stream& s)
+	{
+		if (s.readSize() < static_cast<int>(sizeof(uint64_t) * (20 + kNumCloseReasons + 4 * kNumPriorities)))
+			return false;
+		s >> transports >> bytesSent >> bytesReceived >> framesSent >> framesReceived >> writes >> reads >>
+			framesDropped >> outQueueFrames >> outQueueBytes >> outQueuePeakFrames >> outQueuePeakBytes >>
+			inQueueFrames >> inQueueBytes >> inQueuePeakFrames >> inQueuePeakBytes >> queuedTimeSum >>
+			queuedTimeMax >> chunksSent >> chunksReceived;
+		for (auto&& c : closes)
+			s >> c;
+		for (auto&& l : lanes)
+			s >> l.bytesSent >> l.framesSent >> l.queuedTimeSum >> l.queuedTimeMax;
+		return true;
+	}
+};
+
+//
+// Conversion to/from Any, as returned by the __transportMetrics control RPC
+//
+inline Any transportMetricsToAny(const TransportMetrics& metrics)
+{
+	Stream s;
+	metrics.write(s);
+	std::vector<char> buf = s.extract();
+	return Any(std::vector<unsigned char>(buf.begin(), buf.end()));
+}
+
+inline bool transportMetricsFromAny(const Any& a, TransportMetrics& metrics)
+{
+	std::vector<unsigned char> blob;
+	if (!a.getAs(blob))
+		return false;
+	Stream s(std::vector<char>(blob.begin(), blob.end()));
+	return metrics.read(s);
+}
+
+namespace details
+{
+	// Marks threads that drive transports themselves while waiting (see Call::get). If such a thread is the only
+	// one running a transport's io_service, any waiting it does needs to keep polling, or it never ends.
+	struct TransportDriver
+	{
+		// How long to park between polls, when there is nothing to do
+		static std::chrono::milliseconds pollInterval()
+		{
+			return std::chrono::milliseconds(1);
+		}
+
+		static bool isCurrent()
+		{
+			return Callstack<TransportDriver>::begin() != Callstack<TransportDriver>::end();
+		}
+	};
+}
+
 class Transport
 {
   public:
 	virtual ~Transport() {}
 
 	// Send one single RPC
-	virtual void send(std::vector<char> data) = 0;
+	// priority : Transports without priority lanes can ignore it, as long as frames are sent in order
+	// return: true if the data was accepted for sending, false if the transport refused it
+	// (e.g: transport closed, or the outgoing queue is full)
+	virtual bool send(std::vector<char> data, Priority priority) = 0;
+
+	// Send one single RPC, made of a per-frame prefix (e.g: the header), followed by a payload shared with
+	// other frames.
+	// The default implementation puts everything in one single buffer. Transports that can send from
+	// multiple buffers should override this, to avoid the copy.
+	virtual bool sendShared(std::vector<char> prefix, SharedBuffer payload, Priority priority)
+	{
+		prefix.insert(prefix.end(), payload->begin(), payload->end());
+		return send(std::move(prefix), priority);
+	}
 
 	// Receive one single RPC
 	// dst : Will contain the data for one single RPC, or empty if no RPC available
@@ -20,7 +238,117 @@ class Transport
 
 	// Close connection to the peer
 	virtual void close() = 0;
+
+	// Tells if the transport can take more outgoing data without going over its limits.
+	// Transports without outgoing limits are always writable.
+	virtual bool isWritable() const
+	{
+		return true;
+	}
+
+	// Calls the handler once the transport is writable (or closed).
+	// The handler is called from inside this call if the transport is already writable, or later
+	// from whatever thread the transport uses to drain its outgoing data.
+	virtual void waitWritable(std::function<void()> h)
+	{
+		h();
+	}
+
+	// Gets the transport's metrics
+	// return: false if the transport doesn't keep any metrics
+	virtual bool getMetrics(TransportMetrics& /*dst*/) const
+	{
+		return false;
+	}
+
+	// Does some of the transport's pending work (e.g: processing incoming data) in the calling thread, without
+	// blocking. Used by Call::get to drive the transport while waiting for a reply, and by transports blocking
+	// a send from a thread marked with details::TransportDriver.
+	// return: true if any work was done, false if there was nothing to do, or the transport doesn't support it
+	virtual bool poll()
+	{
+		return false;
+	}
 };
+
+//
+// Base class for transports that wrap another transport to add some functionality (e.g: capture the traffic).
+// Everything is forwarded to the wrapped transport, so derived classes only need to override what they change.
+//
+class TransportDecorator : public Transport
+{
+public:
+	explicit TransportDecorator(std::shared_ptr<Transport> inner)
+		: m_inner(std::move(inner))
+	{
+	}
+
+	virtual bool send(std::vector<char> data, Priority priority) override
+	{
+		return m_inner->send(std::move(data), priority);
+	}
+
+	virtual bool sendShared(std::vector<char> prefix, SharedBuffer payload, Priority priority) override
+	{
+		return m_inner->sendShared(std::move(prefix), std::move(payload), priority);
+	}
+
+	virtual bool receive(std::vector<char>& dst) override
+	{
+		return m_inner->receive(dst);
+	}
+
+	virtual void close() override
+	{
+		m_inner->close();
+	}
+
+	virtual bool isWritable() const override
+	{
+		return m_inner->isWritable();
+	}
+
+	virtual void waitWritable(std::function<void()> h) override
+	{
+		m_inner->waitWritable(std::move(h));
+	}
+
+	virtual bool getMetrics(TransportMetrics& dst) const override
+	{
+		return m_inner->getMetrics(dst);
+	}
+
+	virtual bool poll() override
+	{
+		return m_inner->poll();
+	}
+
+	Transport* getInner() const
+	{
+		return m_inner.get();
+	}
+
+protected:
+	std::shared_ptr<Transport> m_inner;
+};
+
+// Wraps a transport with a decorator (or decorators), returning the outermost one
+using TransportDecoratorFunc = std::function<std::shared_ptr<Transport>(std::shared_ptr<Transport>)>;
+
+// Finds the transport of the specified type, looking through any decorators
+// return: The transport found, or nullptr if none
+template<typename T>
+T* findTransport(Transport* trp)
+{
+	while (trp)
+	{
+		if (auto res = dynamic_cast<T*>(trp))
+			return res;
+		auto decorator = dynamic_cast<TransportDecorator*>(trp);
+		trp = decorator ? decorator->getInner() : nullptr;
+	}
+	return nullptr;
+}
 }
 }
 
@@ -38,6 +38,30 @@ namespace details
 		static constexpr bool value = true;
 		using type = T;
 	};
+
+	// Parameter types fed by the caller after the call (StreamReader and Channel, see RPCStreaming.h and
+	// RPCChannel.h)
+	template<typename T>
+	struct IsClientStream
+	{
+		static constexpr bool value = false;
+	};
+
+	// RPCs taking a client stream have it as the last parameter
+	template<typename... Args>
+	struct HasClientStream
+	{
+		static constexpr bool value = false;
+	};
+	template<typename Last>
+	struct HasClientStream<Last>
+	{
+		static constexpr bool value = IsClientStream<typename std::decay<Last>::type>::value;
+	};
+	template<typename First, typename... Rest>
+	struct HasClientStream<First, Rest...> : HasClientStream<Rest...>
+	{
+	};
 }
 
 // function pointer
@@ -65,6 +89,7 @@ struct FunctionTraits<R(Args...)>
     using return_type = typename details::CheckFuture<R>::type;
 	static constexpr bool valid = ParamTraits<return_type>::valid && ParamPack<Args...>::valid;
 	static constexpr bool isasync = details::CheckFuture<R>::value;
+	static constexpr bool hasClientStream = details::HasClientStream<Args...>::value;
 	using param_tuple = std::tuple<typename ParamTraits<Args>::store_type...>;
     static constexpr std::size_t arity = sizeof...(Args);
  
@@ -137,7 +162,9 @@ void serializeMethod(Stream& s, Args&&... args)
 {
 	using Traits = FunctionTraits<F>;
 	static_assert(Traits::valid, "Function signature not valid for RPC calls. Check if parameter types are valid");
-	static_assert(Traits::arity == sizeof...(Args), "Invalid number of parameters for RPC call.");
+	// The StreamReader parameter of RPCs taking a client stream is not specified by the caller (see Call::upload)
+	static_assert(Traits::arity == sizeof...(Args) || (Traits::hasClientStream && Traits::arity == sizeof...(Args) + 1),
+				  "Invalid number of parameters for RPC call.");
 	details::Parameters<F, 0>::serialize(s, std::forward<Args>(args)...);
 }
 
@@ -160,6 +187,180 @@ public:
 	}
 };
 
+//
+// Lock free multiple producer, single consumer queue.
+// Any thread can push, but only one thread at a time can pop.
+// Pushing is one allocation and one atomic exchange, so producers never wait for each other or for the
+// consumer. A push is only visible to the consumer once it completes, therefore "pop" can briefly fail while
+// a push is in progress.
+// T needs to be default constructible.
+//
+template <class T>
+class MPSCQueue
+{
+public:
+	MPSCQueue()
+	{
+		m_tail = new Node();
+		m_head.store(m_tail, std::memory_order_relaxed);
+	}
+
+	~MPSCQueue()
+	{
+		T tmp;
+		while (pop(tmp))
+		{
+		}
+		delete m_tail;
+	}
+
+	MPSCQueue(const MPSCQueue&) = delete;
+	MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+	void push(T v)
+	{
+		Node* n = new Node(std::move(v));
+		Node* prev = m_head.exchange(n, std::memory_order_acq_rel);
+		prev->next.store(n, std::memory_order_release);
+	}
+
+	// Consumer only
+	bool pop(T& dst)
+	{
+		Node* next = m_tail->next.load(std::memory_order_acquire);
+		if (!next)
+			return false;
+		dst = std::move(next->value);
+		// The node we popped becomes the new dummy tail
+		delete m_tail;
+		m_tail = next;
+		return true;
+	}
+
+	// Consumer only
+	bool empty() const
+	{
+		return m_tail->next.load(std::memory_order_acquire) == nullptr;
+	}
+
+private:
+	struct Node
+	{
+		Node() {}
+		explicit Node(T v) : value(std::move(v)) {}
+		std::atomic<Node*> next{nullptr};
+		T value;
+	};
+
+	// Producers push here
+	alignas(64) std::atomic<Node*> m_head;
+	// Consumer side. Always points to a dummy node whose value was already popped
+	alignas(64) Node* m_tail;
+};
+
+//
+// Read-copy-update container, for data that is read a lot more than it is changed.
+// Readers never block or take locks. They get the current version of the data, which stays valid until they
+// are done with it, even if it is updated meanwhile.
+// Updates copy the current version, change the copy and publish it, and then wait for any readers still
+// using the old version before deleting it. Updates are serialized.
+// NOTE: Calling "update" from inside "read" deadlocks.
+// T needs to be copy constructible.
+//
+template <class T>
+class RCU
+{
+public:
+	RCU() : m_current(new T()) {}
+	explicit RCU(T t) : m_current(new T(std::move(t))) {}
+	~RCU()
+	{
+		delete m_current.load();
+	}
+
+	RCU(const RCU&) = delete;
+	RCU& operator=(const RCU&) = delete;
+
+	// Calls f with the current version of the data.
+	// f should be short, since updates wait for it to finish.
+	template <typename F>
+	auto read(F f) const -> decltype(f(std::declval<const T&>()))
+	{
+		ReadScope scope(*this);
+		return f(static_cast<const T&>(*m_current.load()));
+	}
+
+	// Calls f with a copy of the current version. If f returns true, the copy is published.
+	// return: What f returned
+	template <typename F>
+	bool update(F f)
+	{
+		std::lock_guard<std::mutex> lk(m_updateMtx);
+		std::unique_ptr<T> next(new T(*m_current.load()));
+		if (!f(*next))
+			return false;
+		std::unique_ptr<T> old(m_current.exchange(next.release()));
+		synchronize();
+		return true;
+	}
+
+private:
+	static constexpr int kShards = 8;
+
+	// Readers register themselves in a counter of their shard, for the current epoch parity
+	struct alignas(64) ReaderShard
+	{
+		std::atomic<int> count[2] = {{0}, {0}};
+	};
+
+	class ReadScope
+	{
+	public:
+		explicit ReadScope(const RCU& outer)
+			: m_shard(outer.m_readers[getThreadShard()])
+			, m_parity(outer.m_epoch.load() & 1)
+		{
+			m_shard.count[m_parity].fetch_add(1);
+		}
+		~ReadScope()
+		{
+			m_shard.count[m_parity].fetch_sub(1, std::memory_order_release);
+		}
+	private:
+		ReaderShard& m_shard;
+		unsigned m_parity;
+	};
+
+	static int getThreadShard()
+	{
+		static std::atomic<int> next(0);
+		thread_local int shard = next.fetch_add(1, std::memory_order_relaxed) % kShards;
+		return shard;
+	}
+
+	// Waits for all the readers that might be using the previous version.
+	// The epoch is flipped twice (as userspace RCU does), since a reader might read the epoch right before a
+	// flip, but only register itself after the wait for that parity is done. Such a reader can only see the
+	// new version, and flipping twice makes sure the next update still waits for it.
+	void synchronize()
+	{
+		for (int i = 0; i < 2; i++)
+		{
+			unsigned parity = m_epoch.fetch_add(1) & 1;
+			for (auto&& shard : m_readers)
+			{
+				while (shard.count[parity].load() != 0)
+					std::this_thread::yield();
+			}
+		}
+	}
+
+	std::atomic<T*> m_current;
+	std::atomic<unsigned> m_epoch{0};
+	std::mutex m_updateMtx;
+	mutable ReaderShard m_readers[kShards];
+};
+
 
 //
 // Future continuations, since std::future::then is not available yet
@@ -7,6 +7,7 @@
 //
 #include "crazygaze/rpc/RPC.h"
 #include "crazygaze/rpc/RPCAsioTransport.h"
+#include "crazygaze/rpc/RPCNetEmulator.h"
 
 #include <stdio.h>
 #include <tchar.h>
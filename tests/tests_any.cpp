@@ -24,6 +24,11 @@ TEST(Constructors)
 	TestConstructor(std::string("Hello"), Any::Type::String);
 	TestConstructor(std::vector<unsigned char>{ 0, 1, 2, 3, 4 }, Any::Type::Blob);
 	TestConstructor(std::vector<int>{0, 1}, Any::Type::None);
+	TestConstructor(int64_t(-1), Any::Type::Int64);
+	TestConstructor(uint64_t(1), Any::Type::UInt64);
+	TestConstructor(double(0.5), Any::Type::Double);
+	TestConstructor(Any::Array{Any(1), Any("Hello")}, Any::Type::Array);
+	TestConstructor(Any::Map{{"a", Any(1)}}, Any::Type::Map);
 }
 
 TEST(toString)
@@ -37,6 +42,107 @@ TEST(toString)
 	CHECK(std::string(Any(float(1234.5)).toString()) == "1234.5000");
 	CHECK(std::string(Any("hello").toString()) == "hello");
 	CHECK(std::string(Any(std::vector<unsigned char>{0, 1}).toString()) == "BLOB{2}");
+	CHECK(std::string(Any(int64_t(-12345678901234)).toString()) == "-12345678901234");
+	CHECK(std::string(Any(uint64_t(12345678901234)).toString()) == "12345678901234");
+	CHECK(std::string(Any(double(1234.5)).toString()) == "1234.5000");
+	CHECK(std::string(Any(std::string(100, 'a')).toString()) == std::string(100, 'a'));
+	CHECK(std::string(Any(Any::Array{Any(1), Any(2)}).toString()) == "ARRAY{2}");
+	CHECK(std::string(Any(Any::Map{{"a", Any(1)}}).toString()) == "MAP{1}");
+}
+
+TEST(NumericConversions)
+{
+	int i;
+	unsigned u;
+	int64_t i64;
+	uint64_t u64;
+	double d;
+	float f;
+
+	CHECK(Any(int64_t(-5)).getAs(i) && i == -5);
+	CHECK(Any(int64_t(1) << 40).getAs(i) == false); // Doesn't fit
+	CHECK(Any(uint64_t(5)).getAs(u) && u == 5);
+	CHECK(Any(uint64_t(1) << 40).getAs(u) == false);
+	CHECK(Any(int64_t(-1)).getAs(u) == false);
+	CHECK(Any(uint64_t(1) << 63).getAs(i64) == false);
+	CHECK(Any(int(-5)).getAs(i64) && i64 == -5);
+	CHECK(Any(unsigned(5)).getAs(u64) && u64 == 5);
+	CHECK(Any(float(1.5)).getAs(d) && d == 1.5);
+	CHECK(Any(double(1.5)).getAs(f) && f == 1.5f);
+	CHECK(Any(double(2.5)).getAs(i) && i == 2);
+	CHECK(Any(uint64_t(5)).getAs(i) && i == 5);
+	CHECK(Any(uint64_t(1) << 40).getAs(i) == false);
+	CHECK(Any(unsigned(0xFFFFFFFF)).getAs(i) == false);
+	CHECK(Any(int(-1)).getAs(u) == false); // Doesn't wrap
+	CHECK(Any(int(-1)).getAs(u64) == false);
+	CHECK(Any(int64_t(-1)).getAs(u64) == false);
+	CHECK(Any(double(1e20)).getAs(i) == false);
+	CHECK(Any(double(1e20)).getAs(i64) == false);
+	CHECK(Any(double(-1)).getAs(u) == false);
+	CHECK(Any(double(-0.5)).getAs(u) && u == 0);
+	CHECK(Any(std::numeric_limits<double>::quiet_NaN()).getAs(i) == false);
+	CHECK(Any(double(-2147483648.0)).getAs(i) && i == std::numeric_limits<int>::min());
+	CHECK(Any(double(2147483648.0)).getAs(i) == false);
+	CHECK(Any(double(4294967295.0)).getAs(u) && u == 0xFFFFFFFF);
+	CHECK(Any(float(1e30f)).getAs(u64) == false);
+	CHECK(Any(int64_t(7)).getAs(d) && d == 7);
+	CHECK(Any("1").getAs(d) == false);
+}
+
+TEST(Serialization)
+{
+	Any::Map m;
+	m.emplace_back("int", Any(-1));
+	m.emplace_back("uint", Any(unsigned(0xFFFFFFFF)));
+	m.emplace_back("int64", Any(std::numeric_limits<int64_t>::min()));
+	m.emplace_back("uint64", Any(std::numeric_limits<uint64_t>::max()));
+	m.emplace_back("float", Any(float(1.5)));
+	m.emplace_back("double", Any(double(1.0 / 3.0)));
+	m.emplace_back("bool", Any(true));
+	m.emplace_back("none", Any());
+	m.emplace_back("short", Any("Hello"));
+	m.emplace_back("long", Any(std::string(1000, 'x')));
+	m.emplace_back("blob", Any(std::vector<unsigned char>{0, 1, 2}));
+	m.emplace_back("bigblob", Any(std::vector<unsigned char>(1000, 7)));
+	m.emplace_back("array", Any(Any::Array{Any(1), Any(Any::Array{Any("nested")}), Any(Any::Map())}));
+	Any a(std::move(m));
+
+	Stream s;
+	s << a;
+	Any b;
+	s >> b;
+	CHECK_EQUAL(0, s.readSize());
+	CHECK(a == b);
+
+	double d;
+	CHECK(b.find("double")->getAs(d) && d == 1.0 / 3.0);
+	std::string str;
+	CHECK(b.find("long")->getAs(str) && str == std::string(1000, 'x'));
+	CHECK(b.find("missing") == nullptr);
+	const Any::Array* arr = b.find("array")->getArray();
+	CHECK(arr && arr->size() == 3 && (*arr)[1].getArray()->at(0) == Any("nested"));
+}
+
+TEST(EncodedSize)
+{
+	auto size = [](const Any& a)
+	{
+		Stream s;
+		s << a;
+		return s.writeSize();
+	};
+
+	CHECK_EQUAL(1, size(Any()));
+	CHECK_EQUAL(2, size(Any(true)));
+	CHECK_EQUAL(2, size(Any(1)));
+	CHECK_EQUAL(2, size(Any(-1)));
+	CHECK_EQUAL(3, size(Any(1000)));
+	CHECK_EQUAL(11, size(Any(std::numeric_limits<uint64_t>::max())));
+	CHECK_EQUAL(5, size(Any(float(1))));
+	CHECK_EQUAL(9, size(Any(double(1))));
+	CHECK_EQUAL(7, size(Any("Hello")));
+	CHECK_EQUAL(1 + 2 + 1000, size(Any(std::string(1000, 'x'))));
+	CHECK_EQUAL(1 + 1 + 2 + 2, size(Any(Any::Array{Any(1), Any(2)})));
 }
 
 TEST(TupleConversion)
@@ -64,4 +170,41 @@ TEST(TupleConversion)
 
 }
 
+TEST(TupleFromStream)
+{
+	std::tuple<bool, int, float, std::string, std::vector<unsigned char>, Any> t;
+
+	std::vector<Any> a;
+	a.push_back(Any(int(1)));
+	a.push_back(Any(float(2.5)));
+	a.push_back(Any(int(3)));
+	a.push_back(Any(std::string("4")));
+	a.push_back(Any(std::vector<unsigned char>{5, 6}));
+	a.push_back(Any("7"));
+
+	Stream s;
+	s << a;
+	CHECK(readTupleFromAny(s, t) == true);
+	CHECK(std::get<0>(t) == true);
+	CHECK_EQUAL(2, std::get<1>(t));
+	CHECK_EQUAL(float(3), std::get<2>(t));
+	CHECK_EQUAL("4", std::get<3>(t));
+	CHECK(std::get<4>(t) == (std::vector<unsigned char>{5, 6}));
+	CHECK_EQUAL("7", std::get<5>(t).toString());
+	CHECK_EQUAL(0, s.readSize());
+
+	// Wrong number of values
+	a.pop_back();
+	s.clear();
+	s << a;
+	CHECK(readTupleFromAny(s, t) == false);
+
+	// Value that can't be converted
+	a.push_back(Any(std::vector<unsigned char>{8}));
+	a[3] = Any(int(1));
+	s.clear();
+	s << a;
+	CHECK(readTupleFromAny(s, t) == false);
+}
+
 }
@@ -91,7 +91,86 @@ public:
 		return v;
 	}
 
+	void testSleep(int ms)
+	{
+		UnitTest::TimeHelpers::SleepMs(ms);
+	}
+
+	void testPublished(int v)
+	{
+		lastPublished = v;
+		publishedCount++;
+	}
+
+	// Streams the integers [0, count), in frames of about "chunkSize" bytes.
+	// Throws once it gets to "throwAt", if not negative
+	ServerStream<int> testStream(int count, int chunkSize, int throwAt)
+	{
+		streamProduced = 0;
+		return ServerStream<int>([this, count, throwAt, i = 0](StreamWriter<int>& w) mutable
+		{
+			while (i < count)
+			{
+				if (i == throwAt)
+					throw std::exception("Testing exception");
+				streamProduced++;
+				if (!w.write(i++))
+					return i < count;
+			}
+			return false;
+		}, chunkSize);
+	}
+
+	// Reads the client stream once "uploadGate" is notified, expecting the integers [first, ...).
+	// return: How many integers it got
+	std::future<int> testUpload(int first, StreamReader<int> data)
+	{
+		auto reader = std::make_shared<StreamReader<int>>(std::move(data));
+		return std::async(std::launch::async, [this, first, reader]
+		{
+			uploadGate.wait();
+			int count = 0;
+			int v;
+			while (reader->next(v))
+			{
+				if (v != first + count)
+					throw std::exception("Out of sequence");
+				count++;
+			}
+			return count;
+		});
+	}
+
+	// Sends back every integer it gets through the channel, plus "add", until the caller closes its side
+	std::future<void> testChannel(int add, Channel<int, int> ch)
+	{
+		auto channel = std::make_shared<Channel<int, int>>(std::move(ch));
+		return std::async(std::launch::async, [add, channel]
+		{
+			int v;
+			while (channel->next(v))
+			{
+				channel->write(v + add);
+				channel->flush();
+			}
+			channel->close();
+		});
+	}
+
+	// Keeps the channel, for the test to write to
+	void testFeed(Channel<int, int> ch)
+	{
+		feed = std::move(ch);
+		feedReady.notify();
+	}
+
 	int clientCallRes = 0;
+	std::atomic<int> lastPublished{ -1 };
+	std::atomic<int> publishedCount{ 0 };
+	std::atomic<int> streamProduced{ 0 };
+	Semaphore uploadGate;
+	Channel<int, int> feed;
+	Semaphore feedReady;
 };
 
 class TesterEx : public Tester
@@ -133,7 +212,13 @@ public:
 	REGISTERRPC(testFoo1) \
 	REGISTERRPC(testFoo2) \
 	REGISTERRPC(testFuture) \
-	REGISTERRPC(testAny)
+	REGISTERRPC(testAny) \
+	REGISTERRPC(testSleep) \
+	REGISTERRPC(testPublished) \
+	REGISTERRPC(testStream) \
+	REGISTERRPC(testUpload) \
+	REGISTERRPC(testChannel) \
+	REGISTERRPC(testFeed)
 
 #define RPCTABLE_CLASS Tester
 	#define RPCTABLE_CONTENTS RPCTABLE_TESTER_CONTENTS
@@ -151,6 +236,80 @@ public:
 	REGISTERRPC(clientAdd)
 #include "crazygaze/rpc/RPCGenerate.h"
 
+#if CZRPC_COROUTINES
+//
+// RPCs implemented as coroutines. They all wait for the test to release them, so the test can have several
+// RPCs pending at the same time, without any threads blocked.
+//
+class CoroTester
+{
+public:
+	struct Gate
+	{
+		CoroTester& outer;
+		bool await_ready()
+		{
+			return false;
+		}
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			std::unique_lock<std::mutex> lk(outer.m_mtx);
+			outer.m_waiting.push_back(h);
+			outer.m_cv.notify_all();
+		}
+		void await_resume()
+		{
+		}
+	};
+
+	cz::rpc::Task<int> add(int a, int b)
+	{
+		co_await Gate{*this};
+		co_return a + b;
+	}
+
+	cz::rpc::Task<void> voidCall()
+	{
+		co_await Gate{*this};
+		voidCalls++;
+	}
+
+	cz::rpc::Task<int> intTestException()
+	{
+		co_await Gate{*this};
+		throw std::runtime_error("Testing exception");
+		co_return 0;
+	}
+
+	// Waits for "count" RPCs to be suspended, and resumes them
+	void release(size_t count)
+	{
+		std::vector<std::coroutine_handle<>> waiting;
+		{
+			std::unique_lock<std::mutex> lk(m_mtx);
+			m_cv.wait(lk, [&] { return m_waiting.size() >= count; });
+			waiting.swap(m_waiting);
+		}
+		for (auto h : waiting)
+			h.resume();
+	}
+
+	std::atomic<int> voidCalls{0};
+
+private:
+	std::mutex m_mtx;
+	std::condition_variable m_cv;
+	std::vector<std::coroutine_handle<>> m_waiting;
+};
+
+#define RPCTABLE_CLASS CoroTester
+#define RPCTABLE_CONTENTS \
+	REGISTERRPC(add) \
+	REGISTERRPC(voidCall) \
+	REGISTERRPC(intTestException)
+#include "crazygaze/rpc/RPCGenerate.h"
+#endif
+
 
 // Server side calls a RPC on the client...
 int Tester::testClientAddCall(int a, int b)
@@ -203,7 +362,8 @@ public:
 	using Local = LOCAL;
 	using Remote = REMOTE;
 
-	explicit ServerProcess(int port, std::string authToken="")
+	explicit ServerProcess(int port, std::string authToken="",
+		TransportDecoratorFunc decorator = nullptr)
 		: m_objData(&m_obj)
 	{
 		m_th = std::thread([this]
@@ -215,6 +375,7 @@ public:
 		m_objData.setAuthToken(std::move(authToken));
 
 		m_acceptor = AsioTransportAcceptor<Local, Remote>::create(m_io, m_obj);
+		m_acceptor->setTransportDecorator(std::move(decorator));
 		m_acceptor->start(port, [&](std::shared_ptr<Connection<Local, Remote>> con)
 		{
 			m_cons.push_back(std::move(con));
@@ -228,6 +389,7 @@ public:
 	}
 
 	LOCAL& obj() { return m_obj;   }
+	AsioTransportAcceptor<Local, Remote>& acceptor() { return *m_acceptor; }
 private:
 	ASIO::io_service m_io;
 	std::thread m_th;
@@ -750,4 +912,1710 @@ TEST(ControlRPCs)
 	iothread.join();
 }
 
+TEST(PropertyCache)
+{
+	using namespace cz::rpc;
+
+	ServerProcess<Tester, void> server(TEST_PORT);
+	ObjectData serverData(&server.obj());
+	serverData.setProperty("name", Any("Tester1"));
+
+	ASIO::io_service io;
+	std::thread iothread = std::thread([&io]
+	{
+		ASIO::io_service::work w(io);
+		io.run();
+	});
+
+	auto clientCon = AsioTransport<void, GenericServer>::create(io, "127.0.0.1", TEST_PORT).get();
+	// Calls the server got, which is what the cache saves. Counted before the server replies.
+	auto serverCalls = [&]
+	{
+		return server.acceptor().getMetrics().framesReceived;
+	};
+
+	Any v;
+	CHECK(clientCon->remotePrc.getCachedProperty("name", v) == false);
+	CHECK_EQUAL("Tester1", clientCon->getProperty("name").get().toString());
+	CHECK_EQUAL(1, serverCalls());
+
+	// Served from the cache
+	CHECK_EQUAL("Tester1", clientCon->getProperty("name").get().toString());
+	CHECK(clientCon->remotePrc.getCachedProperty("name", v) && std::string(v.toString()) == "Tester1");
+	CHECK_EQUAL(1, serverCalls());
+
+	// Watching a property that doesn't exist yet
+	CHECK(clientCon->getProperty("prop1").get().getType() == Any::Type::None);
+	CHECK_EQUAL(2, serverCalls());
+
+	// Changes are pushed by the server
+	auto waitFor = [&](const char* name, const char* expected)
+	{
+		auto start = std::chrono::steady_clock::now();
+		while (std::chrono::steady_clock::now() - start < std::chrono::seconds(1))
+		{
+			if (clientCon->remotePrc.getCachedProperty(name, v) && std::string(v.toString()) == expected)
+				return true;
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		return false;
+	};
+	serverData.setProperty("name", Any("Tester2"), true);
+	CHECK(waitFor("name", "Tester2"));
+	serverData.setProperty("prop1", Any(10));
+	CHECK(waitFor("prop1", "10"));
+
+	// Changes done by other clients are pushed too
+	auto otherCon = AsioTransport<void, GenericServer>::create(io, "127.0.0.1", TEST_PORT).get();
+	CZRPC_CALLGENERIC(*otherCon, "__setProperty", std::vector<Any>{Any("prop1"), Any(11)}).ft().get();
+	CHECK(waitFor("prop1", "11"));
+	CHECK_EQUAL(3, serverCalls());
+
+	// Async version
+	auto p = Future<Result<Any>>::create();
+	clientCon->getPropertyAsync("name", [pr = std::move(p.second)](Result<Any>&& res)
+	{
+		pr.setValue(std::move(res));
+	});
+	CHECK_EQUAL("Tester2", p.first.get().get().toString());
+	CHECK_EQUAL(3, serverCalls());
+
+	io.stop();
+	iothread.join();
+}
+
+// Fill the outgoing queue while the server is not reading, to test the outgoing limits
+TEST(SendQueueLimits)
+{
+	using namespace cz::rpc;
+
+	ServerProcess<Tester, void> server(TEST_PORT);
+
+	ASIO::io_service io;
+	std::thread iothread = std::thread([&io]
+	{
+		ASIO::io_service::work w(io);
+		io.run();
+	});
+
+	auto clientCon = AsioTransport<void, Tester>::create(io, "127.0.0.1", TEST_PORT).get();
+	auto trp = static_cast<BaseAsioTransport*>(clientCon->transport.get());
+	SendQueueLimits limits;
+	limits.highWatermarkBytes = 1024 * 1024;
+	limits.lowWatermarkBytes = 0;
+	limits.policy = OverflowPolicy::Fail;
+	trp->setSendQueueLimits(limits);
+	CHECK(trp->isWritable());
+
+	// Keep the server busy, so it stops reading from the socket
+	CZRPC_CALL(*clientCon, testSleep, 500);
+
+	// Calls refused by the transport are aborted right away
+	std::atomic<bool> refused(false);
+	std::vector<int> big(256 * 1024);
+	for (int i = 0; i < 1000 && !refused; i++)
+	{
+		CZRPC_CALL(*clientCon, testVector1, big).async([&](Result<std::vector<int>> res)
+		{
+			if (res.isAborted())
+				refused = true;
+		});
+	}
+	CHECK(refused.load());
+	CHECK(trp->isWritable() == false);
+
+	// Once the server starts reading again, the queue drains
+	Semaphore writable;
+	trp->waitWritable([&]
+	{
+		writable.notify();
+	});
+	writable.wait();
+	CHECK(trp->isWritable());
+
+	io.stop();
+	iothread.join();
+}
+
+// OverflowPolicy::DropOldest only drops pushes. Calls are either refused and aborted right away, or get their reply.
+TEST(SendQueueDropOldest)
+{
+	using namespace cz::rpc;
+
+	ServerProcess<Tester, void> server(TEST_PORT);
+
+	ASIO::io_service io;
+	std::thread iothread = std::thread([&io]
+	{
+		ASIO::io_service::work w(io);
+		io.run();
+	});
+
+	auto clientCon = AsioTransport<void, Tester>::create(io, "127.0.0.1", TEST_PORT).get();
+	auto trp = static_cast<BaseAsioTransport*>(clientCon->transport.get());
+	SendQueueLimits limits;
+	limits.highWatermarkBytes = 1024 * 1024;
+	limits.lowWatermarkBytes = 0;
+	limits.policy = OverflowPolicy::DropOldest;
+	trp->setSendQueueLimits(limits);
+
+	// Keep the server busy, so it stops reading from the socket
+	CZRPC_CALL(*clientCon, testSleep, 500);
+
+	ZeroSemaphore pending;
+	std::atomic<int> refused(0);
+	std::atomic<int> replied(0);
+	std::vector<int> big(256 * 1024);
+	for (int i = 0; i < 1000 && !refused; i++)
+	{
+		pending.increment();
+		CZRPC_CALL(*clientCon, testVector1, big).async([&](Result<std::vector<int>> res)
+		{
+			if (res.isAborted())
+				++refused;
+			else if (res.get().size() == big.size())
+				++replied;
+			pending.decrement();
+		});
+	}
+	CHECK(trp->isWritable() == false);
+
+	// The calls queued before the queue filled up are still sent
+	pending.wait();
+	CHECK_EQUAL(1, refused.load());
+	CHECK(replied.load() > 0);
+	TransportMetrics metrics;
+	CHECK(trp->getMetrics(metrics));
+	CHECK_EQUAL(0, metrics.framesDropped);
+
+	io.stop();
+	iothread.join();
+}
+
+// Sending from a handler of the io_service that isn't the transport's own, with a full queue and
+// OverflowPolicy::Block, can't block, since the io_service is what drains the queue
+TEST(SendQueueBlockFromIoService)
+{
+	using namespace cz::rpc;
+
+	ServerProcess<Tester, void> server(TEST_PORT);
+
+	ASIO::io_service io;
+	std::thread iothread = std::thread([&io]
+	{
+		ASIO::io_service::work w(io);
+		io.run();
+	});
+
+	auto clientCon = AsioTransport<void, Tester>::create(io, "127.0.0.1", TEST_PORT).get();
+	auto trp = static_cast<BaseAsioTransport*>(clientCon->transport.get());
+	SendQueueLimits limits;
+	limits.highWatermarkBytes = 1024 * 1024;
+	limits.lowWatermarkBytes = 0;
+	limits.policy = OverflowPolicy::Block;
+	trp->setSendQueueLimits(limits);
+
+	// Keep the server busy, so it stops reading from the socket
+	CZRPC_CALL(*clientCon, testSleep, 500);
+
+	ZeroSemaphore pending;
+	std::vector<int> big(256 * 1024);
+	for (int i = 0; i < 1000 && trp->isWritable(); i++)
+	{
+		pending.increment();
+		CZRPC_CALL(*clientCon, testVector1, big).async([&](Result<std::vector<int>> res)
+		{
+			CHECK(res.get().size() == big.size());
+			pending.decrement();
+		});
+	}
+	CHECK(trp->isWritable() == false);
+
+	std::promise<void> sent;
+	io.post([&]
+	{
+		pending.increment();
+		CZRPC_CALL(*clientCon, add, 1, 2).async([&](Result<int> res)
+		{
+			CHECK_EQUAL(3, res.get());
+			pending.decrement();
+		});
+		sent.set_value();
+	});
+	CHECK(sent.get_future().wait_for(std::chrono::seconds(2)) == std::future_status::ready);
+	pending.wait();
+
+	io.stop();
+	iothread.join();
+}
+
+// Dispatch incoming RPCs with an executor we control, to test the incoming limits
+TEST(ReceiveQueueLimits)
+{
+	using namespace cz::rpc;
+
+	ServerProcess<Tester, void> server(TEST_PORT);
+
+	ASIO::io_service io;
+	std::thread iothread = std::thread([&io]
+	{
+		ASIO::io_service::work w(io);
+		io.run();
+	});
+
+	auto clientCon = AsioTransport<void, Tester>::create(io, "127.0.0.1", TEST_PORT).get();
+	auto trp = static_cast<BaseAsioTransport*>(clientCon->transport.get());
+	ReceiveQueueLimits limits;
+	limits.highWatermarkFrames = 1;
+	limits.lowWatermarkFrames = 0;
+	trp->setReceiveQueueLimits(limits);
+
+	Monitor<std::queue<std::function<void()>>> tasks;
+	trp->setExecutor([&](std::function<void()> task)
+	{
+		tasks([&](std::queue<std::function<void()>>& q)
+		{
+			q.push(std::move(task));
+		});
+	});
+	auto runTasks = [&](auto&& done)
+	{
+		while (!done())
+		{
+			std::function<void()> task;
+			tasks([&](std::queue<std::function<void()>>& q)
+			{
+				if (q.size())
+				{
+					task = std::move(q.front());
+					q.pop();
+				}
+			});
+
+			if (!task)
+			{
+				UnitTest::TimeHelpers::SleepMs(1);
+				continue;
+			}
+
+			task();
+		}
+	};
+
+	// The transport stops reading once it has one reply queued, and resumes reading as the executor
+	// drains the queue. All the replies should still arrive, and in order.
+	const int numCalls = 10;
+	std::atomic<int> done(0);
+	for (int i = 0; i < numCalls; i++)
+	{
+		CZRPC_CALL(*clientCon, add, i, 1).async([&, i](Result<int> res)
+		{
+			CHECK_EQUAL(done, i);
+			CHECK_EQUAL(i + 1, res.get());
+			++done;
+		});
+	}
+	runTasks([&] { return done == numCalls; });
+
+	// Pending calls are aborted by the executor too once the transport closes, so the connection is never
+	// processed by two threads at once. The close handler runs after that, from the executor.
+	std::atomic<bool> aborted(false);
+	std::atomic<bool> closed(false);
+	std::thread::id closedThread;
+	trp->setOnClosed([&]
+	{
+		CHECK(aborted.load());
+		closedThread = std::this_thread::get_id();
+		closed = true;
+	});
+	CZRPC_CALL(*clientCon, testSleep, 200).async([&](Result<void> res)
+	{
+		aborted = res.isAborted();
+	});
+	trp->close();
+	UnitTest::TimeHelpers::SleepMs(50);
+	CHECK(!aborted && !closed);
+	runTasks([&] { return closed.load(); });
+	CHECK(closedThread == std::this_thread::get_id());
+
+	io.stop();
+	iothread.join();
+}
+
+// Send the same call to several connections, serializing it only once
+TEST(SharedCall)
+{
+	using namespace cz::rpc;
+
+	ServerProcess<Tester, void> server(TEST_PORT);
+
+	ASIO::io_service io;
+	std::thread iothread = std::thread([&io]
+	{
+		ASIO::io_service::work w(io);
+		io.run();
+	});
+
+	std::vector<std::shared_ptr<Connection<void, Tester>>> cons;
+	for (int i = 0; i < 3; i++)
+		cons.push_back(AsioTransport<void, Tester>::create(io, "127.0.0.1", TEST_PORT).get());
+
+	ZeroSemaphore pending;
+	auto call = CZRPC_SHAREDCALL(Tester, add, 1, 2);
+	for (auto&& con : cons)
+	{
+		pending.increment();
+		call.send(*con, [&](Result<int> res)
+		{
+			CHECK_EQUAL(3, res.get());
+			pending.decrement();
+		});
+	}
+	pending.wait();
+
+	// Replies are ignored when broadcasting, so follow up with a normal call to make sure the connections
+	// are still in a good state
+	// It's a single statement, so it works without braces
+	if (cons.size())
+		CZRPC_BROADCAST(cons, testVector1, std::vector<int>{1, 2, 3});
+	else
+		CHECK(false);
+	for (auto&& con : cons)
+		CHECK_EQUAL(3, CZRPC_CALL(*con, add, 1, 2).ft().get().get());
+
+	io.stop();
+	iothread.join();
+}
+
+// The test acts as the publisher, and the server connections are the subscribers
+TEST(PubSub)
+{
+	using namespace cz::rpc;
+
+	ServerProcess<Tester, void> server(TEST_PORT);
+
+	ASIO::io_service io;
+	std::thread iothread = std::thread([&io]
+	{
+		ASIO::io_service::work w(io);
+		io.run();
+	});
+
+	auto conA = AsioTransport<void, Tester>::create(io, "127.0.0.1", TEST_PORT).get();
+	auto conB = AsioTransport<void, Tester>::create(io, "127.0.0.1", TEST_PORT).get();
+
+	auto waitPublished = [&](int count)
+	{
+		for (int i = 0; i < 200 && server.obj().publishedCount != count; i++)
+			UnitTest::TimeHelpers::SleepMs(10);
+		return server.obj().publishedCount.load();
+	};
+
+	PubSub<Connection<void, Tester>> pubsub;
+	CHECK(pubsub.subscribe(conA, "a"));
+	CHECK(pubsub.subscribe(conB, "a"));
+	CHECK(pubsub.subscribe(conB, "b"));
+	CHECK(pubsub.subscribe(conB, "b") == false);
+	CHECK_EQUAL(2, pubsub.getSubscriberCount("a"));
+	CHECK_EQUAL(1, pubsub.getSubscriberCount("b"));
+
+	CHECK_EQUAL(2, CZRPC_PUBLISH(pubsub, "a", testPublished, 1));
+	CHECK_EQUAL(1, CZRPC_PUBLISH(pubsub, "b", testPublished, 2));
+	CHECK_EQUAL(0, CZRPC_PUBLISH(pubsub, "c", testPublished, 3));
+	CHECK_EQUAL(3, waitPublished(3));
+
+	pubsub.unsubscribeAll(conB.get());
+	CHECK(pubsub.unsubscribe(conA.get(), "b") == false);
+	CHECK_EQUAL(1, pubsub.getSubscriberCount("a"));
+	CHECK_EQUAL(0, pubsub.getSubscriberCount("b"));
+	CHECK_EQUAL(1, CZRPC_PUBLISH(pubsub, "a", testPublished, 4));
+	CHECK_EQUAL(0, CZRPC_PUBLISH(pubsub, "b", testPublished, 5));
+	CHECK_EQUAL(4, waitPublished(4));
+
+	// Make conA a slow subscriber, so most messages get coalesced, but the last one still gets there
+	SendQueueLimits limits;
+	limits.highWatermarkFrames = 1;
+	limits.lowWatermarkFrames = 0;
+	limits.policy = OverflowPolicy::Fail;
+	static_cast<BaseAsioTransport*>(conA->transport.get())->setSendQueueLimits(limits);
+	server.obj().publishedCount = 0;
+	const int count = 1000;
+	for (int i = 0; i < count; i++)
+		CZRPC_PUBLISH(pubsub, "a", testPublished, i);
+	for (int i = 0; i < 200 && server.obj().lastPublished != count - 1; i++)
+		UnitTest::TimeHelpers::SleepMs(10);
+	CHECK_EQUAL(count - 1, server.obj().lastPublished.load());
+	auto stats = pubsub.getStats();
+	CHECK_EQUAL(0, stats.dropped);
+	CHECK_EQUAL(count, server.obj().publishedCount + stats.coalesced);
+
+	io.stop();
+	iothread.join();
+}
+
+#if CZRPC_STATS
+static RPCStatsSnapshot findStats(const std::vector<RPCStatsEntry>& entries, const char* name)
+{
+	for (auto&& e : entries)
+	{
+		if (e.name == name)
+			return e.stats;
+	}
+	return RPCStatsSnapshot();
+}
+
+TEST(Stats)
+{
+	using namespace cz::rpc;
+
+	ServerProcess<Tester, void> server(TEST_PORT);
+
+	ASIO::io_service io;
+	std::thread iothread = std::thread([&io]
+	{
+		ASIO::io_service::work w(io);
+		io.run();
+	});
+
+	auto clientCon = AsioTransport<void, Tester>::create(io, "127.0.0.1", TEST_PORT).get();
+
+	auto getServerStats = [&]
+	{
+		std::vector<RPCStatsEntry> entries;
+		auto res = CZRPC_CALLGENERIC(*clientCon, "__stats").ft().get();
+		CHECK(statsFromAny(res.get(), entries));
+		return entries;
+	};
+
+	// Server side stats are shared by all objects of the same type, so we need to check the difference
+	auto before = getServerStats();
+
+	for (int i = 0; i < 10; i++)
+		CHECK_EQUAL(3, CZRPC_CALL(*clientCon, add, 1, 2).ft().get().get());
+	CHECK(CZRPC_CALL(*clientCon, intTestException, true).ft().get().isException());
+	CHECK(CZRPC_CALLGENERIC(*clientCon, "add", std::vector<Any>{Any(1), Any(2)}).ft().get().isValid());
+
+	auto after = getServerStats();
+	auto addBefore = findStats(before, "add");
+	auto addAfter = findStats(after, "add");
+	CHECK_EQUAL(11, addAfter.calls - addBefore.calls);
+	CHECK_EQUAL(0, addAfter.errors - addBefore.errors);
+	CHECK(addAfter.callBytes > addBefore.callBytes);
+	CHECK(addAfter.replyBytes > addBefore.replyBytes);
+	CHECK_EQUAL(addAfter.calls, addAfter.getLatencyCount());
+	CHECK_EQUAL(1, findStats(after, "intTestException").errors - findStats(before, "intTestException").errors);
+	CHECK(findStats(after, "__stats").calls >= 1);
+
+	// Client side stats are per connection
+	auto clientStats = clientCon->remotePrc.getStats();
+	CHECK_EQUAL(10, findStats(clientStats, "add").calls);
+	CHECK_EQUAL(1, findStats(clientStats, "intTestException").errors);
+	CHECK_EQUAL(3, findStats(clientStats, "genericRPC").calls);
+	CHECK(findStats(clientStats, "add").getPercentile(50) > 0);
+
+	io.stop();
+	iothread.join();
+}
+#endif
+
+TEST(TransportMetrics)
+{
+	using namespace cz::rpc;
+
+	ServerProcess<Tester, void> server(TEST_PORT);
+
+	ASIO::io_service io;
+	std::thread iothread = std::thread([&io]
+	{
+		ASIO::io_service::work w(io);
+		io.run();
+	});
+
+	auto clientCon = AsioTransport<void, Tester>::create(io, "127.0.0.1", TEST_PORT).get();
+	auto trp = static_cast<BaseAsioTransport*>(clientCon->transport.get());
+
+	for (int i = 0; i < 10; i++)
+		CHECK_EQUAL(3, CZRPC_CALL(*clientCon, add, 1, 2).ft().get().get());
+
+	// The reply to the last call can be processed before the completion handler of its write runs, so give
+	// the handler a chance to run
+	TransportMetrics client;
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+	while (trp->getMetrics(client) && client.outQueueFrames && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	CHECK(trp->getMetrics(client));
+	CHECK_EQUAL(1, client.transports);
+	CHECK_EQUAL(10, client.framesSent);
+	CHECK_EQUAL(10, client.framesReceived);
+	CHECK_EQUAL(client.framesSent, client.writes);
+	CHECK_EQUAL(client.framesReceived * 2, client.reads);
+	CHECK(client.bytesSent > 0 && client.bytesReceived > 0);
+	CHECK(client.outQueuePeakFrames >= 1);
+	CHECK_EQUAL(0, client.outQueueFrames);
+	CHECK_EQUAL(0, client.closes[static_cast<int>(CloseReason::Local)]);
+
+	// The server side, as seen by the server itself
+	TransportMetrics serverSide;
+	auto res = CZRPC_CALLGENERIC(*clientCon, "__transportMetrics").ft().get();
+	CHECK(transportMetricsFromAny(res.get(), serverSide));
+	CHECK_EQUAL(11, serverSide.framesReceived);
+	CHECK_EQUAL(10, serverSide.framesSent);
+	CHECK_EQUAL(client.bytesReceived, serverSide.bytesSent);
+	CHECK(serverSide.bytesReceived > client.bytesSent);
+
+	// Acceptor metrics include the connections already closed
+	CHECK_EQUAL(1, server.acceptor().getMetrics().transports);
+	clientCon->transport->close();
+	for (int i = 0; i < 200 && server.acceptor().getMetrics().closes[static_cast<int>(CloseReason::Peer)] == 0; i++)
+		UnitTest::TimeHelpers::SleepMs(10);
+	auto acceptorMetrics = server.acceptor().getMetrics();
+	CHECK_EQUAL(1, acceptorMetrics.transports);
+	CHECK_EQUAL(1, acceptorMetrics.closes[static_cast<int>(CloseReason::Peer)]);
+	CHECK_EQUAL(11, acceptorMetrics.framesReceived);
+	CHECK(trp->getCloseReason() == CloseReason::Local);
+
+	io.stop();
+	iothread.join();
+}
+
+// Frames bigger than the maximum chunk size are sent in chunks, and don't hold back the frames queued behind them
+// Whole frames are read as they arrive, so a peer claiming a huge frame can't make us allocate it all up front
+TEST(OversizedFrame)
+{
+	using namespace cz::rpc;
+
+	ServerProcess<Tester, void> server(TEST_PORT);
+	server.acceptor().setMaxChunkSize(BaseAsioTransport::kMaxChunkSize);
+
+	ASIO::io_service io;
+	std::thread iothread = std::thread([&io]
+	{
+		ASIO::io_service::work w(io);
+		io.run();
+	});
+
+	// Whole frames bigger than one read step still arrive intact
+	auto clientCon = AsioTransport<void, Tester>::create(io, "127.0.0.1", TEST_PORT).get();
+	auto trp = static_cast<BaseAsioTransport*>(clientCon->transport.get());
+	trp->setMaxChunkSize(BaseAsioTransport::kMaxChunkSize);
+	std::vector<int> big(1024 * 1024);
+	for (int i = 0; i < static_cast<int>(big.size()); i++)
+		big[i] = i;
+	CHECK(CZRPC_CALL(*clientCon, testVector1, big).ft().get().get() == big);
+	TransportMetrics client;
+	CHECK(trp->getMetrics(client));
+	CHECK_EQUAL(0, client.chunksSent);
+	CHECK_EQUAL(0, client.chunksReceived);
+
+	// A peer claiming a frame of almost 2GB, but only sending a bit of it before going away
+	ASIO::ip::tcp::socket s(io);
+	s.connect(ASIO::ip::tcp::endpoint(ASIO::ip::address_v4::loopback(), TEST_PORT));
+	std::vector<char> data(1024);
+	uint32_t size = details::ChunkHeader::kChunkBit - 1;
+	memcpy(&data[0], &size, sizeof(size));
+	ASIO::write(s, ASIO::buffer(data));
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	s.close();
+
+	CHECK_EQUAL(3, CZRPC_CALL(*clientCon, add, 1, 2).ft().get().get());
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+	while (server.acceptor().getMetrics().closes[static_cast<int>(CloseReason::Peer)] == 0 &&
+		   std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	CHECK_EQUAL(1, server.acceptor().getMetrics().closes[static_cast<int>(CloseReason::Peer)]);
+
+	io.stop();
+	iothread.join();
+}
+
+TEST(Chunks)
+{
+	using namespace cz::rpc;
+
+	ServerProcess<Tester, void> server(TEST_PORT);
+	server.acceptor().setMaxChunkSize(4096);
+
+	ASIO::io_service io;
+	std::thread iothread = std::thread([&io]
+	{
+		ASIO::io_service::work w(io);
+		io.run();
+	});
+
+	auto clientCon = AsioTransport<void, Tester>::create(io, "127.0.0.1", TEST_PORT).get();
+	auto trp = static_cast<BaseAsioTransport*>(clientCon->transport.get());
+	trp->setMaxChunkSize(4096);
+
+	std::vector<int> big(4 * 1024 * 1024);
+	for (int i = 0; i < static_cast<int>(big.size()); i++)
+		big[i] = i;
+
+	// The small calls are queued after the big one, but go out in between its chunks, so their replies arrive
+	// first
+	const int numSmall = 10;
+	std::atomic<int> smallDone(0);
+	int smallBeforeBig = -1;
+	Semaphore bigDone;
+	CZRPC_CALL(*clientCon, testVector1, big).async([&](Result<std::vector<int>> res)
+	{
+		CHECK(res.get() == big);
+		smallBeforeBig = smallDone;
+		bigDone.notify();
+	});
+	for (int i = 0; i < numSmall; i++)
+	{
+		CZRPC_CALL(*clientCon, add, i, 1).async([&, i](Result<int> res)
+		{
+			CHECK_EQUAL(i + 1, res.get());
+			++smallDone;
+		});
+	}
+	bigDone.wait();
+	CHECK(smallBeforeBig > 0);
+
+	// Chunks can span the prefix and the shared payload
+	Semaphore sharedDone;
+	CZRPC_SHAREDCALL(Tester, testVector1, big).send(*clientCon, [&](Result<std::vector<int>> res)
+	{
+		CHECK(res.get() == big);
+		sharedDone.notify();
+	});
+	sharedDone.wait();
+	CHECK_EQUAL(3, CZRPC_CALL(*clientCon, add, 1, 2).ft().get().get());
+
+	TransportMetrics client;
+	CHECK(trp->getMetrics(client));
+	size_t minChunks = 2 * big.size() * sizeof(int) / 4096;
+	CHECK(client.chunksSent >= minChunks);
+	CHECK(client.chunksReceived >= minChunks);
+	CHECK(client.writes > client.framesSent);
+	CHECK_EQUAL(numSmall + 3, client.framesReceived);
+
+	// Stream frames bigger than a chunk still arrive in order, and the stream's end doesn't overtake them
+	{
+		const int count = 60000;
+		std::vector<int> items = CZRPC_CALL(*clientCon, testStream, count, 200000, -1).ft().get().get();
+		CHECK_EQUAL(count, (int)items.size());
+		bool ordered = true;
+		for (int i = 0; i < (int)items.size(); i++)
+			ordered = ordered && items[i] == i;
+		CHECK(ordered);
+	}
+
+	// Same with a Low priority stream, while Urgent calls overtake it
+	{
+		Table<Tester>::setPriority(Table<Tester>::RPCId::testStream, Priority::Low);
+		const int count = 60000;
+		auto ft = CZRPC_CALL(*clientCon, testStream, count, 200000, -1).ft();
+		for (int i = 0; i < numSmall; i++)
+			CHECK_EQUAL(i + 1, CZRPC_CALL(*clientCon, add, i, 1).priority(Priority::Urgent).ft().get().get());
+		std::vector<int> items = ft.get().get();
+		Table<Tester>::setPriority(Table<Tester>::RPCId::testStream, Priority::Normal);
+		CHECK_EQUAL(count, (int)items.size());
+		bool ordered = true;
+		for (int i = 0; i < (int)items.size(); i++)
+			ordered = ordered && items[i] == i;
+		CHECK(ordered);
+	}
+
+	io.stop();
+	iothread.join();
+}
+
+// Urgent calls overtake the bulk calls queued before them
+TEST(Priorities)
+{
+	using namespace cz::rpc;
+
+	ServerProcess<Tester, void> server(TEST_PORT);
+
+	ASIO::io_service io;
+	std::thread iothread = std::thread([&io]
+	{
+		ASIO::io_service::work w(io);
+		io.run();
+	});
+
+	auto clientCon = AsioTransport<void, Tester>::create(io, "127.0.0.1", TEST_PORT).get();
+	auto trp = static_cast<BaseAsioTransport*>(clientCon->transport.get());
+
+	// Both sides use the same table, so the replies are sent with Low priority too
+	Table<Tester>::setPriority(Table<Tester>::RPCId::testVector1, Priority::Low);
+
+	const int numBulk = 32;
+	std::vector<int> big(256 * 1024);
+	ZeroSemaphore pending;
+	std::atomic<int> bulkDone(0);
+	for (int i = 0; i < numBulk; i++)
+	{
+		pending.increment();
+		CZRPC_CALL(*clientCon, testVector1, big).async([&](Result<std::vector<int>> res)
+		{
+			CHECK(res.get().size() == big.size());
+			++bulkDone;
+			pending.decrement();
+		});
+	}
+
+	CHECK_EQUAL(3, CZRPC_CALL(*clientCon, add, 1, 2).priority(Priority::Urgent).ft().get().get());
+	CHECK(bulkDone < numBulk);
+	pending.wait();
+	Table<Tester>::setPriority(Table<Tester>::RPCId::testVector1, Priority::Normal);
+
+	TransportMetrics client;
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+	while (trp->getMetrics(client) && client.outQueueFrames && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	auto& urgent = client.lanes[static_cast<int>(Priority::Urgent)];
+	auto& low = client.lanes[static_cast<int>(Priority::Low)];
+	CHECK_EQUAL(1, urgent.framesSent);
+	CHECK_EQUAL(numBulk, low.framesSent);
+	CHECK_EQUAL(0, client.lanes[static_cast<int>(Priority::Normal)].framesSent);
+	CHECK_EQUAL(client.bytesSent, urgent.bytesSent + low.bytesSent);
+#if CZRPC_STATS
+	CHECK(urgent.queuedTimeMax < low.queuedTimeMax);
+#endif
+
+	io.stop();
+	iothread.join();
+}
+
+// One connection with lots of replies queued doesn't get processed all in one go, ahead of another connection
+TEST(ProcessBudget)
+{
+	using namespace cz::rpc;
+
+	ServerProcess<Tester, void> server(TEST_PORT);
+
+	ASIO::io_service io;
+	std::thread iothread = std::thread([&io]
+	{
+		ASIO::io_service::work w(io);
+		io.run();
+	});
+
+	// Both connections are dispatched by the same executor, with a budget of a few frames per dispatch
+	Monitor<std::queue<std::function<void()>>> tasks;
+	auto executor = [&](std::function<void()> task)
+	{
+		tasks([&](std::queue<std::function<void()>>& q)
+		{
+			q.push(std::move(task));
+		});
+	};
+	ProcessBudget budget;
+	budget.maxFrames = 4;
+
+	std::shared_ptr<Connection<void, Tester>> cons[2];
+	for (auto&& con : cons)
+	{
+		con = AsioTransport<void, Tester>::create(io, "127.0.0.1", TEST_PORT).get();
+		auto trp = static_cast<BaseAsioTransport*>(con->transport.get());
+		trp->setProcessBudget(budget);
+		trp->setExecutor(executor);
+	}
+
+	const int numCalls = 10;
+	std::atomic<int> busyDone(0);
+	std::atomic<bool> quietDone(false);
+	for (int i = 0; i < numCalls; i++)
+	{
+		CZRPC_CALL(*cons[0], add, i, 1).async([&, i](Result<int> res)
+		{
+			CHECK_EQUAL(busyDone, i);
+			CHECK_EQUAL(i + 1, res.get());
+			++busyDone;
+		});
+	}
+	CZRPC_CALL(*cons[1], add, 1, 2).async([&](Result<int> res)
+	{
+		CHECK_EQUAL(3, res.get());
+		// The busy connection had to give us a turn before processing all its replies
+		CHECK(busyDone < numCalls);
+		quietDone = true;
+	});
+
+	// Wait for all the replies to be queued, so everything is ready to process when we start running tasks
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	auto queued = [&](int idx)
+	{
+		TransportMetrics metrics;
+		static_cast<BaseAsioTransport*>(cons[idx]->transport.get())->getMetrics(metrics);
+		return metrics.inQueueFrames;
+	};
+	while ((queued(0) != numCalls || queued(1) != 1) && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	// Each dispatch processes up to the budget, and schedules another one (at the back of the queue) for the rest
+	int passes = 0;
+	while (busyDone != numCalls || !quietDone)
+	{
+		std::function<void()> task;
+		tasks([&](std::queue<std::function<void()>>& q)
+		{
+			if (q.size())
+			{
+				task = std::move(q.front());
+				q.pop();
+			}
+		});
+
+		if (!task)
+		{
+			UnitTest::TimeHelpers::SleepMs(1);
+			continue;
+		}
+
+		task();
+		passes++;
+		CHECK(busyDone <= passes * 4);
+	}
+	CHECK_EQUAL(4, passes);
+
+	io.stop();
+	iothread.join();
+}
+
+// Capture the server side traffic, and replay it into another object
+TEST(CaptureReplay)
+{
+	using namespace cz::rpc;
+	const char* filename = "czrpc_test_capture.bin";
+
+	auto writer = std::make_shared<CaptureWriter>();
+	CHECK(writer->open(filename));
+	{
+		ServerProcess<Tester, void> server(TEST_PORT, "", [writer](std::shared_ptr<Transport> trp)
+		{
+			return std::make_shared<CaptureTransport>(std::move(trp), writer);
+		});
+
+		ASIO::io_service io;
+		std::thread iothread = std::thread([&io]
+		{
+			ASIO::io_service::work w(io);
+			io.run();
+		});
+
+		auto clientCon = AsioTransport<void, Tester>::create(io, "127.0.0.1", TEST_PORT).get();
+		for (int i = 0; i < 10; i++)
+			CHECK_EQUAL(3, CZRPC_CALL(*clientCon, add, 1, 2).ft().get().get());
+		CHECK(CZRPC_CALL(*clientCon, intTestException, true).ft().get().isException());
+
+		io.stop();
+		iothread.join();
+	}
+	writer->close();
+
+	{
+		CaptureReader reader;
+		CHECK(reader.open(filename));
+		CaptureFrame frame;
+		int in = 0, out = 0;
+		while (reader.next(frame))
+		{
+			CHECK_EQUAL(0, frame.connection);
+			if (frame.direction == CaptureDirection::In)
+				in++;
+			else
+				out++;
+		}
+		CHECK_EQUAL(11, in);
+		CHECK_EQUAL(11, out);
+	}
+
+	{
+		CaptureReader reader;
+		CHECK(reader.open(filename));
+		Tester obj;
+		Replayer<Tester> replayer(obj, 0);
+		std::atomic<int> replies(0), errors(0);
+		replayer.setOnReply([&](bool success, std::chrono::steady_clock::duration)
+		{
+			replies++;
+			if (!success)
+				errors++;
+		});
+		CHECK_EQUAL(11, replayer.run(reader));
+		CHECK_EQUAL(11, replies.load());
+		CHECK_EQUAL(1, errors.load());
+		CHECK_EQUAL(0, replayer.getPending());
+	}
+
+	remove(filename);
+}
+
+TEST(NetEmulator)
+{
+	using namespace cz::rpc;
+	using Clock = std::chrono::steady_clock;
+
+	ServerProcess<Tester, void> server(TEST_PORT);
+
+	ASIO::io_service io;
+	std::thread iothread = std::thread([&io]
+	{
+		ASIO::io_service::work w(io);
+		io.run();
+	});
+
+	NetEmulatorSettings settings;
+	settings.latency = std::chrono::milliseconds(30);
+	auto clientCon = AsioTransport<void, Tester>::create(io, "127.0.0.1", TEST_PORT,
+		[&](std::shared_ptr<Transport> trp)
+	{
+		return std::make_shared<NetEmulatorTransport>(io, std::move(trp), settings);
+	}).get();
+	auto emulator = findTransport<NetEmulatorTransport>(clientCon->transport.get());
+	CHECK(emulator != nullptr);
+	CHECK(findTransport<BaseAsioTransport>(clientCon->transport.get()) != nullptr);
+
+	auto start = Clock::now();
+	CHECK_EQUAL(3, CZRPC_CALL(*clientCon, add, 1, 2).ft().get().get());
+	CHECK(Clock::now() - start >= std::chrono::milliseconds(30));
+
+	// Jitter doesn't reorder calls
+	settings.latency = std::chrono::milliseconds(1);
+	settings.jitter = std::chrono::milliseconds(20);
+	emulator->setSettings(settings);
+	const int numCalls = 20;
+	ZeroSemaphore pending;
+	std::atomic<int> done(0);
+	for (int i = 0; i < numCalls; i++)
+	{
+		pending.increment();
+		CZRPC_CALL(*clientCon, add, i, 1).async([&, i](Result<int> res)
+		{
+			CHECK_EQUAL(done, i);
+			CHECK_EQUAL(i + 1, res.get());
+			++done;
+			pending.decrement();
+		});
+	}
+	pending.wait();
+	CHECK_EQUAL(numCalls, done.load());
+
+	// Two calls of about 10KB each, at 100KB/s
+	settings = NetEmulatorSettings();
+	settings.bandwidth = 100 * 1000;
+	emulator->setSettings(settings);
+	start = Clock::now();
+	std::vector<int> data(2500);
+	auto ft1 = CZRPC_CALL(*clientCon, testVector1, data).ft();
+	auto ft2 = CZRPC_CALL(*clientCon, testVector1, data).ft();
+	CHECK(ft1.get().isValid() && ft2.get().isValid());
+	CHECK(Clock::now() - start >= std::chrono::milliseconds(190));
+
+	// Frames waiting to be delivered count towards the transport's limits
+	settings = NetEmulatorSettings();
+	settings.latency = std::chrono::milliseconds(50);
+	settings.maxQueuedBytes = 16 * 1024;
+	emulator->setSettings(settings);
+	CHECK(emulator->isWritable());
+	std::vector<int> big(8 * 1024);
+	auto ft3 = CZRPC_CALL(*clientCon, testVector1, big).ft();
+	CHECK(emulator->isWritable() == false);
+	Semaphore writable;
+	emulator->waitWritable([&]
+	{
+		writable.notify();
+	});
+	writable.wait();
+	CHECK(emulator->isWritable());
+	CHECK(ft3.get().isValid());
+
+	io.stop();
+	iothread.join();
+}
+
+TEST(MPSCQueue)
+{
+	using namespace cz::rpc;
+
+	// Each producer pushes increasing values, which need to be popped in the same order
+	const int numProducers = 4;
+	const int numItems = 20000;
+	MPSCQueue<std::pair<int, int>> q;
+	std::vector<std::thread> producers;
+	for (int p = 0; p < numProducers; p++)
+	{
+		producers.emplace_back([&q, p]
+		{
+			for (int i = 0; i < numItems; i++)
+				q.push(std::make_pair(p, i));
+		});
+	}
+
+	std::vector<int> next(numProducers, 0);
+	int popped = 0;
+	std::pair<int, int> v;
+	while (popped < numProducers * numItems)
+	{
+		if (!q.pop(v))
+			continue;
+		CHECK_EQUAL(next[v.first], v.second);
+		next[v.first] = v.second + 1;
+		popped++;
+	}
+	CHECK(q.empty());
+
+	for (auto&& th : producers)
+		th.join();
+}
+
+TEST(RCU)
+{
+	using namespace cz::rpc;
+
+	// Every version has all elements set to the same value, so readers can detect torn or deleted data
+	RCU<std::vector<int>> data(std::vector<int>(64, 0));
+	std::atomic<bool> finish(false);
+	std::atomic<int> bad(0);
+	std::vector<std::thread> readers;
+	for (int r = 0; r < 3; r++)
+	{
+		readers.emplace_back([&]
+		{
+			while (!finish)
+			{
+				data.read([&](const std::vector<int>& v)
+				{
+					for (auto&& i : v)
+					{
+						if (i != v[0])
+							bad++;
+					}
+				});
+			}
+		});
+	}
+
+	for (int i = 1; i <= 500; i++)
+	{
+		data.update([i](std::vector<int>& v)
+		{
+			std::fill(v.begin(), v.end(), i);
+			return true;
+		});
+	}
+	CHECK(data.update([](std::vector<int>&) { return false; }) == false);
+
+	finish = true;
+	for (auto&& th : readers)
+		th.join();
+	CHECK_EQUAL(0, bad.load());
+	CHECK_EQUAL(500, data.read([](const std::vector<int>& v) { return v[0]; }));
+}
+
+TEST(ObjectData)
+{
+	using namespace cz::rpc;
+
+	int obj;
+	ObjectData a(&obj);
+	CHECK(a.setProperty("prop1", Any(1)) == true);
+	CHECK(a.setProperty("prop1", Any(2)) == false);
+	CHECK(std::string(a.getProperty("prop1").toString()) == "1");
+	CHECK(a.setProperty("prop1", Any(2), true) == true);
+
+	// Other instances for the same object share the data
+	ObjectData b(&obj);
+	PropertyKey key("prop1");
+	CHECK(std::string(b.getProperty(key).toString()) == "2");
+	CHECK(b.setProperty(PropertyKey("prop2"), Any("Hello")) == true);
+	CHECK(std::string(a.getProperty("prop2").toString()) == "Hello");
+
+	// Reading unknown properties doesn't intern the names
+	CHECK(a.getProperty("ObjectDataUnknownProperty").getType() == Any::Type::None);
+	CHECK(PropertyKey::find("ObjectDataUnknownProperty").isValid() == false);
+	CHECK(PropertyKey::find("prop1") == key);
+
+	// Different object
+	int obj2;
+	ObjectData c(&obj2);
+	CHECK(c.getProperty(key).getType() == Any::Type::None);
+
+	a.setAuthToken("token");
+	CHECK(b.checkAuthToken("token"));
+	CHECK(b.getAuthToken() == "token");
+	CHECK(c.checkAuthToken("token") == false);
+
+	// A slow watcher doesn't hold back other threads changing properties, and changes are still seen in order.
+	// Watchers can change properties too.
+	std::vector<std::string> seen;
+	std::promise<void> entered, release;
+	auto releaseFt = release.get_future();
+	auto watcher = std::make_shared<ObjectData::WatchHandler>([&](const PropertyKey&, const Any& val)
+	{
+		seen.push_back(val.toString());
+		if (seen.size() == 1)
+		{
+			entered.set_value();
+			releaseFt.wait();
+		}
+		else
+		{
+			a.setProperty("prop4", Any(val.toString()), true);
+		}
+	});
+	std::string prop4;
+	auto watcher4 = std::make_shared<ObjectData::WatchHandler>([&](const PropertyKey&, const Any& val)
+	{
+		prop4 = val.toString();
+	});
+	a.watchProperty(PropertyKey("prop3"), watcher);
+	a.watchProperty(PropertyKey("prop4"), watcher4);
+	std::thread th([&]
+	{
+		a.setProperty("prop3", Any(1), true);
+	});
+	entered.get_future().wait();
+	CHECK(b.setProperty("prop3", Any(2), true) == true);
+	CHECK(b.setProperty("prop3", Any(3), true) == true);
+	release.set_value();
+	th.join();
+	CHECK(seen == std::vector<std::string>({"1", "2", "3"}));
+	CHECK_EQUAL("3", prop4);
+}
+
+// Several threads calling through the same connection at the same time
+TEST(ConcurrentCallers)
+{
+	using namespace cz::rpc;
+
+	ServerProcess<Tester, void> server(TEST_PORT);
+
+	ASIO::io_service io;
+	std::thread iothread = std::thread([&io]
+	{
+		ASIO::io_service::work w(io);
+		io.run();
+	});
+
+	auto clientCon = AsioTransport<void, Tester>::create(io, "127.0.0.1", TEST_PORT).get();
+
+	const int numThreads = 8;
+	const int numCalls = 2000;
+	ZeroSemaphore pending;
+	std::atomic<int> errors(0);
+	std::vector<std::thread> callers;
+	for (int t = 0; t < numThreads; t++)
+	{
+		callers.emplace_back([&, t]
+		{
+			for (int i = 0; i < numCalls; i++)
+			{
+				pending.increment();
+				CZRPC_CALL(*clientCon, add, t, i).async([&, r = t + i](Result<int> res)
+				{
+					if (!res.isValid() || res.get() != r)
+						errors++;
+					pending.decrement();
+				});
+			}
+		});
+	}
+
+	for (auto&& th : callers)
+		th.join();
+	pending.wait();
+	CHECK_EQUAL(0, errors.load());
+
+	TransportMetrics metrics;
+	clientCon->transport->getMetrics(metrics);
+	CHECK_EQUAL(static_cast<uint64_t>(numThreads * numCalls), metrics.framesSent);
+	CHECK_EQUAL(0, metrics.outQueueFrames);
+
+	io.stop();
+	iothread.join();
+}
+
+TEST(InlineCall)
+{
+	using namespace cz::rpc;
+
+	ServerProcess<Tester, void> server(TEST_PORT);
+
+	// No thread runs the io_service, so the client side of the calls runs entirely in this thread
+	ASIO::io_service io;
+	auto conFt = AsioTransport<void, Tester>::create(io, "127.0.0.1", TEST_PORT);
+	while (conFt.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+		io.run_one();
+	auto clientCon = conFt.get();
+	CHECK(clientCon != nullptr);
+
+	for (int i = 0; i < 10; i++)
+		CHECK_EQUAL(i + 1, CZRPC_CALL(*clientCon, add, i, 1).get().get());
+
+	auto res = CZRPC_CALL(*clientCon, intTestException, true).get();
+	CHECK(res.isException());
+	CHECK_EQUAL("Testing exception", res.getException());
+
+	// Replies to calls sent with other methods are processed too
+	auto ft = CZRPC_CALL(*clientCon, add, 2, 3).ft();
+	CHECK_EQUAL(3, CZRPC_CALL(*clientCon, add, 1, 2).get().get());
+	CHECK(ft.isReady());
+	CHECK_EQUAL(5, ft.get().get());
+
+	// Gives up once the timeout expires, and later replies are ignored
+	CHECK(CZRPC_CALL(*clientCon, testSleep, 200).get(std::chrono::milliseconds(10)).isAborted());
+	CHECK_EQUAL(3, CZRPC_CALL(*clientCon, add, 1, 2).get().get());
+
+	// Sending with a full queue and OverflowPolicy::Block keeps driving the transport, since nothing else drains it
+	auto trp = static_cast<BaseAsioTransport*>(clientCon->transport.get());
+	SendQueueLimits limits;
+	limits.highWatermarkBytes = 64 * 1024;
+	limits.lowWatermarkBytes = 0;
+	limits.policy = OverflowPolicy::Block;
+	trp->setSendQueueLimits(limits);
+	std::vector<int> big(256 * 1024);
+	auto bigFt = CZRPC_CALL(*clientCon, testVector1, big).ft();
+	CHECK(trp->isWritable() == false);
+	CHECK_EQUAL(3, CZRPC_CALL(*clientCon, add, 1, 2).get().get());
+	CHECK(CZRPC_CALL(*clientCon, testVector1, big).get().get().size() == big.size());
+	CHECK(bigFt.isReady());
+
+	// Once the transport closes, the call is aborted instead of blocking forever
+	clientCon->transport->close();
+	CHECK(CZRPC_CALL(*clientCon, add, 1, 2).get().isAborted());
+}
+
+TEST(Future)
+{
+	using namespace cz::rpc;
+
+	auto ft = Future<Result<int>>::create();
+	CHECK(ft.first.isValid());
+	CHECK(!ft.first.isReady());
+	CHECK(!ft.first.waitFor(std::chrono::milliseconds(10)));
+
+	std::thread th([pr = std::move(ft.second)]
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		pr.setValue(Result<int>(3));
+	});
+	// This parks the thread, since the value takes a while
+	ft.first.wait();
+	CHECK(ft.first.isReady());
+	CHECK_EQUAL(3, ft.first.get().get());
+	CHECK(!ft.first.isValid());
+	th.join();
+
+	// The promise can outlive the future
+	{
+		auto ft2 = Future<Result<int>>::create();
+		ft2.first = std::move(ft.first);
+		ft2.second.setValue(Result<int>(4));
+	}
+}
+
+TEST(ServerStream)
+{
+	using namespace cz::rpc;
+
+	ServerProcess<Tester, void> server(TEST_PORT);
+	auto& obj = server.obj();
+
+	ASIO::io_service io;
+	std::thread iothread = std::thread([&io]
+	{
+		ASIO::io_service::work w(io);
+		io.run();
+	});
+
+	auto clientCon = AsioTransport<void, Tester>::create(io, "127.0.0.1", TEST_PORT).get();
+	auto checkSequence = [](const std::vector<int>& v, int count)
+	{
+		CHECK_EQUAL(count, (int)v.size());
+		for (int i = 0; i < (int)v.size(); i++)
+		{
+			if (v[i] != i)
+				return false;
+		}
+		return true;
+	};
+
+	// Waiting for the whole stream, like any other call
+	CHECK(checkSequence(CZRPC_CALL(*clientCon, testStream, 1000, 64, -1).ft().get().get(), 1000));
+	CHECK(checkSequence(CZRPC_CALL(*clientCon, testStream, 0, 64, -1).ft().get().get(), 0));
+
+	// One call per element
+	{
+		std::vector<int> items;
+		auto done = Future<Result<void>>::create();
+		CZRPC_CALL(*clientCon, testStream, 1000, 64, -1).stream(
+			[&items](int v)
+		{
+			items.push_back(v);
+		},
+			[pr = std::move(done.second)](Result<void>&& res)
+		{
+			pr.setValue(std::move(res));
+		});
+		CHECK(done.first.get().isValid());
+		CHECK(checkSequence(items, 1000));
+	}
+
+	// The server only gets as far as the credit allows, until the reader consumes the elements.
+	// Frames of 64 bytes hold 14 integers (the frame header and type take 9 bytes)
+	{
+		const int count = 100000;
+		auto reader = CZRPC_CALL(*clientCon, testStream, count, 64, -1).reader();
+		UnitTest::TimeHelpers::SleepMs(100);
+		CHECK_EQUAL(details::kStreamWindow * 14, (unsigned)obj.streamProduced.load());
+
+		std::vector<int> items;
+		int v;
+		while (reader.next(v))
+			items.push_back(v);
+		CHECK(checkSequence(items, count));
+	}
+
+	// Destroying the reader early cancels the stream
+	{
+		auto reader = CZRPC_CALL(*clientCon, testStream, 100000, 64, -1).reader();
+		int v;
+		CHECK(reader.next(v) && v == 0);
+	}
+	UnitTest::TimeHelpers::SleepMs(100);
+	CHECK(obj.streamProduced.load() < 1000);
+	CHECK_EQUAL(3, CZRPC_CALL(*clientCon, add, 1, 2).ft().get().get());
+
+	// Exceptions finish the stream, after the elements sent so far
+	{
+		auto res = CZRPC_CALL(*clientCon, testStream, 1000, 64, 500).ft().get();
+		CHECK(res.isException());
+		CHECK_EQUAL("Testing exception", res.getException());
+
+		auto reader = CZRPC_CALL(*clientCon, testStream, 1000, 64, 500).reader();
+		int v;
+		int received = 0;
+		bool thrown = false;
+		try
+		{
+			while (reader.next(v))
+				received++;
+		}
+		catch (const Exception&)
+		{
+			thrown = true;
+		}
+		CHECK(thrown);
+		CHECK(received > 0 && received <= 500);
+	}
+
+	// Generic calls get all the elements at once
+	{
+		Any res = CZRPC_CALLGENERIC(*clientCon, "testStream", std::vector<Any>{Any(5), Any(64), Any(-1)}).ft().get().get();
+		CHECK(res.getArray() && res.getArray()->size() == 5);
+		CHECK(res == Any(Any::Array{Any(0), Any(1), Any(2), Any(3), Any(4)}));
+	}
+
+#if CZRPC_COROUTINES
+	{
+		auto reader = CZRPC_CALL(*clientCon, testStream, 1000, 64, -1).reader();
+		auto sum = [&reader]() -> Task<int>
+		{
+			int res = 0;
+			while (auto v = co_await reader.nextAsync())
+				res += *v;
+			co_return res;
+		};
+
+		auto ft = Future<int>::create();
+		sum().detach([pr = std::move(ft.second)](details::TaskPromise<int>& p)
+		{
+			pr.setValue(p.get());
+		});
+		CHECK_EQUAL(999 * 1000 / 2, ft.first.get());
+	}
+#endif
+
+	io.stop();
+	iothread.join();
+}
+
+TEST(ClientStream)
+{
+	using namespace cz::rpc;
+
+	ServerProcess<Tester, void> server(TEST_PORT);
+	auto& obj = server.obj();
+
+	ASIO::io_service io;
+	std::thread iothread = std::thread([&io]
+	{
+		ASIO::io_service::work w(io);
+		io.run();
+	});
+
+	auto clientCon = AsioTransport<void, Tester>::create(io, "127.0.0.1", TEST_PORT).get();
+	const int count = 100000;
+
+	// The caller only gets as far as the credit allows, until the callee consumes the elements.
+	// Frames of 64 bytes hold 14 integers
+	{
+		auto up = CZRPC_CALL(*clientCon, testUpload, 0).upload(64);
+		int i = 0;
+		while (up.isWritable())
+			CHECK(up.write(i++));
+		CHECK_EQUAL(details::kStreamWindow * 14, (unsigned)i);
+
+		obj.uploadGate.notify();
+		while (i < count)
+			CHECK(up.write(i++));
+		auto res = up.finish().get();
+		CHECK(res.isValid());
+		CHECK_EQUAL(count, res.get());
+	}
+
+	// Without "upload", it's an empty upload
+	obj.uploadGate.notify();
+	CHECK_EQUAL(0, CZRPC_CALL(*clientCon, testUpload, 0).ft().get().get());
+
+	// The callee failing stops the upload
+	{
+		obj.uploadGate.notify();
+		auto up = CZRPC_CALL(*clientCon, testUpload, 1).upload(64);
+		bool ok = true;
+		for (int i = 0; i < count && ok; i++)
+			ok = up.write(i);
+		CHECK(!ok);
+		auto res = up.finish().get();
+		CHECK(res.isException());
+		CHECK_EQUAL("Out of sequence", res.getException());
+	}
+
+	// Destroying the upload early cancels it
+	{
+		obj.uploadGate.notify();
+		auto up = CZRPC_CALL(*clientCon, testUpload, 0).upload(64);
+		for (int i = 0; i < 1000; i++)
+			CHECK(up.write(i));
+	}
+	CHECK_EQUAL(3, CZRPC_CALL(*clientCon, add, 1, 2).ft().get().get());
+
+	// Client streams can't be used with generic calls
+	{
+		auto res = CZRPC_CALLGENERIC(*clientCon, "testUpload", std::vector<Any>{Any(0)}).ft().get();
+		CHECK(res.isException());
+	}
+
+	io.stop();
+	iothread.join();
+}
+
+TEST(Channel)
+{
+	using namespace cz::rpc;
+
+	ServerProcess<Tester, void> server(TEST_PORT);
+	auto& obj = server.obj();
+
+	ASIO::io_service io;
+	std::thread iothread = std::thread([&io]
+	{
+		ASIO::io_service::work w(io);
+		io.run();
+	});
+
+	auto clientCon = AsioTransport<void, Tester>::create(io, "127.0.0.1", TEST_PORT).get();
+
+	// Writing and reading at the same time, through a window much smaller than the data
+	auto echo = [&clientCon](int count)
+	{
+		auto ch = CZRPC_CALL(*clientCon, testChannel, 10).channel(64);
+		std::thread writer([&ch, count]
+		{
+			for (int i = 0; i < count; i++)
+				ch.write(i);
+			ch.close();
+		});
+
+		int received = 0;
+		int v;
+		bool ok = true;
+		while (ch.next(v))
+			ok = ok && (v == received++ + 10);
+		writer.join();
+		return ok && received == count;
+	};
+	CHECK(echo(10000));
+
+	// A channel that is not being read stalls once its window is full, without affecting anything else in the
+	// connection
+	{
+		auto feed = CZRPC_CALL(*clientCon, testFeed).channel();
+		obj.feedReady.wait();
+		int count = 0;
+		while (obj.feed.isWritable())
+			CHECK(obj.feed.write(count++));
+		CHECK(count > 0);
+		UnitTest::TimeHelpers::SleepMs(50);
+		CHECK(!obj.feed.isWritable());
+
+		CHECK_EQUAL(3, CZRPC_CALL(*clientCon, add, 1, 2).ft().get().get());
+		CHECK(echo(1000));
+
+		obj.feed.close();
+		int received = 0;
+		int v;
+		while (feed.next(v))
+		{
+			if (v != received)
+				break;
+			received++;
+		}
+		CHECK_EQUAL(count, received);
+	}
+
+	// Destroying the channel cancels it at the other side
+	{
+		auto feed = CZRPC_CALL(*clientCon, testFeed).channel();
+		obj.feedReady.wait();
+		CHECK(obj.feed.write(1));
+	}
+	UnitTest::TimeHelpers::SleepMs(100);
+	CHECK(!obj.feed.write(1));
+
+	// Without "channel", the callee sees its input closed right away
+	CHECK(CZRPC_CALL(*clientCon, testChannel, 0).ft().get().isValid());
+
+	// Disconnecting fails the channels still open
+	{
+		auto feed = CZRPC_CALL(*clientCon, testFeed).channel();
+		obj.feedReady.wait();
+		clientCon->transport->close();
+		int v;
+		CHECK_THROW(feed.next(v), Exception);
+		CHECK(!feed.write(1));
+	}
+
+	io.stop();
+	iothread.join();
+}
+
+#if CZRPC_COROUTINES
+TEST(Coroutines)
+{
+	using namespace cz::rpc;
+
+	ServerProcess<CoroTester, void> server(TEST_PORT);
+	auto& obj = server.obj();
+
+	ASIO::io_service io;
+	std::thread iothread = std::thread([&io]
+	{
+		ASIO::io_service::work w(io);
+		io.run();
+	});
+
+	auto clientCon = AsioTransport<void, CoroTester>::create(io, "127.0.0.1", TEST_PORT).get();
+
+	// Several RPCs pending at the same time
+	const int numCalls = 10;
+	std::vector<Future<Result<int>>> fts;
+	for (int i = 0; i < numCalls; i++)
+		fts.push_back(CZRPC_CALL(*clientCon, add, i, 1).ft());
+	obj.release(numCalls);
+	for (int i = 0; i < numCalls; i++)
+		CHECK_EQUAL(i + 1, fts[i].get().get());
+
+	auto ft1 = CZRPC_CALL(*clientCon, voidCall).ft();
+	auto ft2 = CZRPC_CALL(*clientCon, intTestException).ft();
+	auto ft3 = CZRPC_CALLGENERIC(*clientCon, "add", std::vector<Any>{Any(1), Any(2)}).ft();
+	obj.release(3);
+	CHECK(ft1.get().isValid());
+	CHECK_EQUAL(1, obj.voidCalls.load());
+	auto res2 = ft2.get();
+	CHECK(res2.isException());
+	CHECK_EQUAL("Testing exception", res2.getException());
+	CHECK_EQUAL("3", std::string(ft3.get().get().toString()));
+
+	// Awaiting calls from a coroutine
+	bool executorUsed = false;
+	auto executor = [&](std::function<void()> f)
+	{
+		executorUsed = true;
+		io.post(std::move(f));
+	};
+	auto client = [&]() -> Task<int>
+	{
+		Result<int> a = co_await CZRPC_CALL(*clientCon, add, 1, 2);
+		Result<int> b = co_await CZRPC_CALL(*clientCon, add, a.get(), 3).resumeOn(executor);
+		Result<int> c = co_await CZRPC_CALL(*clientCon, intTestException);
+		CHECK(c.isException());
+		co_return b.get();
+	};
+
+	Semaphore sem;
+	int clientRes = 0;
+	client().detach([&](details::TaskPromise<int>& p)
+	{
+		clientRes = p.get();
+		sem.notify();
+	});
+	obj.release(1);
+	obj.release(1);
+	obj.release(1);
+	sem.wait();
+	CHECK_EQUAL(6, clientRes);
+	CHECK(executorUsed);
+
+	io.stop();
+	iothread.join();
+}
+#endif
+
+#if CZRPC_TRACE
+TEST(Trace)
+{
+	using namespace cz::rpc;
+
+	ServerProcess<Tester, void> server(TEST_PORT);
+
+	ASIO::io_service io;
+	std::thread iothread = std::thread([&io]
+	{
+		ASIO::io_service::work w(io);
+		io.run();
+	});
+
+	auto clientCon = AsioTransport<void, Tester>::create(io, "127.0.0.1", TEST_PORT).get();
+
+	Trace::clear();
+	Trace::setEnabled(true);
+	for (int i = 0; i < 5; i++)
+		CHECK_EQUAL(3, CZRPC_CALL(*clientCon, add, 1, 2).ft().get().get());
+	Trace::setEnabled(false);
+	// Not recorded
+	CHECK_EQUAL(3, CZRPC_CALL(*clientCon, add, 1, 2).ft().get().get());
+
+	std::string json = Trace::getJson();
+	auto count = [&json](const char* name)
+	{
+		std::string str = std::string("\"name\":\"") + name + "\"";
+		int res = 0;
+		for (size_t pos = json.find(str); pos != std::string::npos; pos = json.find(str, pos + 1))
+			res++;
+		return res;
+	};
+	CHECK_EQUAL(5, count("serialize"));
+	CHECK_EQUAL(5, count("dispatch"));
+	CHECK_EQUAL(5, count("handler"));
+	CHECK_EQUAL(5, count("reply"));
+	CHECK_EQUAL(5, count("processReply"));
+	// Both the calls and the replies go through the transports
+	CHECK_EQUAL(10, count("send"));
+	CHECK_EQUAL(10, count("read"));
+
+	Trace::clear();
+	json = Trace::getJson();
+	CHECK_EQUAL(0, count("send"));
+
+	io.stop();
+	iothread.join();
+}
+#endif
+
 }